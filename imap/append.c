@@ -851,6 +851,8 @@ EXPORTED int append_fromstage(struct appendstate *as, struct body **body,
 
     /* for staging */
     char stagefile[MAX_MAILBOX_PATH+1];
+    char zstagefile[sizeof(stagefile)+2];  /* room for ".z" */
+    const char *srcfile;
 
     assert(stage != NULL && stage->parts.count);
 
@@ -914,6 +916,19 @@ EXPORTED int append_fromstage(struct appendstate *as, struct body **body,
 
     /* 'stagefile' contains the message and is on the same partition
        as the mailbox we're looking at */
+    srcfile = stagefile;
+
+    /* compressed partitions get one compressed copy of the stage file,
+       which is then linked into each mailbox just like the original */
+    if (mailbox_partition_compressed(mailbox->part)) {
+        snprintf(zstagefile, sizeof(zstagefile), "%s.z", stagefile);
+        if (strarray_find(&stage->parts, zstagefile, 0) < 0) {
+            r = mailbox_compress_file(stagefile, zstagefile);
+            if (r) goto out;
+            strarray_append(&stage->parts, zstagefile);
+        }
+        srcfile = zstagefile;
+    }
 
     /* Setup */
     record.uid = as->baseuid + as->nummsg;
@@ -941,7 +956,7 @@ EXPORTED int append_fromstage(struct appendstate *as, struct body **body,
     as->nummsg++;
     fname = mailbox_record_fname(mailbox, &record);
 
-    r = mailbox_copyfile(stagefile, fname, nolink);
+    r = mailbox_copyfile(srcfile, fname, nolink);
     if (r) goto out;
 
     FILE *destfile = fopen(fname, "r");
@@ -961,7 +976,9 @@ EXPORTED int append_fromstage(struct appendstate *as, struct body **body,
             newflags = strarray_dup(flags);
         else
             newflags = strarray_new();
-        r = callout_run(fname, *body, &user_annots, &system_annots, newflags);
+        /* the callout reads the file itself, so give it the raw copy */
+        r = callout_run(srcfile == stagefile ? fname : stagefile, *body,
+                        &user_annots, &system_annots, newflags);
         if (r) {
             syslog(LOG_ERR, "Annotation callout failed, ignoring\n");
             r = 0;
@@ -1192,7 +1209,7 @@ HIDDEN int append_run_annotator(struct appendstate *as,
     fname = mailbox_record_fname(as->mailbox, record);
     if (!fname) goto out;
 
-    f = fopen(fname, "r");
+    f = mailbox_fopen_file(fname);
     if (!f) {
         r = IMAP_IOERROR;
         goto out;
@@ -74,6 +74,7 @@
 #include "cyrusdb.h"
 #include "duplicate.h"
 #include "global.h"
+#include "headercache.h"
 #include "exitcodes.h"
 #include "libcyr_cfg.h"
 #include "mboxlist.h"
@@ -416,6 +417,10 @@ int main(int argc, char *argv[])
     if(op == RECOVER && reserve_flag)
         process_mboxlist();
 
+    /* the shared header cache is rebuilt by use */
+    if (op == RECOVER)
+        headercache_reset();
+
     free(dirname);
     free(backup1);
     free(backup2);
@@ -0,0 +1,587 @@
+/* cyrusdb_bench.c -- benchmark cyrusdb backends
+ *
+ * Copyright (c) 1994-2016 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "cyrusdb.h"
+#include "exitcodes.h"
+#include "global.h"
+#include "util.h"
+#include "xmalloc.h"
+
+/* latency histogram: exact below 32ns, then 16 buckets per power of
+ * two, so any percentile is within about 6% */
+#define HIST_SUB 16
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct hist {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+enum {
+    OP_FETCH = 0,
+    OP_STORE,
+    OP_FOREACH,
+    NUM_OPS
+};
+
+static const char * const op_names[NUM_OPS] = { "fetch", "store", "foreach" };
+
+static const struct workload {
+    const char *name;
+    int percent[NUM_OPS];
+} workloads[] = {
+    { "fetch",   { 100, 0, 0 } },
+    { "foreach", { 0, 0, 100 } },
+    { "store",   { 0, 100, 0 } },
+    { "mixed",   { 80, 15, 5 } },
+    { NULL,      { 0, 0, 0 } }
+};
+
+static const char * const default_backends[] = {
+    "twoskip", "skiplist", "lmdb", "flat", "sql", NULL
+};
+
+struct params {
+    const char *dir;
+    int db_flags;
+    unsigned nrecords;
+    unsigned groupsize;
+    unsigned long nops;
+    unsigned nprocs;
+    unsigned vallen;
+    unsigned seed;
+    int percent[NUM_OPS];
+};
+
+static void usage(const char *name)
+{
+    int i;
+
+    fprintf(stderr,
+            "Usage: %s [-C altconfig] [-d dir] [-b backend,...] [-w workload]\n"
+            "       [-m fetch%%,store%%,foreach%%] [-n records] [-o ops]\n"
+            "       [-p procs] [-g groupsize] [-v vallen] [-s seed] [-M]\n",
+            name);
+    fprintf(stderr, "Workloads:");
+    for (i = 0; workloads[i].name; i++)
+        fprintf(stderr, " %s", workloads[i].name);
+    fprintf(stderr, "\n");
+
+    exit(EC_USAGE);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t v)
+{
+    int shift = 0;
+
+    while ((v >> shift) >= 2 * HIST_SUB)
+        shift++;
+
+    if (!shift) return v;
+
+    return (shift + 1) * HIST_SUB + (v >> shift) - HIST_SUB;
+}
+
+/* the largest value which lands in bucket i */
+static uint64_t hist_value(int i)
+{
+    int shift;
+
+    if (i < 2 * HIST_SUB) return i;
+
+    shift = i / HIST_SUB - 1;
+
+    return (((uint64_t)(HIST_SUB + i % HIST_SUB) + 1) << shift) - 1;
+}
+
+static void hist_add(struct hist *h, uint64_t v)
+{
+    int i = hist_bucket(v);
+
+    if (i >= HIST_BUCKETS) i = HIST_BUCKETS - 1;
+
+    h->buckets[i]++;
+    h->count++;
+    if (v > h->max) h->max = v;
+}
+
+static void hist_merge(struct hist *to, const struct hist *from)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        to->buckets[i] += from->buckets[i];
+
+    to->count += from->count;
+    if (from->max > to->max) to->max = from->max;
+}
+
+static uint64_t hist_percentile(const struct hist *h, double pct)
+{
+    uint64_t want = (uint64_t)(h->count * pct / 100.0);
+    uint64_t seen = 0;
+    int i;
+
+    if (want >= h->count) return h->max;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > want) break;
+    }
+
+    if (i == HIST_BUCKETS || hist_value(i) > h->max)
+        return h->max;
+
+    return hist_value(i);
+}
+
+static void make_key(struct buf *buf, const struct params *p, unsigned n)
+{
+    buf_reset(buf);
+    buf_printf(buf, "bench.%06u.%08u", n / p->groupsize, n);
+}
+
+static void make_val(struct buf *buf, const struct params *p)
+{
+    unsigned i;
+
+    buf_reset(buf);
+    for (i = 0; i < p->vallen; i++)
+        buf_putc(buf, 'a' + random() % 26);
+}
+
+static int count_cb(void *rock,
+                    const char *key __attribute__((unused)),
+                    size_t keylen __attribute__((unused)),
+                    const char *data __attribute__((unused)),
+                    size_t datalen __attribute__((unused)))
+{
+    unsigned long *countp = (unsigned long *)rock;
+
+    (*countp)++;
+
+    return 0;
+}
+
+static int populate(const char *backend, const char *fname,
+                    const struct params *p)
+{
+    struct buf key = BUF_INITIALIZER;
+    struct buf val = BUF_INITIALIZER;
+    struct txn *tid = NULL;
+    struct db *db = NULL;
+    unsigned n;
+    int r;
+
+    r = cyrusdb_open(backend, fname, p->db_flags | CYRUSDB_CREATE, &db);
+    if (r) {
+        fprintf(stderr, "%s: can't create %s: %s\n",
+                backend, fname, cyrusdb_strerror(r));
+        return r;
+    }
+
+    for (n = 0; n < p->nrecords; n++) {
+        make_key(&key, p, n);
+        make_val(&val, p);
+        r = cyrusdb_store(db, key.s, key.len, val.s, val.len, &tid);
+        if (r) break;
+
+        /* keep the transactions a sensible size */
+        if (n % 1000 == 999) {
+            r = cyrusdb_commit(db, tid);
+            tid = NULL;
+            if (r) break;
+        }
+    }
+
+    if (tid) {
+        if (r) cyrusdb_abort(db, tid);
+        else r = cyrusdb_commit(db, tid);
+    }
+
+    if (r) {
+        fprintf(stderr, "%s: failed to populate %s: %s\n",
+                backend, fname, cyrusdb_strerror(r));
+    }
+
+    cyrusdb_close(db);
+    buf_free(&key);
+    buf_free(&val);
+
+    return r;
+}
+
+/* one benchmark process: wait for the starting gun, then run our
+ * share of the operations, timing each one */
+static int run_worker(const char *backend, const char *fname,
+                      const struct params *p, unsigned procnum,
+                      int gofd, struct hist *hists)
+{
+    struct buf key = BUF_INITIALIZER;
+    struct buf val = BUF_INITIALIZER;
+    unsigned long nops = p->nops / p->nprocs;
+    unsigned long i;
+    struct db *db = NULL;
+    char c;
+    int r;
+
+    if (procnum < p->nops % p->nprocs) nops++;
+
+    srandom(p->seed + procnum);
+
+    r = cyrusdb_open(backend, fname, p->db_flags, &db);
+    if (r) {
+        fprintf(stderr, "%s: can't open %s: %s\n",
+                backend, fname, cyrusdb_strerror(r));
+        return EC_TEMPFAIL;
+    }
+
+    /* returns at EOF, when the parent closes the other end */
+    while (read(gofd, &c, 1) < 0 && errno == EINTR);
+
+    for (i = 0; i < nops; i++) {
+        int pick = random() % 100;
+        unsigned long count = 0;
+        const char *data;
+        size_t datalen;
+        uint64_t start;
+        int op;
+
+        for (op = 0; op < NUM_OPS - 1; op++) {
+            if (pick < p->percent[op]) break;
+            pick -= p->percent[op];
+        }
+
+        /* build the arguments before the clock starts */
+        switch (op) {
+        case OP_FETCH:
+            make_key(&key, p, random() % p->nrecords);
+            break;
+        case OP_STORE:
+            make_key(&key, p, random() % p->nrecords);
+            make_val(&val, p);
+            break;
+        case OP_FOREACH:
+            buf_reset(&key);
+            buf_printf(&key, "bench.%06u.",
+                       (unsigned)(random() % p->nrecords) / p->groupsize);
+            break;
+        }
+
+        start = now_ns();
+
+        switch (op) {
+        case OP_FETCH:
+            r = cyrusdb_fetch(db, key.s, key.len, &data, &datalen, NULL);
+            break;
+        case OP_STORE:
+            r = cyrusdb_store(db, key.s, key.len, val.s, val.len, NULL);
+            break;
+        case OP_FOREACH:
+            r = cyrusdb_foreach(db, key.s, key.len, NULL,
+                                count_cb, &count, NULL);
+            break;
+        }
+
+        hist_add(&hists[op], now_ns() - start);
+
+        if (r) {
+            fprintf(stderr, "%s: %s failed on %s: %s\n", backend,
+                    op_names[op], key.s, cyrusdb_strerror(r));
+            break;
+        }
+    }
+
+    cyrusdb_close(db);
+    buf_free(&key);
+    buf_free(&val);
+
+    return r ? EC_SOFTWARE : 0;
+}
+
+static int run_backend(const char *backend, const struct params *p)
+{
+    struct hist total[NUM_OPS];
+    struct hist *hists;
+    size_t histsize = p->nprocs * NUM_OPS * sizeof(struct hist);
+    pid_t *pids;
+    char *fname;
+    uint64_t start, elapsed;
+    unsigned i;
+    int gopipe[2];
+    int failed = 0;
+    int op;
+    int r;
+
+    fname = strconcat(p->dir, "/cyrusdb_bench.", backend, (char *)NULL);
+    unlink(fname);
+
+    r = populate(backend, fname, p);
+    if (r) goto done;
+
+    /* every worker fills in its own histograms in here */
+    hists = mmap(NULL, histsize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (hists == MAP_FAILED) {
+        perror("mmap");
+        r = EC_OSERR;
+        goto done;
+    }
+    memset(hists, 0, histsize);
+
+    if (pipe(gopipe) < 0) {
+        perror("pipe");
+        munmap(hists, histsize);
+        r = EC_OSERR;
+        goto done;
+    }
+
+    pids = xzmalloc(p->nprocs * sizeof(pid_t));
+    for (i = 0; i < p->nprocs; i++) {
+        pids[i] = fork();
+        if (pids[i] < 0) {
+            perror("fork");
+            failed++;
+            break;
+        }
+        if (!pids[i]) {
+            close(gopipe[1]);
+            _exit(run_worker(backend, fname, p, i, gopipe[0],
+                             hists + i * NUM_OPS));
+        }
+    }
+
+    /* let them all go at once */
+    close(gopipe[0]);
+    start = now_ns();
+    close(gopipe[1]);
+
+    for (i = 0; i < p->nprocs && pids[i] > 0; i++) {
+        int status;
+
+        while (waitpid(pids[i], &status, 0) < 0 && errno == EINTR);
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            failed++;
+    }
+    elapsed = now_ns() - start;
+
+    memset(total, 0, sizeof(total));
+    for (i = 0; i < p->nprocs; i++) {
+        for (op = 0; op < NUM_OPS; op++)
+            hist_merge(&total[op], &hists[i * NUM_OPS + op]);
+    }
+
+    printf("%-10s procs=%u records=%u ops=%llu time=%.3fs ops/sec=%.0f%s\n",
+           backend, p->nprocs, p->nrecords,
+           (unsigned long long)(total[OP_FETCH].count + total[OP_STORE].count
+                                + total[OP_FOREACH].count),
+           elapsed / 1e9,
+           (total[OP_FETCH].count + total[OP_STORE].count
+            + total[OP_FOREACH].count) / (elapsed / 1e9),
+           failed ? " (WORKERS FAILED)" : "");
+
+    for (op = 0; op < NUM_OPS; op++) {
+        if (!total[op].count) continue;
+        printf("  %-8s n=%-9llu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+               op_names[op], (unsigned long long)total[op].count,
+               hist_percentile(&total[op], 50) / 1e3,
+               hist_percentile(&total[op], 99) / 1e3,
+               hist_percentile(&total[op], 99.9) / 1e3,
+               total[op].max / 1e3);
+    }
+
+    if (failed) r = EC_SOFTWARE;
+
+    free(pids);
+    munmap(hists, histsize);
+
+ done:
+    unlink(fname);
+    free(fname);
+
+    return r;
+}
+
+int main(int argc, char *argv[])
+{
+    struct params p;
+    strarray_t *available;
+    strarray_t *backends = NULL;
+    const char *workload = "mixed";
+    const char *mix = NULL;
+    char *alt_config = NULL;
+    int failed = 0;
+    int opt;
+    int i;
+
+    memset(&p, 0, sizeof(struct params));
+    p.nrecords = 100000;
+    p.groupsize = 100;
+    p.nops = 100000;
+    p.nprocs = 1;
+    p.vallen = 64;
+    p.seed = time(NULL);
+
+    while ((opt = getopt(argc, argv, "C:b:d:g:m:Mn:o:p:s:v:w:")) != EOF) {
+        switch (opt) {
+        case 'C': /* alt config file */
+            alt_config = optarg;
+            break;
+        case 'b':
+            backends = strarray_split(optarg, ",", STRARRAY_TRIM);
+            break;
+        case 'd':
+            p.dir = optarg;
+            break;
+        case 'g':
+            p.groupsize = atoi(optarg);
+            break;
+        case 'm':
+            mix = optarg;
+            break;
+        case 'M': /* use "improved_mboxlist_sort" */
+            p.db_flags |= CYRUSDB_MBOXSORT;
+            break;
+        case 'n':
+            p.nrecords = atoi(optarg);
+            break;
+        case 'o':
+            p.nops = atol(optarg);
+            break;
+        case 'p':
+            p.nprocs = atoi(optarg);
+            break;
+        case 's':
+            p.seed = atoi(optarg);
+            break;
+        case 'v':
+            p.vallen = atoi(optarg);
+            break;
+        case 'w':
+            workload = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc || !p.nrecords || !p.groupsize || !p.nprocs)
+        usage(argv[0]);
+
+    for (i = 0; workloads[i].name; i++) {
+        if (!strcmp(workload, workloads[i].name)) break;
+    }
+    if (!workloads[i].name) usage(argv[0]);
+    memcpy(p.percent, workloads[i].percent, sizeof(p.percent));
+
+    if (mix) {
+        if (sscanf(mix, "%d,%d,%d", &p.percent[OP_FETCH],
+                   &p.percent[OP_STORE], &p.percent[OP_FOREACH]) != 3 ||
+            p.percent[OP_FETCH] + p.percent[OP_STORE]
+                + p.percent[OP_FOREACH] != 100)
+            usage(argv[0]);
+    }
+
+    cyrus_init(alt_config, "cyrusdb_bench", 0, 0);
+
+    if (!p.dir) p.dir = config_getstring(IMAPOPT_TEMP_PATH);
+
+    /* by default, everything we've got */
+    available = cyrusdb_backends();
+    if (!backends) {
+        backends = strarray_new();
+        for (i = 0; default_backends[i]; i++) {
+            if (strarray_find(available, default_backends[i], 0) >= 0)
+                strarray_append(backends, default_backends[i]);
+        }
+    }
+
+    printf("workload=%s fetch=%d%% store=%d%% foreach=%d%% vallen=%u seed=%u\n",
+           mix ? "custom" : workload, p.percent[OP_FETCH],
+           p.percent[OP_STORE], p.percent[OP_FOREACH], p.vallen, p.seed);
+
+    for (i = 0; i < backends->count; i++) {
+        const char *backend = strarray_nth(backends, i);
+
+        if (strarray_find(available, backend, 0) < 0) {
+            fprintf(stderr, "%s: not available\n", backend);
+            failed++;
+            continue;
+        }
+
+        if (run_backend(backend, &p))
+            failed++;
+
+        fflush(stdout);
+    }
+
+    strarray_free(available);
+    strarray_free(backends);
+
+    cyrus_done();
+
+    return failed ? EC_SOFTWARE : 0;
+}
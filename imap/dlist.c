@@ -81,47 +81,32 @@ static const char *lastkey = NULL;
 
 static void printfile(struct protstream *out, const struct dlist *dl)
 {
-    struct stat sbuf;
-    FILE *f;
-    unsigned long size;
+    struct buf buf = BUF_INITIALIZER;
     struct message_guid guid2;
-    const char *msg_base = NULL;
-    size_t msg_len = 0;
 
     assert(dlist_isfile(dl));
 
-    f = fopen(dl->sval, "r");
-    if (!f) {
+    /* compressed spool files are sent uncompressed */
+    if (mailbox_map_file(dl->sval, NULL, &buf)) {
         syslog(LOG_ERR, "IOERROR: Failed to read file %s", dl->sval);
         prot_printf(out, "NIL");
         return;
     }
-    if (fstat(fileno(f), &sbuf) == -1) {
-        syslog(LOG_ERR, "IOERROR: Failed to stat file %s", dl->sval);
-        prot_printf(out, "NIL");
-        fclose(f);
-        return;
-    }
-    size = sbuf.st_size;
-    if (size != dl->nval) {
+    if (buf.len != dl->nval) {
         syslog(LOG_ERR, "IOERROR: Size mismatch %s (%lu != " MODSEQ_FMT ")",
-               dl->sval, size, dl->nval);
+               dl->sval, (unsigned long) buf.len, dl->nval);
         prot_printf(out, "NIL");
-        fclose(f);
+        buf_free(&buf);
         return;
     }
 
-    map_refresh(fileno(f), 1, &msg_base, &msg_len, sbuf.st_size,
-                "new message", 0);
-
-    message_guid_generate(&guid2, msg_base, msg_len);
+    message_guid_generate(&guid2, buf.s, buf.len);
 
     if (!message_guid_equal(&guid2, dl->gval)) {
         syslog(LOG_ERR, "IOERROR: GUID mismatch %s",
                dl->sval);
         prot_printf(out, "NIL");
-        fclose(f);
-        map_free(&msg_base, &msg_len);
+        buf_free(&buf);
         return;
     }
 
@@ -129,10 +114,9 @@ static void printfile(struct protstream *out, const struct dlist *dl)
     prot_printastring(out, dl->part);
     prot_printf(out, " ");
     prot_printastring(out, message_guid_encode(dl->gval));
-    prot_printf(out, " %lu}\r\n", size);
-    prot_write(out, msg_base, msg_len);
-    fclose(f);
-    map_free(&msg_base, &msg_len);
+    prot_printf(out, " %lu}\r\n", (unsigned long) buf.len);
+    prot_write(out, buf.s, buf.len);
+    buf_free(&buf);
 }
 
 /* XXX - these two functions should be out in append.c or reserve.c
@@ -41,6 +41,7 @@
 
 #include <config.h>
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -68,6 +69,7 @@
 #endif
 
 #include "assert.h"
+#include "bloom.h"
 #include "xmalloc.h"
 #include "global.h"
 #include "exitcodes.h"
@@ -86,6 +88,103 @@
 static struct db *dupdb = NULL;
 static int duplicate_dbopen = 0;
 
+/* optional filter of the keys in the db, so misses can skip it */
+static struct bloom *dupbloom = NULL;
+static char *bloomfname = NULL;
+
+static int bloom_add_cb(void *rock, const char *key, size_t keylen,
+                        const char *data __attribute__((unused)),
+                        size_t datalen __attribute__((unused)))
+{
+    bloom_add((struct bloom *) rock, key, keylen);
+    return 0;
+}
+
+/* create an empty filter under a temporary name */
+static struct bloom *bloom_new(void)
+{
+    struct bloom *b = NULL;
+    char newext[32];
+    char *newfname;
+    int r;
+
+    snprintf(newext, sizeof(newext), ".NEW.%d", (int) getpid());
+    newfname = strconcat(bloomfname, newext, (char *)NULL);
+    r = bloom_create(newfname, config_getint(IMAPOPT_DUPLICATE_BLOOM_ENTRIES),
+                     &b);
+    if (r) {
+        syslog(LOG_ERR, "duplicate: can't create %s: %s",
+               newfname, strerror(-r));
+    }
+    free(newfname);
+
+    return b;
+}
+
+/* put a filter holding the surviving keys in place, then add everything
+ * again to catch keys marked in the old filter while we were building */
+static int bloom_install(struct bloom *b)
+{
+    int r;
+
+    r = bloom_replace(b, bloomfname);
+    if (r) return r;
+
+    cyrusdb_foreach(dupdb, "", 0, NULL, bloom_add_cb, b, NULL);
+
+    bloom_close(&dupbloom);
+    dupbloom = b;
+
+    return 0;
+}
+
+/* open the filter, building it from the db if there isn't one yet,
+ * or if the one there may be missing keys after a crash */
+static int bloom_load(void)
+{
+    struct bloom *old = NULL;
+    struct bloom *b;
+    int r;
+
+    r = bloom_open(bloomfname, &dupbloom);
+    if (!r) return 0;
+
+    if (r == BLOOM_UNCLEAN) {
+        /* keep it (and its lock) until the new one is in place */
+        syslog(LOG_NOTICE, "duplicate: %s was not closed cleanly, rebuilding",
+               bloomfname);
+        old = dupbloom;
+        dupbloom = NULL;
+    }
+    else if (r != -ENOENT) {
+        return r;
+    }
+
+    b = bloom_new();
+    if (b) {
+        cyrusdb_foreach(dupdb, "", 0, NULL, bloom_add_cb, b, NULL);
+        if (bloom_install(b)) bloom_close(&b);
+    }
+    bloom_close(&old);
+
+    return dupbloom ? 0 : -EIO;
+}
+
+/* returns 1 if a different filter was opened */
+static int bloom_refresh(void)
+{
+    if (dupbloom && !bloom_is_stale(dupbloom)) return 0;
+
+    bloom_close(&dupbloom);
+    return !bloom_load();
+}
+
+static void bloom_init(const char *fname)
+{
+    bloomfname = strconcat(fname, ".bloom", (char *)NULL);
+    bloom_load();
+}
+
 /* must be called after cyrus_init */
 EXPORTED int duplicate_init(const char *fname)
 {
@@ -109,6 +208,9 @@ EXPORTED int duplicate_init(const char *fname)
     }
     duplicate_dbopen = 1;
 
+    if (config_getint(IMAPOPT_DUPLICATE_BLOOM_ENTRIES) > 0)
+        bloom_init(fname);
+
 out:
     free(tofree);
 
@@ -173,6 +275,15 @@ EXPORTED time_t duplicate_check(const duplicate_key_t *dkey)
     r = make_key(&key, dkey);
     if (r) return 0;
 
+    if (bloomfname) {
+        bloom_refresh();
+        if (dupbloom && !bloom_check(dupbloom, key.s, key.len)) {
+            /* definitely never marked */
+            buf_free(&key);
+            return 0;
+        }
+    }
+
     do {
         r = cyrusdb_fetch(dupdb, key.s, key.len,
                       &data, &len, NULL);
@@ -226,11 +337,18 @@ EXPORTED void duplicate_mark(const duplicate_key_t *dkey, time_t mark, unsigned
     memcpy(data, &mark, sizeof(mark));
     memcpy(data + sizeof(mark), &uid, sizeof(uid));
 
+    /* set the bits before the record exists, so no check can miss it */
+    if (dupbloom) bloom_add(dupbloom, key.s, key.len);
+
     do {
         r = cyrusdb_store(dupdb, key.s, key.len,
                       data, sizeof(mark)+sizeof(uid), NULL);
     } while (r == CYRUSDB_AGAIN);
 
+    /* the filter may have been rebuilt without us meanwhile */
+    if (bloomfname && bloom_refresh())
+        bloom_add(dupbloom, key.s, key.len);
+
 #if DEBUG
     syslog(LOG_DEBUG, "duplicate_mark: %-40s %-20s %-40s %ld %lu",
            dkey->id, dkey->to, dkey->date, mark, uid);
@@ -289,6 +407,7 @@ struct prunerock {
     struct db *db;
     time_t expmark; /* default expmark, if not overridden by table entry */
     struct hash_table *expire_table;
+    struct bloom *bloom;
     int count;
     int deletions;
 };
@@ -316,7 +435,12 @@ static int prune_p(void *rock,
     memcpy(&mark, data, sizeof(time_t));
 
     /* check if we should prune this entry */
-    return (mark < (expmark ? *expmark : prock->expmark));
+    if (mark < (expmark ? *expmark : prock->expmark))
+        return 1;
+
+    if (prock->bloom) bloom_add(prock->bloom, key, keylen);
+
+    return 0;
 }
 
 static int prune_cb(void *rock, const char *id, size_t idlen,
@@ -345,6 +469,7 @@ EXPORTED int duplicate_prune(int seconds, struct hash_table *expire_table)
     prock.count = prock.deletions = 0;
     prock.expmark = time(NULL) - seconds;
     prock.expire_table = expire_table;
+    prock.bloom = bloomfname ? bloom_new() : NULL;
     syslog(LOG_NOTICE, "duplicate_prune: pruning back %0.2f days",
            ((double)seconds/86400));
 
@@ -355,6 +480,18 @@ EXPORTED int duplicate_prune(int seconds, struct hash_table *expire_table)
     syslog(LOG_NOTICE, "duplicate_prune: purged %d out of %d entries",
            prock.deletions, prock.count);
 
+    if (prock.bloom) {
+        int nentries = config_getint(IMAPOPT_DUPLICATE_BLOOM_ENTRIES);
+
+        if (bloom_install(prock.bloom)) bloom_close(&prock.bloom);
+
+        if (prock.count - prock.deletions > nentries) {
+            syslog(LOG_WARNING, "duplicate_prune: %d entries left, more than"
+                   " duplicate_bloom_entries %d", prock.count - prock.deletions,
+                   nentries);
+        }
+    }
+
     return 0;
 }
 
@@ -434,5 +571,9 @@ EXPORTED int duplicate_done(void)
         duplicate_dbopen = 0;
     }
 
+    bloom_close(&dupbloom);
+    free(bloomfname);
+    bloomfname = NULL;
+
     return r;
 }
@@ -318,6 +318,18 @@ EXPORTED int cyrus_init(const char *alt_config, const char *ident, unsigned flag
                                   config_getswitch(IMAPOPT_SQL_USESSL));
         libcyrus_config_setswitch(CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
                                   config_getswitch(IMAPOPT_SKIPLIST_ALWAYS_CHECKPOINT));
+        libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_SNAPSHOT_READS,
+                                  config_getswitch(IMAPOPT_TWOSKIP_SNAPSHOT_READS));
+        libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_ONLINE_REPACK,
+                                  config_getswitch(IMAPOPT_TWOSKIP_ONLINE_REPACK));
+        libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_GROUP_COMMIT,
+                                  config_getswitch(IMAPOPT_TWOSKIP_GROUP_COMMIT));
+        libcyrus_config_setswitch(CYRUSOPT_LMDB_ZERO_COPY,
+                                  config_getswitch(IMAPOPT_LMDB_ZERO_COPY));
+        libcyrus_config_setint(CYRUSOPT_DBCACHE_TIMEOUT,
+                               config_getint(IMAPOPT_DBCACHE_TIMEOUT));
+        libcyrus_config_setstring(CYRUSOPT_LSM_TTL,
+                                  config_getstring(IMAPOPT_LSM_TTL));
 
         /* Not until all configuration parameters are set! */
         libcyrus_init();
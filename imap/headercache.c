@@ -0,0 +1,369 @@
+/* headercache.c -- Shared cache of mailbox index headers
+ *
+ * Copyright (c) 1994-2017 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The header cache is a fixed size table of slots in a file that every
+ * process maps MAP_SHARED.  Each slot holds the on-disk index header of
+ * one mailbox, exactly as it was last written by mailbox_commit(), so a
+ * STATUS can be answered without opening, mapping or locking the
+ * mailbox.  Mailboxes are direct-mapped to slots by name; a collision
+ * simply replaces the older entry.
+ *
+ * There are no locks on the read side.  Each slot carries a sequence
+ * number which is odd while a writer is updating it: writers claim a
+ * slot by compare-and-swap from an even value and give up if they can't
+ * (the slot is being rewritten for some other mailbox anyway), and
+ * readers treat an odd or changed sequence number as a miss.  The header
+ * CRC is checked again by the caller when decoding.  A writer which dies
+ * holding a slot leaves it odd, so a slot claimed for longer than
+ * HEADERCACHE_STALE seconds is taken over and emptied by whoever next
+ * finds it that way.
+ *
+ * Since the table is only ever a cache, it is thrown away at recovery.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "crc32.h"
+#include "cyr_lock.h"
+#include "global.h"
+#include "util.h"
+#include "xmalloc.h"
+
+#include "headercache.h"
+
+static char *headercache_base = NULL;
+static uint32_t headercache_nslots = 0;
+static int headercache_failed = 0;
+
+EXPORTED char *headercache_filename(void)
+{
+    const char *fname = config_getstring(IMAPOPT_HEADERCACHE_PATH);
+
+    if (fname)
+        return xstrdup(fname);
+
+    return strconcat(config_dir, FNAME_HEADERCACHE, (char *)NULL);
+}
+
+static int headercache_valid(const struct headercache_file *hf, size_t size)
+{
+    if (size < HEADERCACHE_HDRSIZE) return 0;
+    if (hf->magic != HEADERCACHE_MAGIC) return 0;
+    if (hf->version != HEADERCACHE_VERSION) return 0;
+    if (hf->slotsize != sizeof(struct headercache_slot)) return 0;
+    if (!hf->nslots) return 0;
+    if (size != HEADERCACHE_HDRSIZE +
+                (size_t) hf->nslots * sizeof(struct headercache_slot))
+        return 0;
+    return 1;
+}
+
+/* map the table, creating it if required.  An existing valid table is
+ * used at whatever size it was created with, so that processes never
+ * see the file shrink under their mapping */
+static int headercache_map(void)
+{
+    struct headercache_file hf;
+    struct stat sbuf;
+    char *fname = NULL;
+    int slots;
+    int fd = -1;
+    int r = -1;
+
+    if (headercache_base) return 0;
+    if (headercache_failed) return -1;
+
+    slots = config_getint(IMAPOPT_HEADERCACHE_SLOTS);
+    if (slots <= 0) return -1;
+
+    /* only try once per process */
+    headercache_failed = 1;
+
+    fname = headercache_filename();
+    fd = open(fname, O_RDWR|O_CREAT, 0600);
+    if (fd == -1 && errno == ENOENT) {
+        if (!cyrus_mkdir(fname, 0755))
+            fd = open(fname, O_RDWR|O_CREAT, 0600);
+    }
+    if (fd == -1) {
+        syslog(LOG_ERR, "IOERROR: opening %s: %m", fname);
+        goto done;
+    }
+
+    if (lock_setlock(fd, /*excl*/1, /*nb*/0, fname)) {
+        syslog(LOG_ERR, "IOERROR: locking %s: %m", fname);
+        goto done;
+    }
+
+    if (fstat(fd, &sbuf) == -1) {
+        syslog(LOG_ERR, "IOERROR: fstat %s: %m", fname);
+        goto unlock;
+    }
+
+    memset(&hf, 0, sizeof(hf));
+    if ((size_t) sbuf.st_size >= sizeof(hf) &&
+        pread(fd, &hf, sizeof(hf), 0) != sizeof(hf)) {
+        syslog(LOG_ERR, "IOERROR: reading %s: %m", fname);
+        goto unlock;
+    }
+
+    if (!headercache_valid(&hf, sbuf.st_size)) {
+        /* nobody can have a partial file mapped, so start afresh */
+        hf.magic = HEADERCACHE_MAGIC;
+        hf.version = HEADERCACHE_VERSION;
+        hf.slotsize = sizeof(struct headercache_slot);
+        hf.nslots = slots;
+        sbuf.st_size = HEADERCACHE_HDRSIZE +
+                       (size_t) hf.nslots * sizeof(struct headercache_slot);
+        if (ftruncate(fd, 0) || ftruncate(fd, sbuf.st_size) ||
+            pwrite(fd, &hf, sizeof(hf), 0) != sizeof(hf)) {
+            syslog(LOG_ERR, "IOERROR: initialising %s: %m", fname);
+            goto unlock;
+        }
+    }
+
+    headercache_base = mmap(NULL, sbuf.st_size, PROT_READ|PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+    if (headercache_base == MAP_FAILED) {
+        syslog(LOG_ERR, "IOERROR: mapping %s: %m", fname);
+        headercache_base = NULL;
+        goto unlock;
+    }
+
+    headercache_nslots = hf.nslots;
+    headercache_failed = 0;
+    r = 0;
+
+ unlock:
+    lock_unlock(fd, fname);
+ done:
+    /* the mapping stays valid without the descriptor */
+    if (fd != -1) close(fd);
+    free(fname);
+    return r;
+}
+
+static struct headercache_slot *headercache_slot(const char *mboxname,
+                                                 uint32_t *hashp)
+{
+    uint32_t hash = crc32_cstring(mboxname);
+
+    *hashp = hash;
+    return (struct headercache_slot *)
+        (headercache_base + HEADERCACHE_HDRSIZE +
+         (size_t) (hash % headercache_nslots) * sizeof(struct headercache_slot));
+}
+
+static void headercache_release(struct headercache_slot *slot)
+{
+    __sync_fetch_and_add(&slot->seq, 1);
+}
+
+/* empty a slot whose writer has held it for too long */
+static void headercache_recover(struct headercache_slot *slot)
+{
+    uint32_t seq = *(volatile uint32_t *) &slot->seq;
+    uint32_t now = time(NULL);
+
+    if (!(seq & 1)) return;
+    if (now - *(volatile uint32_t *) &slot->claimed < HEADERCACHE_STALE)
+        return;
+
+    /* still odd, so nobody else can claim it meanwhile */
+    if (!__sync_bool_compare_and_swap(&slot->seq, seq, seq + 2))
+        return;
+
+    syslog(LOG_NOTICE, "headercache: recovering slot abandoned by a writer");
+
+    slot->claimed = now;
+    slot->hash = 0;
+    slot->namelen = 0;
+    slot->datalen = 0;
+
+    headercache_release(slot);
+}
+
+static int headercache_claim(struct headercache_slot *slot, uint32_t seq)
+{
+    if (seq & 1) {
+        headercache_recover(slot);
+        return 0;
+    }
+    if (!__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1))
+        return 0;
+
+    slot->claimed = time(NULL);
+    return 1;
+}
+
+EXPORTED void headercache_store(const char *mboxname,
+                                const unsigned char *buf, size_t len)
+{
+    struct headercache_slot *slot;
+    size_t namelen = strlen(mboxname);
+    uint32_t hash;
+
+    if (headercache_map()) return;
+
+    if (namelen > HEADERCACHE_NAMELEN || len > HEADERCACHE_DATALEN) {
+        /* can't hold this one, make sure nothing stale is left */
+        headercache_invalidate(mboxname);
+        return;
+    }
+
+    slot = headercache_slot(mboxname, &hash);
+    if (!headercache_claim(slot, *(volatile uint32_t *) &slot->seq))
+        return;
+
+    slot->hash = hash;
+    slot->namelen = namelen;
+    memcpy(slot->name, mboxname, namelen);
+    slot->datalen = len;
+    memcpy(slot->data, buf, len);
+
+    headercache_release(slot);
+}
+
+/* copy the slot contents if it holds mboxname, returning the sequence
+ * number it was read at, or an odd value if it didn't */
+static uint32_t headercache_read(struct headercache_slot *slot,
+                                 const char *mboxname, uint32_t hash,
+                                 unsigned char *buf, size_t *lenp)
+{
+    size_t namelen = strlen(mboxname);
+    uint32_t seq = *(volatile uint32_t *) &slot->seq;
+    size_t len;
+
+    if (seq & 1) return 1;
+    __sync_synchronize();
+
+    if (slot->hash != hash || slot->namelen != namelen ||
+        memcmp(slot->name, mboxname, namelen))
+        return 1;
+
+    len = slot->datalen;
+    if (buf) {
+        if (len > *lenp) return 1;
+        memcpy(buf, slot->data, len);
+    }
+
+    __sync_synchronize();
+    if (*(volatile uint32_t *) &slot->seq != seq) return 1;
+
+    *lenp = len;
+    return seq;
+}
+
+EXPORTED size_t headercache_fetch(const char *mboxname,
+                                  unsigned char *buf, size_t len)
+{
+    struct headercache_slot *slot;
+    uint32_t hash;
+
+    if (headercache_map()) return 0;
+
+    slot = headercache_slot(mboxname, &hash);
+    if (headercache_read(slot, mboxname, hash, buf, &len) & 1) {
+        headercache_recover(slot);
+        return 0;
+    }
+
+    return len;
+}
+
+EXPORTED void headercache_invalidate(const char *mboxname)
+{
+    struct headercache_slot *slot;
+    uint32_t hash, seq;
+    size_t len = 0;
+
+    if (headercache_map()) return;
+
+    slot = headercache_slot(mboxname, &hash);
+
+    /* only claim the slot if it really holds this mailbox: if the
+     * sequence moved on since, somebody else replaced the entry */
+    seq = headercache_read(slot, mboxname, hash, NULL, &len);
+    if (!headercache_claim(slot, seq))
+        return;
+
+    slot->hash = 0;
+    slot->namelen = 0;
+    slot->datalen = 0;
+
+    headercache_release(slot);
+}
+
+EXPORTED void headercache_done(void)
+{
+    if (headercache_base)
+        munmap(headercache_base, HEADERCACHE_HDRSIZE +
+               (size_t) headercache_nslots * sizeof(struct headercache_slot));
+    headercache_base = NULL;
+    headercache_nslots = 0;
+    headercache_failed = 0;
+}
+
+EXPORTED void headercache_reset(void)
+{
+    char *fname = headercache_filename();
+
+    if (unlink(fname) && errno != ENOENT)
+        syslog(LOG_ERR, "IOERROR: unlinking %s: %m", fname);
+
+    free(fname);
+}
@@ -0,0 +1,102 @@
+/* headercache.h -- Shared cache of mailbox index headers
+ *
+ * Copyright (c) 1994-2017 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HEADERCACHE_H
+#define HEADERCACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* name of the shared header cache file */
+#define FNAME_HEADERCACHE "/headercache"
+
+/* file layout: a HEADERCACHE_HDRSIZE byte file header, then the slots.
+ * Both are in host byte order, the file never leaves the machine */
+#define HEADERCACHE_MAGIC   0x48434831  /* "HCH1" */
+#define HEADERCACHE_VERSION 2
+#define HEADERCACHE_HDRSIZE 64
+#define HEADERCACHE_NAMELEN 364
+#define HEADERCACHE_DATALEN 128
+
+/* seconds a writer may hold a slot before others take it back */
+#define HEADERCACHE_STALE   10
+
+struct headercache_file {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotsize;
+    uint32_t nslots;
+};
+
+struct headercache_slot {
+    uint32_t seq;       /* odd while being written */
+    uint32_t claimed;   /* when the current writer claimed it */
+    uint32_t hash;
+    uint32_t namelen;
+    uint32_t datalen;
+    char name[HEADERCACHE_NAMELEN];
+    unsigned char data[HEADERCACHE_DATALEN];
+};
+
+/* Return the filename of the header cache.  Returns a new string
+ * which must be free()d by the caller. */
+extern char *headercache_filename(void);
+
+/* store the on-disk index header of a mailbox after a commit */
+extern void headercache_store(const char *mboxname,
+                              const unsigned char *buf, size_t len);
+
+/* copy the last stored index header of a mailbox into buf, returning
+ * its length, or 0 if there is no (consistent) entry for it */
+extern size_t headercache_fetch(const char *mboxname,
+                                unsigned char *buf, size_t len);
+
+/* drop any entry for the mailbox, e.g. on delete or rename */
+extern void headercache_invalidate(const char *mboxname);
+
+/* unmap the cache; the next call maps it again */
+extern void headercache_done(void);
+
+/* throw away the whole cache, used at recovery */
+extern void headercache_reset(void);
+
+#endif /* HEADERCACHE_H */
@@ -984,6 +984,7 @@ int service_main(int argc __attribute__((unused)),
     imapd_timeout *= 60;
     prot_settimeout(imapd_in, imapd_timeout);
     prot_setflushonread(imapd_in, imapd_out);
+    prot_setgather(imapd_out, 1);
 
     /* we were connected on imaps port so we should do
        TLS negotiation immediately */
@@ -1253,6 +1254,9 @@ static void cmdloop(void)
         /* Release any held index */
         index_release(imapd_index);
 
+        /* and any database snapshots */
+        cyrusdb_release();
+
         /* Flush any buffered output */
         prot_flush(imapd_out);
         if (backend_current) prot_flush(backend_current->out);
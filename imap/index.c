@@ -59,6 +59,7 @@
 #include "assert.h"
 #include "charset.h"
 #include "conversations.h"
+#include "crc32.h"
 #include "dlist.h"
 #include "exitcodes.h"
 #include "hash.h"
@@ -71,6 +72,7 @@
 #include "map.h"
 #include "message.h"
 #include "parseaddr.h"
+#include "retry.h"
 #include "search_engines.h"
 #include "search_query.h"
 #include "seen.h"
@@ -587,6 +589,144 @@ static struct seqset *_readseen(struct index_state *state, unsigned *recentuid)
     return seenlist;
 }
 
+/* bring an existing view of the mailbox up to date by only looking at
+ * the records which cyrus.modseq says have changed since.  Returns 0
+ * if it can't, and the whole index needs to be read */
+static int index_refresh_changes(struct index_state *state)
+{
+    struct mailbox *mailbox = state->mailbox;
+    struct index_record record;
+    uint32_t *recnos = NULL;
+    uint32_t nrecnos = 0;
+    uint32_t msgno, n;
+    uint32_t exists = state->exists;
+    uint32_t firstnotseen = 0;
+    uint32_t numrecent = 0;
+    uint32_t numunseen = 0;
+    uint32_t num_expunged = 0;
+    uint32_t recentuid = 0;
+    modseq_t delayed_modseq = 0;
+    struct index_map *im;
+    uint32_t need_records;
+    struct seqset *seenlist;
+    int i;
+
+    /* only for the same index we last looked at */
+    if (!state->last_uid || state->generation != mailbox->i.generation_no)
+        return 0;
+
+    /* includes anything changed silently, and anything changed by the
+     * commit we last saw (there may have been more at the same modseq) */
+    if (mailbox_changed_recnos(mailbox, state->highestmodseq, 1,
+                               &recnos, &nrecnos))
+        return 0;
+
+    /* same space rules as index_refresh_locked */
+    need_records = state->exists + (mailbox->i.last_uid - state->last_uid);
+    if (need_records >= state->mapsize) {
+        state->mapsize = (need_records | 0xff) + 1; /* round up 1-256 */
+        state->map = xrealloc(state->map,
+                              state->mapsize * sizeof(struct index_map));
+    }
+
+    seenlist = _readseen(state, &recentuid);
+
+    for (n = 0; n < nrecnos; n++) {
+        if (mailbox_read_index_flags(mailbox, recnos[n], &record))
+            continue;
+        if (!record.uid) continue; /* can happen on damaged mailboxes */
+
+        if (record.uid > state->last_uid) {
+            /* new records go on the end, in uid order like recno.
+             * Anything expunged already doesn't need telling about */
+            if (record.system_flags & FLAG_UNLINKED)
+                continue;
+            if (!state->want_expunged && (record.system_flags & FLAG_EXPUNGED))
+                continue;
+            im = &state->map[exists++];
+            memset(im, 0, sizeof(struct index_map));
+            im->uid = record.uid;
+        }
+        else {
+            msgno = index_finduid(state, record.uid);
+            /* expunged before this connection heard of it */
+            if (!msgno || state->map[msgno-1].uid != record.uid)
+                continue;
+            im = &state->map[msgno-1];
+
+            if (record.system_flags & FLAG_UNLINKED) {
+                /* same as a record which is gone in index_refresh_locked,
+                 * except that here we know when it went */
+                if (!(im->system_flags & FLAG_EXPUNGED))
+                    im->modseq = record.modseq;
+                im->recno = 0;
+                im->system_flags |= FLAG_EXPUNGED | FLAG_UNLINKED;
+                continue;
+            }
+        }
+
+        /* copy all mutable fields */
+        im->recno = record.recno;
+        im->modseq = record.modseq;
+        im->system_flags = record.system_flags;
+        im->cache_offset = record.cache_offset;
+        for (i = 0; i < MAX_USER_FLAGS/32; i++)
+            im->user_flags[i] = record.user_flags[i];
+
+        if (im->uid > state->last_uid && !(im->system_flags & FLAG_EXPUNGED)) {
+            /* don't auto-tell new records */
+            im->told_modseq = im->modseq;
+            if (im->uid > recentuid) {
+                im->isrecent = 1;
+                state->seen_dirty = 1;
+            }
+        }
+    }
+    free(recnos);
+
+    /* the counts still cover every message, but they're all in memory */
+    for (msgno = 1; msgno <= exists; msgno++) {
+        im = &state->map[msgno-1];
+
+        if (im->system_flags & FLAG_EXPUNGED) {
+            num_expunged++;
+            if (!delayed_modseq || im->modseq < delayed_modseq)
+                delayed_modseq = im->modseq - 1;
+            continue;
+        }
+
+        if (state->internalseen)
+            im->isseen = (im->system_flags & FLAG_SEEN) ? 1 : 0;
+        else
+            im->isseen = seqset_ismember(seenlist, im->uid) ? 1 : 0;
+
+        if (!im->isseen) {
+            numunseen++;
+            if (!firstnotseen)
+                firstnotseen = msgno;
+        }
+        if (im->isrecent)
+            numrecent++;
+    }
+
+    seqset_free(seenlist);
+
+    /* update the header tracking data */
+    state->oldexists = state->exists;
+    state->exists = exists;
+    state->delayed_modseq = delayed_modseq;
+    state->highestmodseq = mailbox->i.highestmodseq;
+    state->uidvalidity = mailbox->i.uidvalidity;
+    state->last_uid = mailbox->i.last_uid;
+    state->num_records = mailbox->i.num_records;
+    state->num_expunged = num_expunged;
+    state->firstnotseen = firstnotseen;
+    state->numunseen = numunseen;
+    state->numrecent = numrecent;
+
+    return 1;
+}
+
 static void index_refresh_locked(struct index_state *state)
 {
     struct mailbox *mailbox = state->mailbox;
@@ -603,6 +743,9 @@ static void index_refresh_locked(struct index_state *state)
     struct seqset *seenlist;
     int i;
 
+    if (index_refresh_changes(state))
+        return;
+
     /* need to start by having enough space for the entire index state
      * before telling of any expunges (which happens after this refresh
      * if the command allows it).  In the update case, where there's
@@ -632,7 +775,8 @@ static void index_refresh_locked(struct index_state *state)
     seenlist = _readseen(state, &recentuid);
 
     /* walk through all records */
-    struct mailbox_iter *iter = mailbox_iter_init(mailbox, 0, ITER_SKIP_UNLINKED);
+    struct mailbox_iter *iter = mailbox_iter_init(mailbox, 0,
+                                                  ITER_SKIP_UNLINKED|ITER_COLUMNS);
     while ((record = mailbox_iter_step(iter))) {
         im = &state->map[msgno-1];
         while (msgno <= state->exists && im->uid < record->uid) {
@@ -896,8 +1040,8 @@ EXPORTED int index_check(struct index_state *state, int usinguid, int printuid)
 /*
  * Perform UID FETCH (VANISHED) on a sequence.
  */
-struct seqset *index_vanished(struct index_state *state,
-                              struct vanished_params *params)
+EXPORTED struct seqset *index_vanished(struct index_state *state,
+                                       struct vanished_params *params)
 {
     struct mailbox *mailbox = state->mailbox;
     struct seqset *outlist;
@@ -919,11 +1063,19 @@ struct seqset *index_vanished(struct index_state *state,
 
     /* XXX - use match_seq and match_uid */
 
+    /* cyrus.vanished remembers, even if the index doesn't */
+    if (!mailbox_vanished_since(mailbox, params->modseq,
+                                params->sequence ? seq : NULL, outlist)) {
+        seqset_free(seq);
+        return outlist;
+    }
+
     if (params->modseq >= mailbox->i.deletedmodseq) {
         /* all records are significant */
         /* List only expunged UIDs with MODSEQ > requested */
         const struct index_record *record;
-        struct mailbox_iter *iter = mailbox_iter_init(mailbox, params->modseq, 0);
+        struct mailbox_iter *iter = mailbox_iter_init(mailbox, params->modseq,
+                                                      ITER_COLUMNS);
         while ((record = mailbox_iter_step(iter))) {
             if (!(record->system_flags & FLAG_EXPUNGED))
                 continue;
@@ -962,7 +1114,8 @@ struct seqset *index_vanished(struct index_state *state,
         }
 
         const struct index_record *record;
-        struct mailbox_iter *iter = mailbox_iter_init(mailbox, params->modseq, ITER_SKIP_EXPUNGED);
+        struct mailbox_iter *iter = mailbox_iter_init(mailbox, params->modseq,
+                                                      ITER_SKIP_EXPUNGED|ITER_COLUMNS);
         mailbox_iter_startuid(iter, prevuid);
 
         /* possible efficiency improvement - use "seq_getnext" on seq
@@ -1047,8 +1200,10 @@ EXPORTED void index_fetchresponses(struct index_state *state,
                           int *fetchedsomething)
 {
     uint32_t msgno, start, end;
+    uint32_t ahead = 0;
     struct index_map *im;
     int fetched = 0;
+    int readahead = 0;
     annotate_db_t *annot_db = NULL;
 
     /* Keep an open reference on the per-mailbox db to avoid
@@ -1082,10 +1237,19 @@ EXPORTED void index_fetchresponses(struct index_state *state,
     if (start < 1) start = 1;
     if (end > state->exists) end = state->exists;
 
+    /* only worth it if the message files are going to be read */
+    if ((fetchargs->fetchitems &
+         (FETCH_HEADER|FETCH_TEXT|FETCH_SHA1|FETCH_RFC822)) ||
+        fetchargs->binsections || fetchargs->sizesections ||
+        fetchargs->bodysections)
+        readahead = 1;
+
     for (msgno = start; msgno <= end; msgno++) {
         im = &state->map[msgno-1];
         if (seq && !seqset_ismember(seq, usinguid ? im->uid : msgno))
             continue;
+        if (readahead)
+            index_readahead(state, seq, usinguid, msgno, &ahead);
         if (index_fetchreply(state, msgno, fetchargs))
             break;
         fetched = 1;
@@ -1304,6 +1468,47 @@ out:
     return r;
 }
 
+/*
+ * Start readahead of the message files following 'msgno' in 'seq'
+ * (NULL means all messages), up to message_readahead messages ahead.
+ * '*nextp' is the first message not yet warmed and must start as 0;
+ * call this once for each message in ascending order before reading it.
+ */
+EXPORTED void index_readahead(struct index_state *state, struct seqset *seq,
+                              int usinguid, uint32_t msgno, uint32_t *nextp)
+{
+    int window = config_getint(IMAPOPT_MESSAGE_READAHEAD);
+    struct index_record record;
+    struct index_map *im;
+    uint32_t limit;
+    const char *fname;
+
+    if (window <= 0) return;
+
+    limit = msgno + window;
+    if (limit > state->exists) limit = state->exists;
+
+    if (*nextp < msgno) *nextp = msgno;
+
+    for (; *nextp <= limit; (*nextp)++) {
+        im = &state->map[*nextp-1];
+        if (!im->recno || (im->system_flags & FLAG_EXPUNGED))
+            continue;
+        if (seq && !seqset_ismember(seq, usinguid ? im->uid : *nextp))
+            continue;
+
+        if (index_reload_record(state, *nextp, &record))
+            continue;
+
+        fname = mailbox_record_fname(state->mailbox, &record);
+        if (!fname)
+            continue;
+
+        /* missing files are reported when the message is read */
+        warmup_file(fname, 0, 0);
+    }
+}
+
 static void prefetch_messages(struct index_state *state,
                               struct seqset *seq,
                               int usinguid)
@@ -1869,6 +2074,544 @@ out:
     return nmsg;
 }
 
+/*
+ * cyrus.sort and cyrus.thread are message indexes: what a command needs
+ * to know about every message of a mailbox, kept up to date by the
+ * command itself.  Both start with a header:
+ *
+ *   magic (16 bytes), version, uidvalidity, count, strings length
+ *   (4 bytes each), ... crc32 of the first 60 bytes
+ *
+ * and are replaced by writing cyrus.<name>.NEW and renaming it.
+ */
+#define MSGINDEX_MAGIC_SIZE 16
+#define MSGINDEX_HEADER_SIZE 64
+
+#define MSGINDEX_OFFSET_VERSION 16
+#define MSGINDEX_OFFSET_UIDVALIDITY 20
+#define MSGINDEX_OFFSET_COUNT 24
+#define MSGINDEX_OFFSET_STRINGS 28
+#define MSGINDEX_OFFSET_CRC 60
+
+/* a .NEW file this old was left by a writer which died */
+#define MSGINDEX_STALE 300
+
+struct msgindex_type {
+    const char *name;
+    int metafile;
+    const char *magic;
+    uint32_t version;
+    /* check what follows the header is all there */
+    int (*check)(const char *base, size_t len,
+                 uint32_t count, uint32_t strings_len);
+};
+
+/*
+ * Map the mailbox's index of 'type', if it has a good one.  Returns
+ * the number of entries, or -1 with nothing mapped.
+ */
+static int msgindex_map(struct mailbox *mailbox,
+                        const struct msgindex_type *type,
+                        const char **basep, size_t *lenp)
+{
+    const char *base = NULL;
+    size_t len = 0;
+    struct stat sbuf;
+    uint32_t count;
+    int fd;
+
+    *basep = NULL;
+    *lenp = 0;
+
+    fd = open(mailbox_meta_fname(mailbox, type->metafile), O_RDONLY, 0);
+    if (fd == -1) return -1;
+
+    if (fstat(fd, &sbuf) == -1 || sbuf.st_size < MSGINDEX_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+    map_refresh(fd, 1, &base, &len, sbuf.st_size, type->name, mailbox->name);
+    close(fd);
+
+    if (memcmp(base, type->magic, MSGINDEX_MAGIC_SIZE) ||
+        crc32_map(base, MSGINDEX_OFFSET_CRC) !=
+            ntohl(*((bit32 *)(base+MSGINDEX_OFFSET_CRC))) ||
+        ntohl(*((bit32 *)(base+MSGINDEX_OFFSET_VERSION))) != type->version ||
+        ntohl(*((bit32 *)(base+MSGINDEX_OFFSET_UIDVALIDITY))) !=
+            mailbox->i.uidvalidity) {
+        map_free(&base, &len);
+        return -1;
+    }
+
+    count = ntohl(*((bit32 *)(base+MSGINDEX_OFFSET_COUNT)));
+    if (type->check(base, len, count,
+                    ntohl(*((bit32 *)(base+MSGINDEX_OFFSET_STRINGS))))) {
+        map_free(&base, &len);
+        return -1;
+    }
+
+    *basep = base;
+    *lenp = len;
+    return count;
+}
+
+/*
+ * Replace the mailbox's index of 'type' with 'buf', which starts with
+ * room for the header.  If another session is already writing one,
+ * leave it to them.
+ */
+static void msgindex_write(struct mailbox *mailbox,
+                           const struct msgindex_type *type,
+                           struct buf *buf, uint32_t count,
+                           uint32_t strings_len)
+{
+    char *fname = xstrdup(mailbox_meta_fname(mailbox, type->metafile));
+    char *newfname = xstrdup(mailbox_meta_newfname(mailbox, type->metafile));
+    char *header = (char *)buf->s;
+    struct stat sbuf;
+    int fd;
+
+    memcpy(header, type->magic, MSGINDEX_MAGIC_SIZE);
+    *((bit32 *)(header+MSGINDEX_OFFSET_VERSION)) = htonl(type->version);
+    *((bit32 *)(header+MSGINDEX_OFFSET_UIDVALIDITY)) = htonl(mailbox->i.uidvalidity);
+    *((bit32 *)(header+MSGINDEX_OFFSET_COUNT)) = htonl(count);
+    *((bit32 *)(header+MSGINDEX_OFFSET_STRINGS)) = htonl(strings_len);
+    *((bit32 *)(header+MSGINDEX_OFFSET_CRC)) =
+        htonl(crc32_map(header, MSGINDEX_OFFSET_CRC));
+
+    fd = open(newfname, O_WRONLY|O_CREAT|O_EXCL, 0666);
+    if (fd == -1 && errno == EEXIST && stat(newfname, &sbuf) == 0 &&
+        sbuf.st_mtime + MSGINDEX_STALE < time(NULL)) {
+        syslog(LOG_NOTICE, "removing stale %s index %s", type->name, newfname);
+        unlink(newfname);
+        fd = open(newfname, O_WRONLY|O_CREAT|O_EXCL, 0666);
+    }
+    if (fd == -1) {
+        if (errno != EEXIST)
+            syslog(LOG_ERR, "IOERROR: creating %s index %s: %m",
+                   type->name, newfname);
+        goto done;
+    }
+
+    if (retry_write(fd, buf->s, buf->len) != (ssize_t)buf->len ||
+        fdatasync(fd) == -1 ||
+        rename(newfname, fname) == -1) {
+        syslog(LOG_ERR, "IOERROR: writing %s index %s: %m",
+               type->name, newfname);
+        unlink(newfname);
+    }
+    close(fd);
+
+ done:
+    free(newfname);
+    free(fname);
+}
+
+/*
+ * cyrus.sort: the messages of a mailbox in order for each of the
+ * simple SORT criteria, so that SORT doesn't have to load and sort the
+ * envelope data of every message each time.  After the header come
+ * 'count' keys in UID order: uid and size (4 bytes each),
+ * internaldate and sent date (8 bytes each), and the offsets of the
+ * From local-part and the base subject in the strings (4 bytes each).
+ * Then, for each criterion, the positions of the keys in sorted order
+ * (4 bytes each), and lastly the NUL-terminated strings.
+ *
+ * SORT keeps it up to date: messages appended since it was written
+ * have their keys taken from the cache and are merged in, expunged
+ * messages are skipped, and once enough has changed it is rewritten.
+ */
+#define SORTINDEX_MAGIC ("\241\002\213\015cyrus sortidx")
+#define SORTINDEX_VERSION 1
+#define SORTINDEX_KEY_SIZE 32
+
+#define SORTINDEX_KEY(base, n) \
+    ((base) + MSGINDEX_HEADER_SIZE + SORTINDEX_KEY_SIZE*(size_t)(n))
+#define SORTINDEX_ORDER(base, count, crit) \
+    (SORTINDEX_KEY(base, count) + 4*(size_t)(count)*(crit))
+#define SORTINDEX_STRINGS(base, count) \
+    SORTINDEX_ORDER(base, count, SORTINDEX_NUM)
+
+/* rewrite once this many messages have come or gone */
+#define SORTINDEX_SLACK(count) ((count)/32 + 64)
+
+enum {
+    SORTINDEX_ARRIVAL = 0,
+    SORTINDEX_DATE,
+    SORTINDEX_SIZE,
+    SORTINDEX_FROM,
+    SORTINDEX_SUBJECT,
+    SORTINDEX_NUM
+};
+
+struct sortindex_key {
+    uint32_t uid;
+    uint32_t size;
+    time_t internaldate;
+    time_t date;            /* sent date, else internaldate */
+    const char *from;
+    const char *subject;
+};
+
+struct sortindex {
+    const char *base;       /* the file, if any */
+    size_t len;
+    struct sortindex_key *keys;     /* by uid */
+    uint32_t nkeys;
+    int crit;
+    uint32_t *order;        /* positions in keys, in 'crit' order */
+    strarray_t strings;     /* keys of messages not in the file */
+};
+
+static const struct sortindex_key *the_sortindex_keys;
+static int the_sortindex_crit;
+
+/* Which criterion, if any, can the sort index answer? */
+static int sortindex_crit(const struct sortcrit *sortcrit)
+{
+    if (!config_getswitch(IMAPOPT_SORT_INDEX)) return -1;
+
+    /* just one criterion, then the implicit SEQUENCE */
+    if (sortcrit[0].key == SORT_SEQUENCE) return -1;
+    if (sortcrit[1].key != SORT_SEQUENCE || sortcrit[1].flags) return -1;
+
+    switch (sortcrit[0].key) {
+    case SORT_ARRIVAL:
+        return SORTINDEX_ARRIVAL;
+    case SORT_DATE:
+        return SORTINDEX_DATE;
+    case SORT_SIZE:
+        return SORTINDEX_SIZE;
+    case SORT_FROM:
+        return SORTINDEX_FROM;
+    case SORT_SUBJECT:
+        return SORTINDEX_SUBJECT;
+    default:
+        return -1;
+    }
+}
+
+/* compare two keys on a criterion alone, as index_sort_compare does */
+static int sortindex_keycmp(const struct sortindex_key *k1,
+                            const struct sortindex_key *k2, int crit)
+{
+    switch (crit) {
+    case SORTINDEX_ARRIVAL:
+        return (k1->internaldate < k2->internaldate) ? -1 :
+               (k1->internaldate > k2->internaldate);
+    case SORTINDEX_DATE:
+        return (k1->date < k2->date) ? -1 : (k1->date > k2->date);
+    case SORTINDEX_SIZE:
+        return (k1->size < k2->size) ? -1 : (k1->size > k2->size);
+    case SORTINDEX_FROM:
+        return strcmp(k1->from, k2->from);
+    case SORTINDEX_SUBJECT:
+        return strcmp(k1->subject, k2->subject);
+    }
+    return 0;
+}
+
+/* ... and then by uid, as the implicit SEQUENCE does */
+static int sortindex_cmp(const struct sortindex_key *k1,
+                         const struct sortindex_key *k2, int crit)
+{
+    int ret = sortindex_keycmp(k1, k2, crit);
+
+    if (!ret) ret = (k1->uid < k2->uid) ? -1 : (k1->uid > k2->uid);
+    return ret;
+}
+
+static int sortindex_cmp_qsort(const void *v1, const void *v2)
+{
+    uint32_t p1 = *(const uint32_t *)v1;
+    uint32_t p2 = *(const uint32_t *)v2;
+
+    return sortindex_cmp(&the_sortindex_keys[p1], &the_sortindex_keys[p2],
+                         the_sortindex_crit);
+}
+
+static int sortindex_check(const char *base, size_t len,
+                           uint32_t count, uint32_t strings_len)
+{
+    uint32_t i, n;
+    const char *strings;
+
+    if (count > INT_MAX / (SORTINDEX_KEY_SIZE + 4*SORTINDEX_NUM)) return -1;
+    strings = SORTINDEX_STRINGS(base, count);
+    if ((size_t)(strings - base) + strings_len != len) return -1;
+    if (count && (!strings_len || strings[strings_len-1])) return -1;
+
+    for (i = 0; i < count; i++) {
+        const char *key = SORTINDEX_KEY(base, i);
+        if (ntohl(*((bit32 *)(key+24))) >= strings_len) return -1;
+        if (ntohl(*((bit32 *)(key+28))) >= strings_len) return -1;
+    }
+    for (n = 0; n < count * SORTINDEX_NUM; n++) {
+        if (ntohl(*((bit32 *)(SORTINDEX_ORDER(base, count, 0) + 4*n))) >= count)
+            return -1;
+    }
+
+    return 0;
+}
+
+static const struct msgindex_type sortindex_type = {
+    "sort", META_SORT, SORTINDEX_MAGIC, SORTINDEX_VERSION, sortindex_check
+};
+
+static void sortindex_file_key(const char *base, uint32_t count, uint32_t n,
+                               struct sortindex_key *key)
+{
+    const char *p = SORTINDEX_KEY(base, n);
+    const char *strings = SORTINDEX_STRINGS(base, count);
+
+    key->uid = ntohl(*((bit32 *)(p)));
+    key->size = ntohl(*((bit32 *)(p+4)));
+    key->internaldate = ntohll(*((bit64 *)(p+8)));
+    key->date = ntohll(*((bit64 *)(p+16)));
+    key->from = strings + ntohl(*((bit32 *)(p+24)));
+    key->subject = strings + ntohl(*((bit32 *)(p+28)));
+}
+
+/* work out the keys for a message the file doesn't have yet */
+static int sortindex_key_load(struct index_state *state, uint32_t msgno,
+                              struct sortindex_key *key, strarray_t *strings)
+{
+    struct index_record record;
+    char *s;
+    int is_refwd;
+
+    if (index_reload_record(state, msgno, &record))
+        return IMAP_IOERROR;
+    if (mailbox_cacherecord(state->mailbox, &record))
+        return IMAP_IOERROR;
+
+    key->uid = record.uid;
+    key->size = record.size;
+    key->internaldate = record.internaldate;
+    key->date = record.gmtime ? record.gmtime : record.internaldate;
+
+    s = get_localpart_addr(cacheitem_base(&record, CACHE_FROM));
+    key->from = s ? s : xstrdup("");
+    strarray_appendm(strings, (char *)key->from);
+
+    s = index_extract_subject(cacheitem_base(&record, CACHE_SUBJECT),
+                              cacheitem_size(&record, CACHE_SUBJECT),
+                              &is_refwd);
+    key->subject = s ? s : xstrdup("");
+    strarray_appendm(strings, (char *)key->subject);
+
+    return 0;
+}
+
+/* the keys in order for 'crit': the file's order, less the messages
+ * which have gone, merged with the new messages */
+static uint32_t *sortindex_order(struct sortindex *si, int crit,
+                                 const char *base, uint32_t nfile,
+                                 const uint32_t *fmap,
+                                 uint32_t *newpos, uint32_t nnew)
+{
+    uint32_t *order = xmalloc((si->nkeys ? si->nkeys : 1) * sizeof(uint32_t));
+    const char *forder = base ? SORTINDEX_ORDER(base, nfile, crit) : NULL;
+    uint32_t i = 0, j = 0, n = 0;
+
+    the_sortindex_keys = si->keys;
+    the_sortindex_crit = crit;
+    qsort(newpos, nnew, sizeof(uint32_t), sortindex_cmp_qsort);
+
+    while (i < nfile || j < nnew) {
+        uint32_t pos = UINT32_MAX;
+
+        if (i < nfile) {
+            pos = fmap[ntohl(*((bit32 *)(forder + 4*i)))];
+            if (pos == UINT32_MAX) {
+                /* expunged */
+                i++;
+                continue;
+            }
+        }
+
+        if (j < nnew && (pos == UINT32_MAX ||
+                         sortindex_cmp(&si->keys[newpos[j]],
+                                       &si->keys[pos], crit) < 0)) {
+            order[n++] = newpos[j++];
+        }
+        else {
+            order[n++] = pos;
+            i++;
+        }
+    }
+
+    return order;
+}
+
+static void sortindex_write(struct mailbox *mailbox, struct sortindex *si,
+                            const char *base, uint32_t nfile,
+                            const uint32_t *fmap,
+                            uint32_t *newpos, uint32_t nnew)
+{
+    struct buf buf = BUF_INITIALIZER;
+    struct buf strings = BUF_INITIALIZER;
+    hash_table offsets = HASH_TABLE_INITIALIZER;
+    char header[MSGINDEX_HEADER_SIZE];
+    uint32_t i;
+    int crit;
+
+    construct_hash_table(&offsets, si->nkeys + 1, 0);
+
+    memset(header, 0, MSGINDEX_HEADER_SIZE);
+    buf_appendmap(&buf, header, MSGINDEX_HEADER_SIZE);
+
+    for (i = 0; i < si->nkeys; i++) {
+        const struct sortindex_key *key = &si->keys[i];
+        const char *s[2] = { key->from, key->subject };
+        bit32 val[2], val32;
+        bit64 val64;
+        int k;
+
+        /* each distinct string just once */
+        for (k = 0; k < 2; k++) {
+            uintptr_t off = (uintptr_t) hash_lookup(s[k], &offsets);
+            if (!off) {
+                off = strings.len + 1;
+                buf_appendmap(&strings, s[k], strlen(s[k]) + 1);
+                hash_insert(s[k], (void *) off, &offsets);
+            }
+            val[k] = htonl(off - 1);
+        }
+
+        val32 = htonl(key->uid);
+        buf_appendmap(&buf, (const char *)&val32, 4);
+        val32 = htonl(key->size);
+        buf_appendmap(&buf, (const char *)&val32, 4);
+        val64 = htonll(key->internaldate);
+        buf_appendmap(&buf, (const char *)&val64, 8);
+        val64 = htonll(key->date);
+        buf_appendmap(&buf, (const char *)&val64, 8);
+        buf_appendmap(&buf, (const char *)val, 8);
+    }
+
+    for (crit = 0; crit < SORTINDEX_NUM; crit++) {
+        uint32_t *order = si->order;
+
+        if (crit != si->crit)
+            order = sortindex_order(si, crit, base, nfile, fmap, newpos, nnew);
+        for (i = 0; i < si->nkeys; i++) {
+            bit32 val = htonl(order[i]);
+            buf_appendmap(&buf, (const char *)&val, 4);
+        }
+        if (order != si->order) free(order);
+    }
+
+    buf_append(&buf, &strings);
+
+    msgindex_write(mailbox, &sortindex_type, &buf, si->nkeys, strings.len);
+
+    free_hash_table(&offsets, NULL);
+    buf_free(&strings);
+    buf_free(&buf);
+}
+
+/*
+ * Bring the mailbox's sort index up to date with what this session can
+ * see, and get the order for 'crit'.  Messages the session sees which
+ * are missing from the file are added from the cache.
+ */
+static int index_sortindex_load(struct index_state *state, int crit,
+                                struct sortindex *si)
+{
+    struct mailbox *mailbox = state->mailbox;
+    uint32_t *fmap = NULL, *newpos = NULL;
+    uint32_t nfile = 0, nnew = 0, ngone = 0, i = 0, msgno;
+    int count, r = 0;
+
+    memset(si, 0, sizeof(struct sortindex));
+
+    count = msgindex_map(mailbox, &sortindex_type, &si->base, &si->len);
+    if (count > 0) nfile = count;
+
+    si->keys = xmalloc((nfile + state->exists + 1) * sizeof(struct sortindex_key));
+    fmap = xmalloc((nfile + 1) * sizeof(uint32_t));
+    newpos = xmalloc((state->exists + 1) * sizeof(uint32_t));
+
+    /* both are in uid order: walk them together */
+    for (msgno = 1; msgno <= state->exists; msgno++) {
+        uint32_t uid = index_getuid(state, msgno);
+
+        for (; i < nfile && ntohl(*((bit32 *)SORTINDEX_KEY(si->base, i))) < uid; i++) {
+            fmap[i] = UINT32_MAX;
+            ngone++;
+        }
+
+        if (i < nfile && ntohl(*((bit32 *)SORTINDEX_KEY(si->base, i))) == uid) {
+            sortindex_file_key(si->base, nfile, i, &si->keys[si->nkeys]);
+            fmap[i++] = si->nkeys++;
+            continue;
+        }
+
+        r = sortindex_key_load(state, msgno, &si->keys[si->nkeys], &si->strings);
+        if (r) goto done;
+        newpos[nnew++] = si->nkeys++;
+    }
+
+    /* and keep anything newer than this session knows about */
+    for (; i < nfile; i++) {
+        sortindex_file_key(si->base, nfile, i, &si->keys[si->nkeys]);
+        fmap[i] = si->nkeys++;
+    }
+
+    si->crit = crit;
+    si->order = sortindex_order(si, crit, si->base, nfile, fmap, newpos, nnew);
+
+    if ((!si->base || nnew + ngone > SORTINDEX_SLACK(nfile)) &&
+        !mailbox->is_readonly) {
+        sortindex_write(mailbox, si, si->base, nfile, fmap, newpos, nnew);
+    }
+
+done:
+    free(newpos);
+    free(fmap);
+    return r;
+}
+
+static void sortindex_fini(struct sortindex *si)
+{
+    if (si->base) map_free(&si->base, &si->len);
+    free(si->keys);
+    free(si->order);
+    strarray_fini(&si->strings);
+}
+
+/* print the messages found by the search, in sort index order */
+static void index_sortindex_print(struct index_state *state,
+                                  struct sortindex *si, int crit, int reverse,
+                                  search_folder_t *folder, int usinguid)
+{
+    uint32_t i, j, end;
+
+    for (i = 0; i < si->nkeys; i = end) {
+        uint32_t first = reverse ? si->nkeys - i - 1 : i;
+
+        /* backwards by key, but equal keys still in uid order */
+        end = i + 1;
+        if (reverse) {
+            while (first > 0 &&
+                   !sortindex_keycmp(&si->keys[si->order[first-1]],
+                                     &si->keys[si->order[first]], crit)) {
+                first--;
+                end++;
+            }
+        }
+
+        for (j = first; j < first + (end - i); j++) {
+            uint32_t uid = si->keys[si->order[j]].uid;
+
+            if (!bv_isset(&folder->uids, uid)) continue;
+            prot_printf(state->out, " %u",
+                        usinguid ? uid : index_finduid(state, uid));
+        }
+    }
+}
+
 /*
  * Performs a SORT command
  */
@@ -1881,6 +2624,8 @@ EXPORTED int index_sort(struct index_state *state,
     modseq_t highestmodseq = 0;
     search_query_t *query = NULL;
     search_folder_t *folder = NULL;
+    struct sortindex si;
+    int crit;
     int r;
 
     /* update the index */
@@ -1888,10 +2633,11 @@ EXPORTED int index_sort(struct index_state *state,
         return 0;
 
     highestmodseq = needs_modseq(searchargs, NULL);
+    crit = sortindex_crit(sortcrit);
 
     /* Search for messages based on the given criteria */
     query = search_query_new(state, searchargs);
-    query->sortcrit = sortcrit;
+    if (crit < 0) query->sortcrit = sortcrit;
     r = search_query_run(query);
     if (r) goto out;        /* search failed */
     folder = search_query_find_folder(query, index_mboxname(state));
@@ -1904,7 +2650,33 @@ EXPORTED int index_sort(struct index_state *state,
 
     prot_printf(state->out, "* SORT");
 
-    if (nmsg) {
+    if (nmsg && crit >= 0) {
+        /* let the sort index put what we found in order */
+        if (!index_sortindex_load(state, crit, &si)) {
+            index_sortindex_print(state, &si, crit,
+                                  sortcrit[0].flags & SORT_REVERSE,
+                                  folder, usinguid);
+        }
+        else {
+            /* no good: sort the found messages the usual way */
+            unsigned *msgno_list = NULL;
+            MsgData **msgdata;
+
+            search_folder_use_msn(folder, state);
+            nmsg = search_folder_get_array(folder, &msgno_list);
+            msgdata = index_msgdata_load(state, msgno_list, nmsg,
+                                         sortcrit, 0, NULL);
+            index_msgdata_sort(msgdata, nmsg, sortcrit);
+            for (i = 0 ; i < nmsg ; i++) {
+                prot_printf(state->out, " %u",
+                            (usinguid ? msgdata[i]->uid : msgdata[i]->msgno));
+            }
+            index_msgdata_free(msgdata, nmsg);
+            free(msgno_list);
+        }
+        sortindex_fini(&si);
+    }
+    else if (nmsg) {
         /* Output the sorted messages */
         for (i = 0 ; i < query->merged_msgdata.count ; i++) {
             MsgData *md = ptrarray_nth(&query->merged_msgdata, i);
@@ -2034,6 +2806,7 @@ EXPORTED int index_convsort(struct index_state *state,
     uint32_t first_pos = 0;
     unsigned int ninwindow = 0;
     ptrarray_t results = PTRARRAY_INITIALIZER;
+    unsigned char *prefilter = NULL;
     int total = 0;
     int r = 0;
     struct conversations_state *cstate = NULL;
@@ -2069,6 +2842,8 @@ EXPORTED int index_convsort(struct index_state *state,
 
     construct_hashu64_table(&seen_cids, state->exists/4+4, 0);
 
+    prefilter = search_expr_prefilter(state, searchargs->root);
+
     /* Create/load the msgdata array.
      * load data for ALL messages always.  We sort before searching so
      * we can take advantage of the window arguments to stop searching
@@ -2093,7 +2868,8 @@ EXPORTED int index_convsort(struct index_state *state,
             continue;
 
         /* run the search program against all messages */
-        if (!index_search_evaluate(state, searchargs->root, msg->msgno))
+        if (!index_search_evaluate_prefiltered(state, searchargs->root,
+                                               prefilter, msg->msgno))
             continue;
 
         /* figure out whether this message is an exemplar */
@@ -2184,6 +2960,7 @@ out:
     index_msgdata_free(msgdata, state->exists);
     ptrarray_fini(&results);
     free_hashu64_table(&seen_cids, NULL);
+    free(prefilter);
 
     return r;
 }
@@ -2539,6 +3316,7 @@ EXPORTED int index_convupdates(struct index_state *state,
     ptrarray_t added = PTRARRAY_INITIALIZER;
     ptrarray_t removed = PTRARRAY_INITIALIZER;
     ptrarray_t changed = PTRARRAY_INITIALIZER;
+    unsigned char *prefilter = NULL;
     int total = 0;
     struct conversations_state *cstate = NULL;
     int search_is_mutable = is_mutable_ordering(sortcrit, searchargs);
@@ -2574,6 +3352,8 @@ EXPORTED int index_convupdates(struct index_state *state,
     construct_hashu64_table(&seen_cids, state->exists/4+4, 0);
     construct_hashu64_table(&old_seen_cids, state->exists/4+4, 0);
 
+    prefilter = search_expr_prefilter(state, searchargs->root);
+
     /* Create/load the msgdata array
      * initial list - load data for ALL messages always */
     msgdata = index_msgdata_load(state, NULL, state->exists, sortcrit, 0, NULL);
@@ -2593,7 +3373,8 @@ EXPORTED int index_convupdates(struct index_state *state,
         int is_changed = 0;
         int in_search = 0;
 
-        in_search = index_search_evaluate(state, searchargs->root, msg->msgno);
+        in_search = index_search_evaluate_prefiltered(state, searchargs->root,
+                                                      prefilter, msg->msgno);
         is_deleted = !!(im->system_flags & FLAG_EXPUNGED);
         is_new = (im->uid >= windowargs->uidnext);
         was_deleted = is_deleted && (im->modseq <= windowargs->modseq);
@@ -2719,6 +3500,7 @@ out:
     ptrarray_fini(&changed);
     free_hashu64_table(&seen_cids, NULL);
     free_hashu64_table(&old_seen_cids, NULL);
+    free(prefilter);
 
     return r;
 }
@@ -3067,6 +3849,41 @@ static int data_domain(const char *p, size_t n)
     return DOMAIN_7BIT;
 }
 
+/*
+ * Send the 'n' bytes at 'data' straight from the file of the message
+ * being fetched, if they're part of it and there are enough of them to
+ * be worth it.  Returns 0 if the caller still needs to write them.
+ */
+static int index_sendfile(struct index_state *state,
+                          const char *data, unsigned n)
+{
+    int minsize = config_getint(IMAPOPT_SENDFILE_MINSIZE);
+    const struct buf *msg = state->fetch_msg;
+    ssize_t sent;
+    int fd;
+
+    if (minsize <= 0 || n < (unsigned) minsize) return 0;
+
+    /* not decoded or otherwise copied from the file */
+    if (!state->fetch_record || !msg || !msg->s) return 0;
+    if (data < msg->s || data + n > msg->s + msg->len) return 0;
+
+    fd = open(mailbox_record_fname(state->mailbox, state->fetch_record),
+              O_RDONLY, 0);
+    if (fd == -1) return 0;
+
+    /* a compressed file doesn't hold the bytes we mapped */
+    if (mailbox_file_compressed(fd, NULL)) {
+        close(fd);
+        return 0;
+    }
+
+    sent = prot_sendfile(state->out, fd, data - msg->s, n);
+    close(fd);
+
+    return sent >= 0;
+}
+
 /*
  * Helper function to fetch data from a message file.  Writes a
  * quoted-string or literal containing data from 'msg_base', which is
@@ -3133,7 +3950,8 @@ void index_fetchmsg(struct index_state *state, const struct buf *msg,
     /* Non-text literal -- tell the protstream about it */
     if (domain != DOMAIN_7BIT) prot_data_boundary(state->out);
 
-    prot_write(state->out, msg->s + offset, n);
+    if (!index_sendfile(state, msg->s + offset, n))
+        prot_write(state->out, msg->s + offset, n);
     while (n++ < size) {
         /* File too short, resynch client.
          *
@@ -3884,6 +4702,8 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
             prot_printf(state->out, "\r\n");
             return 0;
         }
+        state->fetch_record = &record;
+        state->fetch_msg = &buf;
     }
     int ischanged = im->told_modseq < record.modseq;
 
@@ -4147,6 +4967,8 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
         /* finsh the response if we have one */
         prot_printf(state->out, ")\r\n");
     }
+    state->fetch_record = NULL;
+    state->fetch_msg = NULL;
     buf_free(&buf);
     if (body) {
         message_free_body(body);
@@ -4572,9 +5394,25 @@ int index_search_evaluate(struct index_state *state,
     int r;
     message_t *m;
     struct index_record record;
+    int i;
 
-    r = index_reload_record(state, msgno, &record);
-    if (r) return r;
+    if (config_getswitch(IMAPOPT_MAILBOX_COLUMNS) &&
+        search_expr_is_indexmap(e)) {
+        /* everything we need is already in the map, don't
+         * go back to the index record for it */
+        memset(&record, 0, sizeof(struct index_record));
+        record.recno = im->recno;
+        record.uid = im->uid;
+        record.modseq = im->modseq;
+        record.system_flags = im->system_flags;
+        record.cache_offset = im->cache_offset;
+        for (i = 0; i < MAX_USER_FLAGS/32; i++)
+            record.user_flags[i] = im->user_flags[i];
+    }
+    else {
+        r = index_reload_record(state, msgno, &record);
+        if (r) return r;
+    }
 
     xstats_inc(SEARCH_EVALUATE);
 
@@ -4587,6 +5425,26 @@ int index_search_evaluate(struct index_state *state,
     return r;
 }
 
+/*
+ * As index_search_evaluate(), but first consult the per-message
+ * results of search_expr_prefilter() (if any), and only evaluate
+ * the messages which it couldn't decide.
+ */
+int index_search_evaluate_prefiltered(struct index_state *state,
+                                      const search_expr_t *e,
+                                      const unsigned char *prefilter,
+                                      uint32_t msgno)
+{
+    if (prefilter) {
+        switch (prefilter[msgno-1]) {
+        case SEARCH_PF_TRUE: return 1;
+        case SEARCH_PF_FALSE: return 0;
+        }
+    }
+
+    return index_search_evaluate(state, e, msgno);
+}
+
 struct getsearchtext_rock
 {
     search_text_receiver_t *receiver;
@@ -5438,6 +6296,358 @@ static void index_thread_sort(Thread *root,
                         (void *)sortcrit);
 }
 
+/*
+ * cyrus.thread: what THREAD needs to know about each message of a
+ * mailbox, so that it doesn't have to parse the envelope and headers of
+ * every message from the cache each time.  After the message index
+ * header come 'count' entries in UID order: uid and flags (4 bytes
+ * each), sent date and internaldate (8 bytes each), the offsets of the
+ * base subject and message-id in the strings, and the offset and number
+ * of the references (4 bytes each).  Then come the NUL-terminated
+ * strings, each entry's references one after another.
+ *
+ * THREAD keeps it up to date the same way SORT does cyrus.sort.
+ */
+#define THREADINDEX_MAGIC ("\241\002\213\015cyrus thread")
+#define THREADINDEX_VERSION 1
+#define THREADINDEX_ENTRY_SIZE 40
+
+#define THREADINDEX_ENTRY(base, n) \
+    ((base) + MSGINDEX_HEADER_SIZE + THREADINDEX_ENTRY_SIZE*(size_t)(n))
+#define THREADINDEX_STRINGS(base, count) THREADINDEX_ENTRY(base, count)
+
+/* entry flags */
+#define THREADINDEX_REFWD       (1<<0)  /* subject was a reply/forward */
+#define THREADINDEX_NOMSGID     (1<<1)  /* envelope couldn't be read */
+#define THREADINDEX_EMPTYID     (1<<2)  /* no Message-ID: make one up */
+
+/* rewrite once this many messages have come or gone */
+#define THREADINDEX_SLACK(count) ((count)/32 + 64)
+
+/* what gets stored for new messages */
+static const struct sortcrit threadindex_loadcrit[] =
+                             {{ LOAD_IDS,      0, {{NULL,NULL}} },
+                              { SORT_SUBJECT,  0, {{NULL,NULL}} },
+                              { SORT_DATE,     0, {{NULL,NULL}} },
+                              { SORT_SEQUENCE, 0, {{NULL,NULL}} }};
+
+static int threadindex_check(const char *base, size_t len,
+                             uint32_t count, uint32_t strings_len)
+{
+    uint32_t i;
+    const char *strings;
+
+    if (count > INT_MAX / THREADINDEX_ENTRY_SIZE) return -1;
+    strings = THREADINDEX_STRINGS(base, count);
+    if ((size_t)(strings - base) + strings_len != len) return -1;
+    if (count && (!strings_len || strings[strings_len-1])) return -1;
+
+    for (i = 0; i < count; i++) {
+        const char *entry = THREADINDEX_ENTRY(base, i);
+        uint32_t off = ntohl(*((bit32 *)(entry+32)));
+        uint32_t nrefs = ntohl(*((bit32 *)(entry+36)));
+
+        if (ntohl(*((bit32 *)(entry+24))) >= strings_len) return -1;
+        if (ntohl(*((bit32 *)(entry+28))) >= strings_len) return -1;
+        while (nrefs--) {
+            if (off >= strings_len) return -1;
+            off += strlen(strings + off) + 1;
+        }
+    }
+
+    return 0;
+}
+
+static const struct msgindex_type threadindex_type = {
+    "thread", META_THREAD, THREADINDEX_MAGIC, THREADINDEX_VERSION,
+    threadindex_check
+};
+
+/* the strings of an entry's references, one after another */
+static const char *threadindex_refs(const char *base, uint32_t count,
+                                    const char *entry, size_t *lenp)
+{
+    const char *refs = THREADINDEX_STRINGS(base, count) +
+                       ntohl(*((bit32 *)(entry+32)));
+    uint32_t nrefs = ntohl(*((bit32 *)(entry+36)));
+    const char *p = refs;
+
+    while (nrefs--) p += strlen(p) + 1;
+
+    *lenp = p - refs;
+    return refs;
+}
+
+static void threadindex_append(struct buf *buf, struct buf *strings,
+                               hash_table *subjects,
+                               uint32_t uid, uint32_t flags,
+                               time_t sentdate, time_t internaldate,
+                               const char *subject, const char *msgid,
+                               const char *refs, size_t refslen,
+                               uint32_t nrefs)
+{
+    uintptr_t off;
+    bit32 val32;
+    bit64 val64;
+
+    val32 = htonl(uid);
+    buf_appendmap(buf, (const char *)&val32, 4);
+    val32 = htonl(flags);
+    buf_appendmap(buf, (const char *)&val32, 4);
+    val64 = htonll(sentdate);
+    buf_appendmap(buf, (const char *)&val64, 8);
+    val64 = htonll(internaldate);
+    buf_appendmap(buf, (const char *)&val64, 8);
+
+    /* threads share subjects, so each just once */
+    off = (uintptr_t) hash_lookup(subject, subjects);
+    if (!off) {
+        off = strings->len + 1;
+        buf_appendmap(strings, subject, strlen(subject) + 1);
+        hash_insert(subject, (void *) off, subjects);
+    }
+    val32 = htonl(off - 1);
+    buf_appendmap(buf, (const char *)&val32, 4);
+
+    val32 = htonl(strings->len);
+    buf_appendmap(buf, (const char *)&val32, 4);
+    buf_appendmap(strings, msgid, strlen(msgid) + 1);
+
+    val32 = htonl(nrefs ? strings->len : 0);
+    buf_appendmap(buf, (const char *)&val32, 4);
+    val32 = htonl(nrefs);
+    buf_appendmap(buf, (const char *)&val32, 4);
+    buf_appendmap(strings, refs, refslen);
+}
+
+static void threadindex_write(struct index_state *state,
+                              const char *base, uint32_t nfile,
+                              MsgData **newdata, const uint32_t *newidx)
+{
+    struct buf buf = BUF_INITIALIZER;
+    struct buf strings = BUF_INITIALIZER;
+    struct buf refs = BUF_INITIALIZER;
+    hash_table subjects = HASH_TABLE_INITIALIZER;
+    char header[MSGINDEX_HEADER_SIZE];
+    uint32_t i = 0, msgno, count = 0;
+
+    construct_hash_table(&subjects, state->exists + 1, 0);
+
+    memset(header, 0, MSGINDEX_HEADER_SIZE);
+    buf_appendmap(&buf, header, MSGINDEX_HEADER_SIZE);
+
+    /* the messages this session sees, then any newer ones */
+    for (msgno = 1; msgno <= state->exists + 1; msgno++) {
+        uint32_t uid = msgno <= state->exists ? index_getuid(state, msgno)
+                                              : UINT32_MAX;
+        MsgData *md;
+        int k;
+
+        for (; i < nfile; i++) {
+            const char *entry = THREADINDEX_ENTRY(base, i);
+            const char *strs = THREADINDEX_STRINGS(base, nfile);
+            const char *r;
+            size_t len;
+
+            if (ntohl(*((bit32 *)entry)) >= uid) break;
+            if (uid != UINT32_MAX) continue;    /* expunged */
+
+            r = threadindex_refs(base, nfile, entry, &len);
+            threadindex_append(&buf, &strings, &subjects,
+                               ntohl(*((bit32 *)entry)),
+                               ntohl(*((bit32 *)(entry+4))),
+                               ntohll(*((bit64 *)(entry+8))),
+                               ntohll(*((bit64 *)(entry+16))),
+                               strs + ntohl(*((bit32 *)(entry+24))),
+                               strs + ntohl(*((bit32 *)(entry+28))),
+                               r, len, ntohl(*((bit32 *)(entry+36))));
+            count++;
+        }
+        if (msgno > state->exists) break;
+
+        if (newidx[msgno-1] == UINT32_MAX) {
+            const char *entry = THREADINDEX_ENTRY(base, i);
+            const char *strs = THREADINDEX_STRINGS(base, nfile);
+            const char *r;
+            size_t len;
+
+            r = threadindex_refs(base, nfile, entry, &len);
+            threadindex_append(&buf, &strings, &subjects, uid,
+                               ntohl(*((bit32 *)(entry+4))),
+                               ntohll(*((bit64 *)(entry+8))),
+                               ntohll(*((bit64 *)(entry+16))),
+                               strs + ntohl(*((bit32 *)(entry+24))),
+                               strs + ntohl(*((bit32 *)(entry+28))),
+                               r, len, ntohl(*((bit32 *)(entry+36))));
+            i++;
+        }
+        else {
+            uint32_t flags = 0;
+
+            md = newdata[newidx[msgno-1]];
+            if (!md->uid) continue;     /* couldn't load it */
+            if (md->is_refwd) flags |= THREADINDEX_REFWD;
+            if (!md->msgid) {
+                flags |= THREADINDEX_NOMSGID;
+            }
+            else {
+                /* made up by index_get_ids, with a msgno in it */
+                buf_reset(&refs);
+                buf_printf(&refs, "<Empty-ID: %u>", msgno);
+                if (!strcmp(md->msgid, buf_cstring(&refs)))
+                    flags |= THREADINDEX_EMPTYID;
+            }
+
+            buf_reset(&refs);
+            for (k = 0; k < md->ref.count; k++)
+                buf_appendmap(&refs, md->ref.data[k],
+                              strlen(md->ref.data[k]) + 1);
+
+            threadindex_append(&buf, &strings, &subjects, uid, flags,
+                               md->sentdate, md->internaldate,
+                               md->xsubj ? md->xsubj : "",
+                               (flags & (THREADINDEX_NOMSGID|THREADINDEX_EMPTYID))
+                                   ? "" : md->msgid,
+                               refs.s, refs.len, md->ref.count);
+        }
+        count++;
+    }
+
+    buf_append(&buf, &strings);
+
+    msgindex_write(state->mailbox, &threadindex_type, &buf, count, strings.len);
+
+    free_hash_table(&subjects, NULL);
+    buf_free(&refs);
+    buf_free(&strings);
+    buf_free(&buf);
+}
+
+/*
+ * Load the MsgData for threading the messages in 'msgno_list' (which
+ * is in msgno order) from the mailbox's thread index, bringing it up
+ * to date with what this session sees.  Falls back to
+ * index_msgdata_load() if the thread index isn't in use.
+ */
+static MsgData **index_threadindex_load(struct index_state *state,
+                                        unsigned *msgno_list, unsigned nmsg,
+                                        const struct sortcrit *loadcrit)
+{
+    struct mailbox *mailbox = state->mailbox;
+    const char *base = NULL;
+    size_t len = 0;
+    uint32_t *fileidx = NULL, *newidx = NULL;
+    unsigned *newlist = NULL;
+    MsgData **ptrs, *md, **newdata = NULL;
+    uint32_t nfile = 0, nnew = 0, ngone = 0, i = 0, msgno, k;
+    int count, want_ids = 0;
+
+    if (!config_getswitch(IMAPOPT_THREAD_INDEX) || !nmsg)
+        return index_msgdata_load(state, msgno_list, nmsg, loadcrit, 0, NULL);
+
+    for (k = 0; loadcrit[k].key; k++) {
+        if (loadcrit[k].key == LOAD_IDS) want_ids = 1;
+    }
+
+    count = msgindex_map(mailbox, &threadindex_type, &base, &len);
+    if (count > 0) nfile = count;
+
+    /* which messages does the file have?  Both are in uid order */
+    fileidx = xmalloc((state->exists + 1) * sizeof(uint32_t));
+    newidx = xmalloc((state->exists + 1) * sizeof(uint32_t));
+    newlist = xmalloc((state->exists + 1) * sizeof(unsigned));
+    for (msgno = 1; msgno <= state->exists; msgno++) {
+        uint32_t uid = index_getuid(state, msgno);
+
+        for (; i < nfile && ntohl(*((bit32 *)THREADINDEX_ENTRY(base, i))) < uid; i++)
+            ngone++;
+
+        if (i < nfile && ntohl(*((bit32 *)THREADINDEX_ENTRY(base, i))) == uid) {
+            fileidx[msgno-1] = i++;
+            newidx[msgno-1] = UINT32_MAX;
+        }
+        else {
+            fileidx[msgno-1] = UINT32_MAX;
+            newidx[msgno-1] = nnew;
+            newlist[nnew++] = msgno;
+        }
+    }
+
+    if (nnew) {
+        newdata = index_msgdata_load(state, newlist, nnew,
+                                     threadindex_loadcrit, 0, NULL);
+    }
+
+    if ((!base || nnew + ngone > THREADINDEX_SLACK(nfile)) &&
+        !mailbox->is_readonly) {
+        threadindex_write(state, base, nfile, newdata, newidx);
+    }
+
+    /* laid out as index_msgdata_load() does, for index_msgdata_free() */
+    ptrs = (MsgData **) xzmalloc(nmsg * sizeof(MsgData *) + nmsg * sizeof(MsgData));
+    md = (MsgData *)(ptrs + nmsg);
+
+    for (k = 0; k < nmsg; k++) {
+        MsgData *cur = ptrs[k] = &md[k];
+        const char *entry, *strs, *p;
+        uint32_t flags, nrefs;
+
+        msgno = msgno_list[k];
+
+        if (fileidx[msgno-1] == UINT32_MAX) {
+            /* take it over from the newly loaded ones */
+            MsgData *src = newdata[newidx[msgno-1]];
+            *cur = *src;
+            memset(src, 0, sizeof(MsgData));
+            if (!want_ids) {
+                free(cur->msgid);
+                cur->msgid = NULL;
+                strarray_fini(&cur->ref);
+            }
+            continue;
+        }
+
+        entry = THREADINDEX_ENTRY(base, fileidx[msgno-1]);
+        strs = THREADINDEX_STRINGS(base, nfile);
+        flags = ntohl(*((bit32 *)(entry+4)));
+
+        cur->msgno = msgno;
+        cur->uid = ntohl(*((bit32 *)entry));
+        cur->modseq = state->map[msgno-1].modseq;
+        cur->sentdate = ntohll(*((bit64 *)(entry+8)));
+        cur->internaldate = ntohll(*((bit64 *)(entry+16)));
+        cur->xsubj = xstrdup(strs + ntohl(*((bit32 *)(entry+24))));
+        cur->xsubj_hash = strhash(cur->xsubj);
+        cur->is_refwd = (flags & THREADINDEX_REFWD) ? 1 : 0;
+
+        if (!want_ids || (flags & THREADINDEX_NOMSGID))
+            continue;
+
+        if (flags & THREADINDEX_EMPTYID) {
+            struct buf buf = BUF_INITIALIZER;
+            buf_printf(&buf, "<Empty-ID: %u>", msgno);
+            cur->msgid = buf_release(&buf);
+        }
+        else {
+            cur->msgid = xstrdup(strs + ntohl(*((bit32 *)(entry+28))));
+        }
+
+        p = strs + ntohl(*((bit32 *)(entry+32)));
+        for (nrefs = ntohl(*((bit32 *)(entry+36))); nrefs; nrefs--) {
+            strarray_append(&cur->ref, p);
+            p += strlen(p) + 1;
+        }
+    }
+
+    index_msgdata_free(newdata, nnew);
+    if (base) map_free(&base, &len);
+    free(newlist);
+    free(newidx);
+    free(fileidx);
+
+    return ptrs;
+}
+
 /*
  * Thread a list of messages using the ORDEREDSUBJECT algorithm.
  */
@@ -5456,7 +6666,7 @@ static void index_thread_orderedsubj(struct index_state *state,
     Thread *head, *newnode, *cur, *parent, *last;
 
     /* Create/load the msgdata array */
-    msgdata = index_msgdata_load(state, msgno_list, nmsg, sortcrit, 0, NULL);
+    msgdata = index_threadindex_load(state, msgno_list, nmsg, sortcrit);
 
     /* Sort messages by subject and date */
     index_msgdata_sort(msgdata, nmsg, sortcrit);
@@ -6115,7 +7325,7 @@ static void _index_thread_ref(struct index_state *state, unsigned *msgno_list,
     struct rootset rootset;
 
     /* Create/load the msgdata array */
-    msgdata = index_msgdata_load(state, msgno_list, nmsg, loadcrit, 0, NULL);
+    msgdata = index_threadindex_load(state, msgno_list, nmsg, loadcrit);
 
     /* calculate the sum of the number of references for all messages */
     for (mi = 0, tref = 0 ; mi < nmsg ; mi++)
@@ -132,6 +132,9 @@ struct index_state {
     int want_dav;
     int want_expunged;
     unsigned num_expunged;
+    /* the message being fetched, so it can be sent from its file */
+    const struct index_record *fetch_record;
+    const struct buf *fetch_msg;
 };
 
 struct copyargs {
@@ -318,6 +321,12 @@ MsgData **index_msgdata_load(struct index_state *state, unsigned *msgno_list, in
                              const struct sortcrit *sortcrit,
                              unsigned int anchor, int *found_anchor);
 int index_search_evaluate(struct index_state *state, const search_expr_t *e, uint32_t msgno);
+int index_search_evaluate_prefiltered(struct index_state *state,
+                                      const search_expr_t *e,
+                                      const unsigned char *prefilter,
+                                      uint32_t msgno);
+void index_readahead(struct index_state *state, struct seqset *seq,
+                     int usinguid, uint32_t msgno, uint32_t *nextp);
 
 extern int index_expunge(struct index_state *state, char *uidsequence,
                          int need_deleted);
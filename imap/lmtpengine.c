@@ -1047,6 +1047,7 @@ void lmtpmode(struct lmtp_func *func,
     for (;;) {
     nextcmd:
       signals_poll();
+      cyrusdb_release();
 
       if (!prot_fgets(buf, sizeof(buf), pin)) {
           const char *err = prot_error(pin);
@@ -56,6 +56,9 @@
 #include <string.h>
 #include <syslog.h>
 #include <utime.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #ifdef HAVE_DIRENT_H
 # include <dirent.h>
@@ -84,10 +87,13 @@
 #include "ical_support.h"
 #include "vcard_support.h"
 #endif /* WITH_DAV */
+#include "bitvector.h"
 #include "crc32.h"
 #include "md5.h"
 #include "exitcodes.h"
 #include "global.h"
+#include "hash.h"
+#include "headercache.h"
 #include "imparse.h"
 #include "cyr_lock.h"
 #include "mailbox.h"
@@ -130,7 +136,10 @@ static struct mailboxlist *open_mailboxes = NULL;
 
 #define zeromailbox(m) { memset(&m, 0, sizeof(struct mailbox)); \
                          (m).index_fd = -1; \
-                         (m).header_fd = -1; }
+                         (m).header_fd = -1; \
+                         (m).columns_fd = -1; \
+                         (m).modseqlog_fd = -1; \
+                         (m).vanished_fd = -1; }
 
 /* for repack */
 struct mailbox_repack {
@@ -141,16 +150,38 @@ struct mailbox_repack {
     int old_version;
     int newindex_fd;
     ptrarray_t caches;
+    struct buf cachedict;
+    /* incremental repack: what happened to each source record */
+    uint32_t src_generation;
+    uint32_t src_done;          /* source records copied so far */
+    uint32_t src_alloc;
+    uint32_t *src_newrecno;     /* recno in the new index, 0 if dropped */
+    uint32_t *src_crc;          /* record CRC when it was copied */
+    bitvector_t src_cleanup;    /* files to clean up in the final pass */
 };
 
 static int mailbox_index_unlink(struct mailbox *mailbox);
 static int mailbox_index_repack(struct mailbox *mailbox, int version);
+static void mailbox_repack_prepare(struct mailbox *mailbox,
+                                   struct mailbox_repack **repackptr);
+static int mailbox_repack_finish(struct mailbox_repack **repackptr);
 static void mailbox_repack_abort(struct mailbox_repack **repackptr);
 static int mailbox_lock_index_internal(struct mailbox *mailbox,
                                        int locktype);
 static void cleanup_stale_expunged(struct mailbox *mailbox);
 static bit32 mailbox_index_record_to_buf(struct index_record *record, int version,
                                          unsigned char *buf);
+static int mailbox_read_index_record(struct mailbox *mailbox,
+                                     uint32_t recno,
+                                     struct index_record *record);
+static void mailbox_columns_close(struct mailbox *mailbox);
+static void mailbox_columns_stage(struct mailbox *mailbox);
+static void mailbox_columns_invalidate(struct mailbox *mailbox);
+static void mailbox_modseqlog_close(struct mailbox *mailbox);
+static void mailbox_modseqlog_stage(struct mailbox *mailbox);
+static void mailbox_modseqlog_invalidate(struct mailbox *mailbox);
+static void mailbox_vanished_close(struct mailbox *mailbox);
+static void mailbox_vanished_stage(struct mailbox *mailbox);
 
 #ifdef WITH_DAV
 static int mailbox_commit_dav(struct mailbox *mailbox);
@@ -475,11 +506,339 @@ EXPORTED struct buf *cacheitem_buf(const struct index_record *record, int field)
     return &staticbuf;
 }
 
+/* lay out a cache record in the current format from its items,
+ * pointing 'crec' at the result in 'buf' */
+EXPORTED void cache_buildrecord(struct buf *buf, struct cacherecord *crec,
+                                const struct buf items[NUM_CACHE_FIELDS])
+{
+    unsigned itemoffset = CACHE_TABLE_SIZE;
+    int i;
+
+    buf_reset(buf);
+
+    /* the table: total length is filled in at the end */
+    buf_appendbit32(buf, 0);
+    for (i = 0; i < NUM_CACHE_FIELDS; i++) {
+        crec->item[i].offset = itemoffset + CACHE_ITEM_SIZE_SKIP;
+        crec->item[i].len = buf_len(&items[i]);
+        buf_appendbit32(buf, crec->item[i].offset);
+        buf_appendbit32(buf, crec->item[i].len);
+        itemoffset += CACHE_ITEM_SIZE_SKIP + ((3 + crec->item[i].len) & ~3);
+    }
+
+    for (i = 0; i < NUM_CACHE_FIELDS; i++)
+        message_write_xdrstring(buf, &items[i]);
+
+    *((bit32 *)buf->s) = htonl(buf_len(buf));
+
+    crec->buf = buf;
+    crec->offset = 0; /* we're at the start of the buffer */
+    crec->len = buf_len(buf);
+}
+
+/* parse a version 5 record using its table: only the table is read */
+static int cache_parsetable(const struct buf *buf, size_t buf_size,
+                            size_t cache_offset, struct cacherecord *crec)
+{
+    const char *base = buf->s + cache_offset;
+    unsigned reclen;
+    int cache_ent;
+
+    if (cache_offset + CACHE_TABLE_SIZE > buf_size) {
+        syslog(LOG_ERR, "IOERROR: cache table past end of cache "
+               SIZE_T_FMT " " SIZE_T_FMT, cache_offset, buf_size);
+        return IMAP_IOERROR;
+    }
+
+    reclen = CACHE_ITEM_BIT32(base);
+    if (reclen < CACHE_TABLE_SIZE || cache_offset + reclen > buf_size) {
+        syslog(LOG_ERR, "IOERROR: bad cache record length %u at "
+               SIZE_T_FMT, reclen, cache_offset);
+        return IMAP_IOERROR;
+    }
+
+    for (cache_ent = 0; cache_ent < NUM_CACHE_FIELDS; cache_ent++) {
+        unsigned itemoffset = CACHE_ITEM_BIT32(base + 4 + 8*cache_ent);
+        unsigned itemlen = CACHE_ITEM_BIT32(base + 8 + 8*cache_ent);
+
+        if (itemoffset < CACHE_TABLE_SIZE || itemoffset > reclen ||
+            itemlen > reclen - itemoffset) {
+            syslog(LOG_ERR, "IOERROR: bad cache table at " SIZE_T_FMT " (%d)",
+                   cache_offset, cache_ent);
+            return IMAP_IOERROR;
+        }
+
+        crec->item[cache_ent].offset = cache_offset + itemoffset;
+        crec->item[cache_ent].len = itemlen;
+    }
+
+    crec->buf = buf;
+    crec->len = reclen;
+    crec->offset = cache_offset;
+
+    return 0;
+}
+
+/*
+ * Compressed cache records (mailbox_cache_compress).
+ *
+ * A cache file written by repack may have a dictionary block straight
+ * after the generation number:
+ *
+ *   bit32 CACHE_DICT_MAGIC, bit32 length, bit32 crc32, dictionary
+ *
+ * holding the text most often repeated in the mailbox's cache records.
+ * A compressed record is
+ *
+ *   bit32 CACHE_RECORD_DEFLATED | length of the next three fields,
+ *   bit32 inflated length, bit32 crc32 of the dictionary (0 for none),
+ *   raw deflate data
+ *
+ * padded to 4 bytes, and inflates to a version 5 record.  The first word
+ * of an uncompressed version 5 record never has the high bit set.
+ */
+#define CACHE_DICT_MAGIC 0xCACED1C7
+#define CACHE_DICT_OFFSET 4
+#define CACHE_DICT_MAX 32768 /* the deflate window */
+#define CACHE_DICT_SAMPLE 512
+#define CACHE_RECORD_DEFLATED (1U<<31)
+#define CACHE_DEFLATED_HEADER 12
+
+static void cache_getdict(struct mappedfile *cachefile, const char **dictp,
+                          size_t *lenp, uint32_t *crcp)
+{
+    const char *base = mappedfile_base(cachefile);
+    size_t size = mappedfile_size(cachefile);
+    uint32_t len;
+
+    *dictp = NULL;
+    *lenp = 0;
+    *crcp = 0;
+
+    if (size < CACHE_DICT_OFFSET + 12)
+        return;
+    if (CACHE_ITEM_BIT32(base + CACHE_DICT_OFFSET) != CACHE_DICT_MAGIC)
+        return;
+    len = CACHE_ITEM_BIT32(base + CACHE_DICT_OFFSET + 4);
+    if (len > CACHE_DICT_MAX || CACHE_DICT_OFFSET + 12 + len > size)
+        return;
+
+    /* the dictionary's own crc is only checked when it's written: each
+     * record names the one it needs, and the inflated record is checked
+     * against the cache_crc anyway */
+    *dictp = base + CACHE_DICT_OFFSET + 12;
+    *lenp = len;
+    *crcp = CACHE_ITEM_BIT32(base + CACHE_DICT_OFFSET + 8);
+}
+
+/* write the dictionary block into a freshly created cache file */
+static int cache_writedict(struct mappedfile *cachefile, const struct buf *dict)
+{
+    struct buf block = BUF_INITIALIZER;
+    int r = 0;
+
+    buf_appendbit32(&block, CACHE_DICT_MAGIC);
+    buf_appendbit32(&block, buf_len(dict));
+    buf_appendbit32(&block, crc32_buf(dict));
+    buf_append(&block, dict);
+    while (buf_len(&block) & 3)
+        buf_putc(&block, '\0');
+
+    if (mappedfile_pwritebuf(cachefile, &block, CACHE_DICT_OFFSET) < 0) {
+        syslog(LOG_ERR, "IOERROR: failed to write cache dictionary to %s",
+               mappedfile_fname(cachefile));
+        r = IMAP_IOERROR;
+    }
+
+    buf_free(&block);
+    return r;
+}
+
+struct dictline {
+    const char *line;
+    size_t score;
+};
+
+static void cache_dict_collect(const char *line, void *data, void *rock)
+{
+    ptrarray_t *lines = (ptrarray_t *)rock;
+    size_t count = (uintptr_t)data;
+    struct dictline *dl;
+
+    if (count < 2) return;
+
+    dl = xmalloc(sizeof(struct dictline));
+    dl->line = line;
+    dl->score = count * strlen(line);
+    ptrarray_append(lines, dl);
+}
+
+static int cache_dict_compar(const void *a, const void *b)
+{
+    const struct dictline *dla = *(const struct dictline **)a;
+    const struct dictline *dlb = *(const struct dictline **)b;
+
+    if (dla->score > dlb->score) return -1;
+    if (dla->score < dlb->score) return 1;
+    return strcmp(dla->line, dlb->line);
+}
+
+static void cache_dict_count(hash_table *counts, const char *base, size_t len)
+{
+    const char *end = base + len;
+    char *line;
+
+    while (base < end) {
+        const char *eol = memchr(base, '\n', end - base);
+        size_t linelen = eol ? (size_t)(eol - base + 1) : (size_t)(end - base);
+
+        /* short lines aren't worth a dictionary entry */
+        if (linelen >= 8 && linelen < 1024 && !memchr(base, '\0', linelen)) {
+            line = xstrndup(base, linelen);
+            hash_insert(line,
+                        (void *)((uintptr_t)hash_lookup(line, counts) + 1),
+                        counts);
+            free(line);
+        }
+
+        base += linelen;
+    }
+}
+
+/* pick the lines most often repeated across the headers and body
+ * structures of the newest records, most valuable last so they're
+ * closest to the data being compressed */
+static void cache_traindict(struct mailbox *mailbox, struct buf *dict)
+{
+    hash_table counts = HASH_TABLE_INITIALIZER;
+    ptrarray_t lines = PTRARRAY_INITIALIZER;
+    struct index_record record;
+    uint32_t recno, sampled = 0;
+    size_t total = 0;
+    int i, n;
+
+    buf_reset(dict);
+    construct_hash_table(&counts, 4096, 1);
+
+    for (recno = mailbox->i.num_records; recno && sampled < CACHE_DICT_SAMPLE; recno--) {
+        if (mailbox_read_index_record(mailbox, recno, &record))
+            continue;
+        if (record.system_flags & FLAG_UNLINKED)
+            continue;
+        if (mailbox_cacherecord(mailbox, &record))
+            continue;
+
+        cache_dict_count(&counts, cacheitem_base(&record, CACHE_HEADERS),
+                         cacheitem_size(&record, CACHE_HEADERS));
+        cache_dict_count(&counts, cacheitem_base(&record, CACHE_BODYSTRUCTURE),
+                         cacheitem_size(&record, CACHE_BODYSTRUCTURE));
+        sampled++;
+    }
+
+    hash_enumerate(&counts, cache_dict_collect, &lines);
+    qsort(lines.data, lines.count, sizeof(void *), cache_dict_compar);
+
+    for (n = 0; n < lines.count; n++) {
+        struct dictline *dl = ptrarray_nth(&lines, n);
+        size_t len = strlen(dl->line);
+        if (total + len > CACHE_DICT_MAX) break;
+        total += len;
+    }
+    for (i = n - 1; i >= 0; i--) {
+        struct dictline *dl = ptrarray_nth(&lines, i);
+        buf_appendcstr(dict, dl->line);
+    }
+
+    for (i = 0; i < lines.count; i++)
+        free(ptrarray_nth(&lines, i));
+    ptrarray_fini(&lines);
+    free_hash_table(&counts, NULL);
+}
+
+#ifdef HAVE_ZLIB
+/* compress a version 5 record into 'out'.  Leaves 'out' empty if it
+ * wouldn't be any smaller */
+static int cache_deflaterecord(struct mappedfile *cachefile,
+                               const struct buf *raw, struct buf *out)
+{
+    static z_stream zs, primed;
+    static int zs_init, primed_init;
+    static uint32_t primed_crc;
+    static size_t primed_len;
+    const char *dict;
+    size_t dictlen, bound, stored;
+    uint32_t dictcrc;
+
+    buf_reset(out);
+
+    /* loading the dictionary is most of the cost of compressing a small
+     * record, so keep a stream primed with it and copy that per record */
+    cache_getdict(cachefile, &dict, &dictlen, &dictcrc);
+    if (!primed_init || primed_len != dictlen || primed_crc != dictcrc) {
+        if (!primed_init) {
+            memset(&primed, 0, sizeof(z_stream));
+            if (deflateInit2(&primed, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                             -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                return IMAP_IOERROR;
+            primed_init = 1;
+        }
+        else if (deflateReset(&primed) != Z_OK)
+            return IMAP_IOERROR;
+
+        if (dictlen &&
+            deflateSetDictionary(&primed, (const Bytef *)dict, dictlen) != Z_OK) {
+            deflateEnd(&primed);
+            primed_init = 0;
+            return IMAP_IOERROR;
+        }
+        primed_len = dictlen;
+        primed_crc = dictcrc;
+    }
+
+    if (zs_init) {
+        deflateEnd(&zs);
+        zs_init = 0;
+    }
+    if (deflateCopy(&zs, &primed) != Z_OK)
+        return IMAP_IOERROR;
+    zs_init = 1;
+
+    bound = deflateBound(&zs, raw->len);
+    buf_ensure(out, CACHE_DEFLATED_HEADER + bound + 3);
+
+    zs.next_in = (Bytef *)raw->s;
+    zs.avail_in = raw->len;
+    zs.next_out = (Bytef *)out->s + CACHE_DEFLATED_HEADER;
+    zs.avail_out = bound;
+
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+        return IMAP_IOERROR;
+
+    stored = CACHE_DEFLATED_HEADER + zs.total_out;
+    if (((stored + 3) & ~3) >= raw->len)
+        return 0;
+
+    *((bit32 *)(out->s)) = htonl(CACHE_RECORD_DEFLATED | stored);
+    *((bit32 *)(out->s+4)) = htonl(raw->len);
+    *((bit32 *)(out->s+8)) = htonl(dictlen ? dictcrc : 0);
+    out->len = stored;
+    while (out->len & 3)
+        out->s[out->len++] = '\0';
+
+    return 0;
+}
+#endif /* HAVE_ZLIB */
+
+static int cache_inflaterecord(struct mailbox *mailbox,
+                               struct mappedfile *cachefile,
+                               size_t cache_offset, struct cacherecord *crec);
+
 /* parse a single cache record from the mapped file - creates buf
- * records which point into the map, so you can't free it while
- * you still have them around! */
-static int cache_parserecord(struct mappedfile *cachefile, size_t cache_offset,
-                             struct cacherecord *crec)
+ * records which point into the map (or into the mailbox's inflated
+ * records), so you can't free it while you still have them around! */
+static int cache_parserecord(struct mailbox *mailbox,
+                             struct mappedfile *cachefile, size_t cache_offset,
+                             uint32_t cache_version, struct cacherecord *crec)
 {
     const struct buf *buf = mappedfile_buf(cachefile);
     size_t buf_size = mappedfile_size(cachefile);
@@ -495,6 +854,13 @@ static int cache_parserecord(struct mappedfile *cachefile, size_t cache_offset,
         return IMAP_IOERROR;
     }
 
+    if (cache_version >= 5) {
+        if (offset + 4 <= buf_size &&
+            (CACHE_ITEM_BIT32(buf->s + offset) & CACHE_RECORD_DEFLATED))
+            return cache_inflaterecord(mailbox, cachefile, cache_offset, crec);
+        return cache_parsetable(buf, buf_size, cache_offset, crec);
+    }
+
     for (cache_ent = 0; cache_ent < NUM_CACHE_FIELDS; cache_ent++) {
         cacheitem = buf->s + offset;
         /* copy locations */
@@ -525,6 +891,129 @@ static int cache_parserecord(struct mappedfile *cachefile, size_t cache_offset,
     return 0;
 }
 
+static void inflated_free(void *p)
+{
+    struct buf *buf = (struct buf *)p;
+    buf_destroy(buf);
+}
+
+/* inflated records are owned by the mailbox, keyed by cache file,
+ * generation and offset, and stay valid until its caches are released */
+static int cache_inflaterecord(struct mailbox *mailbox,
+                               struct mappedfile *cachefile,
+                               size_t cache_offset, struct cacherecord *crec)
+{
+#ifdef HAVE_ZLIB
+    static z_stream zs;
+    static int zs_init;
+    const char *base = mappedfile_base(cachefile) + cache_offset;
+    size_t size = mappedfile_size(cachefile);
+    struct buf *out = NULL;
+    struct buf key = BUF_INITIALIZER;
+    const char *dict;
+    size_t dictlen, stored, rawlen;
+    uint32_t dictcrc, wantcrc;
+
+    if (cache_offset + CACHE_DEFLATED_HEADER > size)
+        goto bad;
+
+    buf_printf(&key, "%s/%u/" SIZE_T_FMT, mappedfile_fname(cachefile),
+               CACHE_ITEM_BIT32(mappedfile_base(cachefile)), cache_offset);
+    if (!mailbox->inflated.size)
+        construct_hash_table(&mailbox->inflated, 1024, 0);
+    out = hash_lookup(buf_cstring(&key), &mailbox->inflated);
+    if (out) {
+        buf_free(&key);
+        return cache_parsetable(out, out->len, 0, crec);
+    }
+
+    stored = CACHE_ITEM_BIT32(base) & ~CACHE_RECORD_DEFLATED;
+    rawlen = CACHE_ITEM_BIT32(base + 4);
+    wantcrc = CACHE_ITEM_BIT32(base + 8);
+    if (stored < CACHE_DEFLATED_HEADER || cache_offset + stored > size ||
+        rawlen < CACHE_TABLE_SIZE)
+        goto bad;
+
+    if (!zs_init) {
+        memset(&zs, 0, sizeof(z_stream));
+        if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+            goto bad;
+        zs_init = 1;
+    }
+    else if (inflateReset(&zs) != Z_OK)
+        goto bad;
+
+    if (wantcrc) {
+        cache_getdict(cachefile, &dict, &dictlen, &dictcrc);
+        if (!dictlen || dictcrc != wantcrc)
+            goto bad;
+        if (inflateSetDictionary(&zs, (const Bytef *)dict, dictlen) != Z_OK)
+            goto bad;
+    }
+
+    out = buf_new();
+    buf_ensure(out, rawlen);
+
+    zs.next_in = (Bytef *)base + CACHE_DEFLATED_HEADER;
+    zs.avail_in = stored - CACHE_DEFLATED_HEADER;
+    zs.next_out = (Bytef *)out->s;
+    zs.avail_out = rawlen;
+
+    if (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out != rawlen)
+        goto bad;
+    out->len = rawlen;
+
+    hash_insert(buf_cstring(&key), out, &mailbox->inflated);
+    buf_free(&key);
+
+    return cache_parsetable(out, out->len, 0, crec);
+
+bad:
+    if (out) buf_destroy(out);
+    buf_free(&key);
+#endif /* HAVE_ZLIB */
+    syslog(LOG_ERR, "IOERROR: failed to inflate cache record at "
+           SIZE_T_FMT " in %s", cache_offset, mappedfile_fname(cachefile));
+    return IMAP_IOERROR;
+}
+
+/* rewrite a loaded cache record in the layout of the given cache
+ * version: with an item table from version 5, without one before */
+static void cache_rewriterecord(struct index_record *record,
+                                uint32_t cache_version)
+{
+    static struct buf rewritebuf;
+    struct buf newbuf = BUF_INITIALIZER;
+    struct buf items[NUM_CACHE_FIELDS];
+    int i;
+
+    /* the items may still be in rewritebuf, so build it anew */
+    for (i = 0; i < NUM_CACHE_FIELDS; i++)
+        buf_init_ro(&items[i], cacheitem_base(record, i),
+                    cacheitem_size(record, i));
+
+    if (cache_version >= 5) {
+        cache_buildrecord(&newbuf, &record->crec, items);
+    }
+    else {
+        for (i = 0; i < NUM_CACHE_FIELDS; i++) {
+            record->crec.item[i].offset = buf_len(&newbuf) +
+                                          CACHE_ITEM_SIZE_SKIP;
+            record->crec.item[i].len = buf_len(&items[i]);
+            message_write_xdrstring(&newbuf, &items[i]);
+        }
+        record->crec.offset = 0;
+        record->crec.len = buf_len(&newbuf);
+    }
+
+    buf_free(&rewritebuf);
+    rewritebuf = newbuf;
+    record->crec.buf = &rewritebuf;
+
+    record->cache_version = cache_version;
+    record->cache_crc = crc32_buf(&rewritebuf);
+}
+
 EXPORTED char *mailbox_cache_get_env(struct mailbox *mailbox,
                                      const struct index_record *record,
                                      int token)
@@ -570,6 +1059,15 @@ static int cache_append_record(struct mappedfile *mf, struct index_record *recor
     size_t offset = mappedfile_size(mf);
     int n;
 
+#ifdef HAVE_ZLIB
+    static struct buf deflated = BUF_INITIALIZER;
+
+    if (record->cache_version >= 5 &&
+        config_getswitch(IMAPOPT_MAILBOX_CACHE_COMPRESS) &&
+        !cache_deflaterecord(mf, buf, &deflated) && deflated.len)
+        buf = &deflated;
+#endif
+
     n = mappedfile_pwritebuf(mf, buf, offset);
     if (n < 0) {
         syslog(LOG_ERR, "failed to append " SIZE_T_FMT " bytes to cache", buf->len);
@@ -629,6 +1127,7 @@ static struct mappedfile *mailbox_cachefile(struct mailbox *mailbox,
 static struct mappedfile *repack_cachefile(struct mailbox_repack *repack,
                                            const struct index_record *record)
 {
+    struct mappedfile *cachefile;
     const char *fname;
 
     if (record->system_flags & FLAG_ARCHIVED)
@@ -636,7 +1135,16 @@ static struct mappedfile *repack_cachefile(struct mailbox_repack *repack,
     else
         fname = mailbox_meta_newfname(repack->mailbox, META_CACHE);
 
-    return cache_getfile(&repack->caches, fname, /*readonly*/0, repack->i.generation_no);
+    cachefile = cache_getfile(&repack->caches, fname, /*readonly*/0, repack->i.generation_no);
+
+    /* just created?  Start it with the dictionary */
+    if (cachefile && buf_len(&repack->cachedict) &&
+        mappedfile_size(cachefile) == CACHE_DICT_OFFSET &&
+        cache_writedict(cachefile, &repack->cachedict)) {
+        return NULL;
+    }
+
+    return cachefile;
 }
 
 /* return the offset for the start of the record! */
@@ -706,7 +1214,8 @@ EXPORTED int mailbox_cacherecord(struct mailbox *mailbox,
         goto err;
 
     /* try to parse the cache record */
-    r = cache_parserecord(cachefile, record->cache_offset, &backdoor->crec);
+    r = cache_parserecord(mailbox, cachefile, record->cache_offset,
+                          record->cache_version, &backdoor->crec);
     if (r) goto err;
 
     /* old-style record */
@@ -814,10 +1323,70 @@ EXPORTED void mailbox_make_uniqueid(struct mailbox *mailbox)
     mailbox_set_uniqueid(mailbox, makeuuid());
 }
 
-static int _map_local_record(const struct mailbox *mailbox, const char *fname, struct buf *buf)
+/*
+ * Message files on partitions listed in spool_compress_partitions are
+ * stored as SPOOL_COMPRESS_MAGIC, the uncompressed length as a 32 bit
+ * network order value and then a zlib stream.  The magic can't start
+ * an RFC 5322 message, so files are recognised by content alone and
+ * raw and compressed files can be mixed freely, e.g. by linking.
+ */
+#define SPOOL_COMPRESS_MAGIC "\0CYRZ\r\n\032"
+#define SPOOL_COMPRESS_MAGIC_LEN 8
+#define SPOOL_COMPRESS_HEADER_LEN 12
+
+static int spool_is_compressed(const char *base, size_t len)
+{
+    return (len >= SPOOL_COMPRESS_HEADER_LEN &&
+            !memcmp(base, SPOOL_COMPRESS_MAGIC, SPOOL_COMPRESS_MAGIC_LEN));
+}
+
+static int spool_inflate(const char *fname, const char *base, size_t len,
+                         struct buf *buf)
+{
+#ifdef HAVE_ZLIB
+    struct buf raw = BUF_INITIALIZER;
+    uLongf expected, rawlen;
+    bit32 netlen;
+    int zr;
+
+    memcpy(&netlen, base + SPOOL_COMPRESS_MAGIC_LEN, 4);
+    expected = rawlen = ntohl(netlen);
+
+    /* never zero, so that the buffer is always allocated */
+    buf_ensure(&raw, expected + 1);
+
+    zr = uncompress((Bytef *) raw.s, &rawlen,
+                    (const Bytef *) base + SPOOL_COMPRESS_HEADER_LEN,
+                    len - SPOOL_COMPRESS_HEADER_LEN);
+    if (zr != Z_OK || rawlen != expected) {
+        syslog(LOG_ERR, "IOERROR: inflating %s: %s", fname, zError(zr));
+        buf_free(&raw);
+        return EIO;
+    }
+
+    raw.len = rawlen;
+    buf_move(buf, &raw);
+    return 0;
+#else
+    (void) base;
+    (void) len;
+    (void) buf;
+    syslog(LOG_ERR, "IOERROR: %s is compressed, but zlib is not available",
+           fname);
+    return EIO;
+#endif
+}
+
+/*
+ * Map the message file 'fname' into 'buf', uncompressing it if it was
+ * stored compressed.  Returns 0 or an errno value.
+ */
+EXPORTED int mailbox_map_file(const char *fname, const char *mboxname,
+                              struct buf *buf)
 {
     struct stat sbuf;
     int msgfd;
+    int r = 0;
 
     msgfd = open(fname, O_RDONLY, 0666);
     if (msgfd == -1) return errno;
@@ -826,11 +1395,187 @@ static int _map_local_record(const struct mailbox *mailbox, const char *fname, s
         syslog(LOG_ERR, "IOERROR: fstat on %s: %m", fname);
         fatal("can't fstat message file", EC_OSFILE);
     }
+    if (!S_ISREG(sbuf.st_mode)) {
+        close(msgfd);
+        return EINVAL;
+    }
 
-    buf_init_mmap(buf, /*onceonly*/1, msgfd, fname, sbuf.st_size, mailbox->name);
+    buf_init_mmap(buf, /*onceonly*/1, msgfd, fname, sbuf.st_size, mboxname);
     close(msgfd);
 
+    if (spool_is_compressed(buf->s, buf->len))
+        r = spool_inflate(fname, buf->s, buf->len, buf);
+
+    return r;
+}
+
+/*
+ * Return non-zero if the open message file 'fd' was stored compressed,
+ * and if so set '*rawlenp' (if not NULL) to its uncompressed length.
+ */
+EXPORTED int mailbox_file_compressed(int fd, size_t *rawlenp)
+{
+    char header[SPOOL_COMPRESS_HEADER_LEN];
+    bit32 netlen;
+
+    if (pread(fd, header, sizeof(header), 0) != sizeof(header) ||
+        !spool_is_compressed(header, sizeof(header)))
+        return 0;
+
+    if (rawlenp) {
+        memcpy(&netlen, header + SPOOL_COMPRESS_MAGIC_LEN, 4);
+        *rawlenp = ntohl(netlen);
+    }
+    return 1;
+}
+
+/*
+ * stat(2) the message file 'fname', but report the uncompressed length
+ * as st_size if it was stored compressed.
+ */
+EXPORTED int mailbox_stat_file(const char *fname, struct stat *sbuf)
+{
+    size_t rawlen;
+    int fd;
+
+    fd = open(fname, O_RDONLY, 0666);
+    if (fd == -1) return -1;
+
+    if (fstat(fd, sbuf) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (mailbox_file_compressed(fd, &rawlen))
+        sbuf->st_size = rawlen;
+
+    close(fd);
+    return 0;
+}
+
+/*
+ * Open the message file 'fname' for stdio reading, uncompressing it
+ * into a temporary file if it was stored compressed.
+ */
+EXPORTED FILE *mailbox_fopen_file(const char *fname)
+{
+    char magic[SPOOL_COMPRESS_MAGIC_LEN];
+    struct buf buf = BUF_INITIALIZER;
+    FILE *f;
+
+    f = fopen(fname, "r");
+    if (!f) return NULL;
+
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+        memcmp(magic, SPOOL_COMPRESS_MAGIC, SPOOL_COMPRESS_MAGIC_LEN)) {
+        rewind(f);
+        return f;
+    }
+
+    fclose(f);
+    if (mailbox_map_file(fname, NULL, &buf))
+        return NULL;
+
+    f = tmpfile();
+    if (f && fwrite(buf.s, 1, buf.len, f) != buf.len) {
+        syslog(LOG_ERR, "IOERROR: writing temporary copy of %s: %m", fname);
+        fclose(f);
+        f = NULL;
+    }
+    if (f) rewind(f);
+    buf_free(&buf);
+
+    return f;
+}
+
+/*
+ * Return non-zero if new message files on 'part' are to be stored
+ * compressed.
+ */
+EXPORTED int mailbox_partition_compressed(const char *part)
+{
+#ifdef HAVE_ZLIB
+    static strarray_t *parts = NULL;
+
+    if (!parts) {
+        const char *val = config_getstring(IMAPOPT_SPOOL_COMPRESS_PARTITIONS);
+        parts = strarray_split(val, NULL, STRARRAY_TRIM);
+    }
+
+    return (part && strarray_find(parts, part, 0) >= 0);
+#else
+    (void) part;
     return 0;
+#endif
+}
+
+/*
+ * Write a compressed copy of the message file 'from' to 'to'.  If that
+ * wouldn't save any space, 'to' is just a link to (or copy of) 'from'.
+ */
+EXPORTED int mailbox_compress_file(const char *from, const char *to)
+{
+#ifdef HAVE_ZLIB
+    struct buf raw = BUF_INITIALIZER;
+    struct buf out = BUF_INITIALIZER;
+    uLongf zlen;
+    bit32 rawlen;
+    int fd = -1;
+    int r = IMAP_IOERROR;
+
+    if (mailbox_map_file(from, NULL, &raw))
+        goto done;
+
+    zlen = compressBound(raw.len);
+    buf_ensure(&out, SPOOL_COMPRESS_HEADER_LEN + zlen);
+    memcpy(out.s, SPOOL_COMPRESS_MAGIC, SPOOL_COMPRESS_MAGIC_LEN);
+    rawlen = htonl(raw.len);
+    memcpy(out.s + SPOOL_COMPRESS_MAGIC_LEN, &rawlen, 4);
+    if (compress2((Bytef *) out.s + SPOOL_COMPRESS_HEADER_LEN, &zlen,
+                  (const Bytef *) raw.s, raw.len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        syslog(LOG_ERR, "IOERROR: compressing %s", from);
+        goto done;
+    }
+    out.len = SPOOL_COMPRESS_HEADER_LEN + zlen;
+
+    if (out.len >= raw.len) {
+        r = mailbox_copyfile(from, to, 0);
+        goto done;
+    }
+
+    fd = open(to, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd == -1 && errno == ENOENT) {
+        if (!cyrus_mkdir(to, 0755))
+            fd = open(to, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    }
+    if (fd == -1) {
+        syslog(LOG_ERR, "IOERROR: creating %s: %m", to);
+        goto done;
+    }
+
+    if (retry_write(fd, out.s, out.len) != (ssize_t) out.len || fsync(fd)) {
+        syslog(LOG_ERR, "IOERROR: writing %s: %m", to);
+        unlink(to);
+        goto done;
+    }
+
+    r = 0;
+
+ done:
+    if (fd != -1) close(fd);
+    buf_free(&out);
+    buf_free(&raw);
+    return r;
+#else
+    (void) from;
+    (void) to;
+    return IMAP_IOERROR;
+#endif
+}
+
+static int _map_local_record(const struct mailbox *mailbox, const char *fname, struct buf *buf)
+{
+    return mailbox_map_file(fname, mailbox->name, buf);
 }
 
 EXPORTED int mailbox_map_record(struct mailbox *mailbox, const struct index_record *record, struct buf *buf)
@@ -870,12 +1615,18 @@ static void mailbox_release_resources(struct mailbox *mailbox)
     if (mailbox->index_base)
         map_free(&mailbox->index_base, &mailbox->index_len);
 
+    mailbox_columns_close(mailbox);
+    mailbox_modseqlog_close(mailbox);
+    mailbox_vanished_close(mailbox);
+
     /* release caches */
     for (i = 0; i < mailbox->caches.count; i++) {
         struct mappedfile *cachefile = ptrarray_nth(&mailbox->caches, i);
         mappedfile_close(&cachefile);
     }
     ptrarray_fini(&mailbox->caches);
+    if (mailbox->inflated.size)
+        free_hash_table(&mailbox->inflated, inflated_free);
 }
 
 /*
@@ -1140,7 +1891,23 @@ EXPORTED void mailbox_close(struct mailbox **mailboxptr)
     /* do we need to try and clean up? (not if doing a shutdown,
      * speed is probably more important!) */
     if (!in_shutdown && (mailbox->i.options & MAILBOX_CLEANUP_MASK)) {
-        int r = mailbox_mboxlock_reopen(listitem, LOCK_NONBLOCKING);
+        struct mailbox_repack *repack = NULL;
+        int r;
+
+        r = mailbox_mboxlock_reopen(listitem, LOCK_NONBLOCKING);
+
+        /* only the last process to close the mailbox gets to clean up,
+         * and now we know it's us: let the others back in while we copy
+         * what we can, then take the exclusive lock again to finish */
+        if (!r && (mailbox->i.options & OPT_MAILBOX_NEEDS_REPACK) &&
+            !(mailbox->i.options & OPT_MAILBOX_DELETED) &&
+            config_getint(IMAPOPT_MAILBOX_REPACK_BATCH) > 0) {
+            r = mailbox_mboxlock_reopen(listitem, LOCK_SHARED);
+            if (!r) r = mailbox_open_index(mailbox);
+            if (!r) mailbox_repack_prepare(mailbox, &repack);
+            if (!r) r = mailbox_mboxlock_reopen(listitem, LOCK_NONBLOCKING);
+        }
+
         /* we need to re-open the index because we dropped the mboxname lock,
          * so the file may have changed */
         if (!r) r = mailbox_open_index(mailbox);
@@ -1151,6 +1918,8 @@ EXPORTED void mailbox_close(struct mailbox **mailboxptr)
             /* finish cleaning up */
             if (mailbox->i.options & OPT_MAILBOX_DELETED)
                 mailbox_delete_cleanup(mailbox, mailbox->part, mailbox->name, mailbox->uniqueid);
+            else if ((mailbox->i.options & OPT_MAILBOX_NEEDS_REPACK) && repack)
+                mailbox_repack_finish(&repack);
             else if (mailbox->i.options & OPT_MAILBOX_NEEDS_REPACK)
                 mailbox_index_repack(mailbox, mailbox->i.minor_version);
             else if (mailbox->i.options & OPT_MAILBOX_NEEDS_UNLINK)
@@ -1160,6 +1929,8 @@ EXPORTED void mailbox_close(struct mailbox **mailboxptr)
             /* anyway, unlock again */
             mailbox_unlock_index(mailbox, NULL);
         }
+        /* didn't get to finish it */
+        mailbox_repack_abort(&repack);
         /* otherwise someone else has the mailbox locked
          * already, so they can handle the cleanup in
          * THEIR mailbox_close call */
@@ -1662,11 +2433,67 @@ static int mailbox_read_index_header(struct mailbox *mailbox)
 }
 
 /*
- * Read an index record from a mapped index file
+ * Read the index header of a mailbox from the shared header cache,
+ * without opening the mailbox.  Returns IMAP_NO_NOSUCHMSG if there is
+ * no usable entry, in which case the caller has to open the mailbox.
+ *
+ * A process which can't map the cache commits without updating it, so
+ * an entry is only used if its uidvalidity matches mailboxes.db and its
+ * uidvalidity and highestmodseq match the index file on disk.  Every
+ * change STATUS can see bumps the highestmodseq.
  */
-static int mailbox_buf_to_index_record(const char *buf,
-                                       int version,
-                                       struct index_record *record)
+EXPORTED int mailbox_read_cached_header(const char *name,
+                                        struct index_header *i)
+{
+    unsigned char buf[INDEX_HEADER_SIZE];
+    unsigned char disk[OFFSET_HIGHESTMODSEQ + 8];
+    mbentry_t *mbentry = NULL;
+    const char *fname;
+    size_t len;
+    ssize_t n;
+    int fd;
+    int r = IMAP_NO_NOSUCHMSG;
+
+    len = headercache_fetch(name, buf, sizeof(buf));
+    if (!len) return IMAP_NO_NOSUCHMSG;
+
+    if (mailbox_buf_to_index_header((const char *)buf, len, i))
+        return IMAP_NO_NOSUCHMSG;
+
+    if (i->options & OPT_MAILBOX_DELETED)
+        return IMAP_NO_NOSUCHMSG;
+
+    if (mboxlist_lookup(name, &mbentry, NULL))
+        return IMAP_NO_NOSUCHMSG;
+
+    if (mbentry->uidvalidity && mbentry->uidvalidity != i->uidvalidity)
+        goto done;
+
+    fname = mbentry_metapath(mbentry, META_INDEX, 0);
+    fd = open(fname, O_RDONLY, 0);
+    if (fd == -1) goto done;
+    n = pread(fd, disk, sizeof(disk), 0);
+    close(fd);
+    if (n != (ssize_t) sizeof(disk)) goto done;
+
+    if (ntohl(*((bit32 *)(disk+OFFSET_UIDVALIDITY))) != i->uidvalidity)
+        goto done;
+    if (align_ntohll(disk+OFFSET_HIGHESTMODSEQ) != i->highestmodseq)
+        goto done;
+
+    r = 0;
+
+ done:
+    mboxlist_entry_free(&mbentry);
+    return r;
+}
+
+/*
+ * Read an index record from a mapped index file
+ */
+static int mailbox_buf_to_index_record(const char *buf,
+                                       int version,
+                                       struct index_record *record)
 {
     uint32_t crc;
     int n;
@@ -1811,91 +2638,1567 @@ static int _commit_one(struct mailbox *mailbox, struct index_change *change)
     return 0;
 }
 
-static void _cleanup_changes(struct mailbox *mailbox)
-{
-    free(mailbox->index_changes);
-    mailbox->index_changes = NULL;
-    mailbox->index_change_count = 0;
-    mailbox->index_change_alloc = 0;
-    memset(mailbox->index_change_map, 0, sizeof(uint32_t)*INDEX_MAP_SIZE);
+static void _cleanup_changes(struct mailbox *mailbox)
+{
+    free(mailbox->index_changes);
+    mailbox->index_changes = NULL;
+    mailbox->index_change_count = 0;
+    mailbox->index_change_alloc = 0;
+    memset(mailbox->index_change_map, 0, sizeof(uint32_t)*INDEX_MAP_SIZE);
+}
+
+/* qsort function for changes */
+static int change_compar(const void *a, const void *b)
+{
+    struct index_change *ac = (struct index_change *)a;
+    struct index_change *bc = (struct index_change *)b;
+
+    if (ac->record.recno > bc->record.recno)
+        return 1;
+    if (ac->record.recno < bc->record.recno)
+        return -1;
+    return 0;
+}
+
+static int _commit_changes(struct mailbox *mailbox)
+{
+    uint32_t i;
+    int r;
+
+    if (!mailbox->index_change_count) return 0;
+    mailbox->i.dirty = 1;
+
+    /* in which we throw away all our next pointers, but we don't care any more.
+     * we just want to write in sensible order.  Otherwise, there's no need to
+     * do this sort at all */
+    qsort(mailbox->index_changes, mailbox->index_change_count,
+          sizeof(struct index_change), change_compar);
+
+    /* silent changes don't show in the index header, so nothing else
+     * would tell the columns are out of date if we stop half way */
+    for (i = 0; i < mailbox->index_change_count; i++) {
+        if (mailbox->index_changes[i].record.silent) {
+            mailbox_columns_invalidate(mailbox);
+            mailbox_modseqlog_invalidate(mailbox);
+            break;
+        }
+    }
+
+    for (i = 1; i <= mailbox->index_change_count; i++) {
+        r = _commit_one(mailbox, &mailbox->index_changes[i-1]);
+        if (r) return r; /* DAMN, we're screwed */
+    }
+
+    mailbox_columns_stage(mailbox);
+    mailbox_modseqlog_stage(mailbox);
+    mailbox_vanished_stage(mailbox);
+
+    _cleanup_changes(mailbox);
+
+    /* recalculate the size */
+    mailbox->index_size = mailbox->i.start_offset + (mailbox->i.num_records * mailbox->i.record_size);
+
+    r = mailbox_refresh_index_map(mailbox);
+    if (r) return r;
+
+    return 0;
+}
+
+/*
+ * Read an index record from a mailbox
+ */
+static int mailbox_read_index_record(struct mailbox *mailbox,
+                                     uint32_t recno,
+                                     struct index_record *record)
+{
+    const char *buf;
+    unsigned offset;
+    int r;
+    struct index_change *change = _find_change(mailbox, recno);
+
+    if (change) {
+        *record = change->record;
+        return 0;
+    }
+
+    offset = mailbox->i.start_offset + (recno-1) * mailbox->i.record_size;
+
+    if (offset + mailbox->i.record_size > mailbox->index_size) {
+        syslog(LOG_ERR,
+               "IOERROR: index record %u for %s past end of file",
+               recno, mailbox->name);
+        return IMAP_IOERROR;
+    }
+
+    buf = mailbox->index_base + offset;
+
+    r = mailbox_buf_to_index_record(buf, mailbox->i.minor_version, record);
+
+    if (!r) record->recno = recno;
+
+    return r;
+}
+
+/*
+ * Field accessors which read straight out of the mapped index, without
+ * decoding the whole record.  Uncommitted changes are still seen.  They
+ * don't verify the record CRC or parse the GUID, so use
+ * mailbox_read_index_record() if you need those guarantees or fields.
+ */
+static const char *mailbox_index_record_base(struct mailbox *mailbox,
+                                             uint32_t recno)
+{
+    unsigned offset;
+
+    if (!recno || recno > mailbox->i.num_records)
+        return NULL;
+
+    offset = mailbox->i.start_offset + (recno-1) * mailbox->i.record_size;
+    if (offset + mailbox->i.record_size > mailbox->index_size)
+        return NULL;
+
+    return mailbox->index_base + offset;
+}
+
+static modseq_t mailbox_buf_modseq(const char *buf, int version)
+{
+    if (version < 8)
+        return 0;
+    if (version < 10)
+        return ntohll(*((bit64 *)(buf+72)));
+    return ntohll(*((bit64 *)(buf+OFFSET_MODSEQ)));
+}
+
+EXPORTED uint32_t mailbox_record_getuid(struct mailbox *mailbox, uint32_t recno)
+{
+    struct index_change *change = _find_change(mailbox, recno);
+    const char *buf;
+
+    if (change) return change->record.uid;
+
+    buf = mailbox_index_record_base(mailbox, recno);
+    if (!buf) return 0;
+
+    return ntohl(*((bit32 *)(buf+OFFSET_UID)));
+}
+
+EXPORTED uint32_t mailbox_record_getsystemflags(struct mailbox *mailbox,
+                                                uint32_t recno)
+{
+    struct index_change *change = _find_change(mailbox, recno);
+    const char *buf;
+
+    if (change) return change->record.system_flags;
+
+    buf = mailbox_index_record_base(mailbox, recno);
+    if (!buf) return 0;
+
+    return ntohl(*((bit32 *)(buf+OFFSET_SYSTEM_FLAGS)));
+}
+
+EXPORTED modseq_t mailbox_record_getmodseq(struct mailbox *mailbox,
+                                           uint32_t recno)
+{
+    struct index_change *change = _find_change(mailbox, recno);
+    const char *buf;
+
+    if (change) return change->record.modseq;
+
+    buf = mailbox_index_record_base(mailbox, recno);
+    if (!buf) return 0;
+
+    return mailbox_buf_modseq(buf, mailbox->i.minor_version);
+}
+
+EXPORTED time_t mailbox_record_getinternaldate(struct mailbox *mailbox,
+                                               uint32_t recno)
+{
+    struct index_change *change = _find_change(mailbox, recno);
+    const char *buf;
+
+    if (change) return change->record.internaldate;
+
+    buf = mailbox_index_record_base(mailbox, recno);
+    if (!buf) return 0;
+
+    return ntohl(*((bit32 *)(buf+OFFSET_INTERNALDATE)));
+}
+
+EXPORTED uint32_t mailbox_record_getsize(struct mailbox *mailbox,
+                                         uint32_t recno)
+{
+    struct index_change *change = _find_change(mailbox, recno);
+    const char *buf;
+
+    if (change) return change->record.size;
+
+    buf = mailbox_index_record_base(mailbox, recno);
+    if (!buf) return 0;
+
+    return ntohl(*((bit32 *)(buf+OFFSET_SIZE)));
+}
+
+/*
+ * Fill in just uid, recno, modseq, flags and cache_offset; everything
+ * else in 'record' is zeroed.
+ */
+EXPORTED int mailbox_read_index_flags(struct mailbox *mailbox,
+                                      uint32_t recno,
+                                      struct index_record *record)
+{
+    struct index_change *change = _find_change(mailbox, recno);
+    const char *buf;
+    int n;
+
+    if (change) {
+        *record = change->record;
+        return 0;
+    }
+
+    buf = mailbox_index_record_base(mailbox, recno);
+    if (!buf) {
+        syslog(LOG_ERR,
+               "IOERROR: index record %u for %s past end of file",
+               recno, mailbox->name);
+        return IMAP_IOERROR;
+    }
+
+    memset(record, 0, sizeof(struct index_record));
+    record->recno = recno;
+    record->uid = ntohl(*((bit32 *)(buf+OFFSET_UID)));
+    record->cache_offset = ntohl(*((bit32 *)(buf+OFFSET_CACHE_OFFSET)));
+    record->system_flags = ntohl(*((bit32 *)(buf+OFFSET_SYSTEM_FLAGS)));
+    for (n = 0; n < MAX_USER_FLAGS/32; n++) {
+        record->user_flags[n] = ntohl(*((bit32 *)(buf+OFFSET_USER_FLAGS+4*n)));
+    }
+    record->modseq = mailbox_buf_modseq(buf, mailbox->i.minor_version);
+
+    return 0;
+}
+
+/*
+ * cyrus.columns: the fields of each index record which change after
+ * append (plus the uid and cache offset), in packed columns, so that
+ * scans which only need those don't have to decode and checksum every
+ * index record.  It's only a cache of cyrus.index: it is trusted while
+ * its header matches the index header, and rebuilt from the index by
+ * the next exclusive lock otherwise.  Silent changes leave the index
+ * header alone, so they mark it dirty first (or remove it, in a process
+ * which isn't keeping it up to date).  Each rebuild leaves room for
+ * half as many again records to be appended.
+ *
+ * Header (64 bytes, network byte order):
+ *   0  magic
+ *  16  version
+ *  20  flags
+ *  24  generation_no  \
+ *  28  num_records     > copied from the index header
+ *  32  highestmodseq  /
+ *  40  alloc: room for records in each column
+ *  60  crc32 of the above
+ *
+ * followed by the columns, each with room for 'alloc' records:
+ * modseq (8 bytes), uid, system_flags, cache_offset (4 bytes each) and
+ * user_flags (MAX_USER_FLAGS/8 bytes).
+ */
+#define COLUMNS_MAGIC ("\241\002\213\015cyrus cols\0\0")
+#define COLUMNS_MAGIC_SIZE 16
+#define COLUMNS_VERSION 1
+#define COLUMNS_HEADER_SIZE 64
+
+#define COLUMNS_OFFSET_VERSION 16
+#define COLUMNS_OFFSET_FLAGS 20
+#define COLUMNS_OFFSET_GENERATION 24
+#define COLUMNS_OFFSET_NUM_RECORDS 28
+#define COLUMNS_OFFSET_HIGHESTMODSEQ 32
+#define COLUMNS_OFFSET_ALLOC 40
+#define COLUMNS_OFFSET_CRC 60
+
+/* columns are being written, don't trust them */
+#define COLUMNS_DIRTY (1<<0)
+
+#define COLUMN_MODSEQ(alloc) (COLUMNS_HEADER_SIZE)
+#define COLUMN_UID(alloc) (COLUMNS_HEADER_SIZE + 8*(size_t)(alloc))
+#define COLUMN_SYSTEM_FLAGS(alloc) (COLUMNS_HEADER_SIZE + 12*(size_t)(alloc))
+#define COLUMN_CACHE_OFFSET(alloc) (COLUMNS_HEADER_SIZE + 16*(size_t)(alloc))
+#define COLUMN_USER_FLAGS(alloc) (COLUMNS_HEADER_SIZE + 20*(size_t)(alloc))
+#define COLUMNS_SIZE(alloc) (COLUMNS_HEADER_SIZE + 36*(size_t)(alloc))
+
+/* a staged change, written out once the index header is safe */
+struct column_change {
+    uint32_t recno;
+    uint32_t uid;
+    uint32_t system_flags;
+    uint32_t cache_offset;
+    uint32_t user_flags[MAX_USER_FLAGS/32];
+    modseq_t modseq;
+};
+
+static void mailbox_columns_close(struct mailbox *mailbox)
+{
+    if (mailbox->columns_base)
+        map_free(&mailbox->columns_base, &mailbox->columns_len);
+    xclose(mailbox->columns_fd);
+    mailbox->columns_current = 0;
+    buf_free(&mailbox->columns_pending);
+}
+
+/* map the columns and check them against the index header.  Called
+ * with the index locked and its header freshly read */
+static void mailbox_columns_refresh(struct mailbox *mailbox)
+{
+    const char *base;
+    struct stat sbuf;
+    uint32_t alloc;
+
+    mailbox->columns_current = 0;
+    buf_reset(&mailbox->columns_pending);
+
+    if (mailbox->columns_fd != -1) {
+        if (fstat(mailbox->columns_fd, &sbuf) == -1) return;
+        /* removed by a process which couldn't keep it up to date */
+        if (!sbuf.st_nlink) mailbox_columns_close(mailbox);
+    }
+
+    if (mailbox->columns_fd == -1) {
+        const char *fname = mailbox_meta_fname(mailbox, META_COLUMNS);
+        if (mailbox->is_readonly)
+            mailbox->columns_fd = open(fname, O_RDONLY, 0);
+        else
+            mailbox->columns_fd = open(fname, O_RDWR|O_CREAT, 0666);
+        if (mailbox->columns_fd == -1) return;
+        if (fstat(mailbox->columns_fd, &sbuf) == -1) return;
+    }
+
+    if (sbuf.st_size < COLUMNS_HEADER_SIZE) return;
+
+    map_refresh(mailbox->columns_fd, 0, &mailbox->columns_base,
+                &mailbox->columns_len, sbuf.st_size,
+                "columns", mailbox->name);
+    base = mailbox->columns_base;
+
+    if (memcmp(base, COLUMNS_MAGIC, COLUMNS_MAGIC_SIZE))
+        return;
+    if (crc32_map(base, COLUMNS_OFFSET_CRC) !=
+        ntohl(*((bit32 *)(base+COLUMNS_OFFSET_CRC))))
+        return;
+    if (ntohl(*((bit32 *)(base+COLUMNS_OFFSET_VERSION))) != COLUMNS_VERSION)
+        return;
+    if (ntohl(*((bit32 *)(base+COLUMNS_OFFSET_FLAGS))) & COLUMNS_DIRTY)
+        return;
+
+    /* same state as the index? */
+    if (ntohl(*((bit32 *)(base+COLUMNS_OFFSET_GENERATION))) !=
+        mailbox->i.generation_no)
+        return;
+    if (ntohl(*((bit32 *)(base+COLUMNS_OFFSET_NUM_RECORDS))) !=
+        mailbox->i.num_records)
+        return;
+    if (ntohll(*((bit64 *)(base+COLUMNS_OFFSET_HIGHESTMODSEQ))) !=
+        mailbox->i.highestmodseq)
+        return;
+
+    alloc = ntohl(*((bit32 *)(base+COLUMNS_OFFSET_ALLOC)));
+    if (alloc < mailbox->i.num_records) return;
+    if (mailbox->columns_len < COLUMNS_SIZE(alloc)) return;
+
+    mailbox->columns_alloc = alloc;
+    mailbox->columns_current = 1;
+}
+
+static int mailbox_columns_write_header(struct mailbox *mailbox,
+                                        uint32_t alloc, int flags)
+{
+    char buf[COLUMNS_HEADER_SIZE];
+
+    memset(buf, 0, COLUMNS_HEADER_SIZE);
+    memcpy(buf, COLUMNS_MAGIC, COLUMNS_MAGIC_SIZE);
+    *((bit32 *)(buf+COLUMNS_OFFSET_VERSION)) = htonl(COLUMNS_VERSION);
+    *((bit32 *)(buf+COLUMNS_OFFSET_FLAGS)) = htonl(flags);
+    *((bit32 *)(buf+COLUMNS_OFFSET_GENERATION)) = htonl(mailbox->i.generation_no);
+    *((bit32 *)(buf+COLUMNS_OFFSET_NUM_RECORDS)) = htonl(mailbox->i.num_records);
+    *((bit64 *)(buf+COLUMNS_OFFSET_HIGHESTMODSEQ)) = htonll(mailbox->i.highestmodseq);
+    *((bit32 *)(buf+COLUMNS_OFFSET_ALLOC)) = htonl(alloc);
+    *((bit32 *)(buf+COLUMNS_OFFSET_CRC)) = htonl(crc32_map(buf, COLUMNS_OFFSET_CRC));
+
+    if (pwrite(mailbox->columns_fd, buf, COLUMNS_HEADER_SIZE, 0) != COLUMNS_HEADER_SIZE) {
+        syslog(LOG_ERR, "IOERROR: writing columns header for %s: %m",
+               mailbox->name);
+        return IMAP_IOERROR;
+    }
+
+    return 0;
+}
+
+static void column_change_to_bufs(const struct column_change *cc,
+                                  struct buf cols[5])
+{
+    bit64 modseq = htonll(cc->modseq);
+    bit32 val;
+    int n;
+
+    buf_appendmap(&cols[0], (const char *)&modseq, 8);
+    val = htonl(cc->uid);
+    buf_appendmap(&cols[1], (const char *)&val, 4);
+    val = htonl(cc->system_flags);
+    buf_appendmap(&cols[2], (const char *)&val, 4);
+    val = htonl(cc->cache_offset);
+    buf_appendmap(&cols[3], (const char *)&val, 4);
+    for (n = 0; n < MAX_USER_FLAGS/32; n++) {
+        val = htonl(cc->user_flags[n]);
+        buf_appendmap(&cols[4], (const char *)&val, 4);
+    }
+}
+
+/* write one run of consecutive records, starting at 'recno', to each
+ * of the columns */
+static int mailbox_columns_write_run(struct mailbox *mailbox, uint32_t alloc,
+                                     uint32_t recno, struct buf cols[5])
+{
+    size_t offsets[5];
+    size_t idx = recno - 1;
+    int n;
+
+    offsets[0] = COLUMN_MODSEQ(alloc) + 8 * idx;
+    offsets[1] = COLUMN_UID(alloc) + 4 * idx;
+    offsets[2] = COLUMN_SYSTEM_FLAGS(alloc) + 4 * idx;
+    offsets[3] = COLUMN_CACHE_OFFSET(alloc) + 4 * idx;
+    offsets[4] = COLUMN_USER_FLAGS(alloc) + (MAX_USER_FLAGS/8) * idx;
+
+    for (n = 0; n < 5; n++) {
+        if (pwrite(mailbox->columns_fd, cols[n].s, cols[n].len,
+                   offsets[n]) != (ssize_t)cols[n].len) {
+            syslog(LOG_ERR, "IOERROR: writing columns for %s: %m",
+                   mailbox->name);
+            return IMAP_IOERROR;
+        }
+        buf_reset(&cols[n]);
+    }
+
+    return 0;
+}
+
+/* rewrite the whole file from the index, with some room to grow */
+static int mailbox_columns_rebuild(struct mailbox *mailbox)
+{
+    struct buf cols[5];
+    struct column_change cc;
+    struct index_record record;
+    uint32_t alloc = ((mailbox->i.num_records * 3 / 2) | 255) + 1;
+    uint32_t recno;
+    int n, r;
+
+    if (mailbox->columns_fd == -1 || mailbox->is_readonly)
+        return IMAP_IOERROR;
+
+    memset(cols, 0, sizeof(cols));
+
+    r = mailbox_columns_write_header(mailbox, alloc, COLUMNS_DIRTY);
+    if (r) goto done;
+
+    if (ftruncate(mailbox->columns_fd, COLUMNS_SIZE(alloc)) == -1) {
+        syslog(LOG_ERR, "IOERROR: sizing columns for %s: %m",
+               mailbox->name);
+        r = IMAP_IOERROR;
+        goto done;
+    }
+
+    for (recno = 1; recno <= mailbox->i.num_records; recno++) {
+        r = mailbox_read_index_record(mailbox, recno, &record);
+        if (r) goto done;
+
+        cc.uid = record.uid;
+        cc.system_flags = record.system_flags;
+        cc.cache_offset = record.cache_offset;
+        for (n = 0; n < MAX_USER_FLAGS/32; n++)
+            cc.user_flags[n] = record.user_flags[n];
+        cc.modseq = record.modseq;
+        column_change_to_bufs(&cc, cols);
+    }
+
+    if (mailbox->i.num_records) {
+        r = mailbox_columns_write_run(mailbox, alloc, 1, cols);
+        if (r) goto done;
+    }
+
+    if (fdatasync(mailbox->columns_fd) == -1) {
+        syslog(LOG_ERR, "IOERROR: syncing columns for %s: %m",
+               mailbox->name);
+        r = IMAP_IOERROR;
+        goto done;
+    }
+
+    r = mailbox_columns_write_header(mailbox, alloc, 0);
+
+done:
+    for (n = 0; n < 5; n++)
+        buf_free(&cols[n]);
+
+    if (r) {
+        syslog(LOG_NOTICE, "failed to rebuild columns for %s: %s",
+               mailbox->name, error_message(r));
+        return r;
+    }
+
+    mailbox_columns_refresh(mailbox);
+    return mailbox->columns_current ? 0 : IMAP_IOERROR;
+}
+
+/* called before index records are rewritten without a modseq bump:
+ * mark the columns dirty until mailbox_columns_commit() brings them
+ * up to date, or get rid of them if we aren't going to */
+static void mailbox_columns_invalidate(struct mailbox *mailbox)
+{
+    const char *fname;
+
+    if (mailbox->columns_current) {
+        if (!mailbox_columns_write_header(mailbox, mailbox->columns_alloc,
+                                          COLUMNS_DIRTY) &&
+            !fdatasync(mailbox->columns_fd))
+            return;
+    }
+    else if (mailbox->columns_fd != -1) {
+        /* already out of date, and we hold the lock */
+        return;
+    }
+
+    mailbox_columns_close(mailbox);
+    fname = mailbox_meta_fname(mailbox, META_COLUMNS);
+    if (unlink(fname) == -1 && errno != ENOENT)
+        syslog(LOG_ERR, "IOERROR: removing %s: %m", fname);
+}
+
+/* keep a copy of the changes being committed to the index, to write
+ * to the columns after the index header */
+static void mailbox_columns_stage(struct mailbox *mailbox)
+{
+    struct column_change cc;
+    uint32_t i;
+    int n;
+
+    if (!mailbox->columns_current) return;
+
+    for (i = 0; i < mailbox->index_change_count; i++) {
+        const struct index_record *record = &mailbox->index_changes[i].record;
+
+        memset(&cc, 0, sizeof(cc));
+        cc.recno = record->recno;
+        cc.uid = record->uid;
+        cc.system_flags = record->system_flags;
+        cc.cache_offset = record->cache_offset;
+        for (n = 0; n < MAX_USER_FLAGS/32; n++)
+            cc.user_flags[n] = record->user_flags[n];
+        cc.modseq = record->modseq;
+
+        buf_appendmap(&mailbox->columns_pending, (const char *)&cc, sizeof(cc));
+    }
+}
+
+/* called once the index header has been written: bring the columns
+ * up to the same state.  Any failure just leaves them out of date,
+ * to be rebuilt by the next exclusive lock */
+static void mailbox_columns_commit(struct mailbox *mailbox)
+{
+    const struct column_change *changes;
+    struct buf cols[5];
+    uint32_t alloc = mailbox->columns_alloc;
+    size_t count, i;
+    uint32_t runstart = 0, prev = 0;
+    int n, r = 0;
+
+    if (!mailbox->columns_current) return;
+
+    changes = (const struct column_change *) mailbox->columns_pending.s;
+    count = mailbox->columns_pending.len / sizeof(struct column_change);
+
+    /* grown past the room we left?  Start again */
+    if (mailbox->i.num_records > alloc) {
+        buf_reset(&mailbox->columns_pending);
+        mailbox_columns_rebuild(mailbox);
+        return;
+    }
+
+    memset(cols, 0, sizeof(cols));
+
+    if (count) {
+        r = mailbox_columns_write_header(mailbox, alloc, COLUMNS_DIRTY);
+
+        /* changes were sorted by recno at commit */
+        for (i = 0; !r && i < count; i++) {
+            if (runstart && changes[i].recno != prev + 1) {
+                r = mailbox_columns_write_run(mailbox, alloc, runstart, cols);
+                runstart = 0;
+            }
+            if (!runstart) runstart = changes[i].recno;
+            prev = changes[i].recno;
+            column_change_to_bufs(&changes[i], cols);
+        }
+        if (!r && runstart)
+            r = mailbox_columns_write_run(mailbox, alloc, runstart, cols);
+
+        if (!r && fdatasync(mailbox->columns_fd) == -1) {
+            syslog(LOG_ERR, "IOERROR: syncing columns for %s: %m",
+                   mailbox->name);
+            r = IMAP_IOERROR;
+        }
+    }
+
+    if (!r) r = mailbox_columns_write_header(mailbox, alloc, 0);
+
+    for (n = 0; n < 5; n++)
+        buf_free(&cols[n]);
+    buf_reset(&mailbox->columns_pending);
+
+    if (r) {
+        mailbox->columns_current = 0;
+        return;
+    }
+
+    /* always refresh, we may be using map_nommap */
+    map_refresh(mailbox->columns_fd, 0, &mailbox->columns_base,
+                &mailbox->columns_len, COLUMNS_SIZE(alloc),
+                "columns", mailbox->name);
+}
+
+/* read the packed fields of one record; everything else is zero */
+static void mailbox_columns_read_record(struct mailbox *mailbox,
+                                        uint32_t recno,
+                                        struct index_record *record)
+{
+    const char *base = mailbox->columns_base;
+    uint32_t alloc = mailbox->columns_alloc;
+    size_t idx = recno - 1;
+    const char *uf;
+    int n;
+
+    memset(record, 0, sizeof(struct index_record));
+    record->recno = recno;
+    record->modseq = ntohll(*((bit64 *)(base+COLUMN_MODSEQ(alloc)+8*idx)));
+    record->uid = ntohl(*((bit32 *)(base+COLUMN_UID(alloc)+4*idx)));
+    record->system_flags =
+        ntohl(*((bit32 *)(base+COLUMN_SYSTEM_FLAGS(alloc)+4*idx)));
+    record->cache_offset =
+        ntohl(*((bit32 *)(base+COLUMN_CACHE_OFFSET(alloc)+4*idx)));
+    uf = base + COLUMN_USER_FLAGS(alloc) + (MAX_USER_FLAGS/8) * idx;
+    for (n = 0; n < MAX_USER_FLAGS/32; n++)
+        record->user_flags[n] = ntohl(*((bit32 *)(uf+4*n)));
+}
+
+/*
+ * cyrus.modseq: a log of the records changed by each commit, so that
+ * looking for changes since a given modseq only has to read the records
+ * which changed.  Like cyrus.columns it's only a cache of cyrus.index,
+ * trusted while its header matches the index header and rebuilt from
+ * the index by the next exclusive lock otherwise.
+ *
+ * Each entry gives the highestmodseq of the commit which changed the
+ * record, so entries are in modseq order, and a record whose modseq is
+ * greater than N has an entry at or after the first one greater than N.
+ * Silent changes (unlinking, archiving) are logged too, at the modseq
+ * of the commit which made them.  A rebuild writes one entry per record
+ * at its own modseq, forgetting when any silent changes were made: so
+ * silent changes are only known for modseqs above 'basemodseq'.  As
+ * they leave the index header alone, a commit with silent changes marks
+ * the log dirty until they're logged (or removes it, in a process which
+ * isn't logging).  The log is rebuilt once it's grown to twice the
+ * number of records.
+ *
+ * Header (64 bytes, network byte order):
+ *   0  magic
+ *  16  version
+ *  20  flags
+ *  24  generation_no  \
+ *  28  num_records     > copied from the index header
+ *  32  highestmodseq  /
+ *  40  count: number of entries
+ *  48  basemodseq: highestmodseq at the last rebuild
+ *  60  crc32 of the above
+ *
+ * followed by 'count' entries of modseq (8 bytes), recno and uid
+ * (4 bytes each).  Entries are written before the header which counts
+ * them, so anything after 'count' is ignored.
+ */
+#define MODSEQLOG_MAGIC ("\241\002\213\015cyrus modseq")
+#define MODSEQLOG_MAGIC_SIZE 16
+#define MODSEQLOG_VERSION 1
+#define MODSEQLOG_HEADER_SIZE 64
+#define MODSEQLOG_ENTRY_SIZE 16
+
+#define MODSEQLOG_OFFSET_VERSION 16
+#define MODSEQLOG_OFFSET_FLAGS 20
+#define MODSEQLOG_OFFSET_GENERATION 24
+#define MODSEQLOG_OFFSET_NUM_RECORDS 28
+#define MODSEQLOG_OFFSET_HIGHESTMODSEQ 32
+#define MODSEQLOG_OFFSET_COUNT 40
+#define MODSEQLOG_OFFSET_BASEMODSEQ 48
+#define MODSEQLOG_OFFSET_CRC 60
+
+/* entries are being written or are missing, don't trust it */
+#define MODSEQLOG_DIRTY (1<<0)
+
+#define MODSEQLOG_SIZE(count) \
+    (MODSEQLOG_HEADER_SIZE + MODSEQLOG_ENTRY_SIZE*(size_t)(count))
+#define MODSEQLOG_ENTRY(base, n) \
+    ((base) + MODSEQLOG_HEADER_SIZE + MODSEQLOG_ENTRY_SIZE*(size_t)(n))
+
+/* rebuild rather than append past this many entries */
+#define MODSEQLOG_MAXCOUNT(num_records) (2*(size_t)(num_records) + 1024)
+
+struct modseqlog_entry {
+    modseq_t modseq;
+    uint32_t recno;
+    uint32_t uid;
+};
+
+static void mailbox_modseqlog_close(struct mailbox *mailbox)
+{
+    if (mailbox->modseqlog_base)
+        map_free(&mailbox->modseqlog_base, &mailbox->modseqlog_len);
+    xclose(mailbox->modseqlog_fd);
+    mailbox->modseqlog_current = 0;
+    buf_free(&mailbox->modseqlog_pending);
+}
+
+static modseq_t modseqlog_entry_modseq(const char *base, uint32_t n)
+{
+    return ntohll(*((bit64 *)MODSEQLOG_ENTRY(base, n)));
+}
+
+/* map the log and check it against the index header.  Called with
+ * the index locked and its header freshly read */
+static void mailbox_modseqlog_refresh(struct mailbox *mailbox)
+{
+    const char *base;
+    struct stat sbuf;
+    uint32_t count;
+
+    mailbox->modseqlog_current = 0;
+    buf_reset(&mailbox->modseqlog_pending);
+
+    if (mailbox->modseqlog_fd != -1) {
+        if (fstat(mailbox->modseqlog_fd, &sbuf) == -1) return;
+        /* removed by a process which couldn't keep it up to date */
+        if (!sbuf.st_nlink) mailbox_modseqlog_close(mailbox);
+    }
+
+    if (mailbox->modseqlog_fd == -1) {
+        const char *fname = mailbox_meta_fname(mailbox, META_MODSEQLOG);
+        if (mailbox->is_readonly)
+            mailbox->modseqlog_fd = open(fname, O_RDONLY, 0);
+        else
+            mailbox->modseqlog_fd = open(fname, O_RDWR|O_CREAT, 0666);
+        if (mailbox->modseqlog_fd == -1) return;
+        if (fstat(mailbox->modseqlog_fd, &sbuf) == -1) return;
+    }
+
+    if (sbuf.st_size < MODSEQLOG_HEADER_SIZE) return;
+
+    map_refresh(mailbox->modseqlog_fd, 0, &mailbox->modseqlog_base,
+                &mailbox->modseqlog_len, sbuf.st_size,
+                "modseq", mailbox->name);
+    base = mailbox->modseqlog_base;
+
+    if (memcmp(base, MODSEQLOG_MAGIC, MODSEQLOG_MAGIC_SIZE))
+        return;
+    if (crc32_map(base, MODSEQLOG_OFFSET_CRC) !=
+        ntohl(*((bit32 *)(base+MODSEQLOG_OFFSET_CRC))))
+        return;
+    if (ntohl(*((bit32 *)(base+MODSEQLOG_OFFSET_VERSION))) != MODSEQLOG_VERSION)
+        return;
+    if (ntohl(*((bit32 *)(base+MODSEQLOG_OFFSET_FLAGS))) & MODSEQLOG_DIRTY)
+        return;
+
+    /* same state as the index? */
+    if (ntohl(*((bit32 *)(base+MODSEQLOG_OFFSET_GENERATION))) !=
+        mailbox->i.generation_no)
+        return;
+    if (ntohl(*((bit32 *)(base+MODSEQLOG_OFFSET_NUM_RECORDS))) !=
+        mailbox->i.num_records)
+        return;
+    if (ntohll(*((bit64 *)(base+MODSEQLOG_OFFSET_HIGHESTMODSEQ))) !=
+        mailbox->i.highestmodseq)
+        return;
+
+    count = ntohl(*((bit32 *)(base+MODSEQLOG_OFFSET_COUNT)));
+    if (mailbox->modseqlog_len < MODSEQLOG_SIZE(count)) return;
+
+    mailbox->modseqlog_count = count;
+    mailbox->modseqlog_basemodseq =
+        ntohll(*((bit64 *)(base+MODSEQLOG_OFFSET_BASEMODSEQ)));
+    mailbox->modseqlog_current = 1;
+}
+
+static int mailbox_modseqlog_write_header(struct mailbox *mailbox,
+                                          uint32_t count,
+                                          modseq_t basemodseq,
+                                          int flags)
+{
+    char buf[MODSEQLOG_HEADER_SIZE];
+
+    memset(buf, 0, MODSEQLOG_HEADER_SIZE);
+    memcpy(buf, MODSEQLOG_MAGIC, MODSEQLOG_MAGIC_SIZE);
+    *((bit32 *)(buf+MODSEQLOG_OFFSET_VERSION)) = htonl(MODSEQLOG_VERSION);
+    *((bit32 *)(buf+MODSEQLOG_OFFSET_FLAGS)) = htonl(flags);
+    *((bit32 *)(buf+MODSEQLOG_OFFSET_GENERATION)) = htonl(mailbox->i.generation_no);
+    *((bit32 *)(buf+MODSEQLOG_OFFSET_NUM_RECORDS)) = htonl(mailbox->i.num_records);
+    *((bit64 *)(buf+MODSEQLOG_OFFSET_HIGHESTMODSEQ)) = htonll(mailbox->i.highestmodseq);
+    *((bit32 *)(buf+MODSEQLOG_OFFSET_COUNT)) = htonl(count);
+    *((bit64 *)(buf+MODSEQLOG_OFFSET_BASEMODSEQ)) = htonll(basemodseq);
+    *((bit32 *)(buf+MODSEQLOG_OFFSET_CRC)) = htonl(crc32_map(buf, MODSEQLOG_OFFSET_CRC));
+
+    if (pwrite(mailbox->modseqlog_fd, buf, MODSEQLOG_HEADER_SIZE, 0) != MODSEQLOG_HEADER_SIZE) {
+        syslog(LOG_ERR, "IOERROR: writing modseq log header for %s: %m",
+               mailbox->name);
+        return IMAP_IOERROR;
+    }
+
+    return 0;
+}
+
+static void modseqlog_entry_to_buf(modseq_t modseq, uint32_t recno,
+                                   uint32_t uid, struct buf *buf)
+{
+    bit64 m = htonll(modseq);
+    bit32 val;
+
+    buf_appendmap(buf, (const char *)&m, 8);
+    val = htonl(recno);
+    buf_appendmap(buf, (const char *)&val, 4);
+    val = htonl(uid);
+    buf_appendmap(buf, (const char *)&val, 4);
+}
+
+static int modseqlog_entry_compar(const void *a, const void *b)
+{
+    const struct modseqlog_entry *ae = (const struct modseqlog_entry *)a;
+    const struct modseqlog_entry *be = (const struct modseqlog_entry *)b;
+
+    if (ae->modseq < be->modseq) return -1;
+    if (ae->modseq > be->modseq) return 1;
+    if (ae->recno < be->recno) return -1;
+    if (ae->recno > be->recno) return 1;
+    return 0;
+}
+
+/* rewrite the whole log from the index, one entry per record */
+static int mailbox_modseqlog_rebuild(struct mailbox *mailbox)
+{
+    struct modseqlog_entry *entries = NULL;
+    struct index_record record;
+    struct buf buf = BUF_INITIALIZER;
+    uint32_t recno, count = 0;
+    int r = 0;
+
+    if (mailbox->modseqlog_fd == -1 || mailbox->is_readonly)
+        return IMAP_IOERROR;
+
+    if (mailbox->i.num_records)
+        entries = xmalloc(mailbox->i.num_records * sizeof(struct modseqlog_entry));
+
+    for (recno = 1; recno <= mailbox->i.num_records; recno++) {
+        r = mailbox_read_index_flags(mailbox, recno, &record);
+        if (r) goto done;
+        if (!record.uid) continue;
+        entries[count].modseq = record.modseq;
+        entries[count].recno = recno;
+        entries[count].uid = record.uid;
+        count++;
+    }
+
+    qsort(entries, count, sizeof(struct modseqlog_entry),
+          modseqlog_entry_compar);
+
+    for (recno = 0; recno < count; recno++)
+        modseqlog_entry_to_buf(entries[recno].modseq, entries[recno].recno,
+                               entries[recno].uid, &buf);
+
+    /* a dirty log first, so a crash part way leaves nothing usable */
+    r = mailbox_modseqlog_write_header(mailbox, 0, mailbox->i.highestmodseq,
+                                       MODSEQLOG_DIRTY);
+    if (r) goto done;
+
+    if (ftruncate(mailbox->modseqlog_fd, MODSEQLOG_SIZE(count)) == -1 ||
+        pwrite(mailbox->modseqlog_fd, buf.s, buf.len,
+               MODSEQLOG_HEADER_SIZE) != (ssize_t)buf.len) {
+        syslog(LOG_ERR, "IOERROR: writing modseq log for %s: %m",
+               mailbox->name);
+        r = IMAP_IOERROR;
+        goto done;
+    }
+
+    if (fdatasync(mailbox->modseqlog_fd) == -1) {
+        syslog(LOG_ERR, "IOERROR: syncing modseq log for %s: %m",
+               mailbox->name);
+        r = IMAP_IOERROR;
+        goto done;
+    }
+
+    r = mailbox_modseqlog_write_header(mailbox, count,
+                                       mailbox->i.highestmodseq, 0);
+
+done:
+    free(entries);
+    buf_free(&buf);
+
+    if (r) {
+        syslog(LOG_NOTICE, "failed to rebuild modseq log for %s: %s",
+               mailbox->name, error_message(r));
+        return r;
+    }
+
+    mailbox_modseqlog_refresh(mailbox);
+    return mailbox->modseqlog_current ? 0 : IMAP_IOERROR;
+}
+
+/* remember which records are being committed to the index, to log
+ * once the index header is safe */
+static void mailbox_modseqlog_stage(struct mailbox *mailbox)
+{
+    struct modseqlog_entry entry;
+    uint32_t i;
+
+    if (!mailbox->modseqlog_current) return;
+
+    for (i = 0; i < mailbox->index_change_count; i++) {
+        const struct index_record *record = &mailbox->index_changes[i].record;
+
+        memset(&entry, 0, sizeof(entry));
+        entry.modseq = record->modseq;
+        entry.recno = record->recno;
+        entry.uid = record->uid;
+
+        buf_appendmap(&mailbox->modseqlog_pending,
+                      (const char *)&entry, sizeof(entry));
+    }
+}
+
+/* called before index records are rewritten without a modseq bump:
+ * mark the log dirty until mailbox_modseqlog_commit() has logged them,
+ * or get rid of it if we aren't going to */
+static void mailbox_modseqlog_invalidate(struct mailbox *mailbox)
+{
+    const char *fname;
+
+    if (mailbox->modseqlog_current) {
+        if (!mailbox_modseqlog_write_header(mailbox, mailbox->modseqlog_count,
+                                            mailbox->modseqlog_basemodseq,
+                                            MODSEQLOG_DIRTY) &&
+            !fdatasync(mailbox->modseqlog_fd))
+            return;
+    }
+    else if (mailbox->modseqlog_fd != -1) {
+        /* already out of date, and we hold the lock */
+        return;
+    }
+
+    mailbox_modseqlog_close(mailbox);
+    fname = mailbox_meta_fname(mailbox, META_MODSEQLOG);
+    if (unlink(fname) == -1 && errno != ENOENT)
+        syslog(LOG_ERR, "IOERROR: removing %s: %m", fname);
+}
+
+/* called once the index header has been written: append the staged
+ * changes at the new highestmodseq.  Any failure just leaves the log
+ * out of date, to be rebuilt by the next exclusive lock */
+static void mailbox_modseqlog_commit(struct mailbox *mailbox)
+{
+    const struct modseqlog_entry *changes;
+    struct buf buf = BUF_INITIALIZER;
+    uint32_t count = mailbox->modseqlog_count;
+    modseq_t modseq = mailbox->i.highestmodseq;
+    size_t nchanges, i;
+    int r = 0;
+
+    if (!mailbox->modseqlog_current) return;
+
+    changes = (const struct modseqlog_entry *) mailbox->modseqlog_pending.s;
+    nchanges = mailbox->modseqlog_pending.len / sizeof(struct modseqlog_entry);
+
+    /* time to trim? */
+    if (count + nchanges > MODSEQLOG_MAXCOUNT(mailbox->i.num_records)) {
+        buf_reset(&mailbox->modseqlog_pending);
+        mailbox_modseqlog_rebuild(mailbox);
+        return;
+    }
+
+    /* keep the log in order, whatever replication did to the modseqs */
+    if (count && modseqlog_entry_modseq(mailbox->modseqlog_base, count-1) > modseq)
+        modseq = modseqlog_entry_modseq(mailbox->modseqlog_base, count-1);
+    for (i = 0; i < nchanges; i++) {
+        if (changes[i].modseq > modseq)
+            modseq = changes[i].modseq;
+    }
+
+    if (nchanges) {
+        for (i = 0; i < nchanges; i++)
+            modseqlog_entry_to_buf(modseq, changes[i].recno,
+                                   changes[i].uid, &buf);
+
+        if (pwrite(mailbox->modseqlog_fd, buf.s, buf.len,
+                   MODSEQLOG_SIZE(count)) != (ssize_t)buf.len) {
+            syslog(LOG_ERR, "IOERROR: writing modseq log for %s: %m",
+                   mailbox->name);
+            r = IMAP_IOERROR;
+        }
+        else if (fdatasync(mailbox->modseqlog_fd) == -1) {
+            syslog(LOG_ERR, "IOERROR: syncing modseq log for %s: %m",
+                   mailbox->name);
+            r = IMAP_IOERROR;
+        }
+        count += nchanges;
+    }
+
+    if (!r) r = mailbox_modseqlog_write_header(mailbox, count,
+                                               mailbox->modseqlog_basemodseq,
+                                               0);
+
+    buf_free(&buf);
+    buf_reset(&mailbox->modseqlog_pending);
+
+    if (r) {
+        mailbox->modseqlog_current = 0;
+        return;
+    }
+
+    mailbox->modseqlog_count = count;
+
+    /* always refresh, we may be using map_nommap */
+    map_refresh(mailbox->modseqlog_fd, 0, &mailbox->modseqlog_base,
+                &mailbox->modseqlog_len, MODSEQLOG_SIZE(count),
+                "modseq", mailbox->name);
+}
+
+static int recno_compar(const void *a, const void *b)
+{
+    uint32_t ar = *(const uint32_t *)a;
+    uint32_t br = *(const uint32_t *)b;
+
+    if (ar < br) return -1;
+    if (ar > br) return 1;
+    return 0;
+}
+
+/*
+ * Find the records which may have changed at or after modseq 'since',
+ * from cyrus.modseq.  The list includes every record whose modseq is at
+ * least 'since', and maybe some others.  If 'complete' is set it also
+ * includes the records changed silently since then.
+ *
+ * Returns 0 and a sorted list of recnos in *recnosp, which the caller
+ * must free; or IMAP_NOTFOUND if the log can't say, or it would be
+ * about as quick to look at every record.
+ */
+EXPORTED int mailbox_changed_recnos(struct mailbox *mailbox, modseq_t since,
+                                    int complete, uint32_t **recnosp,
+                                    uint32_t *countp)
+{
+    const char *base = mailbox->modseqlog_base;
+    uint32_t count = mailbox->modseqlog_count;
+    uint32_t low = 0, high = count;
+    uint32_t *recnos;
+    uint32_t i, n = 0;
+
+    *recnosp = NULL;
+    *countp = 0;
+
+    /* the log doesn't see uncommitted changes */
+    if (!mailbox->modseqlog_current) return IMAP_NOTFOUND;
+    if (mailbox->index_change_count || mailbox->i.dirty) return IMAP_NOTFOUND;
+    if (complete && since <= mailbox->modseqlog_basemodseq) return IMAP_NOTFOUND;
+
+    /* first entry at or after 'since' */
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (modseqlog_entry_modseq(base, mid) < since)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    if (count - low > mailbox->i.num_records / 4) return IMAP_NOTFOUND;
+    if (low == count) return 0;
+
+    recnos = xmalloc((count - low) * sizeof(uint32_t));
+    for (i = low; i < count; i++) {
+        uint32_t recno = ntohl(*((bit32 *)(MODSEQLOG_ENTRY(base, i) + 8)));
+        if (!recno || recno > mailbox->i.num_records) continue;
+        recnos[n++] = recno;
+    }
+
+    qsort(recnos, n, sizeof(uint32_t), recno_compar);
+
+    /* and each just once */
+    if (n) {
+        uint32_t j = 0;
+        for (i = 1; i < n; i++) {
+            if (recnos[i] != recnos[j])
+                recnos[++j] = recnos[i];
+        }
+        n = j + 1;
+    }
+
+    *recnosp = recnos;
+    *countp = n;
+    return 0;
+}
+
+/*
+ * cyrus.vanished: the UIDs expunged from the mailbox, by modseq, so
+ * that QRESYNC can say exactly what vanished since a client's modseq
+ * even once the expunged records themselves have been cleaned out of
+ * cyrus.index.  The UIDs are stored as ranges: a range can cover UIDs
+ * which were expunged earlier or never used, which QRESYNC allows.
+ *
+ * Unlike cyrus.columns and cyrus.modseq this isn't rebuilt on repack,
+ * since it's the only record of the expunges repack throws away.  It's
+ * trusted while it has seen every commit up to the index's
+ * highestmodseq; otherwise the next exclusive lock starts it again from
+ * the expunged records still in the index.  Once it holds more than
+ * mailbox_vanished_log ranges, the oldest half are dropped.
+ *
+ * Header (64 bytes, network byte order):
+ *   0  magic
+ *  16  version
+ *  20  flags
+ *  24  uidvalidity
+ *  28  count: number of ranges
+ *  32  highestmodseq: of the last commit logged
+ *  40  basemodseq: every expunge after this is logged
+ *  60  crc32 of the above
+ *
+ * followed by 'count' ranges of modseq (8 bytes), first and last UID
+ * (4 bytes each), in modseq order.
+ */
+#define VANISHED_MAGIC ("\241\002\213\015cyrus vanish")
+#define VANISHED_MAGIC_SIZE 16
+#define VANISHED_VERSION 1
+#define VANISHED_HEADER_SIZE 64
+#define VANISHED_RANGE_SIZE 16
+
+#define VANISHED_OFFSET_VERSION 16
+#define VANISHED_OFFSET_FLAGS 20
+#define VANISHED_OFFSET_UIDVALIDITY 24
+#define VANISHED_OFFSET_COUNT 28
+#define VANISHED_OFFSET_HIGHESTMODSEQ 32
+#define VANISHED_OFFSET_BASEMODSEQ 40
+#define VANISHED_OFFSET_CRC 60
+
+#define VANISHED_SIZE(count) \
+    (VANISHED_HEADER_SIZE + VANISHED_RANGE_SIZE*(size_t)(count))
+#define VANISHED_RANGE(base, n) \
+    ((base) + VANISHED_HEADER_SIZE + VANISHED_RANGE_SIZE*(size_t)(n))
+
+/* how many records between two expunged ones to look at, to see if
+ * they can share a range */
+#define VANISHED_MAXGAP 64
+
+struct vanished_range {
+    modseq_t modseq;
+    uint32_t first;
+    uint32_t last;
+};
+
+static void mailbox_vanished_close(struct mailbox *mailbox)
+{
+    if (mailbox->vanished_base)
+        map_free(&mailbox->vanished_base, &mailbox->vanished_len);
+    xclose(mailbox->vanished_fd);
+    mailbox->vanished_current = 0;
+    buf_free(&mailbox->vanished_pending);
+}
+
+static void vanished_read_range(const char *base, uint32_t n,
+                                struct vanished_range *range)
+{
+    const char *p = VANISHED_RANGE(base, n);
+
+    range->modseq = ntohll(*((bit64 *)p));
+    range->first = ntohl(*((bit32 *)(p+8)));
+    range->last = ntohl(*((bit32 *)(p+12)));
+}
+
+static void vanished_range_to_buf(const struct vanished_range *range,
+                                  struct buf *buf)
+{
+    bit64 modseq = htonll(range->modseq);
+    bit32 val;
+
+    buf_appendmap(buf, (const char *)&modseq, 8);
+    val = htonl(range->first);
+    buf_appendmap(buf, (const char *)&val, 4);
+    val = htonl(range->last);
+    buf_appendmap(buf, (const char *)&val, 4);
+}
+
+/* map the log and check it has seen every commit.  Called with the
+ * index locked and its header freshly read */
+static void mailbox_vanished_refresh(struct mailbox *mailbox)
+{
+    const char *base;
+    struct stat sbuf;
+    uint32_t count;
+
+    mailbox->vanished_current = 0;
+    buf_reset(&mailbox->vanished_pending);
+
+    if (mailbox->vanished_fd == -1) {
+        const char *fname = mailbox_meta_fname(mailbox, META_VANISHED);
+        if (mailbox->is_readonly)
+            mailbox->vanished_fd = open(fname, O_RDONLY, 0);
+        else
+            mailbox->vanished_fd = open(fname, O_RDWR|O_CREAT, 0666);
+        if (mailbox->vanished_fd == -1) return;
+    }
+
+    if (fstat(mailbox->vanished_fd, &sbuf) == -1) return;
+    if (sbuf.st_size < VANISHED_HEADER_SIZE) return;
+
+    map_refresh(mailbox->vanished_fd, 0, &mailbox->vanished_base,
+                &mailbox->vanished_len, sbuf.st_size,
+                "vanished", mailbox->name);
+    base = mailbox->vanished_base;
+
+    if (memcmp(base, VANISHED_MAGIC, VANISHED_MAGIC_SIZE))
+        return;
+    if (crc32_map(base, VANISHED_OFFSET_CRC) !=
+        ntohl(*((bit32 *)(base+VANISHED_OFFSET_CRC))))
+        return;
+    if (ntohl(*((bit32 *)(base+VANISHED_OFFSET_VERSION))) != VANISHED_VERSION)
+        return;
+
+    if (ntohl(*((bit32 *)(base+VANISHED_OFFSET_UIDVALIDITY))) !=
+        mailbox->i.uidvalidity)
+        return;
+    if (ntohll(*((bit64 *)(base+VANISHED_OFFSET_HIGHESTMODSEQ))) !=
+        mailbox->i.highestmodseq)
+        return;
+
+    count = ntohl(*((bit32 *)(base+VANISHED_OFFSET_COUNT)));
+    if (mailbox->vanished_len < VANISHED_SIZE(count)) return;
+
+    mailbox->vanished_count = count;
+    mailbox->vanished_basemodseq =
+        ntohll(*((bit64 *)(base+VANISHED_OFFSET_BASEMODSEQ)));
+    mailbox->vanished_current = 1;
+}
+
+static int mailbox_vanished_write_header(struct mailbox *mailbox,
+                                         uint32_t count,
+                                         modseq_t basemodseq)
+{
+    char buf[VANISHED_HEADER_SIZE];
+
+    memset(buf, 0, VANISHED_HEADER_SIZE);
+    memcpy(buf, VANISHED_MAGIC, VANISHED_MAGIC_SIZE);
+    *((bit32 *)(buf+VANISHED_OFFSET_VERSION)) = htonl(VANISHED_VERSION);
+    *((bit32 *)(buf+VANISHED_OFFSET_UIDVALIDITY)) = htonl(mailbox->i.uidvalidity);
+    *((bit32 *)(buf+VANISHED_OFFSET_COUNT)) = htonl(count);
+    *((bit64 *)(buf+VANISHED_OFFSET_HIGHESTMODSEQ)) = htonll(mailbox->i.highestmodseq);
+    *((bit64 *)(buf+VANISHED_OFFSET_BASEMODSEQ)) = htonll(basemodseq);
+    *((bit32 *)(buf+VANISHED_OFFSET_CRC)) = htonl(crc32_map(buf, VANISHED_OFFSET_CRC));
+
+    if (pwrite(mailbox->vanished_fd, buf, VANISHED_HEADER_SIZE, 0) != VANISHED_HEADER_SIZE) {
+        syslog(LOG_ERR, "IOERROR: writing vanished log header for %s: %m",
+               mailbox->name);
+        return IMAP_IOERROR;
+    }
+
+    return 0;
+}
+
+/* replace the whole log with 'ranges', safely */
+static int mailbox_vanished_write(struct mailbox *mailbox,
+                                  const struct buf *ranges,
+                                  modseq_t basemodseq)
+{
+    uint32_t count = ranges->len / VANISHED_RANGE_SIZE;
+    int r;
+
+    /* an empty log first, so a crash part way leaves nothing wrong */
+    r = mailbox_vanished_write_header(mailbox, 0, mailbox->i.highestmodseq);
+    if (r) return r;
+
+    if (ftruncate(mailbox->vanished_fd, VANISHED_SIZE(count)) == -1 ||
+        pwrite(mailbox->vanished_fd, ranges->s, ranges->len,
+               VANISHED_HEADER_SIZE) != (ssize_t)ranges->len) {
+        syslog(LOG_ERR, "IOERROR: writing vanished log for %s: %m",
+               mailbox->name);
+        return IMAP_IOERROR;
+    }
+
+    if (fdatasync(mailbox->vanished_fd) == -1) {
+        syslog(LOG_ERR, "IOERROR: syncing vanished log for %s: %m",
+               mailbox->name);
+        return IMAP_IOERROR;
+    }
+
+    return mailbox_vanished_write_header(mailbox, count, basemodseq);
+}
+
+/* can the expunged records 'prev' and 'recno' share a range?  Only if
+ * everything between them is expunged too */
+static int vanished_can_join(struct mailbox *mailbox,
+                             uint32_t prev, uint32_t recno)
+{
+    uint32_t i;
+
+    if (recno - prev > VANISHED_MAXGAP) return 0;
+
+    for (i = prev + 1; i < recno; i++) {
+        if (!(mailbox_record_getsystemflags(mailbox, i) & FLAG_EXPUNGED))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* start again from the expunged records still in the index: anything
+ * expunged since deletedmodseq is still there */
+static int mailbox_vanished_rebuild(struct mailbox *mailbox)
+{
+    struct modseqlog_entry *expunged = NULL;
+    struct vanished_range range;
+    struct index_record record;
+    struct buf buf = BUF_INITIALIZER;
+    uint32_t recno, n = 0, i;
+    int r = 0;
+
+    if (mailbox->vanished_fd == -1 || mailbox->is_readonly)
+        return IMAP_IOERROR;
+
+    if (mailbox->i.num_records)
+        expunged = xmalloc(mailbox->i.num_records * sizeof(struct modseqlog_entry));
+
+    for (recno = 1; recno <= mailbox->i.num_records; recno++) {
+        r = mailbox_read_index_flags(mailbox, recno, &record);
+        if (r) goto done;
+        if (!record.uid) continue;
+        if (!(record.system_flags & FLAG_EXPUNGED)) continue;
+        expunged[n].modseq = record.modseq;
+        expunged[n].recno = recno;
+        expunged[n].uid = record.uid;
+        n++;
+    }
+
+    qsort(expunged, n, sizeof(struct modseqlog_entry), modseqlog_entry_compar);
+
+    /* join runs expunged together */
+    for (i = 0; i < n; i++) {
+        range.modseq = expunged[i].modseq;
+        range.first = range.last = expunged[i].uid;
+        while (i + 1 < n && expunged[i+1].modseq == range.modseq &&
+               vanished_can_join(mailbox, expunged[i].recno,
+                                 expunged[i+1].recno)) {
+            range.last = expunged[++i].uid;
+        }
+        vanished_range_to_buf(&range, &buf);
+    }
+
+    r = mailbox_vanished_write(mailbox, &buf, mailbox->i.deletedmodseq);
+
+done:
+    free(expunged);
+    buf_free(&buf);
+
+    if (r) {
+        syslog(LOG_NOTICE, "failed to rebuild vanished log for %s: %s",
+               mailbox->name, error_message(r));
+        return r;
+    }
+
+    mailbox_vanished_refresh(mailbox);
+    return mailbox->vanished_current ? 0 : IMAP_IOERROR;
+}
+
+/* gather the UIDs being expunged by this commit into ranges, to log
+ * once the index header is safe.  The changes are in recno order */
+static void mailbox_vanished_stage(struct mailbox *mailbox)
+{
+    struct vanished_range range;
+    uint32_t i, prev = 0;
+
+    if (!mailbox->vanished_current) return;
+
+    memset(&range, 0, sizeof(range));
+
+    for (i = 0; i < mailbox->index_change_count; i++) {
+        const struct index_change *change = &mailbox->index_changes[i];
+        const struct index_record *record = &change->record;
+
+        if (!(record->system_flags & FLAG_EXPUNGED)) continue;
+        if (change->flags & CHANGE_WASEXPUNGED) continue;
+
+        if (range.first && vanished_can_join(mailbox, prev, record->recno)) {
+            range.last = record->uid;
+            if (record->modseq > range.modseq)
+                range.modseq = record->modseq;
+        }
+        else {
+            if (range.first)
+                buf_appendmap(&mailbox->vanished_pending,
+                              (const char *)&range, sizeof(range));
+            range.modseq = record->modseq;
+            range.first = range.last = record->uid;
+        }
+        prev = record->recno;
+    }
+
+    if (range.first)
+        buf_appendmap(&mailbox->vanished_pending,
+                      (const char *)&range, sizeof(range));
 }
 
-/* qsort function for changes */
-static int change_compar(const void *a, const void *b)
+/* called once the index header has been written: log the expunges
+ * and catch up with the new highestmodseq.  Any failure just leaves
+ * the log out of date, to be started again by the next exclusive lock */
+static void mailbox_vanished_commit(struct mailbox *mailbox)
 {
-    struct index_change *ac = (struct index_change *)a;
-    struct index_change *bc = (struct index_change *)b;
+    const struct vanished_range *changes;
+    struct buf buf = BUF_INITIALIZER;
+    uint32_t count = mailbox->vanished_count;
+    uint32_t limit = config_getint(IMAPOPT_MAILBOX_VANISHED_LOG);
+    modseq_t basemodseq = mailbox->vanished_basemodseq;
+    modseq_t lastmodseq = 0;
+    struct vanished_range range;
+    size_t nchanges, i;
+    int r = 0;
 
-    if (ac->record.recno > bc->record.recno)
-        return 1;
-    if (ac->record.recno < bc->record.recno)
-        return -1;
-    return 0;
-}
+    if (!mailbox->vanished_current) return;
 
-static int _commit_changes(struct mailbox *mailbox)
-{
-    uint32_t i;
-    int r;
+    changes = (const struct vanished_range *) mailbox->vanished_pending.s;
+    nchanges = mailbox->vanished_pending.len / sizeof(struct vanished_range);
 
-    if (!mailbox->index_change_count) return 0;
-    mailbox->i.dirty = 1;
+    if (count) {
+        vanished_read_range(mailbox->vanished_base, count-1, &range);
+        lastmodseq = range.modseq;
+    }
 
-    /* in which we throw away all our next pointers, but we don't care any more.
-     * we just want to write in sensible order.  Otherwise, there's no need to
-     * do this sort at all */
-    qsort(mailbox->index_changes, mailbox->index_change_count,
-          sizeof(struct index_change), change_compar);
+    /* too long?  Keep the newest half */
+    if (nchanges && count + nchanges > limit) {
+        uint32_t keep = limit / 2;
+        uint32_t drop = count > keep ? count - keep : 0;
 
-    for (i = 1; i <= mailbox->index_change_count; i++) {
-        r = _commit_one(mailbox, &mailbox->index_changes[i-1]);
-        if (r) return r; /* DAMN, we're screwed */
+        if (drop) {
+            vanished_read_range(mailbox->vanished_base, drop-1, &range);
+            basemodseq = range.modseq;
+        }
+        for (i = drop; i < count; i++) {
+            vanished_read_range(mailbox->vanished_base, i, &range);
+            vanished_range_to_buf(&range, &buf);
+        }
     }
 
-    _cleanup_changes(mailbox);
+    /* keep the log in modseq order.  Replicas can set older modseqs;
+     * it's fine to claim those went later than they did */
+    for (i = 0; i < nchanges; i++) {
+        range = changes[i];
+        if (range.modseq < lastmodseq)
+            range.modseq = lastmodseq;
+        lastmodseq = range.modseq;
+        vanished_range_to_buf(&range, &buf);
+    }
 
-    /* recalculate the size */
-    mailbox->index_size = mailbox->i.start_offset + (mailbox->i.num_records * mailbox->i.record_size);
+    if (nchanges && count + nchanges > limit) {
+        r = mailbox_vanished_write(mailbox, &buf, basemodseq);
+        count = buf.len / VANISHED_RANGE_SIZE;
+    }
+    else if (nchanges) {
+        if (pwrite(mailbox->vanished_fd, buf.s, buf.len,
+                   VANISHED_SIZE(count)) != (ssize_t)buf.len) {
+            syslog(LOG_ERR, "IOERROR: writing vanished log for %s: %m",
+                   mailbox->name);
+            r = IMAP_IOERROR;
+        }
+        else if (fdatasync(mailbox->vanished_fd) == -1) {
+            syslog(LOG_ERR, "IOERROR: syncing vanished log for %s: %m",
+                   mailbox->name);
+            r = IMAP_IOERROR;
+        }
+        count += nchanges;
+        if (!r) r = mailbox_vanished_write_header(mailbox, count, basemodseq);
+    }
+    else {
+        /* nothing expunged, but we've seen this commit */
+        r = mailbox_vanished_write_header(mailbox, count, basemodseq);
+    }
 
-    r = mailbox_refresh_index_map(mailbox);
-    if (r) return r;
+    buf_free(&buf);
+    buf_reset(&mailbox->vanished_pending);
+
+    if (r) {
+        mailbox->vanished_current = 0;
+        return;
+    }
+
+    mailbox->vanished_count = count;
+    mailbox->vanished_basemodseq = basemodseq;
+
+    /* always refresh, we may be using map_nommap */
+    map_refresh(mailbox->vanished_fd, 0, &mailbox->vanished_base,
+                &mailbox->vanished_len, VANISHED_SIZE(count),
+                "vanished", mailbox->name);
+}
+
+static int vanished_first_compar(const void *a, const void *b)
+{
+    const struct vanished_range *ar = (const struct vanished_range *)a;
+    const struct vanished_range *br = (const struct vanished_range *)b;
 
+    if (ar->first < br->first) return -1;
+    if (ar->first > br->first) return 1;
     return 0;
 }
 
 /*
- * Read an index record from a mailbox
+ * Add to 'outlist' the UIDs expunged after modseq 'since' (and maybe
+ * some which were expunged earlier or never used), limited to those in
+ * 'seq' if it's not NULL.  Returns IMAP_NOTFOUND if cyrus.vanished
+ * doesn't go back that far.
  */
-static int mailbox_read_index_record(struct mailbox *mailbox,
-                                     uint32_t recno,
-                                     struct index_record *record)
-{
-    const char *buf;
-    unsigned offset;
-    int r;
-    struct index_change *change = _find_change(mailbox, recno);
-
-    if (change) {
-        *record = change->record;
-        return 0;
+EXPORTED int mailbox_vanished_since(struct mailbox *mailbox, modseq_t since,
+                                    struct seqset *seq, struct seqset *outlist)
+{
+    const char *base = mailbox->vanished_base;
+    uint32_t count = mailbox->vanished_count;
+    uint32_t low = 0, high = count;
+    struct vanished_range *ranges;
+    uint32_t i, n = 0;
+    uint32_t uid, prevuid = 0;
+
+    /* the log doesn't see uncommitted changes */
+    if (!mailbox->vanished_current) return IMAP_NOTFOUND;
+    if (mailbox->index_change_count || mailbox->i.dirty) return IMAP_NOTFOUND;
+    if (since < mailbox->vanished_basemodseq) return IMAP_NOTFOUND;
+
+    /* first range after 'since' */
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (ntohll(*((bit64 *)VANISHED_RANGE(base, mid))) <= since)
+            low = mid + 1;
+        else
+            high = mid;
     }
 
-    offset = mailbox->i.start_offset + (recno-1) * mailbox->i.record_size;
-
-    if (offset + mailbox->i.record_size > mailbox->index_size) {
-        syslog(LOG_ERR,
-               "IOERROR: index record %u for %s past end of file",
-               recno, mailbox->name);
-        return IMAP_IOERROR;
-    }
+    if (low == count) return 0;
 
-    buf = mailbox->index_base + offset;
+    ranges = xmalloc((count - low) * sizeof(struct vanished_range));
+    for (i = low; i < count; i++)
+        vanished_read_range(base, i, &ranges[n++]);
 
-    r = mailbox_buf_to_index_record(buf, mailbox->i.minor_version, record);
+    /* seqsets have to be built in order */
+    qsort(ranges, n, sizeof(struct vanished_range), vanished_first_compar);
 
-    if (!r) record->recno = recno;
+    for (i = 0; i < n; i++) {
+        uid = ranges[i].first > prevuid ? ranges[i].first : prevuid + 1;
+        for (; uid <= ranges[i].last; uid++) {
+            if (!seq || seqset_ismember(seq, uid))
+                seqset_add(outlist, uid, 1);
+            prevuid = uid;
+        }
+    }
 
-    return r;
+    free(ranges);
+    return 0;
 }
 
 EXPORTED int mailbox_has_conversations(struct mailbox *mailbox)
@@ -1974,16 +4277,6 @@ EXPORTED struct webdav_db *mailbox_open_webdav(struct mailbox *mailbox)
 }
 #endif
 
-static uint32_t mailbox_getuid(struct mailbox *mailbox, uint32_t recno)
-{
-    struct index_record record;
-    record.uid = 0;
-    /* XXX - cheaper memory-access reads? */
-    mailbox_read_index_record(mailbox, recno, &record);
-    return record.uid;
-}
-
-
 /*
  * Returns the recno of the message with UID 'uid'.
  * If no message with UID 'uid', returns the message with
@@ -1998,7 +4291,7 @@ static uint32_t mailbox_finduid(struct mailbox *mailbox, uint32_t uid)
 
     while (low <= high) {
         mid = (high - low)/2 + low;
-        miduid = mailbox_getuid(mailbox, mid);
+        miduid = mailbox_record_getuid(mailbox, mid);
         if (miduid == uid)
             return mid;
         else if (miduid > uid)
@@ -2052,6 +4345,9 @@ static int mailbox_lock_index_internal(struct mailbox *mailbox, int locktype)
         /* handle read-only case cleanly - we need to re-open read-write first! */
         if (mailbox->is_readonly) {
             mailbox->is_readonly = 0;
+            mailbox_columns_close(mailbox);
+            mailbox_modseqlog_close(mailbox);
+            mailbox_vanished_close(mailbox);
             r = mailbox_open_index(mailbox);
         }
         if (!r) r = lock_blocking(mailbox->index_fd, index_fname);
@@ -2122,6 +4418,24 @@ static int mailbox_lock_index_internal(struct mailbox *mailbox, int locktype)
                (unsigned int)mailbox->i.header_file_crc);
     }
 
+    if (config_getswitch(IMAPOPT_MAILBOX_COLUMNS)) {
+        mailbox_columns_refresh(mailbox);
+        if (!mailbox->columns_current && locktype == LOCK_EXCLUSIVE)
+            mailbox_columns_rebuild(mailbox);
+    }
+
+    if (config_getswitch(IMAPOPT_MAILBOX_MODSEQ_LOG)) {
+        mailbox_modseqlog_refresh(mailbox);
+        if (!mailbox->modseqlog_current && locktype == LOCK_EXCLUSIVE)
+            mailbox_modseqlog_rebuild(mailbox);
+    }
+
+    if (config_getint(IMAPOPT_MAILBOX_VANISHED_LOG) > 0) {
+        mailbox_vanished_refresh(mailbox);
+        if (!mailbox->vanished_current && locktype == LOCK_EXCLUSIVE)
+            mailbox_vanished_rebuild(mailbox);
+    }
+
     return 0;
 }
 
@@ -2445,6 +4759,7 @@ EXPORTED int mailbox_abort(struct mailbox *mailbox)
 
     /* removed cached changes */
     _cleanup_changes(mailbox);
+    buf_reset(&mailbox->columns_pending);
 
     /* we re-read the header and index header to wipe
      * away all the changed values */
@@ -2506,6 +4821,16 @@ EXPORTED int mailbox_commit(struct mailbox *mailbox)
         return IMAP_IOERROR;
     }
 
+    mailbox_columns_commit(mailbox);
+    mailbox_modseqlog_commit(mailbox);
+    mailbox_vanished_commit(mailbox);
+
+    /* publish the new header to other processes */
+    if (mailbox->i.options & OPT_MAILBOX_DELETED)
+        headercache_invalidate(mailbox->name);
+    else
+        headercache_store(mailbox->name, buf, mailbox->i.start_offset);
+
     if (config_auditlog && mailbox->modseq_dirty)
         syslog(LOG_NOTICE, "auditlog: modseq sessionid=<%s> "
                "mailbox=<%s> uniqueid=<%s> highestmodseq=<" MODSEQ_FMT ">",
@@ -3695,12 +6020,25 @@ static int mailbox_repack_setup(struct mailbox *mailbox, int version,
 
     /* new files */
     fname = mailbox_meta_newfname(mailbox, META_INDEX);
-    repack->newindex_fd = open(fname, O_RDWR|O_TRUNC|O_CREAT, 0666);
+    repack->newindex_fd = open(fname, O_RDWR|O_CREAT, 0666);
     if (repack->newindex_fd == -1) {
         syslog(LOG_ERR, "IOERROR: failed to create %s: %m", fname);
         goto fail;
     }
 
+    /* an incremental repack may be copying into it already */
+    if (lock_nonblocking(repack->newindex_fd, fname)) {
+        syslog(LOG_NOTICE, "%s: repack already in progress", mailbox->name);
+        xclose(repack->newindex_fd);
+        free(repack);
+        return IMAP_MAILBOX_LOCKED;
+    }
+
+    if (ftruncate(repack->newindex_fd, 0) == -1) {
+        syslog(LOG_ERR, "IOERROR: failed to truncate %s: %m", fname);
+        goto fail;
+    }
+
     /* update the generation number */
     repack->i.generation_no++;
 
@@ -3863,6 +6201,10 @@ static void mailbox_repack_abort(struct mailbox_repack **repackptr)
     }
     ptrarray_fini(&repack->caches);
 
+    buf_free(&repack->cachedict);
+    free(repack->src_newrecno);
+    free(repack->src_crc);
+    bv_free(&repack->src_cleanup);
     free(repack->userid);
     free(repack);
     *repackptr = NULL;
@@ -3931,6 +6273,8 @@ HIDDEN int mailbox_repack_commit(struct mailbox_repack **repackptr)
     r = mailbox_meta_rename(repack->mailbox, META_INDEX);
     if (r) goto fail;
 
+    headercache_store(repack->mailbox->name, buf, repack->i.start_offset);
+
     /* which cache files might currently exist? */
     strarray_add(&cachefiles, mailbox_meta_fname(repack->mailbox, META_CACHE));
     strarray_add(&cachefiles, mailbox_meta_fname(repack->mailbox, META_ARCHIVECACHE));
@@ -3958,6 +6302,10 @@ HIDDEN int mailbox_repack_commit(struct mailbox_repack **repackptr)
     strarray_fini(&cachefiles);
 
     seqset_free(repack->seqset);
+    buf_free(&repack->cachedict);
+    free(repack->src_newrecno);
+    free(repack->src_crc);
+    bv_free(&repack->src_cleanup);
     free(repack->userid);
     free(repack);
     *repackptr = NULL;
@@ -3982,6 +6330,9 @@ static int mailbox_index_repack(struct mailbox *mailbox, int version)
     r = mailbox_repack_setup(mailbox, version, &repack);
     if (r) goto done;
 
+    if (config_getswitch(IMAPOPT_MAILBOX_CACHE_COMPRESS))
+        cache_traindict(mailbox, &repack->cachedict);
+
     iter = mailbox_iter_init(mailbox, 0, 0);
     while ((record = mailbox_iter_step(iter))) {
         struct index_record copyrecord = *record;
@@ -4032,6 +6383,15 @@ static int mailbox_index_repack(struct mailbox *mailbox, int version)
         r = mailbox_cacherecord(mailbox, &copyrecord);
         if (r) goto done;
 
+        /* version 5 only changed the layout, so there's no need to
+         * parse the message again.  Older index versions predate it */
+        if (repack->i.minor_version < MAILBOX_MINOR_VERSION) {
+            if (copyrecord.cache_version >= 5)
+                cache_rewriterecord(&copyrecord, 4);
+        }
+        else if (copyrecord.cache_version == 4)
+            cache_rewriterecord(&copyrecord, MAILBOX_CACHE_MINOR_VERSION);
+
         r = mailbox_repack_add(repack, &copyrecord);
         if (r) goto done;
     }
@@ -4046,6 +6406,279 @@ done:
     return r;
 }
 
+/*
+ * Incremental repack (mailbox_repack_batch).  mailbox_repack_prepare()
+ * copies records into the new index and cache files in batches, taking
+ * only a shared index lock for each batch, so other processes can carry
+ * on using the mailbox meanwhile.  Nobody can rewrite the index while
+ * we hold our name lock, so source recnos stay put.
+ *
+ * mailbox_repack_finish() runs with the exclusive locks: it rewrites
+ * any copied record whose CRC has changed since (flag changes, expunges,
+ * silent rewrites), copies whatever was appended, does the file cleanup
+ * which needs the exclusive lock, then swaps the new files in just like
+ * mailbox_index_repack().
+ */
+static uint32_t mailbox_record_getcrc(struct mailbox *mailbox, uint32_t recno)
+{
+    const char *buf = mailbox_index_record_base(mailbox, recno);
+
+    if (!buf) return 0;
+    return ntohl(*((bit32 *)(buf+OFFSET_RECORD_CRC)));
+}
+
+static int repack_copy_records(struct mailbox_repack *repack,
+                               uint32_t limit, int final)
+{
+    struct mailbox *mailbox = repack->mailbox;
+    uint32_t end = mailbox->i.num_records;
+    uint32_t recno;
+    int r;
+
+    if (limit && end > repack->src_done + limit)
+        end = repack->src_done + limit;
+
+    if (end >= repack->src_alloc) {
+        repack->src_alloc = end + 1024;
+        repack->src_newrecno = xrealloc(repack->src_newrecno,
+                                        repack->src_alloc * sizeof(uint32_t));
+        repack->src_crc = xrealloc(repack->src_crc,
+                                   repack->src_alloc * sizeof(uint32_t));
+    }
+
+    for (recno = repack->src_done + 1; recno <= end; recno++) {
+        struct index_record record;
+
+        repack->src_newrecno[recno] = 0;
+        repack->src_crc[recno] = mailbox_record_getcrc(mailbox, recno);
+        repack->src_done = recno;
+
+        /* same records as mailbox_iter_step() would give */
+        if (mailbox_read_index_record(mailbox, recno, &record))
+            continue;
+        if (!record.uid)
+            continue;
+
+        if (record.system_flags & (FLAG_NEEDS_CLEANUP | FLAG_UNLINKED)) {
+            if (final) {
+                mailbox_record_cleanup(mailbox, &record);
+                record.system_flags &= ~FLAG_NEEDS_CLEANUP;
+            }
+            else bv_set(&repack->src_cleanup, recno);
+        }
+
+        if (record.system_flags & FLAG_UNLINKED) {
+            if (record.modseq > repack->i.deletedmodseq)
+                repack->i.deletedmodseq = record.modseq;
+            continue;
+        }
+
+        r = mailbox_cacherecord(mailbox, &record);
+        if (r) return r;
+
+        if (record.cache_version == 4)
+            cache_rewriterecord(&record, MAILBOX_CACHE_MINOR_VERSION);
+
+        r = mailbox_repack_add(repack, &record);
+        if (r) return r;
+
+        repack->src_newrecno[recno] = repack->i.num_records;
+    }
+
+    return 0;
+}
+
+/* replace a record already copied into the new index.  With 'keepcache'
+ * the record keeps the cache record copied with it */
+static int mailbox_repack_replace(struct mailbox_repack *repack,
+                                  uint32_t newrecno,
+                                  struct index_record *record,
+                                  int keepcache)
+{
+    struct mappedfile *cachefile;
+    struct index_record old;
+    indexbuffer_t ibuf;
+    unsigned char *buf = ibuf.buf;
+    off_t offset = repack->i.start_offset +
+                   (off_t)(newrecno-1) * repack->i.record_size;
+    int r;
+
+    /* take the copy we made out of the counts */
+    if (pread(repack->newindex_fd, buf, repack->i.record_size, offset)
+        != (ssize_t)repack->i.record_size)
+        return IMAP_IOERROR;
+    r = mailbox_buf_to_index_record((const char *)buf,
+                                    repack->i.minor_version, &old);
+    if (r) return r;
+    header_update_counts(&repack->i, &old, 0);
+
+    if (keepcache) {
+        record->system_flags &= ~FLAG_ARCHIVED;
+        record->system_flags |= (old.system_flags & FLAG_ARCHIVED);
+        record->cache_offset = old.cache_offset;
+        record->cache_version = old.cache_version;
+        record->cache_crc = old.cache_crc;
+    }
+    else {
+        /* the record may have moved between spool and archive, so the
+         * cache record goes again to whichever file it belongs in now */
+        cachefile = repack_cachefile(repack, record);
+        if (!cachefile) return IMAP_IOERROR;
+        record->cache_offset = 0;
+        r = cache_append_record(cachefile, record);
+        if (r) return r;
+        repack->i.leaked_cache_records++;
+    }
+
+    header_update_counts(&repack->i, record, 1);
+
+    mailbox_index_record_to_buf(record, repack->i.minor_version, buf);
+    if (pwrite(repack->newindex_fd, buf, repack->i.record_size, offset)
+        != (ssize_t)repack->i.record_size)
+        return IMAP_IOERROR;
+
+    return 0;
+}
+
+/* called with the mailbox open but unlocked: returns with *repackptr
+ * set if there's something for mailbox_repack_finish() to do */
+static void mailbox_repack_prepare(struct mailbox *mailbox,
+                                   struct mailbox_repack **repackptr)
+{
+    struct mailbox_repack *repack = NULL;
+    uint32_t batch = config_getint(IMAPOPT_MAILBOX_REPACK_BATCH);
+    int done = 0;
+    int r;
+
+    r = mailbox_lock_index(mailbox, LOCK_SHARED);
+    if (r) return;
+
+    /* we need record CRCs to spot changes */
+    if (mailbox->i.minor_version != MAILBOX_MINOR_VERSION) {
+        mailbox_unlock_index(mailbox, NULL);
+        return;
+    }
+
+    r = mailbox_repack_setup(mailbox, mailbox->i.minor_version, &repack);
+    if (!r) {
+        repack->src_generation = mailbox->i.generation_no;
+        if (config_getswitch(IMAPOPT_MAILBOX_CACHE_COMPRESS))
+            cache_traindict(mailbox, &repack->cachedict);
+    }
+    mailbox_unlock_index(mailbox, NULL);
+
+    while (!r && !done) {
+        r = mailbox_lock_index(mailbox, LOCK_SHARED);
+        if (r) break;
+
+        r = repack_copy_records(repack, batch, /*final*/0);
+        done = (repack->src_done >= mailbox->i.num_records);
+
+        mailbox_unlock_index(mailbox, NULL);
+    }
+
+    if (r) {
+        syslog(LOG_NOTICE, "%s: incremental repack failed: %s",
+               mailbox->name, error_message(r));
+        mailbox_repack_abort(&repack);
+        return;
+    }
+
+    *repackptr = repack;
+}
+
+/* called with the name lock and index lock held exclusively */
+static int mailbox_repack_finish(struct mailbox_repack **repackptr)
+{
+    struct mailbox_repack *repack = *repackptr;
+    struct mailbox *mailbox = repack->mailbox;
+    struct index_header newi;
+    uint32_t recno;
+    int keptunlinked = 0;
+    int r = 0;
+
+    /* somebody else got there while we didn't hold the name lock */
+    if (mailbox->i.generation_no != repack->src_generation) {
+        mailbox_repack_abort(repackptr);
+        return IMAP_AGAIN;
+    }
+
+    for (recno = 1; recno <= repack->src_done; recno++) {
+        struct index_record record;
+
+        if (mailbox_record_getcrc(mailbox, recno) == repack->src_crc[recno] &&
+            !bv_isset(&repack->src_cleanup, recno))
+            continue;
+
+        if (mailbox_read_index_record(mailbox, recno, &record))
+            continue;
+
+        if (record.system_flags & (FLAG_NEEDS_CLEANUP | FLAG_UNLINKED)) {
+            mailbox_record_cleanup(mailbox, &record);
+            record.system_flags &= ~FLAG_NEEDS_CLEANUP;
+        }
+
+        /* dropped already */
+        if (!repack->src_newrecno[recno])
+            continue;
+
+        /* unlinked since we copied it: keep it in place with the cache
+         * record we copied, the message file is gone.  The next repack
+         * will drop it */
+        if (record.system_flags & FLAG_UNLINKED) {
+            if (record.modseq > repack->i.deletedmodseq)
+                repack->i.deletedmodseq = record.modseq;
+            keptunlinked = 1;
+            r = mailbox_repack_replace(repack, repack->src_newrecno[recno],
+                                       &record, /*keepcache*/1);
+            if (r) goto done;
+            continue;
+        }
+
+        r = mailbox_cacherecord(mailbox, &record);
+        if (r) goto done;
+
+        if (record.cache_version == 4)
+            cache_rewriterecord(&record, MAILBOX_CACHE_MINOR_VERSION);
+
+        r = mailbox_repack_replace(repack, repack->src_newrecno[recno],
+                                   &record, /*keepcache*/0);
+        if (r) goto done;
+    }
+
+    /* and anything appended since */
+    r = repack_copy_records(repack, 0, /*final*/1);
+    if (r) goto done;
+
+    /* everything but what we counted comes from the current header */
+    newi = mailbox->i;
+    newi.generation_no = repack->i.generation_no;
+    newi.num_records = repack->i.num_records;
+    newi.quota_mailbox_used = repack->i.quota_mailbox_used;
+    newi.answered = repack->i.answered;
+    newi.deleted = repack->i.deleted;
+    newi.flagged = repack->i.flagged;
+    newi.exists = repack->i.exists;
+    newi.first_expunged = 0;
+    newi.leaked_cache_records = repack->i.leaked_cache_records;
+    if (repack->i.deletedmodseq > newi.deletedmodseq)
+        newi.deletedmodseq = repack->i.deletedmodseq;
+    newi.options &= ~OPT_MAILBOX_NEEDS_UNLINK;
+    if (!keptunlinked)
+        newi.options &= ~OPT_MAILBOX_NEEDS_REPACK;
+    repack->i = newi;
+
+done:
+    if (r) {
+        syslog(LOG_ERR, "IOERROR: incremental repack of %s failed: %s",
+               mailbox->name, error_message(r));
+        mailbox_repack_abort(repackptr);
+        return r;
+    }
+
+    return mailbox_repack_commit(repackptr);
+}
+
 /*
  * Used by mailbox_rename() to expunge all messages in INBOX
  */
@@ -4906,6 +7539,11 @@ static struct meta_file meta_files[] = {
     { META_SQUAT,        1, 0 },
     { META_ANNOTATIONS,  1, 1 },
     { META_ARCHIVECACHE, 1, 1 },
+    { META_COLUMNS,      1, 1 },
+    { META_MODSEQLOG,    1, 1 },
+    { META_VANISHED,     1, 1 },
+    { META_SORT,         1, 1 },
+    { META_THREAD,       1, 1 },
     { 0, 0, 0 }
 };
 
@@ -5717,7 +8355,7 @@ static int mailbox_reconstruct_compare_update(struct mailbox *mailbox,
 
     /* does the file actually exist? */
     if (have_file && do_stat) {
-        if (stat(fname, &sbuf) == -1 || (sbuf.st_size == 0)) {
+        if (mailbox_stat_file(fname, &sbuf) == -1 || (sbuf.st_size == 0)) {
             have_file = 0;
         }
         else if (record->size != (unsigned) sbuf.st_size) {
@@ -6457,6 +9095,14 @@ EXPORTED struct mailbox_iter *mailbox_iter_init(struct mailbox *mailbox,
     if (flags & ITER_SKIP_DELETED)
         iter->skipflags |= FLAG_DELETED;
 
+    iter->columns = (flags & ITER_COLUMNS) ? 1 : 0;
+
+    /* only visit the records which have changed, if we know which */
+    if (changedsince &&
+        mailbox_changed_recnos(mailbox, changedsince + 1, 0,
+                               &iter->recnos, &iter->nrecnos))
+        iter->recnos = NULL;
+
     return iter;
 }
 
@@ -6464,17 +9110,50 @@ EXPORTED void mailbox_iter_startuid(struct mailbox_iter *iter, uint32_t uid)
 {
     struct mailbox *mailbox = iter->mailbox;
     iter->recno = uid ? mailbox_finduid(mailbox, uid-1) : 0;
+    iter->pos = 0;
+}
+
+/* read the record at iter->recno, if it passes the filters */
+static int mailbox_iter_read(struct mailbox_iter *iter)
+{
+    struct mailbox *mailbox = iter->mailbox;
+    int r;
+
+    /* the columns don't see uncommitted changes */
+    if (iter->columns && mailbox->columns_current &&
+        !mailbox->index_change_count && !mailbox->i.dirty &&
+        iter->recno <= mailbox->columns_alloc) {
+        mailbox_columns_read_record(mailbox, iter->recno, &iter->record);
+    }
+    else if (iter->columns) {
+        r = mailbox_read_index_flags(mailbox, iter->recno, &iter->record);
+        if (r) return 0;
+    }
+    else {
+        r = mailbox_read_index_record(mailbox, iter->recno, &iter->record);
+        if (r) return 0;
+    }
+    if (!iter->record.uid) return 0; /* can happen on damaged mailboxes */
+    if ((iter->record.system_flags & iter->skipflags)) return 0;
+    if (iter->record.modseq <= iter->changedsince) return 0;
+    return 1;
 }
 
 EXPORTED const struct index_record *mailbox_iter_step(struct mailbox_iter *iter)
 {
+    if (iter->recnos) {
+        while (iter->pos < iter->nrecnos) {
+            uint32_t recno = iter->recnos[iter->pos++];
+            /* skip anything before mailbox_iter_startuid */
+            if (recno <= iter->recno) continue;
+            iter->recno = recno;
+            if (mailbox_iter_read(iter)) return &iter->record;
+        }
+        return NULL;
+    }
+
     for (iter->recno++; iter->recno <= iter->num_records; iter->recno++) {
-        int r = mailbox_read_index_record(iter->mailbox, iter->recno, &iter->record);
-        if (r) continue;
-        if (!iter->record.uid) continue; /* can happen on damaged mailboxes */
-        if ((iter->record.system_flags & iter->skipflags)) continue;
-        if (iter->record.modseq <= iter->changedsince) continue;
-        return &iter->record;
+        if (mailbox_iter_read(iter)) return &iter->record;
     }
 
     /* guess we're done */
@@ -6485,6 +9164,7 @@ EXPORTED void mailbox_iter_done(struct mailbox_iter **iterp)
 {
     struct mailbox_iter *iter = *iterp;
     if (!iter) return;
+    free(iter->recnos);
     free(iter);
     *iterp = NULL;
 }
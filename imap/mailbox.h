@@ -43,6 +43,7 @@
 #ifndef INCLUDED_MAILBOX_H
 #define INCLUDED_MAILBOX_H
 
+#include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <limits.h>
@@ -50,6 +51,7 @@
 
 #include "byteorder64.h"
 #include "conversations.h"
+#include "hash.h"
 #include "message_guid.h"
 #include "ptrarray.h"
 #include "quota.h"
@@ -75,7 +77,7 @@
  * changed to be able to convert both backwards and forwards between the
  * new version and all supported previous versions */
 #define MAILBOX_MINOR_VERSION   13
-#define MAILBOX_CACHE_MINOR_VERSION 4
+#define MAILBOX_CACHE_MINOR_VERSION 5
 
 #define FNAME_HEADER "/cyrus.header"
 #define FNAME_INDEX "/cyrus.index"
@@ -86,6 +88,11 @@
 #define FNAME_DAV "/cyrus.dav"
 #endif
 #define FNAME_ANNOTATIONS "/cyrus.annotations"
+#define FNAME_COLUMNS "/cyrus.columns"
+#define FNAME_MODSEQLOG "/cyrus.modseq"
+#define FNAME_VANISHED "/cyrus.vanished"
+#define FNAME_SORT "/cyrus.sort"
+#define FNAME_THREAD "/cyrus.thread"
 
 enum meta_filename {
   META_HEADER = 1,
@@ -97,7 +104,12 @@ enum meta_filename {
 #ifdef WITH_DAV
   META_DAV,
 #endif
-  META_ARCHIVECACHE
+  META_ARCHIVECACHE,
+  META_COLUMNS,
+  META_MODSEQLOG,
+  META_VANISHED,
+  META_SORT,
+  META_THREAD
 };
 
 #define MAILBOX_FNAME_LEN 256
@@ -222,6 +234,7 @@ struct mailbox {
     int header_fd;
 
     ptrarray_t caches;
+    hash_table inflated; /* compressed cache records, inflated */
     const char *index_base;
     size_t index_len;   /* mapped size */
 
@@ -275,11 +288,40 @@ struct mailbox {
     struct index_change *index_changes;
     uint32_t index_change_alloc;
     uint32_t index_change_count;
+
+    /* packed copy of the mutable record fields, see mailbox_columns_* */
+    int columns_fd;
+    const char *columns_base;
+    size_t columns_len;
+    uint32_t columns_alloc;
+    int columns_current;        /* matches the index header */
+    struct buf columns_pending; /* changes to write at commit */
+
+    /* records changed by each commit, see mailbox_modseqlog_* */
+    int modseqlog_fd;
+    const char *modseqlog_base;
+    size_t modseqlog_len;
+    uint32_t modseqlog_count;
+    modseq_t modseqlog_basemodseq; /* highestmodseq when last rebuilt */
+    int modseqlog_current;        /* matches the index header */
+    struct buf modseqlog_pending; /* changes to write at commit */
+
+    /* UIDs expunged by modseq, see mailbox_vanished_* */
+    int vanished_fd;
+    const char *vanished_base;
+    size_t vanished_len;
+    uint32_t vanished_count;
+    modseq_t vanished_basemodseq; /* every expunge since is logged */
+    int vanished_current;         /* has seen every commit */
+    struct buf vanished_pending;  /* expunges to write at commit */
 };
 
 #define ITER_SKIP_UNLINKED (1<<0)
 #define ITER_SKIP_EXPUNGED (1<<1)
 #define ITER_SKIP_DELETED (1<<2)
+/* caller only needs uid, recno, flags, modseq and cache_offset: read
+ * them from cyrus.columns, or else with mailbox_read_index_flags() */
+#define ITER_COLUMNS (1<<3)
 
 struct mailbox_iter {
     struct mailbox *mailbox;
@@ -288,6 +330,11 @@ struct mailbox_iter {
     uint32_t recno;
     uint32_t num_records;
     unsigned skipflags;
+    int columns;
+    /* records to visit, from cyrus.modseq; NULL to visit them all */
+    uint32_t *recnos;
+    uint32_t nrecnos;
+    uint32_t pos;
 };
 
 /* Offsets of index/expunge header fields
@@ -435,6 +482,12 @@ typedef union {
 /* Size of a bit32 to skip when jumping over cache item sizes */
 #define CACHE_ITEM_SIZE_SKIP sizeof(bit32)
 
+/* From cache version 5, each record starts with a table giving its total
+ * length and the offset (from the start of the record, of the item data)
+ * and length of every item, so a single item can be found without walking
+ * the ones before it.  The items follow, in the same format as before. */
+#define CACHE_TABLE_SIZE (4 + 8*NUM_CACHE_FIELDS)
+
 /* Cache item positions */
 enum {
     CACHE_ENVELOPE = 0,
@@ -491,6 +544,13 @@ extern unsigned mailbox_should_archive(struct mailbox *mailbox,
 
 /* map individual messages in */
 extern int mailbox_map_record(struct mailbox *mailbox, const struct index_record *record, struct buf *buf);
+extern int mailbox_map_file(const char *fname, const char *mboxname,
+                            struct buf *buf);
+extern int mailbox_file_compressed(int fd, size_t *rawlenp);
+extern int mailbox_stat_file(const char *fname, struct stat *sbuf);
+extern FILE *mailbox_fopen_file(const char *fname);
+extern int mailbox_partition_compressed(const char *part);
+extern int mailbox_compress_file(const char *from, const char *to);
 
 /* cache record API */
 int mailbox_cacherecord(struct mailbox *mailbox,
@@ -503,6 +563,8 @@ char *mailbox_cache_get_env(struct mailbox *mailbox,
 const char *cacheitem_base(const struct index_record *record, int field);
 unsigned cacheitem_size(const struct index_record *record, int field);
 struct buf *cacheitem_buf(const struct index_record *record, int field);
+void cache_buildrecord(struct buf *buf, struct cacherecord *crec,
+                       const struct buf items[NUM_CACHE_FIELDS]);
 
 /* opening and closing */
 extern int mailbox_open_iwl(const char *name,
@@ -521,6 +583,8 @@ struct webdav_db *mailbox_open_webdav(struct mailbox *mailbox);
 
 /* reading bits and pieces */
 extern int mailbox_refresh_index_header(struct mailbox *mailbox);
+extern int mailbox_read_cached_header(const char *name,
+                                      struct index_header *i);
 extern int mailbox_write_header(struct mailbox *mailbox, int force);
 extern void mailbox_index_dirty(struct mailbox *mailbox);
 extern modseq_t mailbox_modseq_dirty(struct mailbox *mailbox);
@@ -532,6 +596,22 @@ extern int mailbox_append_index_record(struct mailbox *mailbox,
                                        struct index_record *record);
 extern int mailbox_find_index_record(struct mailbox *mailbox, uint32_t uid,
                                      struct index_record *record);
+extern int mailbox_read_index_flags(struct mailbox *mailbox, uint32_t recno,
+                                    struct index_record *record);
+extern uint32_t mailbox_record_getuid(struct mailbox *mailbox, uint32_t recno);
+extern uint32_t mailbox_record_getsystemflags(struct mailbox *mailbox,
+                                              uint32_t recno);
+extern modseq_t mailbox_record_getmodseq(struct mailbox *mailbox,
+                                         uint32_t recno);
+extern time_t mailbox_record_getinternaldate(struct mailbox *mailbox,
+                                             uint32_t recno);
+extern uint32_t mailbox_record_getsize(struct mailbox *mailbox,
+                                       uint32_t recno);
+extern int mailbox_changed_recnos(struct mailbox *mailbox, modseq_t since,
+                                  int complete, uint32_t **recnosp,
+                                  uint32_t *countp);
+extern int mailbox_vanished_since(struct mailbox *mailbox, modseq_t since,
+                                  struct seqset *seq, struct seqset *outlist);
 
 extern int mailbox_set_acl(struct mailbox *mailbox, const char *acl,
                            int dirty_modseq);
@@ -1860,6 +1860,32 @@ EXPORTED char *mboxname_metapath(const char *partition,
         filename = FNAME_CACHE;
         archiveflag = 1;
         break;
+    case META_COLUMNS:
+        /* lives with the index it describes */
+        snprintf(confkey, 256, "metadir-index-%s", partition);
+        metaflag = IMAP_ENUM_METAPARTITION_FILES_INDEX;
+        filename = FNAME_COLUMNS;
+        break;
+    case META_MODSEQLOG:
+        snprintf(confkey, 256, "metadir-index-%s", partition);
+        metaflag = IMAP_ENUM_METAPARTITION_FILES_INDEX;
+        filename = FNAME_MODSEQLOG;
+        break;
+    case META_VANISHED:
+        snprintf(confkey, 256, "metadir-index-%s", partition);
+        metaflag = IMAP_ENUM_METAPARTITION_FILES_INDEX;
+        filename = FNAME_VANISHED;
+        break;
+    case META_SORT:
+        snprintf(confkey, 256, "metadir-index-%s", partition);
+        metaflag = IMAP_ENUM_METAPARTITION_FILES_INDEX;
+        filename = FNAME_SORT;
+        break;
+    case META_THREAD:
+        snprintf(confkey, 256, "metadir-index-%s", partition);
+        metaflag = IMAP_ENUM_METAPARTITION_FILES_INDEX;
+        filename = FNAME_THREAD;
+        break;
     case 0:
         break;
     default:
@@ -282,16 +282,20 @@ EXPORTED int message_copy_strict(struct protstream *from, FILE *to,
 EXPORTED int message_parse(const char *fname, struct index_record *record)
 {
     struct body *body = NULL;
-    FILE *f;
+    struct buf buf = BUF_INITIALIZER;
     int r;
 
-    f = fopen(fname, "r");
-    if (!f) return IMAP_IOERROR;
+    /* map rather than parse the FILE, so compressed files work */
+    if (mailbox_map_file(fname, NULL, &buf) || !buf.len) {
+        buf_free(&buf);
+        return IMAP_IOERROR;
+    }
 
-    r = message_parse_file(f, NULL, NULL, &body);
+    body = (struct body *) xzmalloc(sizeof(struct body));
+    r = message_parse_mapped(buf.s, buf.len, body);
     if (!r) r = message_create_record(record, body);
 
-    fclose(f);
+    buf_free(&buf);
 
     if (body) {
         message_free_body(body);
@@ -1874,20 +1878,14 @@ EXPORTED int message_write_cache(struct index_record *record, const struct body
     free(subject);
 
     /* append the records to the buffer */
-    for (i = 0; i < NUM_CACHE_FIELDS; i++) {
-        record->crec.item[i].len = buf_len(&ib[i]);
-        record->crec.item[i].offset = buf_len(&cacheitem_buffer) + sizeof(uint32_t);
-        message_write_xdrstring(&cacheitem_buffer, &ib[i]);
+    cache_buildrecord(&cacheitem_buffer, &record->crec, ib);
+    for (i = 0; i < NUM_CACHE_FIELDS; i++)
         buf_free(&ib[i]);
-    }
 
     /* copy the fields into the message */
     record->cache_offset = 0; /* calculate on write! */
     record->cache_version = MAILBOX_CACHE_MINOR_VERSION;
     record->cache_crc = crc32_buf(&cacheitem_buffer);
-    record->crec.buf = &cacheitem_buffer;
-    record->crec.offset = 0; /* we're at the start of the buffer */
-    record->crec.len = buf_len(&cacheitem_buffer);
 
     return 0;
 }
@@ -3957,26 +3955,9 @@ done:
 
 static int message_map_file(message_t *m, const char *fname)
 {
-    int fd;
-    struct stat sbuf;
-
-    fd = open(fname, O_RDONLY, 0666);
-    if (fd == -1) return errno;
-
-    if (fstat(fd, &sbuf) == -1) {
-        syslog(LOG_ERR, "IOERROR: fstat on %s: %m", fname);
-        fatal("can't fstat message file", EC_OSFILE);
-    }
-    if (!S_ISREG(sbuf.st_mode)) {
-        close(fd);
-        return EINVAL;
-    }
     buf_free(&m->map);
-    buf_init_mmap(&m->map, /*onceonly*/1, fd, fname, sbuf.st_size,
-                  m->mailbox ? m->mailbox->name : NULL);
-    close(fd);
-
-    return 0;
+    return mailbox_map_file(fname, m->mailbox ? m->mailbox->name : NULL,
+                            &m->map);
 }
 
 /*-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-*/
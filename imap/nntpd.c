@@ -802,6 +802,9 @@ static void cmdloop(void)
     allowanonymous = config_getswitch(IMAPOPT_ALLOWANONYMOUSLOGIN);
 
     for (;;) {
+        /* Release any database snapshots */
+        cyrusdb_release();
+
         /* Flush any buffered output */
         prot_flush(nntp_out);
         if (backend_current) prot_flush(backend_current->out);
@@ -1934,7 +1937,7 @@ static void cmd_article(int part, char *msgid, unsigned long uid)
 
     fname = mailbox_record_fname(group_state->mailbox, &record);
 
-    msgfile = fopen(fname, "r");
+    msgfile = mailbox_fopen_file(fname);
     if (!msgfile) {
         prot_printf(nntp_out, "403 Could not read message file\r\n");
         return;
@@ -903,6 +903,9 @@ static void cmdloop(void)
     for (;;) {
         signals_poll();
 
+        /* Release any database snapshots */
+        cyrusdb_release();
+
         /* register process */
         proc_register(config_ident, popd_clienthost, popd_userid, popd_mailbox ? popd_mailbox->name : NULL, NULL);
 
@@ -2053,7 +2056,7 @@ static int blat(int msgno, int lines)
     }
 
     fname = mailbox_record_fname(popd_mailbox, &record);
-    msgfile = fopen(fname, "r");
+    msgfile = mailbox_fopen_file(fname);
     if (!msgfile) {
         prot_printf(popd_out, "-ERR [SYS/PERM] Could not read message file\r\n");
         return IMAP_IOERROR;
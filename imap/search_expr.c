@@ -58,6 +58,7 @@
 #include "annotate.h"
 #include "global.h"
 #include "lsort.h"
+#include "xstats.h"
 #include "xstrlcpy.h"
 #include "xmalloc.h"
 
@@ -813,6 +814,265 @@ EXPORTED int search_expr_evaluate(message_t *m, const search_expr_t *e)
 
 /* ====================================================================== */
 
+/*
+ * Prefiltering: the comparisons on attributes with a search_attr.column
+ * are evaluated for every message in the folder at once, over arrays
+ * of that field packed out of the index map (or the index), with the
+ * boolean operators combining whole arrays.  Every other comparison is
+ * "unknown", i.e. both SEARCH_PF_TRUE and SEARCH_PF_FALSE, which the
+ * operators propagate three-valued style, so the result gives for each
+ * message whether the expression is definitely true, definitely false,
+ * or still needs search_expr_evaluate().
+ *
+ * The loops are kept free of branches and calls so that the compiler
+ * can vectorise them.
+ */
+
+struct prefilter {
+    struct index_state *state;
+    unsigned n;
+    uint32_t *cols[SEARCH_NUM_COLUMNS];
+    modseq_t *modseqs;
+};
+
+#define PF_UNKNOWN  (SEARCH_PF_TRUE|SEARCH_PF_FALSE)
+
+/* SEARCH_PF_TRUE if the condition holds, SEARCH_PF_FALSE if not */
+#define PF_LOOP(cond) \
+    for (i = 0 ; i < n ; i++) out[i] = SEARCH_PF_FALSE >> !!(cond)
+
+static const uint32_t *prefilter_column(struct prefilter *pf, int col)
+{
+    struct index_state *state = pf->state;
+    uint32_t *v;
+    unsigned i;
+
+    if (pf->cols[col])
+        return pf->cols[col];
+
+    v = pf->cols[col] = xmalloc(pf->n * sizeof(uint32_t));
+    for (i = 0 ; i < pf->n ; i++) {
+        struct index_map *im = &state->map[i];
+        switch (col) {
+        case SEARCH_COL_MSGNO:
+            v[i] = i+1;
+            break;
+        case SEARCH_COL_UID:
+            v[i] = im->uid;
+            break;
+        case SEARCH_COL_SYSTEMFLAGS:
+            v[i] = im->system_flags;
+            break;
+        case SEARCH_COL_INDEXFLAGS:
+            v[i] = (im->isrecent ? MESSAGE_RECENT : 0) |
+                   (im->isseen ? MESSAGE_SEEN : 0);
+            break;
+        case SEARCH_COL_SIZE:
+            v[i] = mailbox_record_getsize(state->mailbox, im->recno);
+            break;
+        case SEARCH_COL_INTERNALDATE:
+            v[i] = mailbox_record_getinternaldate(state->mailbox, im->recno);
+            break;
+        }
+    }
+
+    return v;
+}
+
+static const modseq_t *prefilter_modseqs(struct prefilter *pf)
+{
+    unsigned i;
+
+    if (!pf->modseqs) {
+        pf->modseqs = xmalloc(pf->n * sizeof(modseq_t));
+        for (i = 0 ; i < pf->n ; i++)
+            pf->modseqs[i] = pf->state->map[i].modseq;
+    }
+
+    return pf->modseqs;
+}
+
+static void prefilter_compare(struct prefilter *pf, const search_expr_t *e,
+                              unsigned char *out)
+{
+    unsigned n = pf->n;
+    unsigned i;
+    uint64_t val = e->value.u;
+    enum search_op op = e->op;
+
+    if (op == SEOP_FUZZYMATCH)
+        op = SEOP_MATCH;    /* as in search_expr_evaluate() */
+
+    switch (e->attr->column) {
+    case SEARCH_COL_MSGNO:
+    case SEARCH_COL_UID:
+        if (op == SEOP_MATCH && e->internalised) {
+            const uint32_t *v = prefilter_column(pf, e->attr->column);
+            struct seqset *seq = e->internalised;
+            for (i = 0 ; i < n ; i++)
+                out[i] = SEARCH_PF_FALSE >> !!seqset_ismember(seq, v[i]);
+            return;
+        }
+        break;
+
+    case SEARCH_COL_SYSTEMFLAGS:
+    case SEARCH_COL_INDEXFLAGS:
+        if (op == SEOP_MATCH) {
+            const uint32_t *v = prefilter_column(pf, e->attr->column);
+            uint32_t mask = val;
+            PF_LOOP(v[i] & mask);
+            return;
+        }
+        break;
+
+    case SEARCH_COL_USERFLAGS:
+        if (op == SEOP_MATCH) {
+            unsigned num = (unsigned)(unsigned long)e->internalised;
+            const struct index_map *map = pf->state->map;
+            uint32_t mask;
+
+            if (!num) {
+                /* not a valid flag for this mailbox */
+                memset(out, SEARCH_PF_FALSE, n);
+                return;
+            }
+            num--;
+            mask = (1U << (num % 32));
+            num /= 32;
+            PF_LOOP(map[i].user_flags[num] & mask);
+            return;
+        }
+        break;
+
+    case SEARCH_COL_MODSEQ: {
+        const modseq_t *v = prefilter_modseqs(pf);
+        switch (op) {
+        case SEOP_LT: PF_LOOP(v[i] < val); return;
+        case SEOP_LE: PF_LOOP(v[i] <= val); return;
+        case SEOP_GT: PF_LOOP(v[i] > val); return;
+        case SEOP_GE: PF_LOOP(v[i] >= val); return;
+        case SEOP_MATCH: PF_LOOP(v[i] == val); return;
+        default: break;
+        }
+        break;
+    }
+
+    case SEARCH_COL_SIZE:
+    case SEARCH_COL_INTERNALDATE: {
+        const uint32_t *v = prefilter_column(pf, e->attr->column);
+        switch (op) {
+        case SEOP_LT: PF_LOOP(v[i] < val); return;
+        case SEOP_LE: PF_LOOP(v[i] <= val); return;
+        case SEOP_GT: PF_LOOP(v[i] > val); return;
+        case SEOP_GE: PF_LOOP(v[i] >= val); return;
+        case SEOP_MATCH: PF_LOOP(v[i] == val); return;
+        default: break;
+        }
+        break;
+    }
+
+    default:
+        break;
+    }
+
+    memset(out, PF_UNKNOWN, n);
+}
+
+static void prefilter_node(struct prefilter *pf, const search_expr_t *e,
+                           unsigned char *out)
+{
+    unsigned n = pf->n;
+    unsigned i;
+    unsigned char *tmp;
+    search_expr_t *child;
+
+    switch (e->op) {
+    case SEOP_TRUE:
+        memset(out, SEARCH_PF_TRUE, n);
+        return;
+    case SEOP_FALSE:
+        memset(out, SEARCH_PF_FALSE, n);
+        return;
+    case SEOP_AND:
+    case SEOP_OR:
+        memset(out, (e->op == SEOP_AND ? SEARCH_PF_TRUE : SEARCH_PF_FALSE), n);
+        if (!e->children)
+            return;
+        tmp = xmalloc(n);
+        for (child = e->children ; child ; child = child->next) {
+            prefilter_node(pf, child, tmp);
+            if (e->op == SEOP_AND) {
+                /* true if both may be, false if either may be */
+                for (i = 0 ; i < n ; i++)
+                    out[i] = (out[i] & tmp[i] & SEARCH_PF_TRUE) |
+                             ((out[i] | tmp[i]) & SEARCH_PF_FALSE);
+            }
+            else {
+                for (i = 0 ; i < n ; i++)
+                    out[i] = ((out[i] | tmp[i]) & SEARCH_PF_TRUE) |
+                             (out[i] & tmp[i] & SEARCH_PF_FALSE);
+            }
+        }
+        free(tmp);
+        return;
+    case SEOP_NOT:
+        assert(e->children);
+        prefilter_node(pf, e->children, out);
+        for (i = 0 ; i < n ; i++)
+            out[i] = ((out[i] & SEARCH_PF_TRUE) << 1) |
+                     ((out[i] & SEARCH_PF_FALSE) >> 1);
+        return;
+    default:
+        if (e->attr && e->attr->column)
+            prefilter_compare(pf, e, out);
+        else
+            memset(out, PF_UNKNOWN, n);
+        return;
+    }
+}
+
+static int has_column(search_expr_t *e, void *rock __attribute__((unused)))
+{
+    return (e->attr && e->attr->column);
+}
+
+/*
+ * Evaluate as much of the given (internalised) search expression as
+ * can be done from the index alone, for every message in the folder.
+ * Returns a newly allocated array of SEARCH_PF_* results indexed by
+ * msgno-1, which the caller must free, or NULL if there is nothing in
+ * the expression which could be decided this way.
+ */
+EXPORTED unsigned char *search_expr_prefilter(struct index_state *state,
+                                              const search_expr_t *e)
+{
+    struct prefilter pf;
+    unsigned char *out;
+    int i;
+
+    if (!state->exists)
+        return NULL;
+    if (!search_expr_apply((search_expr_t *)e, has_column, NULL))
+        return NULL;
+
+    memset(&pf, 0, sizeof(pf));
+    pf.state = state;
+    pf.n = state->exists;
+
+    out = xmalloc(pf.n);
+    prefilter_node(&pf, e, out);
+
+    for (i = 0 ; i < SEARCH_NUM_COLUMNS ; i++)
+        free(pf.cols[i]);
+    free(pf.modseqs);
+
+    xstats_inc(SEARCH_PREFILTER);
+
+    return out;
+}
+
+/* ====================================================================== */
+
 static int uses_attr(search_expr_t *e, void *rock)
 {
     const search_attr_t *attr = rock;
@@ -863,6 +1123,23 @@ EXPORTED int search_expr_is_mutable(const search_expr_t *e)
 
 /* ====================================================================== */
 
+static int is_not_indexmap(search_expr_t *e, void *rock __attribute__((unused)))
+{
+    return (e->attr && !(e->attr->flags & SEA_INDEXMAP));
+}
+
+/*
+ * Return non-zero if every attribute in the search expression can be
+ * evaluated from the per-message state which index_refresh() keeps in
+ * memory (uid, modseq, flags), i.e. without reading the index record.
+ */
+EXPORTED int search_expr_is_indexmap(const search_expr_t *e)
+{
+    return !search_expr_apply((search_expr_t *)e, is_not_indexmap, NULL);
+}
+
+/* ====================================================================== */
+
 static int get_countability(search_expr_t *e, void *rock)
 {
     unsigned int *maskp = rock;
@@ -1981,6 +2258,20 @@ enum search_cost {
     SEARCH_COST_BODY
 };
 
+static int needs_body(search_expr_t *e, void *rock __attribute__((unused)))
+{
+    return (e->attr && e->attr->cost >= SEARCH_COST_BODY);
+}
+
+/*
+ * Return non-zero if evaluating the search expression may need to
+ * read message files rather than just the index and cache.
+ */
+EXPORTED int search_expr_needs_body(const search_expr_t *e)
+{
+    return search_expr_apply((search_expr_t *)e, needs_body, NULL);
+}
+
 /*
  * Call search_attr_init() before doing any work with search
  * expressions.
@@ -2104,7 +2395,7 @@ EXPORTED void search_attr_init(void)
             (void *)message_get_to
         },{
             "msgno",
-            SEA_MUTABLE,
+            SEA_MUTABLE|SEA_INDEXMAP,
             SEARCH_PART_NONE,
             SEARCH_COST_INDEX,
             search_msgno_internalise,
@@ -2115,10 +2406,11 @@ EXPORTED void search_attr_init(void)
             /*get_countability*/NULL,
             search_string_duplicate,
             search_string_free,
-            (void *)message_get_msgno
+            (void *)message_get_msgno,
+            SEARCH_COL_MSGNO
         },{
             "uid",
-            /*flags*/0,
+            SEA_INDEXMAP,
             SEARCH_PART_NONE,
             SEARCH_COST_INDEX,
             search_uid_internalise,
@@ -2129,10 +2421,11 @@ EXPORTED void search_attr_init(void)
             /*get_countability*/NULL,
             search_string_duplicate,
             search_string_free,
-            (void *)message_get_uid
+            (void *)message_get_uid,
+            SEARCH_COL_UID
         },{
             "systemflags",
-            SEA_MUTABLE,
+            SEA_MUTABLE|SEA_INDEXMAP,
             SEARCH_PART_NONE,
             SEARCH_COST_INDEX,
             /*internalise*/NULL,
@@ -2143,10 +2436,11 @@ EXPORTED void search_attr_init(void)
             /*get_countability*/NULL,
             /*duplicate*/NULL,
             /*free*/NULL,
-            (void *)message_get_systemflags
+            (void *)message_get_systemflags,
+            SEARCH_COL_SYSTEMFLAGS
         },{
             "indexflags",
-            SEA_MUTABLE,
+            SEA_MUTABLE|SEA_INDEXMAP,
             SEARCH_PART_NONE,
             SEARCH_COST_INDEX,
             /*internalise*/NULL,
@@ -2157,10 +2451,11 @@ EXPORTED void search_attr_init(void)
             search_indexflags_get_countability,
             /*duplicate*/NULL,
             /*free*/NULL,
-            (void *)message_get_indexflags
+            (void *)message_get_indexflags,
+            SEARCH_COL_INDEXFLAGS
         },{
             "keyword",
-            SEA_MUTABLE,
+            SEA_MUTABLE|SEA_INDEXMAP,
             SEARCH_PART_NONE,
             SEARCH_COST_INDEX,
             search_keyword_internalise,
@@ -2171,7 +2466,8 @@ EXPORTED void search_attr_init(void)
             /*get_countability*/NULL,
             search_string_duplicate,
             search_string_free,
-            NULL
+            NULL,
+            SEARCH_COL_USERFLAGS
         },{
             "convflags",
             SEA_MUTABLE,
@@ -2202,7 +2498,7 @@ EXPORTED void search_attr_init(void)
             NULL
         },{
             "modseq",
-            SEA_MUTABLE,
+            SEA_MUTABLE|SEA_INDEXMAP,
             SEARCH_PART_NONE,
             SEARCH_COST_INDEX,
             /*internalise*/NULL,
@@ -2213,7 +2509,8 @@ EXPORTED void search_attr_init(void)
             /*get_countability*/NULL,
             /*duplicate*/NULL,
             /*free*/NULL,
-            (void *)message_get_modseq
+            (void *)message_get_modseq,
+            SEARCH_COL_MODSEQ
         },{
             "cid",
             SEA_MUTABLE,
@@ -2269,7 +2566,8 @@ EXPORTED void search_attr_init(void)
             /*get_countability*/NULL,
             /*duplicate*/NULL,
             /*free*/NULL,
-            (void *)message_get_size
+            (void *)message_get_size,
+            SEARCH_COL_SIZE
         },{
             "internaldate",
             /*flags*/0,
@@ -2283,7 +2581,8 @@ EXPORTED void search_attr_init(void)
             /*get_countability*/NULL,
             /*duplicate*/NULL,
             /*free*/NULL,
-            (void *)message_get_internaldate
+            (void *)message_get_internaldate,
+            SEARCH_COL_INTERNALDATE
         },{
             "sentdate",
             /*flags*/0,
@@ -81,6 +81,23 @@ union search_value {
 enum {
     SEA_MUTABLE =       (1<<0),
     SEA_FUZZABLE =      (1<<1),
+    SEA_INDEXMAP =      (1<<2),     /* only needs uid, flags and modseq */
+};
+
+/* search_attr.column: a per-message field which search_expr_prefilter()
+ * can read for all the messages in a folder at once */
+enum search_column {
+    SEARCH_COL_NONE = 0,
+    SEARCH_COL_MSGNO,
+    SEARCH_COL_UID,
+    SEARCH_COL_SYSTEMFLAGS,
+    SEARCH_COL_INDEXFLAGS,
+    SEARCH_COL_USERFLAGS,
+    SEARCH_COL_MODSEQ,
+    SEARCH_COL_SIZE,
+    SEARCH_COL_INTERNALDATE,
+
+    SEARCH_NUM_COLUMNS
 };
 
 typedef struct search_attr search_attr_t;
@@ -99,6 +116,7 @@ struct search_attr {
     void (*duplicate)(union search_value *, const union search_value *);
     void (*free)(union search_value *);
     void *data1;        /* extra data for the functions above */
+    enum search_column column;
 };
 
 typedef struct search_expr search_expr_t;
@@ -112,6 +130,13 @@ struct search_expr {
     void *internalised;
 };
 
+/* per-message results of search_expr_prefilter(); a message
+ * with both bits set needs a full search_expr_evaluate() */
+enum {
+    SEARCH_PF_TRUE =        (1<<0),     /* expression may be true */
+    SEARCH_PF_FALSE =       (1<<1),     /* expression may be false */
+};
+
 /* flags for search_expr_get_countability */
 enum {
     SEC_EXISTS =            (1<<0),
@@ -135,8 +160,12 @@ extern search_expr_t *search_expr_unserialise(const char *s);
 extern int search_expr_normalise(search_expr_t **);
 extern void search_expr_internalise(struct index_state *, search_expr_t *);
 extern int search_expr_evaluate(message_t *m, const search_expr_t *);
+extern unsigned char *search_expr_prefilter(struct index_state *,
+                                            const search_expr_t *);
 extern int search_expr_uses_attr(const search_expr_t *, const char *);
 extern int search_expr_is_mutable(const search_expr_t *);
+extern int search_expr_is_indexmap(const search_expr_t *);
+extern int search_expr_needs_body(const search_expr_t *);
 extern unsigned int search_expr_get_countability(const search_expr_t *);
 extern void search_expr_neutralise(search_expr_t *);
 extern void search_expr_split_by_folder_and_index(search_expr_t *e,
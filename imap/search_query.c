@@ -445,6 +445,7 @@ static void subquery_post_indexed(const char *key, void *data, void *rock)
     unsigned msgno;
     unsigned nmsgs = 0;
     unsigned *msgno_list = NULL;
+    unsigned char *prefilter = NULL;
     int r = 0;
 
     if (query->error) return;
@@ -476,6 +477,7 @@ static void subquery_post_indexed(const char *key, void *data, void *rock)
     if (!state->exists) goto out;
 
     search_expr_internalise(state, sub->expr);
+    prefilter = search_expr_prefilter(state, sub->expr);
 
     if (query->sortcrit)
         msgno_list = (unsigned *) xmalloc(state->exists * sizeof(unsigned));
@@ -500,7 +502,8 @@ static void subquery_post_indexed(const char *key, void *data, void *rock)
             continue;
 
         /* run the search program */
-        if (!index_search_evaluate(state, sub->expr, msgno))
+        if (!index_search_evaluate_prefiltered(state, sub->expr,
+                                               prefilter, msgno))
             continue;
 
         /* we have a new UID that needs to be merged in */
@@ -525,6 +528,7 @@ static void subquery_post_indexed(const char *key, void *data, void *rock)
 out:
     query_end_index(query, &state);
     free(msgno_list);
+    free(prefilter);
     if (r) query->error = r;
 }
 
@@ -622,9 +626,12 @@ static int subquery_run_one_folder(search_query_t *query,
 {
     struct index_state *state = NULL;
     unsigned msgno;
+    uint32_t ahead = 0;
+    int readahead;
     search_folder_t *folder = NULL;
     unsigned nmsgs = 0;
     unsigned *msgno_list = NULL;
+    unsigned char *prefilter = NULL;
     int r = 0;
 
     if (query->verbose) {
@@ -653,10 +660,13 @@ static int subquery_run_one_folder(search_query_t *query,
     if (!state->exists) goto out;
 
     search_expr_internalise(state, e);
+    prefilter = search_expr_prefilter(state, e);
 
     if (query->sortcrit)
         msgno_list = (unsigned *) xmalloc(state->exists * sizeof(unsigned));
 
+    readahead = search_expr_needs_body(e);
+
     /* One pass through the folder's message list */
     for (msgno = 1 ; msgno <= state->exists ; msgno++) {
         struct index_map *im = &state->map[msgno-1];
@@ -668,8 +678,15 @@ static int subquery_run_one_folder(search_query_t *query,
         if (im->system_flags & FLAG_EXPUNGED)
             continue;
 
+        /* decided from the index alone? */
+        if (prefilter && prefilter[msgno-1] == SEARCH_PF_FALSE)
+            continue;
+
+        if (readahead)
+            index_readahead(state, NULL, 0, msgno, &ahead);
+
         /* run the search program */
-        if (!index_search_evaluate(state, e, msgno))
+        if (!index_search_evaluate_prefiltered(state, e, prefilter, msgno))
             continue;
 
         if (!folder) {
@@ -703,6 +720,7 @@ static int subquery_run_one_folder(search_query_t *query,
 out:
     query_end_index(query, &state);
     free(msgno_list);
+    free(prefilter);
     return r;
 }
 
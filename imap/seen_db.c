@@ -496,12 +496,11 @@ EXPORTED int seen_compare(struct seendata *a, struct seendata *b)
 /* Look up the unique id in the new file, if it is there, compare the
  * last change times, and ensure that the database uses the newer of
  * the two */
-static int seen_merge_cb(void *rockp,
-                         const char *key, size_t keylen,
-                         const char *newdata, size_t newlen)
+static int seen_merge_one(struct seen *seendb,
+                          const char *key, size_t keylen,
+                          const char *newdata, size_t newlen)
 {
     int r = 0;
-    struct seen *seendb = (struct seen *)rockp;
     struct seendata oldsd, newsd;
     char *uniqueid = xstrndup(key, keylen);
     int dirty = 0;
@@ -534,14 +533,24 @@ HIDDEN int seen_merge(struct seen *seendb, const char *newfile)
 {
     int r = 0;
     struct db *newdb = NULL;
+    struct cyrusdb_cursor *cur = NULL;
+    const char *key, *data;
+    size_t keylen, datalen;
 
     r = cyrusdb_open(DB, newfile, 0, &newdb);
     /* if it doesn't exist, there's nothing
      * to do, so abort without an error */
     if (r == CYRUSDB_NOTFOUND) return 0;
 
-    if (!r) r = cyrusdb_foreach(newdb, "", 0, NULL, seen_merge_cb, seendb, NULL);
+    if (!r) r = cyrusdb_cursor_open(newdb, "", 0, NULL, &cur);
 
+    while (!r) {
+        r = cyrusdb_cursor_next(cur, &key, &keylen, &data, &datalen);
+        if (!r) r = seen_merge_one(seendb, key, keylen, data, datalen);
+    }
+    if (r == CYRUSDB_DONE) r = 0;
+
+    cyrusdb_cursor_close(cur);
     if (newdb) cyrusdb_close(newdb);
 
     return r;
@@ -167,6 +167,7 @@ EXPORTED int status_lookup(const char *mboxname, const char *userid,
                   unsigned statusitems, struct statusdata *sdata)
 {
     struct mailbox *mailbox = NULL;
+    struct index_header ih;
     unsigned numrecent = 0;
     unsigned numunseen = 0;
     unsigned c_statusitems;
@@ -193,6 +194,27 @@ EXPORTED int status_lookup(const char *mboxname, const char *userid,
                mboxname, userid, statusitems);
     }
 
+    /* The shared header cache answers everything that only needs the
+     * index header, and recent/unseen too if there are no messages */
+    if (!mailbox_read_cached_header(mboxname, &ih)) {
+        c_statusitems = STATUS_MESSAGES | STATUS_UIDNEXT |
+                        STATUS_UIDVALIDITY | STATUS_HIGHESTMODSEQ;
+        if (!ih.exists)
+            c_statusitems |= STATUS_RECENT | STATUS_UNSEEN;
+
+        if ((statusitems & c_statusitems) == statusitems) {
+            sdata->userid = userid;
+            sdata->statusitems = c_statusitems;
+            sdata->messages = ih.exists;
+            sdata->recent = 0;
+            sdata->uidnext = ih.last_uid+1;
+            sdata->uidvalidity = ih.uidvalidity;
+            sdata->unseen = 0;
+            sdata->highestmodseq = ih.highestmodseq;
+            return 0;
+        }
+    }
+
     /* Missing or invalid cache entry */
     r = mailbox_open_irl(mboxname, &mailbox);
     if (r) return r;
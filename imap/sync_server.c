@@ -562,6 +562,7 @@ static void cmdloop(void)
     reserve_list = sync_reserve_list_create(SYNC_MESSAGE_LIST_HASH_SIZE);
 
     for (;;) {
+        cyrusdb_release();
         prot_flush(sync_out);
 
         /* Parse command name */
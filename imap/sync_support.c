@@ -3268,12 +3268,13 @@ int sync_get_message(struct dlist *kin, struct sync_state *sstate)
         return IMAP_PROTOCOL_BAD_PARAMETERS;
 
     fname = mboxname_datapath(partition, mboxname, uniqueid, uid);
-    if (stat(fname, &sbuf) == -1) {
+    if (mailbox_stat_file(fname, &sbuf) == -1) {
         fname = mboxname_archivepath(partition, mboxname, uniqueid, uid);
-        if (stat(fname, &sbuf) == -1)
+        if (mailbox_stat_file(fname, &sbuf) == -1)
             return IMAP_MAILBOX_NONEXISTENT;
     }
 
+    /* the inflated length, which is what dlist_printbuf sends */
     kl = dlist_setfile(NULL, "MESSAGE", partition, &tmp_guid, sbuf.st_size, fname);
     sync_send_response(kl, sstate->pout);
     dlist_free(&kl);
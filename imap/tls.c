@@ -762,6 +762,12 @@ EXPORTED int     tls_init_serverengine(const char *ident,
     if (server_cipher_order)
         off |= SSL_OP_CIPHER_SERVER_PREFERENCE;
 
+#ifdef SSL_OP_ENABLE_KTLS
+    /* let the kernel do the encryption, so messages can be sendfile()d */
+    if (config_getswitch(IMAPOPT_TLS_KTLS))
+        off |= SSL_OP_ENABLE_KTLS;
+#endif
+
     SSL_CTX_set_options(s_ctx, off);
     SSL_CTX_set_info_callback(s_ctx, apps_ssl_info_callback);
 
@@ -46,6 +46,7 @@ X(CONV_NEW),
 X(MSGDATA_LOAD),
 X(MESSAGE_MAP),
 X(SEARCH_EVALUATE),
+X(SEARCH_PREFILTER),
 X(SEARCH_HEADER),
 X(SEARCH_CACHE_HEADER),
 X(SEARCH_BODY),
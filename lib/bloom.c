@@ -0,0 +1,462 @@
+/* bloom.c -- persistent, shared bloom filters
+ *
+ * Copyright (c) 1994-2016 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "bloom.h"
+#include "byteorder64.h"
+#include "util.h"
+#include "xmalloc.h"
+
+/*
+ * FORMAT:
+ *
+ * HEADER: 64 bytes
+ *  magic: 16 bytes
+ *  version: 4 bytes
+ *  nhashes: 4 bytes
+ *  nbits: 8 bytes (always a power of two)
+ *  flags: 4 bytes
+ *  padding up to 64 bytes
+ *
+ * BITS: nbits / 8 bytes
+ *
+ * Bits are only ever set, with an atomic OR where the compiler gives
+ * us one, so processes adding keys at the same time can't lose each
+ * other's bits.  The STALE flag is set on the old file when a rebuilt
+ * filter is renamed over it.
+ *
+ * Bits are set in the shared map without syncing them, so after a
+ * crash the file on disk may be missing keys which made it into the
+ * database.  Every process with the filter open holds a shared fcntl
+ * lock on it, and the first one to open it sets (and syncs) the DIRTY
+ * flag.  The last one to close it, i.e. the one which can upgrade to
+ * an exclusive lock, syncs the bits and clears DIRTY again.  So DIRTY
+ * with nobody holding a lock means the last users died, and the
+ * filter can't be trusted: bloom_open() returns BLOOM_UNCLEAN, still
+ * holding the exclusive lock so nobody else starts using it, and the
+ * caller rebuilds it.
+ */
+
+#define HEADER_MAGIC ("\241\002\213\015cyrus bloom\0")
+#define HEADER_MAGIC_SIZE (16)
+#define HEADER_SIZE (64)
+#undef VERSION /* defined in config.h */
+#define VERSION 1
+
+enum {
+    OFFSET_VERSION = 16,
+    OFFSET_NHASHES = 20,
+    OFFSET_NBITS = 24,
+    OFFSET_FLAGS = 32,
+};
+
+/* lowest byte of the flags */
+#define FLAGS_BYTE (OFFSET_FLAGS + 3)
+#define STALE (1<<0)
+#define DIRTY (1<<1)
+
+/* about 1% false positives */
+#define BITS_PER_KEY 10
+#define NHASHES 7
+#define MINBITS (1<<13)
+
+#ifdef __GNUC__
+#define SETBITS(p, m) __sync_fetch_and_or((p), (m))
+#define CLEARBITS(p, m) __sync_fetch_and_and((p), ~(m))
+#else
+#define SETBITS(p, m) (*(p) |= (m))
+#define CLEARBITS(p, m) (*(p) &= ~(m))
+#endif
+
+struct bloom {
+    char *fname;
+    int fd;
+    int is_locked;
+    int is_unclean;
+    unsigned char *base;
+    size_t size;
+    uint64_t mask;
+    uint32_t nhashes;
+};
+
+/* FNV-1a, with a final mix so the low bits are good enough to mask */
+static uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+static uint64_t hash64(const char *key, size_t keylen)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    while (keylen--) {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211ULL;
+    }
+
+    return mix64(h);
+}
+
+static int _map(const char *fname, int fd, struct bloom **bp)
+{
+    struct bloom *b;
+    struct stat sbuf;
+    unsigned char *base;
+    uint64_t nbits;
+
+    if (fstat(fd, &sbuf) < 0) {
+        syslog(LOG_ERR, "IOERROR: fstat %s: %m", fname);
+        return -errno;
+    }
+
+    if (sbuf.st_size < HEADER_SIZE) {
+        syslog(LOG_ERR, "bloom: %s too short", fname);
+        return -EINVAL;
+    }
+
+    base = mmap(NULL, sbuf.st_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        syslog(LOG_ERR, "IOERROR: mmap %s: %m", fname);
+        return -errno;
+    }
+
+    nbits = ntohll(*((uint64_t *)(base + OFFSET_NBITS)));
+
+    if (memcmp(base, HEADER_MAGIC, HEADER_MAGIC_SIZE) ||
+        ntohl(*((uint32_t *)(base + OFFSET_VERSION))) != VERSION ||
+        !nbits || (nbits & (nbits - 1)) ||
+        (uint64_t)sbuf.st_size != HEADER_SIZE + nbits / 8) {
+        syslog(LOG_ERR, "bloom: %s is not a valid filter", fname);
+        munmap(base, sbuf.st_size);
+        return -EINVAL;
+    }
+
+    b = xzmalloc(sizeof(struct bloom));
+    b->fname = xstrdup(fname);
+    b->fd = fd;
+    b->base = base;
+    b->size = sbuf.st_size;
+    b->mask = nbits - 1;
+    b->nhashes = ntohl(*((uint32_t *)(base + OFFSET_NHASHES)));
+
+    *bp = b;
+
+    return 0;
+}
+
+static int _setlock(int fd, short type, int wait)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(struct flock));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+
+    while (fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl) < 0) {
+        if (errno != EINTR)
+            return -errno;
+    }
+
+    return 0;
+}
+
+static unsigned char _flags(const struct bloom *b)
+{
+    return ((volatile unsigned char *)b->base)[FLAGS_BYTE];
+}
+
+static int _sync_header(struct bloom *b)
+{
+    if (msync(b->base, HEADER_SIZE, MS_SYNC) < 0) {
+        syslog(LOG_ERR, "IOERROR: msync %s: %m", b->fname);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/* join the users of the filter, see FORMAT.  Returns 0, BLOOM_UNCLEAN
+ * with the exclusive lock held, -ESTALE if it has been replaced, or a
+ * negative errno */
+static int _attach(struct bloom *b)
+{
+    int r;
+
+    for (;;) {
+        r = _setlock(b->fd, F_WRLCK, 0);
+        if (!r) {
+            /* nobody else has it open */
+            b->is_locked = 1;
+            if (_flags(b) & STALE)
+                return -ESTALE;
+            if (_flags(b) & DIRTY) {
+                b->is_unclean = 1;
+                return BLOOM_UNCLEAN;
+            }
+
+            SETBITS(b->base + FLAGS_BYTE, DIRTY);
+            r = _sync_header(b);
+            if (r) return r;
+
+            /* and let everybody else in */
+            return _setlock(b->fd, F_RDLCK, 1);
+        }
+        if (r != -EAGAIN && r != -EACCES)
+            return r;
+
+        r = _setlock(b->fd, F_RDLCK, 1);
+        if (r) return r;
+        b->is_locked = 1;
+
+        if (_flags(b) & STALE)
+            return -ESTALE;
+        if (_flags(b) & DIRTY)
+            return 0;
+
+        /* the last user closed it while we waited, start over */
+        _setlock(b->fd, F_UNLCK, 1);
+        b->is_locked = 0;
+    }
+}
+
+EXPORTED int bloom_open(const char *fname, struct bloom **bp)
+{
+    struct bloom *b = NULL;
+    int tries;
+    int fd;
+    int r;
+
+    for (tries = 0 ; tries < 3 ; tries++) {
+        fd = open(fname, O_RDWR, 0);
+        if (fd < 0) return -errno;
+
+        r = _map(fname, fd, &b);
+        if (r) {
+            close(fd);
+            return r;
+        }
+
+        r = _attach(b);
+        if (r >= 0) {
+            *bp = b;
+            return r;
+        }
+
+        bloom_close(&b);
+
+        /* replaced while we waited for the lock: open the new one */
+        if (r != -ESTALE) break;
+    }
+
+    return r;
+}
+
+EXPORTED int bloom_create(const char *fname, size_t nentries,
+                          struct bloom **bp)
+{
+    char header[HEADER_SIZE];
+    uint64_t nbits = MINBITS;
+    int fd;
+    int r;
+
+    while (nbits < (uint64_t)nentries * BITS_PER_KEY)
+        nbits <<= 1;
+
+    memset(header, 0, HEADER_SIZE);
+    memcpy(header, HEADER_MAGIC, HEADER_MAGIC_SIZE);
+    *((uint32_t *)(header + OFFSET_VERSION)) = htonl(VERSION);
+    *((uint32_t *)(header + OFFSET_NHASHES)) = htonl(NHASHES);
+    *((uint64_t *)(header + OFFSET_NBITS)) = htonll(nbits);
+
+    fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        syslog(LOG_ERR, "IOERROR: creating %s: %m", fname);
+        return -errno;
+    }
+
+    /* the bits start out as a hole full of zeros */
+    if (ftruncate(fd, HEADER_SIZE + nbits / 8) < 0 ||
+        pwrite(fd, header, HEADER_SIZE, 0) != HEADER_SIZE) {
+        syslog(LOG_ERR, "IOERROR: writing %s: %m", fname);
+        r = -EIO;
+    }
+    else {
+        r = _map(fname, fd, bp);
+        if (!r) {
+            /* the filter owns the descriptor now */
+            fd = -1;
+            r = _attach(*bp);
+            if (r) bloom_close(bp);
+        }
+    }
+
+    if (fd >= 0) close(fd);
+    if (r) unlink(fname);
+
+    return r;
+}
+
+EXPORTED int bloom_replace(struct bloom *b, const char *fname)
+{
+    struct bloom *old = NULL;
+    int fd;
+
+    /* grab the old one first, so we can tell its users after.  Just map
+     * it: joining its users would wait behind an unclean opener, which
+     * may be us.  Keep the descriptor until after it's marked stale,
+     * closing it drops any lock we hold on it */
+    fd = open(fname, O_RDWR, 0);
+    if (fd >= 0 && _map(fname, fd, &old))
+        close(fd);
+
+    /* the new filter must be on disk before anyone can find it */
+    if (msync(b->base, b->size, MS_SYNC) < 0) {
+        syslog(LOG_ERR, "IOERROR: msync %s: %m", b->fname);
+        bloom_close(&old);
+        return -EIO;
+    }
+
+    if (rename(b->fname, fname) < 0) {
+        syslog(LOG_ERR, "IOERROR: renaming %s to %s: %m", b->fname, fname);
+        unlink(b->fname);
+        bloom_close(&old);
+        return -EIO;
+    }
+
+    free(b->fname);
+    b->fname = xstrdup(fname);
+
+    if (old) {
+        SETBITS(old->base + FLAGS_BYTE, STALE);
+        bloom_close(&old);
+    }
+
+    return 0;
+}
+
+EXPORTED void bloom_close(struct bloom **bp)
+{
+    struct bloom *b = *bp;
+
+    if (!b) return;
+
+    /* last one out syncs the bits and marks it clean, unless it was
+     * unclean to start with */
+    if (b->is_locked && !b->is_unclean &&
+        !_setlock(b->fd, F_WRLCK, 0) &&
+        !(_flags(b) & STALE)) {
+        if (msync(b->base, b->size, MS_SYNC) < 0) {
+            syslog(LOG_ERR, "IOERROR: msync %s: %m", b->fname);
+        }
+        else {
+            CLEARBITS(b->base + FLAGS_BYTE, DIRTY);
+            _sync_header(b);
+        }
+    }
+
+    /* closing the descriptor drops our lock */
+    if (b->fd >= 0) close(b->fd);
+    munmap(b->base, b->size);
+    free(b->fname);
+    free(b);
+
+    *bp = NULL;
+}
+
+EXPORTED void bloom_add(struct bloom *b, const char *key, size_t keylen)
+{
+    unsigned char *bits = b->base + HEADER_SIZE;
+    uint64_t h1 = hash64(key, keylen);
+    uint64_t h2 = mix64(h1) | 1;
+    uint32_t i;
+
+    for (i = 0; i < b->nhashes; i++) {
+        uint64_t bit = (h1 + i * h2) & b->mask;
+        unsigned char m = 1 << (bit & 7);
+
+        /* don't dirty pages which already have the bit */
+        if (!(bits[bit >> 3] & m))
+            SETBITS(bits + (bit >> 3), m);
+    }
+}
+
+EXPORTED int bloom_check(const struct bloom *b, const char *key, size_t keylen)
+{
+    const unsigned char *bits = b->base + HEADER_SIZE;
+    uint64_t h1 = hash64(key, keylen);
+    uint64_t h2 = mix64(h1) | 1;
+    uint32_t i;
+
+    for (i = 0; i < b->nhashes; i++) {
+        uint64_t bit = (h1 + i * h2) & b->mask;
+
+        if (!(bits[bit >> 3] & (1 << (bit & 7))))
+            return 0;
+    }
+
+    return 1;
+}
+
+EXPORTED int bloom_is_stale(const struct bloom *b)
+{
+    return (((volatile unsigned char *)b->base)[FLAGS_BYTE] & STALE);
+}
@@ -0,0 +1,82 @@
+/* bloom.h -- persistent, shared bloom filters
+ *
+ * Copyright (c) 1994-2016 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CYRUS_LIB_BLOOM_H__
+#define __CYRUS_LIB_BLOOM_H__
+
+#include <sys/types.h>
+
+/* A bloom filter kept in a file and mapped shared, so that every process
+ * using it sees the keys the others add straight away.  A filter is
+ * never shrunk or cleared in place: to drop keys, build a new one and
+ * bloom_replace() it over the old, which tells the processes still using
+ * the old one to reopen it. */
+
+struct bloom;
+
+/* open an existing filter.  Returns 0, a negative errno, or
+ * BLOOM_UNCLEAN if the processes which last had it open died without
+ * closing it, so it may be missing keys.  In that case *bp is still
+ * opened, and held exclusively: the caller should build a new filter
+ * and bloom_replace() it before closing this one */
+#define BLOOM_UNCLEAN (1)
+extern int bloom_open(const char *fname, struct bloom **bp);
+
+/* create a new, empty filter sized for nentries keys at about 1% false
+ * positives.  Returns 0 or a negative errno */
+extern int bloom_create(const char *fname, size_t nentries, struct bloom **bp);
+
+/* rename a new filter over the old one at fname, and mark the old
+ * one stale */
+extern int bloom_replace(struct bloom *b, const char *fname);
+
+extern void bloom_close(struct bloom **bp);
+
+extern void bloom_add(struct bloom *b, const char *key, size_t keylen);
+
+/* returns 0 if the key is definitely not in the filter */
+extern int bloom_check(const struct bloom *b, const char *key, size_t keylen);
+
+/* the filter has been replaced, and should be reopened */
+extern int bloom_is_stale(const struct bloom *b);
+
+#endif /* __CYRUS_LIB_BLOOM_H__ */
@@ -52,6 +52,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include "cyrusdb.h"
 #include "util.h"
@@ -67,6 +68,7 @@ extern struct cyrusdb_backend cyrusdb_skiplist;
 extern struct cyrusdb_backend cyrusdb_quotalegacy;
 extern struct cyrusdb_backend cyrusdb_sql;
 extern struct cyrusdb_backend cyrusdb_twoskip;
+extern struct cyrusdb_backend cyrusdb_lsm;
 extern struct cyrusdb_backend cyrusdb_lmdb;
 
 static struct cyrusdb_backend *_backends[] = {
@@ -77,6 +79,7 @@ static struct cyrusdb_backend *_backends[] = {
     &cyrusdb_sql,
 #endif
     &cyrusdb_twoskip,
+    &cyrusdb_lsm,
 #if defined HAVE_LMDB
     &cyrusdb_lmdb,
 #endif
@@ -87,8 +90,24 @@ static struct cyrusdb_backend *_backends[] = {
 struct db {
     struct dbengine *engine;
     struct cyrusdb_backend *backend;
+
+    /* for the handle cache */
+    struct cyrusdb_backend *wanted;
+    char *fname;
+    int flags;
+    dev_t dev;
+    ino_t ino;
+    time_t closed;
+    struct db *next;
 };
 
+/* Databases which have been closed, but are kept open in case the
+ * same process wants them again soon.  Most recently closed first */
+static struct db *dbcache = NULL;
+
+#define DBCACHE_MAX 32
+#define DBCACHE_TIMEOUT libcyrus_config_getint(CYRUSOPT_DBCACHE_TIMEOUT)
+
 static struct cyrusdb_backend *cyrusdb_fromname(const char *name)
 {
     int i;
@@ -169,14 +188,133 @@ static int _open(const char *backend, const char *fname,
 done:
 
     if (r) free(db);
-    else *ret = db;
+    else {
+        db->wanted = cyrusdb_fromname(backend);
+        db->fname = xstrdup(fname);
+        db->flags = flags;
+        *ret = db;
+    }
 
     return r;
 }
 
+static int _close(struct db *db)
+{
+    int r = db->backend->close(db->engine);
+
+    free(db->fname);
+    free(db);
+
+    return r;
+}
+
+/* close cached databases which have been idle too long, or are beyond
+ * the cache size.  With force, close them all */
+static void dbcache_expire(int force)
+{
+    time_t cutoff = time(NULL) - DBCACHE_TIMEOUT;
+    struct db **prevp = &dbcache;
+    struct db *db;
+    int n = 0;
+
+    while ((db = *prevp)) {
+        if (force || ++n > DBCACHE_MAX || db->closed < cutoff) {
+            *prevp = db->next;
+            _close(db);
+        }
+        else {
+            prevp = &db->next;
+        }
+    }
+}
+
+/* take a database out of the cache, as long as its file is
+ * still the one we have open */
+static struct db *dbcache_get(const char *backend, const char *fname,
+                              int flags)
+{
+    struct db **prevp = &dbcache;
+    struct db *db;
+    struct stat sbuf;
+
+    if (!dbcache) return NULL;
+
+    dbcache_expire(0);
+
+    if (!backend) backend = DEFAULT_BACKEND;
+
+    while ((db = *prevp)) {
+        if (db->flags != flags || strcmp(db->fname, fname) ||
+            strcmp(db->wanted->name, backend)) {
+            prevp = &db->next;
+            continue;
+        }
+
+        *prevp = db->next;
+
+        if (!stat(fname, &sbuf) &&
+            sbuf.st_dev == db->dev && sbuf.st_ino == db->ino) {
+            if (db->backend->refresh)
+                db->backend->refresh(db->engine);
+            return db;
+        }
+
+        /* replaced or removed underneath us */
+        _close(db);
+    }
+
+    return NULL;
+}
+
+/* keep a database open after the caller is done with it.
+ * Returns 1 if it was cached */
+static int dbcache_put(struct db *db)
+{
+    struct stat sbuf;
+
+    if (DBCACHE_TIMEOUT <= 0) return 0;
+
+    /* only files we can tell apart from their replacements */
+    if (stat(db->fname, &sbuf)) return 0;
+
+    db->dev = sbuf.st_dev;
+    db->ino = sbuf.st_ino;
+    db->closed = time(NULL);
+    db->next = dbcache;
+    dbcache = db;
+
+    dbcache_expire(0);
+
+    return 1;
+}
+
+/* close any cached databases for fname */
+static void dbcache_drop(const char *fname)
+{
+    struct db **prevp = &dbcache;
+    struct db *db;
+
+    while ((db = *prevp)) {
+        if (!strcmp(db->fname, fname)) {
+            *prevp = db->next;
+            _close(db);
+        }
+        else {
+            prevp = &db->next;
+        }
+    }
+}
+
 EXPORTED int cyrusdb_open(const char *backend, const char *fname,
                           int flags, struct db **ret)
 {
+    struct db *db = dbcache_get(backend, fname, flags);
+
+    if (db) {
+        *ret = db;
+        return 0;
+    }
+
     return _open(backend, fname, flags, ret, NULL);
 }
 
@@ -188,11 +326,9 @@ EXPORTED int cyrusdb_lockopen(const char *backend, const char *fname,
 
 EXPORTED int cyrusdb_close(struct db *db)
 {
-    int r = db->backend->close(db->engine);
-
-    free(db);
+    if (dbcache_put(db)) return 0;
 
-    return r;
+    return _close(db);
 }
 
 EXPORTED int cyrusdb_fetch(struct db *db,
@@ -327,6 +463,274 @@ EXPORTED int cyrusdb_compar(struct db *db,
     return db->backend->compar(db->engine, a, alen, b, blen);
 }
 
+/* a cursor is either the backend's own, or for backends which don't
+ * have cursors, a page of the range read with foreach.  Moving off the
+ * page reads the next one, starting from the key it left at */
+#define CURSOR_PAGE 256
+
+struct cursor_page {
+    struct buf keys[CURSOR_PAGE];
+    struct buf vals[CURSOR_PAGE];
+    int count;
+    int first;  /* oldest slot, while reading backwards */
+};
+
+struct cyrusdb_cursor {
+    struct db *db;
+    struct dbcursor *engine;
+
+    struct buf prefix;
+    struct txn **tid;
+    struct cursor_page *page;
+    int pos;    /* -1 before the first record */
+};
+
+enum {
+    PAGE_FROM,      /* records at or after key */
+    PAGE_AFTER,     /* records after key */
+    PAGE_BEFORE     /* the records just before key */
+};
+
+struct cursor_fill {
+    struct cyrusdb_cursor *cur;
+    struct cursor_page *page;
+    const char *key;
+    size_t keylen;
+    int mode;
+};
+
+static void cursor_page_free(struct cursor_page *page)
+{
+    int i;
+
+    if (!page) return;
+
+    for (i = 0; i < CURSOR_PAGE; i++) {
+        buf_free(&page->keys[i]);
+        buf_free(&page->vals[i]);
+    }
+    free(page);
+}
+
+static int cursor_fill_cb(void *rock,
+                          const char *key, size_t keylen,
+                          const char *data, size_t datalen)
+{
+    struct cursor_fill *fill = (struct cursor_fill *)rock;
+    struct cursor_page *page = fill->page;
+    int slot;
+
+    if (fill->key) {
+        int cmp = cyrusdb_compar(fill->cur->db, key, keylen,
+                                 fill->key, fill->keylen);
+        if (fill->mode == PAGE_FROM && cmp < 0) return 0;
+        if (fill->mode == PAGE_AFTER && cmp <= 0) return 0;
+        if (fill->mode == PAGE_BEFORE && cmp >= 0) return CYRUSDB_DONE;
+    }
+
+    if (page->count < CURSOR_PAGE) {
+        slot = page->count++;
+    }
+    else if (fill->mode == PAGE_BEFORE) {
+        /* keep the last page full, dropping the oldest */
+        slot = page->first;
+        page->first = (page->first + 1) % CURSOR_PAGE;
+    }
+    else {
+        return CYRUSDB_DONE;
+    }
+
+    buf_setmap(&page->keys[slot], key, keylen);
+    buf_setmap(&page->vals[slot], data, datalen);
+
+    return 0;
+}
+
+/* read the page of the range next to key, in the direction of mode.
+ * The cursor keeps its page if the new one is empty */
+static int cursor_fill(struct cyrusdb_cursor *cur, int mode,
+                       const char *key, size_t keylen)
+{
+    struct cursor_fill fill;
+    struct cursor_page *page = xzmalloc(sizeof(struct cursor_page));
+    int r;
+
+    fill.cur = cur;
+    fill.page = page;
+    fill.key = key;
+    fill.keylen = keylen;
+    fill.mode = mode;
+
+    r = cyrusdb_foreach(cur->db, cur->prefix.s, cur->prefix.len, NULL,
+                        cursor_fill_cb, &fill, cur->tid);
+    if (r == CYRUSDB_DONE) r = 0;
+
+    if (!r && !page->count) r = CYRUSDB_DONE;
+
+    if (r) {
+        cursor_page_free(page);
+        return r;
+    }
+
+    if (page->first) {
+        /* put a wrapped around page back in order */
+        struct cursor_page *sorted = xzmalloc(sizeof(struct cursor_page));
+        int i;
+
+        for (i = 0; i < CURSOR_PAGE; i++) {
+            int slot = (page->first + i) % CURSOR_PAGE;
+            sorted->keys[i] = page->keys[slot];
+            sorted->vals[i] = page->vals[slot];
+        }
+        sorted->count = CURSOR_PAGE;
+        free(page);
+        page = sorted;
+    }
+
+    cursor_page_free(cur->page);
+    cur->page = page;
+
+    return 0;
+}
+
+static int cursor_copy_result(struct cyrusdb_cursor *cur,
+                              const char **key, size_t *keylen,
+                              const char **data, size_t *datalen)
+{
+    struct cursor_page *page = cur->page;
+
+    if (key) *key = page->keys[cur->pos].s ? page->keys[cur->pos].s : "";
+    if (keylen) *keylen = page->keys[cur->pos].len;
+    if (data) *data = page->vals[cur->pos].s ? page->vals[cur->pos].s : "";
+    if (datalen) *datalen = page->vals[cur->pos].len;
+
+    return 0;
+}
+
+EXPORTED int cyrusdb_cursor_open(struct db *db,
+                                 const char *prefix, size_t prefixlen,
+                                 struct txn **tid,
+                                 struct cyrusdb_cursor **curp)
+{
+    struct cyrusdb_cursor *cur = xzmalloc(sizeof(struct cyrusdb_cursor));
+    int r = 0;
+
+    cur->db = db;
+    cur->pos = -1;
+
+    if (db->backend->cursor_open) {
+        r = db->backend->cursor_open(db->engine, prefix, prefixlen,
+                                     tid, &cur->engine);
+    }
+    else {
+        /* pages are read when the cursor first moves */
+        if (prefixlen) buf_setmap(&cur->prefix, prefix, prefixlen);
+        cur->tid = tid;
+    }
+
+    if (r) {
+        cyrusdb_cursor_close(cur);
+        cur = NULL;
+    }
+
+    *curp = cur;
+    return r;
+}
+
+EXPORTED int cyrusdb_cursor_seek(struct cyrusdb_cursor *cur,
+                                 const char *key, size_t keylen,
+                                 const char **foundkey, size_t *foundkeylen,
+                                 const char **data, size_t *datalen)
+{
+    int r;
+
+    if (cur->engine)
+        return cur->db->backend->cursor_seek(cur->engine, key, keylen,
+                                             foundkey, foundkeylen,
+                                             data, datalen);
+
+    /* first record at or after key */
+    r = cursor_fill(cur, PAGE_FROM, key, keylen);
+    if (r) return r;
+
+    cur->pos = 0;
+    return cursor_copy_result(cur, foundkey, foundkeylen, data, datalen);
+}
+
+EXPORTED int cyrusdb_cursor_next(struct cyrusdb_cursor *cur,
+                                 const char **key, size_t *keylen,
+                                 const char **data, size_t *datalen)
+{
+    int r;
+
+    if (cur->engine)
+        return cur->db->backend->cursor_next(cur->engine, key, keylen,
+                                             data, datalen);
+
+    if (cur->pos < 0) {
+        r = cursor_fill(cur, PAGE_FROM, NULL, 0);
+        if (r) return r;
+        cur->pos = 0;
+    }
+    else if (cur->pos + 1 < cur->page->count) {
+        cur->pos++;
+    }
+    else {
+        struct buf last = BUF_INITIALIZER;
+
+        buf_copy(&last, &cur->page->keys[cur->pos]);
+        r = cursor_fill(cur, PAGE_AFTER, last.s ? last.s : "", last.len);
+        buf_free(&last);
+        if (r) return r;
+        cur->pos = 0;
+    }
+
+    return cursor_copy_result(cur, key, keylen, data, datalen);
+}
+
+EXPORTED int cyrusdb_cursor_prev(struct cyrusdb_cursor *cur,
+                                 const char **key, size_t *keylen,
+                                 const char **data, size_t *datalen)
+{
+    int r;
+
+    if (cur->engine)
+        return cur->db->backend->cursor_prev(cur->engine, key, keylen,
+                                             data, datalen);
+
+    if (cur->pos < 0) {
+        r = cursor_fill(cur, PAGE_BEFORE, NULL, 0);
+        if (r) return r;
+        cur->pos = cur->page->count - 1;
+    }
+    else if (cur->pos > 0) {
+        cur->pos--;
+    }
+    else {
+        struct buf first = BUF_INITIALIZER;
+
+        buf_copy(&first, &cur->page->keys[0]);
+        r = cursor_fill(cur, PAGE_BEFORE, first.s ? first.s : "", first.len);
+        buf_free(&first);
+        if (r) return r;
+        cur->pos = cur->page->count - 1;
+    }
+
+    return cursor_copy_result(cur, key, keylen, data, datalen);
+}
+
+EXPORTED void cyrusdb_cursor_close(struct cyrusdb_cursor *cur)
+{
+    if (!cur) return;
+
+    if (cur->engine)
+        cur->db->backend->cursor_close(cur->engine);
+
+    cursor_page_free(cur->page);
+    buf_free(&cur->prefix);
+    free(cur);
+}
+
 /**********************************************/
 
 EXPORTED void cyrusdb_init(void)
@@ -352,6 +756,8 @@ EXPORTED void cyrusdb_done(void)
 {
     int i;
 
+    dbcache_expire(1);
+
     for(i=0; _backends[i]; i++) {
         (_backends[i])->done();
     }
@@ -550,6 +956,9 @@ EXPORTED const char *cyrusdb_detect(const char *fname)
     if (!strncmp(buf, "\241\002\213\015twoskip file\0\0\0\0", 16))
         return "twoskip";
 
+    if (!strncmp(buf, "\241\002\213\015lsm file\0\0\0\0", 16))
+        return "lsm";
+
     if (!strncmp(buf+16, "\xde\xc0\xef\xbe", 4))
         return "lmdb";
 
@@ -566,10 +975,21 @@ EXPORTED int cyrusdb_sync(const char *backend)
 EXPORTED int cyrusdb_unlink(const char *backend, const char *fname, int flags)
 {
     struct cyrusdb_backend *db = cyrusdb_fromname(backend);
+    dbcache_drop(fname);
     if (!db->unlink) return 0;
     return db->unlink(fname, flags);
 }
 
+EXPORTED void cyrusdb_release(void)
+{
+    int i;
+
+    for (i = 0; _backends[i]; i++) {
+        if (_backends[i]->release)
+            _backends[i]->release();
+    }
+}
+
 EXPORTED cyrusdb_archiver *cyrusdb_getarchiver(const char *backend)
 {
     struct cyrusdb_backend *db = cyrusdb_fromname(backend);
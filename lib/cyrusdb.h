@@ -90,6 +90,7 @@ typedef int cyrusdb_archiver(const strarray_t *fnames,
                              const char *dirname);
 
 struct dbengine;
+struct dbcursor;
 
 struct cyrusdb_backend {
     const char *name;
@@ -217,6 +218,43 @@ struct cyrusdb_backend {
     int (*repack)(struct dbengine *db);
     int (*compar)(struct dbengine *db, const char *s1, int l1,
                   const char *s2, int l2);
+
+    /* cursors: step through the records that start with 'prefix' in
+       either direction, keeping the position between calls.  The
+       'tid' rules are the same as for foreach.  next and prev return
+       CYRUSDB_DONE when there is no further record in the range, and
+       leave the position where it was.  seek moves to the first
+       record at or after 'key'.  Returned keys stay valid until the
+       next call on the cursor, data until the next call on the db.
+
+       These are optional: cyrusdb_cursor_open() falls back to
+       reading the range a page at a time with foreach for backends
+       without them.  Without a transaction, the pages are read
+       separately, so changes made in between can show. */
+    int (*cursor_open)(struct dbengine *db,
+                       const char *prefix, size_t prefixlen,
+                       struct txn **tid,
+                       struct dbcursor **curp);
+    int (*cursor_seek)(struct dbcursor *cur,
+                       const char *key, size_t keylen,
+                       const char **foundkey, size_t *foundkeylen,
+                       const char **data, size_t *datalen);
+    int (*cursor_next)(struct dbcursor *cur,
+                       const char **key, size_t *keylen,
+                       const char **data, size_t *datalen);
+    int (*cursor_prev)(struct dbcursor *cur,
+                       const char **key, size_t *keylen,
+                       const char **data, size_t *datalen);
+    void (*cursor_close)(struct dbcursor *cur);
+
+    /* drop any read snapshots kept between calls on this backend's
+     * databases, so that an idle process doesn't hold on to old data.
+     * Optional; see cyrusdb_release() */
+    void (*release)(void);
+
+    /* pick up settings read at open again, when a handle kept open
+     * by the handle cache is handed out anew.  Optional */
+    void (*refresh)(struct dbengine *db);
 };
 
 extern int cyrusdb_copyfile(const char *srcname, const char *dstname);
@@ -292,9 +330,34 @@ extern int cyrusdb_compar(struct db *db,
                           const char *a, int alen,
                           const char *b, int blen);
 
+/* cursors - see cursor_open in struct cyrusdb_backend.  A freshly
+ * opened cursor is positioned before the first record of the range,
+ * so next returns the first record and prev the last.  The cursor
+ * must be closed before the db or the transaction it reads. */
+struct cyrusdb_cursor;
+
+extern int cyrusdb_cursor_open(struct db *db,
+                               const char *prefix, size_t prefixlen,
+                               struct txn **tid,
+                               struct cyrusdb_cursor **curp);
+extern int cyrusdb_cursor_seek(struct cyrusdb_cursor *cur,
+                               const char *key, size_t keylen,
+                               const char **foundkey, size_t *foundkeylen,
+                               const char **data, size_t *datalen);
+extern int cyrusdb_cursor_next(struct cyrusdb_cursor *cur,
+                               const char **key, size_t *keylen,
+                               const char **data, size_t *datalen);
+extern int cyrusdb_cursor_prev(struct cyrusdb_cursor *cur,
+                               const char **key, size_t *keylen,
+                               const char **data, size_t *datalen);
+extern void cyrusdb_cursor_close(struct cyrusdb_cursor *cur);
+
 /* somewhat special case, because they don't take a DB */
 
 extern int cyrusdb_sync(const char *backend);
+/* to be called between commands: data returned by earlier calls on
+ * any database may no longer be used afterwards */
+extern void cyrusdb_release(void);
 extern cyrusdb_archiver *cyrusdb_getarchiver(const char *backend);
 
 extern int cyrusdb_canfetchnext(const char *backend);
@@ -71,6 +71,18 @@
  *   of Cyrus DB callers, this backend creates an unique environment
  *   for each database.
  *
+ * - Reads outside of a transaction use a read-only transaction which is
+ *   kept per database and only reset and renewed between calls, rather
+ *   than begun and committed each time.  With the lmdb_zero_copy option
+ *   set, fetch hands out pointers straight into the map, and the
+ *   snapshot they belong to is held until the next call on the database,
+ *   or until cyrusdb_release() is called between commands.
+ *   foreach outside of a transaction then iterates that snapshot too,
+ *   with a cursor that is kept open between calls; callbacks which write
+ *   get their own transactions, like with twoskip.  The environment is
+ *   opened with MDB_NOTLS so that a write can be started while a
+ *   snapshot is still being read.
+ *
  */
 
 /* TODO:
@@ -89,6 +101,7 @@
 #include "bsearch.h"
 #include "cyrusdb.h"
 #include "hash.h"
+#include "libcyr_cfg.h"
 #include "xstrlcpy.h"
 
 #include "lmdb.h"
@@ -105,6 +118,12 @@ struct dbengine {
     void *data;      /* allocated buffer for fetched data */
     size_t datalen;  /* bytes allocated in data */
     struct txn *tid; /* master transaction, if any. See begin_txn. */
+    MDB_dbi dbi;     /* the unnamed database, opened once in myopen */
+    MDB_txn *rtxn;   /* read-only transaction, reset when not in use */
+    int rlive;       /* rtxn holds a snapshot */
+    int rpinned;     /* foreach calls iterating rtxn */
+    MDB_cursor *rcur; /* cursor kept for rtxn */
+    int zerocopy;    /* hand out pointers into the map */
 };
 
 struct dblist {
@@ -112,6 +131,8 @@ struct dblist {
     struct dblist *next;
 };
 
+#define ZERO_COPY libcyrus_config_getswitch(CYRUSOPT_LMDB_ZERO_COPY)
+
 /* Default environment size is 512MB */
 static size_t maxdbsize = 1 << 29;
 
@@ -193,6 +214,45 @@ static int bufferval(struct dbengine *db, MDB_val val, const char **dst, size_t
     return CYRUSDB_OK;
 }
 
+/*
+ * Drop the snapshot of the read-only transaction, unless a foreach is
+ * still iterating over it.
+ */
+static void release_read(struct dbengine *db)
+{
+    if (db->rlive && !db->rpinned) {
+        mdb_txn_reset(db->rtxn);
+        db->rlive = 0;
+    }
+}
+
+/*
+ * Make sure the read-only transaction holds a snapshot.
+ */
+static int acquire_read(struct dbengine *db)
+{
+    int mr;
+
+    if (db->rlive) return CYRUSDB_OK;
+
+    if (db->rtxn) {
+        mr = mdb_txn_renew(db->rtxn);
+        if (mr) {
+            mdb_txn_abort(db->rtxn);
+            db->rtxn = NULL;
+        }
+    } else {
+        mr = mdb_txn_begin(db->env, NULL, MDB_RDONLY, &db->rtxn);
+    }
+    if (mr) {
+        syslog(LOG_ERR, "cryusdb_lmdb(%s): %s", db->fname, mdb_strerror(mr));
+        return my_mdberror(mr);
+    }
+
+    db->rlive = 1;
+    return CYRUSDB_OK;
+}
+
 static int commit_txn(struct dbengine *db, struct txn *tid)
 {
     int mr;
@@ -200,6 +260,8 @@ static int commit_txn(struct dbengine *db, struct txn *tid)
     PDEBUG("cyrusdb_lmdb(%s):     commit_txn %p", db->fname, tid);
     assert(db && tid);
 
+    release_read(db);
+
     mr = mdb_txn_commit(tid->mtxn);
     free(tid);
     if (tid == db->tid) db->tid = NULL;
@@ -213,6 +275,8 @@ static int abort_txn(struct dbengine *db, struct txn *tid)
     PDEBUG("cyrusdb_lmdb(%s):     abort_txn %p", db->fname, tid);
     assert(db && tid);
 
+    release_read(db);
+
     mdb_txn_abort(tid->mtxn);
     free(tid);
     if (tid == db->tid) db->tid = NULL;
@@ -223,11 +287,14 @@ static int abort_txn(struct dbengine *db, struct txn *tid)
 static int begin_txn(struct dbengine *db, struct txn **tidptr, int readonly)
 {
     struct txn *tid = xzmalloc(sizeof(struct txn));
-    int mflags, mr, r;
+    int mr, r;
     struct MDB_txn *parent = NULL;
 
     assert(db && tidptr);
 
+    /* Don't hold on to an old snapshot while writing */
+    release_read(db);
+
     /* Read-only transactions may only be master transactions and do
      * not allow nested transactions. */
     readonly = !db->tid ? readonly : 0;
@@ -253,16 +320,8 @@ static int begin_txn(struct dbengine *db, struct txn **tidptr, int readonly)
 
     PDEBUG("cyrusdb_lmdb(%s):     begin_txn (%p)%p", db->fname, db->tid, tid);
 
-    /* Open the database */
-    mflags = db->flags & CYRUSDB_CREATE ? MDB_CREATE : 0;
-    mr = mdb_dbi_open(tid->mtxn, NULL /*name*/, mflags, &tid->dbi);
-    if (mr) goto fail;
-
-    if (db->flags & CYRUSDB_MBOXSORT) {
-        /* Set mboxsort order */
-        mr = mdb_set_compare(tid->mtxn, tid->dbi, mboxcmp);
-        if (mr) goto fail;
-    }
+    /* The database was opened in myopen */
+    tid->dbi = db->dbi;
 
     if (!db->tid) {
         /* Set the master transaction */
@@ -346,6 +405,7 @@ static int myopen(const char *fname, int flags, struct dbengine **ret,
 {
     struct dbengine *db;
     struct txn *tid = NULL;
+    MDB_txn *mtxn = NULL;
     int r, mr = 0;
 
     PDEBUG("cyrusdb_lmdb(%s): open (create=%d)", fname, flags & CYRUSDB_CREATE);
@@ -355,6 +415,7 @@ static int myopen(const char *fname, int flags, struct dbengine **ret,
     db = (struct dbengine *) xzmalloc(sizeof(struct dbengine));
     db->fname = xstrdup(fname);
     db->flags = flags;
+    db->zerocopy = ZERO_COPY;
 
     /* Assert that either the parent directory or the database exists */
     r = flags & CYRUSDB_CREATE ? my_mkparentdir(fname) : my_stat(fname);
@@ -379,12 +440,36 @@ static int myopen(const char *fname, int flags, struct dbengine **ret,
     }
 
     /* Open the environment */
-    mr = mdb_env_open(db->env, fname, MDB_NOSUBDIR, 0600);
+    mr = mdb_env_open(db->env, fname, MDB_NOSUBDIR | MDB_NOTLS, 0600);
     if (mr) {
         r = CYRUSDB_IOERROR;
         goto fail;
     }
 
+    /* Open the unnamed database. The handle stays valid for all
+     * transactions on the environment once this one is committed */
+    mr = mdb_txn_begin(db->env, NULL, 0, &mtxn);
+    if (mr) {
+        r = my_mdberror(mr);
+        goto fail;
+    }
+    mr = mdb_dbi_open(mtxn, NULL /*name*/,
+                      flags & CYRUSDB_CREATE ? MDB_CREATE : 0, &db->dbi);
+    if (!mr && (flags & CYRUSDB_MBOXSORT)) {
+        /* Set mboxsort order */
+        mr = mdb_set_compare(mtxn, db->dbi, mboxcmp);
+    }
+    if (mr) {
+        mdb_txn_abort(mtxn);
+        r = CYRUSDB_INTERNAL;
+        goto fail;
+    }
+    mr = mdb_txn_commit(mtxn);
+    if (mr) {
+        r = my_mdberror(mr);
+        goto fail;
+    }
+
     /* Touch the unnamend database in the environment */
     r = begin_txn(db, &tid, 0);
     if (r) goto fail;
@@ -420,6 +505,12 @@ static void close_db(struct dbengine *db)
         syslog(LOG_ERR, "cyrusdb_lmdb(%s): stray transaction %p",db->fname, db->tid);
         abort_txn(db, db->tid);
     }
+    if (db->rcur) {
+        mdb_cursor_close(db->rcur);
+    }
+    if (db->rtxn) {
+        mdb_txn_abort(db->rtxn);
+    }
     if (db->env) {
         mdb_env_close(db->env);
     }
@@ -439,6 +530,40 @@ static int myclose(struct dbengine *db)
     return CYRUSDB_OK;
 }
 
+/*
+ * Fetch from the read-only transaction.
+ */
+static int fetch_read(struct dbengine *db, MDB_val *mkey,
+                      const char **data, size_t *datalen)
+{
+    MDB_val mdata;
+    int r, mr;
+
+    r = acquire_read(db);
+    if (r) return r;
+
+    mr = mdb_get(db->rtxn, db->dbi, mkey, &mdata);
+    if (mr == MDB_NOTFOUND) {
+        r = CYRUSDB_NOTFOUND;
+        if (datalen) *datalen = 0;
+        if (data) *data = NULL;
+    } else if (mr) {
+        syslog(LOG_ERR, "cryusdb_lmdb(%s): %s", db->fname, mdb_strerror(mr));
+        r = CYRUSDB_INTERNAL;
+    } else if (data && datalen) {
+        if (db->zerocopy) {
+            /* Valid until the snapshot is released by the next call */
+            *data = mdata.mv_data;
+            *datalen = mdata.mv_size;
+            return CYRUSDB_OK;
+        }
+        r = bufferval(db, mdata, data, datalen);
+    }
+
+    release_read(db);
+    return r;
+}
+
 static int fetch(struct dbengine *db, const char *key, size_t keylen,
                  const char **data, size_t *datalen, struct txn **tidptr)
 {
@@ -452,6 +577,14 @@ static int fetch(struct dbengine *db, const char *key, size_t keylen,
     mkey.mv_data = (void*) key;
     mkey.mv_size = keylen;
 
+    /* Start from the latest commit */
+    release_read(db);
+
+    /* Callbacks of a foreach over rtxn must see their own writes, so
+     * they get a transaction of their own */
+    if (!tidptr && !db->tid && !db->rpinned)
+        return fetch_read(db, &mkey, data, datalen);
+
     /* Open or reuse transaction */
     r = getorset_txn(db, tidptr, &tid, !tidptr /*readonly*/);
     if (r) goto fail;
@@ -489,23 +622,15 @@ fail:
     return r ? r : r2;
 }
 
-static int foreach(struct dbengine *db, const char *prefix, size_t prefixlen,
-                   foreach_p *p, foreach_cb *cb, void *rock, struct txn **tidptr)
+/*
+ * Run the foreach callbacks for all records from cur matching prefix.
+ * Returns the result of the last callback, and any LMDB error in mrp.
+ */
+static int foreach_cursor(MDB_cursor *cur, const char *prefix, size_t prefixlen,
+                          foreach_p *p, foreach_cb *cb, void *rock, int *mrp)
 {
-    int r, r2, mr = 0;
-    struct txn *tid = NULL;
-    MDB_cursor *cur = NULL;
     MDB_val key, val;
-
-    PDEBUG("cyrusdb_lmdb(%s): foreach", db->fname);
-    assert(db);
-
-    /* Open or reuse transaction */
-    r = getorset_txn(db, tidptr, &tid, 0);
-    if (r) goto fail;
-
-    mr = mdb_cursor_open(tid->mtxn, tid->dbi, &cur);
-    if (mr) goto fail;
+    int r = 0, mr;
 
     /* Normalize and set prefix for search */
     if (prefix && !prefixlen) {
@@ -530,7 +655,74 @@ static int foreach(struct dbengine *db, const char *prefix, size_t prefixlen,
         mr = mdb_cursor_get(cur, &key, &val, MDB_NEXT);
     }
 
-    if (mr && mr != MDB_NOTFOUND)
+    *mrp = mr == MDB_NOTFOUND ? 0 : mr;
+    return r;
+}
+
+/*
+ * Iterate over the read-only transaction.  The outermost foreach reuses
+ * the cursor kept in db, nested ones open their own.
+ */
+static int foreach_read(struct dbengine *db, const char *prefix, size_t prefixlen,
+                        foreach_p *p, foreach_cb *cb, void *rock)
+{
+    MDB_cursor *cur = NULL;
+    int r, mr;
+
+    r = acquire_read(db);
+    if (r) return r;
+
+    if (db->rpinned) {
+        mr = mdb_cursor_open(db->rtxn, db->dbi, &cur);
+    } else if (db->rcur) {
+        mr = mdb_cursor_renew(db->rtxn, db->rcur);
+        cur = db->rcur;
+    } else {
+        mr = mdb_cursor_open(db->rtxn, db->dbi, &db->rcur);
+        cur = db->rcur;
+    }
+
+    if (!mr) {
+        db->rpinned++;
+        r = foreach_cursor(cur, prefix, prefixlen, p, cb, rock, &mr);
+        db->rpinned--;
+    }
+
+    if (cur && cur != db->rcur)
+        mdb_cursor_close(cur);
+    release_read(db);
+
+    if (mr) {
+        syslog(LOG_ERR, "cryusdb_lmdb(%s): %s", db->fname, mdb_strerror(mr));
+        r = my_mdberror(mr);
+    }
+    return r;
+}
+
+static int foreach(struct dbengine *db, const char *prefix, size_t prefixlen,
+                   foreach_p *p, foreach_cb *cb, void *rock, struct txn **tidptr)
+{
+    int r, r2, mr = 0;
+    struct txn *tid = NULL;
+    MDB_cursor *cur = NULL;
+
+    PDEBUG("cyrusdb_lmdb(%s): foreach", db->fname);
+    assert(db);
+
+    release_read(db);
+
+    if (db->zerocopy && !tidptr && !db->tid)
+        return foreach_read(db, prefix, prefixlen, p, cb, rock);
+
+    /* Open or reuse transaction */
+    r = getorset_txn(db, tidptr, &tid, 0);
+    if (r) goto fail;
+
+    mr = mdb_cursor_open(tid->mtxn, tid->dbi, &cur);
+    if (mr) goto fail;
+
+    r = foreach_cursor(cur, prefix, prefixlen, p, cb, rock, &mr);
+    if (mr)
         goto fail;
 
     mdb_cursor_close(cur);
@@ -564,6 +756,8 @@ static int put(struct dbengine *db, const char *key, size_t keylen,
     mdata.mv_data = (void*) data;
     mdata.mv_size = datalen;
 
+    release_read(db);
+
     /* Open or reuse transaction */
     r = getorset_txn(db, tidptr, &tid, 0);
     if (r) goto fail;
@@ -618,6 +812,8 @@ static int delete(struct dbengine *db, const char *key, size_t keylen,
     mkey.mv_data = (void*) key;
     mkey.mv_size = keylen;
 
+    release_read(db);
+
     /* Open or reuse transaction */
     r = getorset_txn(db, tidptr, &tid, 0);
     if (r) goto fail;
@@ -652,32 +848,30 @@ static int mycompar(struct dbengine *db, const char *a, int alen,
                     const char *b, int blen)
 {
     int cmp;
-    struct txn *tid = NULL;
     MDB_val ma, mb;
     int use_mboxcmp = db->flags & CYRUSDB_MBOXSORT;
 
     assert(db && a && b);
 
-    /* LMDB internal order requires a transaction to operate on */
-    if (!use_mboxcmp && begin_txn(db, &tid, 1 /*readonly*/)) {
-        syslog(LOG_ERR, "lmdb_compar(%s): internal error", db->fname);
-        return -1;
-    }
-
     ma.mv_data = (void *) a;
     ma.mv_size = alen;
     mb.mv_data = (void *) b;
     mb.mv_size = blen;
 
-    /* Compare values using appropriate comparator */
-    cmp = use_mboxcmp ? mboxcmp(&ma, &mb) : mdb_cmp(tid->mtxn, tid->dbi, &ma, &mb);
+    if (use_mboxcmp)
+        return mboxcmp(&ma, &mb);
 
-    /* Discard LMDB-owned transaction, if any */
-    if (!use_mboxcmp && abort_txn(db, tid)) {
+    /* LMDB internal order requires a transaction to operate on */
+    if (acquire_read(db)) {
         syslog(LOG_ERR, "lmdb_compar(%s): internal error", db->fname);
         return -1;
     }
 
+    cmp = mdb_cmp(db->rtxn, db->dbi, &ma, &mb);
+
+    /* Leave any snapshot handed out by fetch alone */
+    if (!db->zerocopy) release_read(db);
+
     return cmp;
 }
 
@@ -767,6 +961,27 @@ static int mysync(void)
     return r;
 }
 
+/*
+ * Drop the snapshots held for zero copy fetches, so that an idle process
+ * doesn't keep writers from reusing the pages they reference.
+ */
+static void release(void)
+{
+    struct dblist *l;
+
+    for (l = dbs; l; l = l->next)
+        release_read(l->db);
+}
+
+/*
+ * Pick up a changed lmdb_zero_copy setting for a cached handle.
+ */
+static void myrefresh(struct dbengine *db)
+{
+    release_read(db);
+    db->zerocopy = ZERO_COPY;
+}
+
 static int archive(const strarray_t *fnames, const char *dirname)
 {
     struct hash_table want = HASH_TABLE_INITIALIZER;
@@ -879,5 +1094,14 @@ EXPORTED struct cyrusdb_backend cyrusdb_lmdb =
     NULL, /* dump */
     NULL, /* consistent */
     NULL, /* repack */
-    &mycompar
+    &mycompar,
+
+    NULL, /* cursor_open */
+    NULL, /* cursor_seek */
+    NULL, /* cursor_next */
+    NULL, /* cursor_prev */
+    NULL, /* cursor_close */
+
+    &release,
+    &myrefresh
 };
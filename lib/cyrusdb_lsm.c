@@ -0,0 +1,2224 @@
+/* cyrusdb_lsm.c - log structured merge tree database backend
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "assert.h"
+#include "bsearch.h"
+#include "byteorder64.h"
+#include "cyr_lock.h"
+#include "cyrusdb.h"
+#include "crc32.h"
+#include "libcyr_cfg.h"
+#include "map.h"
+#include "mappedfile.h"
+#include "retry.h"
+#include "strarray.h"
+#include "util.h"
+#include "xmalloc.h"
+#include "xstrlcpy.h"
+
+/*
+ * lsm disk format.
+ *
+ * GOALS:
+ *  a) cheap writes - every transaction is a single append
+ *  b) no rewriting of the whole database on every repack
+ *  c) records which expire without anyone deleting them
+ *
+ * ACHIEVED BY:
+ *  a)
+ *   - the main file is a header followed by an append-only log.
+ *     Each transaction appends its records and then a commit record
+ *     holding the crc32 of everything it wrote.  Readers only apply
+ *     records followed by a valid commit.
+ *   - in memory, each process keeps a "memtable" - the offsets of the
+ *     newest record for each key in the log, sorted by key.
+ *  b)
+ *   - once the log grows past LOG_FLUSH_SIZE, the memtable is written
+ *     out as an immutable sorted "run" file (fname.<id>) and the main
+ *     file is replaced with a fresh one listing the new run first.
+ *   - reads merge the memtable and the runs, newest first.
+ *   - after a commit has released the lock, neighbouring runs of
+ *     similar size are merged into one (size-tiered compaction).
+ *     The merge itself runs unlocked, since runs never change - the
+ *     lock is only taken to swap the result into the header.
+ *   - deletes are tombstone records, dropped when a merge reaches
+ *     the oldest run.
+ *  c)
+ *   - every record carries the time it was stored.  If lsm_ttl
+ *     gives a lifetime for this database, older records read as
+ *     missing and are dropped when they're next merged.
+ *
+ * HEADER: 128 bytes
+ *  magic: 16 bytes
+ *  version: 4 bytes
+ *  flags: 4 bytes
+ *  generation: 8 bytes - bumped every time the log is flushed
+ *  nextrun: 8 bytes - id for the next run file
+ *  num_runs: 4 bytes
+ *  padding: 4 bytes
+ *  runs: 8 * 8 bytes - run ids, newest first
+ *  padding: 12 bytes
+ *  crc32: 4 bytes
+ *
+ * RECORD: 16 bytes + key + value, padded to 8 bytes
+ *  type: 1 byte - STORE, DELETE or COMMIT
+ *  padding: 3 bytes
+ *  stamp: 4 bytes - time the record was written
+ *  keylen: 4 bytes
+ *  vallen: 4 bytes - for COMMIT records, the crc32 of the transaction
+ *
+ * RUN FILE: 64 byte header, records, index
+ *  magic: 16 bytes
+ *  version: 4 bytes
+ *  padding: 4 bytes
+ *  num_records: 8 bytes
+ *  index_offset: 8 bytes
+ *  padding: 20 bytes
+ *  crc32: 4 bytes
+ *
+ *  The records are in key order, and the index is num_records 8 byte
+ *  offsets to them.
+ */
+
+/* flush the log to a new run once it gets this big */
+#define LOG_FLUSH_SIZE (1024*1024)
+
+/* maximum number of runs - a flush that would exceed it merges everything */
+#define MAXRUNS 8
+
+/* merge a run into the ones above it if they add up to this fraction */
+#define COMPACT_RATIO 2
+
+/* release the read lock after this many skipped records in foreach */
+#define FOREACH_LOCK_RELEASE 256
+
+/* below this many new records, insert into the memtable one by one */
+#define REPLAY_SORT_MIN 32
+
+/* write out run files in chunks of this size */
+#define WRITE_CHUNK 65536
+
+#define TTL_CONFIG libcyrus_config_getstring(CYRUSOPT_LSM_TTL)
+
+/* format specifics */
+#undef VERSION /* defined in config.h */
+#define VERSION 1
+
+/* type aliases */
+#define LLU long long unsigned int
+#define LU long unsigned int
+
+/* record types */
+#define STORE '+'
+#define DELETE '-'
+#define COMMIT '$'
+
+#define HEADER_MAGIC ("\241\002\213\015lsm file\0\0\0\0")
+#define HEADER_MAGIC_SIZE (16)
+#define HEADER_SIZE 128
+
+/* offsets of header files */
+enum {
+    OFFSET_HEADER = 0,
+    OFFSET_VERSION = 16,
+    OFFSET_FLAGS = 20,
+    OFFSET_GENERATION = 24,
+    OFFSET_NEXTRUN = 32,
+    OFFSET_NUM_RUNS = 40,
+    OFFSET_RUNS = 48,
+    OFFSET_CRC32 = 124
+};
+
+#define RUN_MAGIC ("\241\002\213\015lsm run\0\0\0\0\0")
+#define RUN_MAGIC_SIZE (16)
+#define RUN_HEADER_SIZE 64
+
+enum {
+    RUN_OFFSET_VERSION = 16,
+    RUN_OFFSET_NUM_RECORDS = 24,
+    RUN_OFFSET_INDEX = 32,
+    RUN_OFFSET_CRC32 = 60
+};
+
+#define RECORD_HEAD 16
+
+struct lsmrecord {
+    size_t offset;
+    size_t len;
+    char type;
+    uint32_t stamp;
+    const char *key;
+    size_t keylen;
+    const char *val;
+    size_t vallen;
+};
+
+/* an immutable sorted run, mapped in full */
+struct lsmrun {
+    uint64_t id;
+    const char *base;
+    size_t size;
+    size_t num_records;
+    const uint64_t *index;
+};
+
+/* one sorted input to a lookup: the memtable or a run */
+struct lsmsource {
+    const char *base;
+    size_t size;
+    const uint64_t *offsets;
+    size_t count;
+    int netorder;
+};
+
+/* merges its sources in key order, newest source winning */
+struct lsmiter {
+    int nsrc;
+    struct lsmsource src[MAXRUNS+1];
+    size_t pos[MAXRUNS+1];
+    uint64_t changes;
+};
+
+struct txn {
+    int num;
+};
+
+struct db_header {
+    uint32_t version;
+    uint32_t flags;
+    uint64_t generation;
+    uint64_t nextrun;
+    uint32_t num_runs;
+    uint64_t runs[MAXRUNS];
+};
+
+struct dbengine {
+    /* file data */
+    struct mappedfile *mf;
+    struct db_header header;
+    int is_open;
+
+    /* runs listed in the header, newest first */
+    struct lsmrun runs[MAXRUNS];
+    int num_runs;
+
+    /* runs dropped while a foreach may still be handing out pointers */
+    struct lsmrun *retired;
+    int num_retired;
+    int foreach_depth;
+
+    /* the memtable: offsets of the newest record for each key in the
+     * log, sorted by key.  Includes the current transaction's writes */
+    uint64_t *mem;
+    size_t mem_count;
+    size_t mem_alloc;
+    uint64_t generation;        /* of the log the memtable was read from */
+    size_t end;                 /* end of the last commit we've read */
+    size_t txn_end;             /* end of the current transaction */
+
+    /* bumped whenever anything a reader could be positioned on moves */
+    uint64_t changes;
+
+    /* tracking info */
+    int txn_num;
+    struct txn *current_txn;
+    int want_compact;
+
+    /* comparator function to use for sorting */
+    int open_flags;
+    int (*compar) (const char *s1, int l1, const char *s2, int l2);
+
+    /* seconds a record stays visible, zero for forever */
+    time_t ttl;
+
+    struct buf keybuf;
+};
+
+struct db_list {
+    struct dbengine *db;
+    struct db_list *next;
+    int refcount;
+};
+
+static struct db_list *open_lsm = NULL;
+
+static int mycommit(struct dbengine *db, struct txn *tid);
+static int myabort(struct dbengine *db, struct txn *tid);
+static int compact(struct dbengine *db, int all);
+
+/************** HELPER FUNCTIONS ****************/
+
+#define BASE(db) mappedfile_base((db)->mf)
+#define SIZE(db) mappedfile_size((db)->mf)
+#define FNAME(db) mappedfile_fname((db)->mf)
+
+static size_t roundup(size_t record_size, int howfar)
+{
+    if (record_size % howfar)
+        record_size += howfar - (record_size % howfar);
+    return record_size;
+}
+
+static char *run_fname(const char *fname, uint64_t id)
+{
+    struct buf buf = BUF_INITIALIZER;
+
+    buf_printf(&buf, "%s.%llu", fname, (LLU)id);
+
+    return buf_release(&buf);
+}
+
+/* the lifetime configured for this database in lsm_ttl, which is a
+ * list of "basename=seconds" pairs */
+static time_t config_ttl(const char *fname)
+{
+    const char *conf = TTL_CONFIG;
+    const char *base;
+    strarray_t *sa;
+    time_t ttl = 0;
+    int i;
+
+    if (!conf || !*conf) return 0;
+
+    base = strrchr(fname, '/');
+    base = base ? base + 1 : fname;
+
+    sa = strarray_split(conf, " ,", STRARRAY_TRIM);
+    for (i = 0; i < sa->count; i++) {
+        const char *item = strarray_nth(sa, i);
+        const char *eq = strchr(item, '=');
+        if (!eq) continue;
+        if ((size_t)(eq - item) != strlen(base)) continue;
+        if (strncmp(item, base, eq - item)) continue;
+        ttl = atol(eq + 1);
+    }
+    strarray_free(sa);
+
+    return ttl;
+}
+
+/************** HEADER ****************/
+
+static int parse_header(const char *base, size_t size, const char *fname,
+                        struct db_header *header)
+{
+    uint32_t i;
+
+    if (size < HEADER_SIZE) {
+        syslog(LOG_ERR,
+               "lsm: file not large enough for header: %s", fname);
+        return CYRUSDB_IOERROR;
+    }
+
+    if (memcmp(base, HEADER_MAGIC, HEADER_MAGIC_SIZE)) {
+        syslog(LOG_ERR, "lsm: invalid magic header: %s", fname);
+        return CYRUSDB_IOERROR;
+    }
+
+    if (crc32_map(base, OFFSET_CRC32)
+        != ntohl(*((uint32_t *)(base + OFFSET_CRC32)))) {
+        syslog(LOG_ERR, "DBERROR: %s: lsm header CRC failure", fname);
+        return CYRUSDB_IOERROR;
+    }
+
+    header->version = ntohl(*((uint32_t *)(base + OFFSET_VERSION)));
+    if (header->version > VERSION) {
+        syslog(LOG_ERR, "lsm: version mismatch: %s has version %d",
+               fname, header->version);
+        return CYRUSDB_IOERROR;
+    }
+
+    header->flags = ntohl(*((uint32_t *)(base + OFFSET_FLAGS)));
+    header->generation = ntohll(*((uint64_t *)(base + OFFSET_GENERATION)));
+    header->nextrun = ntohll(*((uint64_t *)(base + OFFSET_NEXTRUN)));
+    header->num_runs = ntohl(*((uint32_t *)(base + OFFSET_NUM_RUNS)));
+
+    if (header->num_runs > MAXRUNS) {
+        syslog(LOG_ERR, "DBERROR: %s: lsm header has %u runs",
+               fname, header->num_runs);
+        return CYRUSDB_IOERROR;
+    }
+
+    for (i = 0; i < header->num_runs; i++)
+        header->runs[i] = ntohll(*((uint64_t *)(base + OFFSET_RUNS + 8*i)));
+
+    return 0;
+}
+
+static void format_header(const struct db_header *header, char *buf)
+{
+    uint32_t i;
+
+    memset(buf, 0, HEADER_SIZE);
+    memcpy(buf, HEADER_MAGIC, HEADER_MAGIC_SIZE);
+    *((uint32_t *)(buf + OFFSET_VERSION)) = htonl(header->version);
+    *((uint32_t *)(buf + OFFSET_FLAGS)) = htonl(header->flags);
+    *((uint64_t *)(buf + OFFSET_GENERATION)) = htonll(header->generation);
+    *((uint64_t *)(buf + OFFSET_NEXTRUN)) = htonll(header->nextrun);
+    *((uint32_t *)(buf + OFFSET_NUM_RUNS)) = htonl(header->num_runs);
+    for (i = 0; i < header->num_runs; i++)
+        *((uint64_t *)(buf + OFFSET_RUNS + 8*i)) = htonll(header->runs[i]);
+    *((uint32_t *)(buf + OFFSET_CRC32)) = htonl(crc32_map(buf, OFFSET_CRC32));
+}
+
+/* given an open, mapped, locked db, read the header information */
+static int read_header(struct dbengine *db)
+{
+    assert(db && db->mf && db->is_open);
+
+    return parse_header(BASE(db), SIZE(db), FNAME(db), &db->header);
+}
+
+/* given an open, mapped, write locked db, write and sync the header */
+static int commit_header(struct dbengine *db)
+{
+    char buf[HEADER_SIZE];
+    int n;
+
+    format_header(&db->header, buf);
+
+    n = mappedfile_pwrite(db->mf, buf, HEADER_SIZE, 0);
+    if (n < 0) return CYRUSDB_IOERROR;
+
+    return mappedfile_commit(db->mf);
+}
+
+/******************** RECORD *********************/
+
+static int parse_record(const char *base, size_t size, size_t offset,
+                        struct lsmrecord *record)
+{
+    const char *ptr;
+
+    if (offset + RECORD_HEAD > size)
+        return CYRUSDB_IOERROR;
+
+    ptr = base + offset;
+
+    record->offset = offset;
+    record->type = ptr[0];
+    record->stamp = ntohl(*((uint32_t *)(ptr + 4)));
+    record->keylen = ntohl(*((uint32_t *)(ptr + 8)));
+    record->vallen = ntohl(*((uint32_t *)(ptr + 12)));
+
+    if (record->type == COMMIT) {
+        record->len = RECORD_HEAD;
+        record->key = record->val = NULL;
+        record->keylen = 0;
+        return 0;
+    }
+
+    if (record->type != STORE && record->type != DELETE)
+        return CYRUSDB_IOERROR;
+
+    record->len = roundup(RECORD_HEAD + record->keylen + record->vallen, 8);
+    if (record->len > size - offset)
+        return CYRUSDB_IOERROR;
+
+    record->key = ptr + RECORD_HEAD;
+    record->val = record->key + record->keylen;
+
+    return 0;
+}
+
+static void format_record(struct buf *buf, char type, uint32_t stamp,
+                          const char *key, size_t keylen,
+                          const char *val, size_t vallen)
+{
+    static const char zeros[8];
+    char head[RECORD_HEAD];
+    size_t len = RECORD_HEAD + keylen + vallen;
+
+    memset(head, 0, RECORD_HEAD);
+    head[0] = type;
+    *((uint32_t *)(head + 4)) = htonl(stamp);
+    *((uint32_t *)(head + 8)) = htonl(keylen);
+    *((uint32_t *)(head + 12)) = htonl(vallen);
+
+    buf_appendmap(buf, head, RECORD_HEAD);
+    buf_appendmap(buf, key, keylen);
+    buf_appendmap(buf, val, vallen);
+    buf_appendmap(buf, zeros, roundup(len, 8) - len);
+}
+
+/* is this the live value for its key? */
+static int is_live(struct dbengine *db, const struct lsmrecord *record,
+                   time_t now)
+{
+    if (record->type != STORE) return 0;
+    if (db->ttl && (time_t)record->stamp + db->ttl <= now) return 0;
+    return 1;
+}
+
+/******************** RUNS *********************/
+
+static int open_run(struct dbengine *db, uint64_t id, struct lsmrun *run)
+{
+    char *fname = run_fname(FNAME(db), id);
+    struct stat sbuf;
+    uint64_t index_offset;
+    int r = CYRUSDB_IOERROR;
+    int fd;
+
+    memset(run, 0, sizeof(struct lsmrun));
+    run->id = id;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "IOERROR: lsm: open %s: %m", fname);
+        goto done;
+    }
+
+    if (fstat(fd, &sbuf) < 0) {
+        syslog(LOG_ERR, "IOERROR: lsm: fstat %s: %m", fname);
+        close(fd);
+        goto done;
+    }
+
+    if (sbuf.st_size < RUN_HEADER_SIZE) {
+        syslog(LOG_ERR, "DBERROR: lsm: run too short: %s", fname);
+        close(fd);
+        goto done;
+    }
+
+    map_refresh(fd, 1, &run->base, &run->size, sbuf.st_size, fname, NULL);
+    close(fd);
+
+    if (memcmp(run->base, RUN_MAGIC, RUN_MAGIC_SIZE)
+        || crc32_map(run->base, RUN_OFFSET_CRC32)
+           != ntohl(*((uint32_t *)(run->base + RUN_OFFSET_CRC32)))) {
+        syslog(LOG_ERR, "DBERROR: lsm: invalid run header: %s", fname);
+        goto done;
+    }
+
+    if (ntohl(*((uint32_t *)(run->base + RUN_OFFSET_VERSION))) > VERSION) {
+        syslog(LOG_ERR, "DBERROR: lsm: run version mismatch: %s", fname);
+        goto done;
+    }
+
+    run->num_records
+        = ntohll(*((uint64_t *)(run->base + RUN_OFFSET_NUM_RECORDS)));
+    index_offset = ntohll(*((uint64_t *)(run->base + RUN_OFFSET_INDEX)));
+
+    if (index_offset % 8 || index_offset > run->size
+        || run->num_records > (run->size - index_offset) / 8) {
+        syslog(LOG_ERR, "DBERROR: lsm: invalid run index: %s", fname);
+        goto done;
+    }
+
+    run->index = (const uint64_t *)(run->base + index_offset);
+    r = 0;
+
+done:
+    if (r && run->base) map_free(&run->base, &run->size);
+    free(fname);
+    return r;
+}
+
+static void close_run(struct lsmrun *run)
+{
+    if (run->base) map_free(&run->base, &run->size);
+    memset(run, 0, sizeof(struct lsmrun));
+}
+
+/* a foreach may still be holding a pointer into this run, so only
+ * unmap it once the outermost one has finished */
+static void retire_run(struct dbengine *db, struct lsmrun *run)
+{
+    if (!db->foreach_depth) {
+        close_run(run);
+        return;
+    }
+
+    db->retired = xrealloc(db->retired,
+                           (db->num_retired + 1) * sizeof(struct lsmrun));
+    db->retired[db->num_retired++] = *run;
+    memset(run, 0, sizeof(struct lsmrun));
+}
+
+static void free_retired(struct dbengine *db)
+{
+    int i;
+
+    for (i = 0; i < db->num_retired; i++)
+        close_run(&db->retired[i]);
+
+    free(db->retired);
+    db->retired = NULL;
+    db->num_retired = 0;
+}
+
+/* make the mapped runs match the list in the header */
+static int load_runs(struct dbengine *db)
+{
+    struct lsmrun runs[MAXRUNS];
+    int taken[MAXRUNS];
+    int changed = ((uint32_t)db->num_runs != db->header.num_runs);
+    uint32_t i;
+    int j;
+    int r = 0;
+
+    memset(taken, 0, sizeof(taken));
+
+    for (i = 0; i < db->header.num_runs; i++) {
+        for (j = 0; j < db->num_runs; j++) {
+            if (!taken[j] && db->runs[j].id == db->header.runs[i])
+                break;
+        }
+
+        if (j < db->num_runs) {
+            if ((uint32_t)j != i) changed = 1;
+            runs[i] = db->runs[j];
+            taken[j] = 1;
+            continue;
+        }
+
+        r = open_run(db, db->header.runs[i], &runs[i]);
+        if (r) {
+            /* throw away just the ones we opened */
+            while (i-- > 0) {
+                for (j = 0; j < db->num_runs; j++)
+                    if (taken[j] && db->runs[j].base == runs[i].base) break;
+                if (j == db->num_runs) close_run(&runs[i]);
+            }
+            return r;
+        }
+        changed = 1;
+    }
+
+    for (j = 0; j < db->num_runs; j++) {
+        if (!taken[j]) retire_run(db, &db->runs[j]);
+    }
+
+    memcpy(db->runs, runs, db->header.num_runs * sizeof(struct lsmrun));
+    db->num_runs = db->header.num_runs;
+
+    if (changed) db->changes++;
+
+    return 0;
+}
+
+/******************** SOURCES *********************/
+
+/* source 0 is the memtable, source N is run N-1 */
+static void source_init(struct dbengine *db, int n, struct lsmsource *src)
+{
+    if (!n) {
+        src->base = BASE(db);
+        src->size = SIZE(db);
+        src->offsets = db->mem;
+        src->count = db->mem_count;
+        src->netorder = 0;
+    }
+    else {
+        struct lsmrun *run = &db->runs[n-1];
+        src->base = run->base;
+        src->size = run->size;
+        src->offsets = run->index;
+        src->count = run->num_records;
+        src->netorder = 1;
+    }
+}
+
+static int source_record(const struct lsmsource *src, size_t n,
+                         struct lsmrecord *record)
+{
+    uint64_t offset = src->offsets[n];
+
+    if (src->netorder) offset = ntohll(offset);
+
+    return parse_record(src->base, src->size, offset, record);
+}
+
+/* find the first record in src not less than key */
+static int source_seek(struct dbengine *db, const struct lsmsource *src,
+                       const char *key, size_t keylen,
+                       size_t *posp, int *exactp)
+{
+    struct lsmrecord record;
+    size_t lo = 0, hi = src->count;
+    int r;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        r = source_record(src, mid, &record);
+        if (r) return r;
+        if (db->compar(record.key, record.keylen, key, keylen) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *posp = lo;
+    *exactp = 0;
+
+    if (lo < src->count) {
+        r = source_record(src, lo, &record);
+        if (r) return r;
+        *exactp = !db->compar(record.key, record.keylen, key, keylen);
+    }
+
+    return 0;
+}
+
+/* find the newest record for key, which may be a tombstone */
+static int find_record(struct dbengine *db, const char *key, size_t keylen,
+                       struct lsmrecord *record)
+{
+    struct lsmsource src;
+    size_t pos;
+    int exact;
+    int i, r;
+
+    for (i = 0; i <= db->num_runs; i++) {
+        source_init(db, i, &src);
+        r = source_seek(db, &src, key, keylen, &pos, &exact);
+        if (r) return r;
+        if (exact) return source_record(&src, pos, record);
+    }
+
+    return CYRUSDB_NOTFOUND;
+}
+
+/******************** ITERATOR *********************/
+
+/* iterate over the memtable (if withmem) and runs first..last */
+static void iter_init(struct dbengine *db, struct lsmiter *it,
+                      int withmem, int first, int last)
+{
+    int i;
+
+    it->nsrc = 0;
+    if (withmem)
+        source_init(db, 0, &it->src[it->nsrc++]);
+    for (i = first; i <= last && i < db->num_runs; i++)
+        source_init(db, i + 1, &it->src[it->nsrc++]);
+
+    memset(it->pos, 0, sizeof(it->pos));
+    it->changes = db->changes;
+}
+
+/* position at key, or just after it */
+static int iter_seek(struct dbengine *db, struct lsmiter *it,
+                     const char *key, size_t keylen, int after)
+{
+    int exact;
+    int i, r;
+
+    for (i = 0; i < it->nsrc; i++) {
+        r = source_seek(db, &it->src[i], key, keylen, &it->pos[i], &exact);
+        if (r) return r;
+        if (after && exact) it->pos[i]++;
+    }
+
+    return 0;
+}
+
+/* the next key in order, including tombstones.  Older versions of
+ * the same key in later sources are skipped */
+static int iter_next(struct dbengine *db, struct lsmiter *it,
+                     struct lsmrecord *record)
+{
+    struct lsmrecord cur;
+    int best = -1;
+    int i, r;
+
+    for (i = 0; i < it->nsrc; i++) {
+        if (it->pos[i] >= it->src[i].count) continue;
+        r = source_record(&it->src[i], it->pos[i], &cur);
+        if (r) return r;
+        if (best < 0 || db->compar(cur.key, cur.keylen,
+                                   record->key, record->keylen) < 0) {
+            *record = cur;
+            best = i;
+        }
+    }
+
+    if (best < 0) return CYRUSDB_NOTFOUND;
+
+    for (i = best; i < it->nsrc; i++) {
+        if (it->pos[i] >= it->src[i].count) continue;
+        if (i > best) {
+            r = source_record(&it->src[i], it->pos[i], &cur);
+            if (r) return r;
+            if (db->compar(cur.key, cur.keylen, record->key, record->keylen))
+                continue;
+        }
+        it->pos[i]++;
+    }
+
+    return 0;
+}
+
+/* the next live key in order */
+static int iter_next_live(struct dbengine *db, struct lsmiter *it,
+                          struct lsmrecord *record)
+{
+    time_t now = db->ttl ? time(NULL) : 0;
+    int r;
+
+    do {
+        r = iter_next(db, it, record);
+    } while (!r && !is_live(db, record, now));
+
+    return r;
+}
+
+/******************** MEMTABLE *********************/
+
+/* for sorting the memtable with qsort */
+static struct dbengine *sort_db;
+
+static int mem_sort_cmp(const void *a, const void *b)
+{
+    uint64_t oa = *((const uint64_t *)a);
+    uint64_t ob = *((const uint64_t *)b);
+    const char *base = BASE(sort_db);
+    struct lsmrecord ra, rb;
+    int cmp;
+
+    /* already checked by replay */
+    parse_record(base, SIZE(sort_db), oa, &ra);
+    parse_record(base, SIZE(sort_db), ob, &rb);
+
+    cmp = sort_db->compar(ra.key, ra.keylen, rb.key, rb.keylen);
+    if (cmp) return cmp;
+
+    /* same key - later in the log is newer */
+    return oa < ob ? -1 : oa > ob;
+}
+
+static void mem_grow(struct dbengine *db, size_t count)
+{
+    if (count <= db->mem_alloc) return;
+
+    db->mem_alloc = count + 1024;
+    db->mem = xrealloc(db->mem, db->mem_alloc * sizeof(uint64_t));
+}
+
+/* pos and exact as found by source_seek on the memtable */
+static void mem_put(struct dbengine *db, size_t pos, int exact,
+                    uint64_t offset)
+{
+    if (!exact) {
+        mem_grow(db, db->mem_count + 1);
+        memmove(db->mem + pos + 1, db->mem + pos,
+                (db->mem_count - pos) * sizeof(uint64_t));
+        db->mem_count++;
+    }
+
+    db->mem[pos] = offset;
+}
+
+static int mem_apply(struct dbengine *db, const uint64_t *offsets, size_t n)
+{
+    struct lsmsource src;
+    struct lsmrecord record;
+    size_t i, j, pos;
+    int exact;
+    int r;
+
+    if (n < REPLAY_SORT_MIN) {
+        for (i = 0; i < n; i++) {
+            r = parse_record(BASE(db), SIZE(db), offsets[i], &record);
+            if (r) return r;
+            source_init(db, 0, &src);
+            r = source_seek(db, &src, record.key, record.keylen, &pos, &exact);
+            if (r) return r;
+            mem_put(db, pos, exact, offsets[i]);
+        }
+        return 0;
+    }
+
+    /* lots of records, cheaper to sort it all and keep the newest */
+    mem_grow(db, db->mem_count + n);
+    memcpy(db->mem + db->mem_count, offsets, n * sizeof(uint64_t));
+    db->mem_count += n;
+
+    sort_db = db;
+    qsort(db->mem, db->mem_count, sizeof(uint64_t), mem_sort_cmp);
+    sort_db = NULL;
+
+    for (i = 0, j = 0; i < db->mem_count; i++) {
+        if (i + 1 < db->mem_count) {
+            struct lsmrecord next;
+            parse_record(BASE(db), SIZE(db), db->mem[i], &record);
+            parse_record(BASE(db), SIZE(db), db->mem[i+1], &next);
+            if (!db->compar(record.key, record.keylen, next.key, next.keylen))
+                continue;
+        }
+        db->mem[j++] = db->mem[i];
+    }
+    db->mem_count = j;
+
+    return 0;
+}
+
+/* read any transactions committed since we last looked */
+static int replay(struct dbengine *db)
+{
+    struct lsmrecord record;
+    uint64_t *pending = NULL;
+    size_t npending = 0, nalloc = 0;
+    size_t start = db->end;
+    size_t offset = db->end;
+    int r = 0;
+
+    while (offset < SIZE(db)) {
+        /* a transaction that never committed, the next writer
+         * will clean it up */
+        if (parse_record(BASE(db), SIZE(db), offset, &record))
+            break;
+
+        if (record.type == COMMIT) {
+            if (record.vallen != crc32_map(BASE(db) + start, offset - start))
+                break;
+            r = mem_apply(db, pending, npending);
+            if (r) break;
+            npending = 0;
+            offset += record.len;
+            start = db->end = offset;
+            continue;
+        }
+
+        if (npending == nalloc) {
+            nalloc += 256;
+            pending = xrealloc(pending, nalloc * sizeof(uint64_t));
+        }
+        pending[npending++] = offset;
+        offset += record.len;
+    }
+
+    free(pending);
+
+    return r;
+}
+
+/* bring the in-memory state up to date with the locked file */
+static int refresh(struct dbengine *db)
+{
+    size_t oldend;
+    int r;
+
+    r = read_header(db);
+    if (r) return r;
+
+    if (db->header.generation != db->generation) {
+        /* a new log, start again */
+        db->mem_count = 0;
+        db->end = HEADER_SIZE;
+        db->generation = db->header.generation;
+        db->changes++;
+    }
+
+    r = load_runs(db);
+    if (r) return r;
+
+    oldend = db->end;
+    r = replay(db);
+    if (r) return r;
+    if (db->end != oldend) db->changes++;
+
+    return 0;
+}
+
+/************ DATABASE STRUCT AND TRANSACTION MANAGEMENT **************/
+
+static int unlock(struct dbengine *db)
+{
+    return mappedfile_unlock(db->mf);
+}
+
+static int write_lock(struct dbengine *db)
+{
+    int r = mappedfile_writelock(db->mf);
+    if (r) return r;
+
+    if (db->is_open) {
+        r = refresh(db);
+        if (r) return r;
+
+        /* throw away anything a crashed writer left behind */
+        if (SIZE(db) > db->end) {
+            syslog(LOG_NOTICE, "lsm: truncating uncommitted data in %s",
+                   FNAME(db));
+            r = mappedfile_truncate(db->mf, db->end);
+            if (!r) r = mappedfile_commit(db->mf);
+            if (r) return CYRUSDB_IOERROR;
+        }
+    }
+
+    return 0;
+}
+
+static int read_lock(struct dbengine *db)
+{
+    int r = mappedfile_readlock(db->mf);
+    if (r) return r;
+
+    if (db->is_open) {
+        r = refresh(db);
+        if (r) return r;
+    }
+
+    return 0;
+}
+
+static int newtxn(struct dbengine *db, struct txn **tidptr)
+{
+    int r;
+
+    assert(!db->current_txn);
+    assert(!*tidptr);
+
+    /* grab a r/w lock */
+    r = write_lock(db);
+    if (r) return r;
+
+    /* create the transaction */
+    db->txn_num++;
+    db->current_txn = xmalloc(sizeof(struct txn));
+    db->current_txn->num = db->txn_num;
+    db->txn_end = db->end;
+
+    /* pass it back out */
+    *tidptr = db->current_txn;
+
+    return 0;
+}
+
+static void dispose_db(struct dbengine *db)
+{
+    int i;
+
+    if (!db) return;
+
+    if (db->mf) {
+        if (mappedfile_islocked(db->mf))
+            unlock(db);
+        mappedfile_close(&db->mf);
+    }
+
+    for (i = 0; i < db->num_runs; i++)
+        close_run(&db->runs[i]);
+    free_retired(db);
+
+    free(db->mem);
+    buf_free(&db->keybuf);
+
+    free(db);
+}
+
+/******************** FLUSH AND COMPACTION *********************/
+
+/* write the records from 'it' into a new run file */
+static int write_run(struct dbengine *db, const char *fname,
+                     struct lsmiter *it, int drop_deletes, size_t *countp)
+{
+    struct buf buf = BUF_INITIALIZER;
+    struct lsmrecord record;
+    char head[RUN_HEADER_SIZE];
+    uint64_t *index = NULL;
+    size_t count = 0, nalloc = 0;
+    size_t offset = RUN_HEADER_SIZE;
+    time_t now = time(NULL);
+    size_t i;
+    int r = 0;
+    int fd;
+
+    fd = open(fname, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        syslog(LOG_ERR, "IOERROR: lsm: create %s: %m", fname);
+        return CYRUSDB_IOERROR;
+    }
+
+    memset(head, 0, RUN_HEADER_SIZE);
+    buf_appendmap(&buf, head, RUN_HEADER_SIZE);
+
+    while (!(r = iter_next(db, it, &record))) {
+        size_t len = buf.len;
+
+        /* nothing older left to hide */
+        if (record.type == DELETE && drop_deletes) continue;
+
+        /* anything older than an expired record has expired too */
+        if (record.type == STORE && !is_live(db, &record, now)) continue;
+
+        format_record(&buf, record.type, record.stamp,
+                      record.key, record.keylen,
+                      record.val, record.vallen);
+
+        if (count == nalloc) {
+            nalloc += 1024;
+            index = xrealloc(index, nalloc * sizeof(uint64_t));
+        }
+        index[count++] = htonll(offset);
+        offset += buf.len - len;
+
+        if (buf.len >= WRITE_CHUNK) {
+            if (retry_write(fd, buf.s, buf.len) < 0) goto ioerror;
+            buf_reset(&buf);
+        }
+    }
+    if (r != CYRUSDB_NOTFOUND) goto done;
+    r = 0;
+
+    for (i = 0; i < count; i++) {
+        buf_appendmap(&buf, (const char *)&index[i], sizeof(uint64_t));
+        if (buf.len >= WRITE_CHUNK) {
+            if (retry_write(fd, buf.s, buf.len) < 0) goto ioerror;
+            buf_reset(&buf);
+        }
+    }
+    if (buf.len && retry_write(fd, buf.s, buf.len) < 0) goto ioerror;
+
+    memcpy(head, RUN_MAGIC, RUN_MAGIC_SIZE);
+    *((uint32_t *)(head + RUN_OFFSET_VERSION)) = htonl(VERSION);
+    *((uint64_t *)(head + RUN_OFFSET_NUM_RECORDS)) = htonll(count);
+    *((uint64_t *)(head + RUN_OFFSET_INDEX)) = htonll(offset);
+    *((uint32_t *)(head + RUN_OFFSET_CRC32))
+        = htonl(crc32_map(head, RUN_OFFSET_CRC32));
+
+    if (pwrite(fd, head, RUN_HEADER_SIZE, 0) != RUN_HEADER_SIZE)
+        goto ioerror;
+
+    if (fsync(fd) < 0) goto ioerror;
+
+    if (countp) *countp = count;
+
+    goto done;
+
+ioerror:
+    syslog(LOG_ERR, "IOERROR: lsm: writing %s: %m", fname);
+    r = CYRUSDB_IOERROR;
+
+done:
+    close(fd);
+    if (r) unlink(fname);
+    buf_free(&buf);
+    free(index);
+    return r;
+}
+
+/* replace the main file with an empty log and the given header, and
+ * keep the new file write locked in its place */
+static int rewrite_file(struct dbengine *db, const struct db_header *header)
+{
+    struct mappedfile *newmf = NULL;
+    char *newfname = strconcat(FNAME(db), ".NEW", (char *)NULL);
+    char buf[HEADER_SIZE];
+    int r;
+
+    unlink(newfname);
+
+    r = mappedfile_open(&newmf, newfname, MAPPEDFILE_RW|MAPPEDFILE_CREATE);
+    if (r) goto err;
+
+    r = mappedfile_writelock(newmf);
+    if (r) goto err;
+
+    format_header(header, buf);
+    if (mappedfile_pwrite(newmf, buf, HEADER_SIZE, 0) < 0) goto err;
+
+    r = mappedfile_commit(newmf);
+    if (r) goto err;
+
+    r = mappedfile_rename(newmf, FNAME(db));
+    if (r) goto err;
+
+    /* the old file stays mapped for anyone who had it open */
+    unlock(db);
+    mappedfile_close(&db->mf);
+    db->mf = newmf;
+
+    db->header = *header;
+    db->generation = header->generation;
+    db->mem_count = 0;
+    db->end = db->txn_end = HEADER_SIZE;
+    db->changes++;
+
+    free(newfname);
+
+    return load_runs(db);
+
+err:
+    syslog(LOG_ERR, "DBERROR: lsm: failed to rewrite %s", newfname);
+    if (newmf) {
+        unlink(newfname);
+        mappedfile_close(&newmf);
+    }
+    free(newfname);
+    return CYRUSDB_IOERROR;
+}
+
+/* write the memtable out as the newest run and start a new log.
+ * Must be write locked with no uncommitted data */
+static int flush_log(struct dbengine *db)
+{
+    struct db_header header = db->header;
+    struct db_header oldheader = db->header;
+    struct lsmiter it;
+    uint64_t id = db->header.nextrun;
+    char *runname = run_fname(FNAME(db), id);
+    int full = (db->num_runs >= MAXRUNS);
+    size_t count = 0;
+    uint32_t i;
+    int r;
+
+    /* with no room for another run, merge everything into one */
+    iter_init(db, &it, 1, 0, full ? db->num_runs - 1 : -1);
+    r = write_run(db, runname, &it, full || !db->num_runs, &count);
+    if (r) goto done;
+
+    header.generation++;
+    header.nextrun = id + 1;
+    header.num_runs = 0;
+    if (count)
+        header.runs[header.num_runs++] = id;
+    if (!full) {
+        for (i = 0; i < oldheader.num_runs; i++)
+            header.runs[header.num_runs++] = oldheader.runs[i];
+    }
+
+    r = rewrite_file(db, &header);
+    if (r) {
+        /* pick up whatever state we're in on the next lock */
+        db->generation = 0;
+        unlink(runname);
+        goto done;
+    }
+
+    if (!count) unlink(runname);
+
+    if (full) {
+        for (i = 0; i < oldheader.num_runs; i++) {
+            char *oldname = run_fname(FNAME(db), oldheader.runs[i]);
+            unlink(oldname);
+            free(oldname);
+        }
+    }
+    else if (header.num_runs > 1) {
+        db->want_compact = 1;
+    }
+
+done:
+    free(runname);
+    return r;
+}
+
+/* pick the runs to merge, from the newest down to the returned index:
+ * a run joins if it's no bigger than COMPACT_RATIO times everything
+ * newer than it.  Returns -1 for nothing to do */
+static int pick_compaction(struct dbengine *db, int all)
+{
+    size_t total;
+    int last = 0;
+
+    if (!db->num_runs) return -1;
+
+    /* a lone run has no tombstones, but may have expired records */
+    if (all) return (db->num_runs > 1 || db->ttl) ? db->num_runs - 1 : -1;
+
+    total = db->runs[0].size;
+    while (last + 1 < db->num_runs
+           && total * COMPACT_RATIO >= db->runs[last+1].size) {
+        last++;
+        total += db->runs[last].size;
+    }
+
+    return last ? last : -1;
+}
+
+static int compact(struct dbengine *db, int all)
+{
+    struct db_header header;
+    struct lsmiter it;
+    struct buf namebuf = BUF_INITIALIZER;
+    uint64_t ids[MAXRUNS];
+    char *tmpname = NULL;
+    char *runname = NULL;
+    size_t count = 0;
+    int last, bottom;
+    int pos, i;
+    int r;
+
+    r = read_lock(db);
+    if (r) return r;
+
+    last = pick_compaction(db, all);
+    if (last < 0) {
+        unlock(db);
+        return 0;
+    }
+
+    for (i = 0; i <= last; i++)
+        ids[i] = db->runs[i].id;
+    bottom = (last == db->num_runs - 1);
+
+    iter_init(db, &it, 0, 0, last);
+
+    /* runs never change, so merge them without holding the lock */
+    unlock(db);
+
+    buf_printf(&namebuf, "%s.COMPACT.%d", FNAME(db), (int)getpid());
+    tmpname = buf_release(&namebuf);
+
+    r = write_run(db, tmpname, &it, bottom, &count);
+    if (r) goto done;
+
+    r = write_lock(db);
+    if (r) goto done;
+
+    /* somebody else may have merged some of these runs meanwhile */
+    for (pos = 0; pos < db->num_runs; pos++)
+        if (db->runs[pos].id == ids[0]) break;
+    for (i = 0; i <= last; i++) {
+        if (pos + i >= db->num_runs || db->runs[pos + i].id != ids[i])
+            break;
+    }
+    if (i <= last || (bottom && pos + last != db->num_runs - 1)) {
+        unlock(db);
+        unlink(tmpname);
+        goto done;
+    }
+
+    header = db->header;
+    header.num_runs = pos;
+    if (count) {
+        runname = run_fname(FNAME(db), header.nextrun);
+        if (rename(tmpname, runname) < 0) {
+            syslog(LOG_ERR, "IOERROR: lsm: rename %s: %m", tmpname);
+            unlock(db);
+            unlink(tmpname);
+            r = CYRUSDB_IOERROR;
+            goto done;
+        }
+        header.runs[header.num_runs++] = header.nextrun++;
+    }
+    else {
+        unlink(tmpname);
+    }
+    for (i = pos + last + 1; i < db->num_runs; i++)
+        header.runs[header.num_runs++] = db->runs[i].id;
+
+    db->header = header;
+    r = commit_header(db);
+    if (!r) r = load_runs(db);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: lsm: failed to compact %s", FNAME(db));
+        if (runname) unlink(runname);
+        db->generation = 0;
+        unlock(db);
+        goto done;
+    }
+
+    unlock(db);
+
+    /* nobody can find these any more */
+    for (i = 0; i <= last; i++) {
+        char *oldname = run_fname(FNAME(db), ids[i]);
+        unlink(oldname);
+        free(oldname);
+    }
+
+done:
+    free(tmpname);
+    free(runname);
+    return r;
+}
+
+/************************************************************/
+
+static int opendb(const char *fname, int flags, struct dbengine **ret, struct txn **mytid)
+{
+    struct dbengine *db;
+    int r;
+    int mappedfile_flags = MAPPEDFILE_RW;
+
+    assert(fname);
+    assert(ret);
+
+    db = (struct dbengine *) xzmalloc(sizeof(struct dbengine));
+
+    if (flags & CYRUSDB_CREATE)
+        mappedfile_flags |= MAPPEDFILE_CREATE;
+
+    db->open_flags = flags & ~CYRUSDB_CREATE;
+    db->compar = (flags & CYRUSDB_MBOXSORT) ? bsearch_ncompare_mbox
+                                            : bsearch_ncompare_raw;
+    db->ttl = config_ttl(fname);
+
+    r = mappedfile_open(&db->mf, fname, mappedfile_flags);
+    if (r) {
+        /* convert to CYRUSDB errors*/
+        if (r == -ENOENT) r = CYRUSDB_NOTFOUND;
+        else r = CYRUSDB_IOERROR;
+        goto done;
+    }
+
+    db->is_open = 0;
+
+    r = read_lock(db);
+    if (r) goto done;
+
+    /* if the map size is zero, it's a new file - we need to create an
+     * initial header */
+    if (mappedfile_size(db->mf) == 0) {
+        unlock(db);
+        r = write_lock(db);
+        if (r) goto done;
+
+        if (mappedfile_size(db->mf) == 0) {
+            db->header.version = VERSION;
+            db->header.generation = 1;
+            db->header.nextrun = 1;
+            r = commit_header(db);
+            if (r) {
+                syslog(LOG_ERR, "DBERROR: writing header for %s: %m",
+                       fname);
+                goto done;
+            }
+        }
+    }
+
+    db->is_open = 1;
+
+    r = refresh(db);
+    if (r) goto done;
+
+    unlock(db);
+
+    *ret = db;
+
+    if (mytid) {
+        r = newtxn(db, mytid);
+        if (r) goto done;
+    }
+
+done:
+    if (r) dispose_db(db);
+    return r;
+}
+
+static int myopen(const char *fname, int flags, struct dbengine **ret, struct txn **mytid)
+{
+    struct db_list *ent;
+    struct dbengine *mydb;
+    int r = 0;
+
+    /* do we already have this DB open? */
+    for (ent = open_lsm; ent; ent = ent->next) {
+        if (strcmp(FNAME(ent->db), fname)) continue;
+        if (ent->db->current_txn)
+            return CYRUSDB_LOCKED;
+        if (mytid) {
+            r = newtxn(ent->db, mytid);
+            if (r) return r;
+        }
+        ent->refcount++;
+        *ret = ent->db;
+        return 0;
+    }
+
+    r = opendb(fname, flags, &mydb, mytid);
+    if (r) return r;
+
+    /* track this database in the open list */
+    ent = (struct db_list *) xzmalloc(sizeof(struct db_list));
+    ent->db = mydb;
+    ent->refcount = 1;
+    ent->next = open_lsm;
+    open_lsm = ent;
+
+    /* return the open DB */
+    *ret = mydb;
+
+    return 0;
+}
+
+static int myclose(struct dbengine *db)
+{
+    struct db_list *ent = open_lsm;
+    struct db_list *prev = NULL;
+
+    assert(db);
+
+    /* remove this DB from the open list */
+    while (ent && ent->db != db) {
+        prev = ent;
+        ent = ent->next;
+    }
+    assert(ent);
+
+    if (--ent->refcount <= 0) {
+        if (prev) prev->next = ent->next;
+        else open_lsm = ent->next;
+        free(ent);
+        if (mappedfile_islocked(db->mf))
+            syslog(LOG_ERR, "lsm: %s closed while still locked", FNAME(db));
+        dispose_db(db);
+    }
+
+    return 0;
+}
+
+/*************** EXTERNAL APIS ***********************/
+
+static int myfetch(struct dbengine *db,
+            const char *key, size_t keylen,
+            const char **foundkey, size_t *foundkeylen,
+            const char **data, size_t *datalen,
+            struct txn **tidptr, int fetchnext)
+{
+    struct lsmrecord record;
+    int r = 0;
+
+    assert(db);
+    if (datalen) assert(data);
+
+    if (data) *data = NULL;
+    if (datalen) *datalen = 0;
+
+    /* Hacky workaround:
+     *
+     * If no transaction was passed, but we're in a transaction,
+     * then just do the read within that transaction.
+     */
+    if (!tidptr && db->current_txn)
+        tidptr = &db->current_txn;
+
+    if (tidptr) {
+        if (!*tidptr) {
+            r = newtxn(db, tidptr);
+            if (r) return r;
+        }
+    } else {
+        /* grab a r lock */
+        r = read_lock(db);
+        if (r) return r;
+    }
+
+    if (fetchnext) {
+        struct lsmiter it;
+
+        iter_init(db, &it, 1, 0, db->num_runs - 1);
+        r = iter_seek(db, &it, key, keylen, 1);
+        if (!r) r = iter_next_live(db, &it, &record);
+        if (!r) {
+            buf_setmap(&db->keybuf, record.key, record.keylen);
+            if (foundkey) *foundkey = db->keybuf.s;
+            if (foundkeylen) *foundkeylen = db->keybuf.len;
+        }
+    }
+    else {
+        r = find_record(db, key, keylen, &record);
+        if (!r && !is_live(db, &record, db->ttl ? time(NULL) : 0))
+            r = CYRUSDB_NOTFOUND;
+    }
+
+    if (!r) {
+        if (data) *data = record.val;
+        if (datalen) *datalen = record.vallen;
+    }
+
+    if (!tidptr) {
+        /* release read lock */
+        int r1;
+        if ((r1 = unlock(db)) < 0) {
+            return r1;
+        }
+    }
+
+    return r;
+}
+
+/* foreach allows for subsidary mailbox operations in 'cb'.
+   if there is a txn, 'cb' must make use of it.
+*/
+static int myforeach(struct dbengine *db,
+                     const char *prefix, size_t prefixlen,
+                     foreach_p *goodp,
+                     foreach_cb *cb, void *rock,
+                     struct txn **tidptr)
+{
+    int r = 0, cb_r = 0;
+    int num_misses = 0;
+    int need_unlock = 0;
+    struct lsmiter it;
+    struct lsmrecord record;
+    const char *val;
+    size_t vallen;
+    struct buf keybuf = BUF_INITIALIZER;
+    struct buf valbuf = BUF_INITIALIZER;
+
+    assert(db);
+    assert(cb);
+    if (prefixlen) assert(prefix);
+
+    /* Hacky workaround:
+     *
+     * If no transaction was passed, but we're in a transaction,
+     * then just do the read within that transaction.
+     */
+    if (!tidptr && db->current_txn)
+        tidptr = &db->current_txn;
+    if (tidptr) {
+        if (!*tidptr) {
+            r = newtxn(db, tidptr);
+            if (r) return r;
+        }
+    }
+    else {
+        /* grab a r lock */
+        r = read_lock(db);
+        if (r) return r;
+        need_unlock = 1;
+    }
+
+    db->foreach_depth++;
+
+    iter_init(db, &it, 1, 0, db->num_runs - 1);
+    r = iter_seek(db, &it, prefix, prefixlen, 0);
+    if (r) goto done;
+
+    while (!(r = iter_next_live(db, &it, &record))) {
+        /* does it match prefix? */
+        if (prefixlen) {
+            if (record.keylen < prefixlen) break;
+            if (db->compar(record.key, prefixlen, prefix, prefixlen)) break;
+        }
+
+        /* take a copy of the key, and of values in the log, which
+         * the callback can remap with its own writes.  Runs stay
+         * mapped until we're done */
+        buf_setmap(&keybuf, record.key, record.keylen);
+        if (record.val >= BASE(db) && record.val < BASE(db) + SIZE(db)) {
+            buf_setmap(&valbuf, record.val, record.vallen);
+            val = buf_cstring(&valbuf);
+        }
+        else {
+            val = record.val;
+        }
+        vallen = record.vallen;
+
+        if (!goodp || goodp(rock, keybuf.s, keybuf.len, val, vallen)) {
+            if (!tidptr) {
+                /* release read lock */
+                r = unlock(db);
+                need_unlock = 0;
+                if (r) goto done;
+            }
+
+            /* make callback */
+            cb_r = cb(rock, keybuf.s, keybuf.len, val, vallen);
+            if (cb_r) break;
+
+            if (!tidptr) {
+                /* grab a r lock */
+                r = read_lock(db);
+                if (r) goto done;
+                need_unlock = 1;
+
+                num_misses = 0;
+            }
+        }
+        else if (!tidptr) {
+            num_misses++;
+            if (num_misses > FOREACH_LOCK_RELEASE) {
+                /* let writers in */
+                r = unlock(db);
+                need_unlock = 0;
+                if (r) goto done;
+
+                r = read_lock(db);
+                if (r) goto done;
+                need_unlock = 1;
+
+                num_misses = 0;
+            }
+        }
+
+        if (it.changes != db->changes) {
+            /* carry on after the last key we know was good */
+            iter_init(db, &it, 1, 0, db->num_runs - 1);
+            r = iter_seek(db, &it, keybuf.s, keybuf.len, 1);
+            if (r) goto done;
+        }
+    }
+
+    if (r == CYRUSDB_NOTFOUND) r = 0;
+
+ done:
+
+    if (!--db->foreach_depth) free_retired(db);
+
+    buf_free(&keybuf);
+    buf_free(&valbuf);
+
+    if (need_unlock) {
+        /* release read lock */
+        int r1 = unlock(db);
+        if (r1) return r1;
+    }
+
+    return r ? r : cb_r;
+}
+
+/* helper function for all writes - wraps create and delete and the FORCE
+ * logic for each */
+static int lsmwrite(struct dbengine *db,
+                    const char *key, size_t keylen,
+                    const char *data, size_t datalen,
+                    int force)
+{
+    struct buf buf = BUF_INITIALIZER;
+    struct lsmrecord record;
+    struct lsmsource src;
+    time_t now = time(NULL);
+    size_t pos;
+    int exact;
+    int exists;
+    ssize_t n;
+    int r;
+
+    r = find_record(db, key, keylen, &record);
+    if (r && r != CYRUSDB_NOTFOUND) return r;
+    exists = !r && is_live(db, &record, now);
+
+    if (exists) {
+        if (data) {
+            if (!force) return CYRUSDB_EXISTS;
+            /* unchanged?  Save the IO, unless it would reset the clock */
+            if (!db->ttl && record.vallen == datalen
+                && !memcmp(record.val, data, datalen))
+                return 0;
+        }
+    }
+    else if (!data) {
+        /* must be a delete - are we forcing? */
+        if (!force) return CYRUSDB_NOTFOUND;
+        return 0;
+    }
+
+    /* find the memtable slot before the write can move the map */
+    source_init(db, 0, &src);
+    r = source_seek(db, &src, key, keylen, &pos, &exact);
+    if (r) return r;
+
+    format_record(&buf, data ? STORE : DELETE, now,
+                  key, keylen, data, datalen);
+
+    n = mappedfile_pwritebuf(db->mf, &buf, db->txn_end);
+    buf_free(&buf);
+    if (n < 0) return CYRUSDB_IOERROR;
+
+    mem_put(db, pos, exact, db->txn_end);
+    db->txn_end += n;
+    db->changes++;
+
+    return 0;
+}
+
+static int mycommit(struct dbengine *db, struct txn *tid)
+{
+    int r = 0;
+
+    assert(db);
+    assert(tid == db->current_txn);
+
+    if (db->txn_end > db->end) {
+        char head[RECORD_HEAD];
+        uint32_t crc = crc32_map(BASE(db) + db->end, db->txn_end - db->end);
+
+        memset(head, 0, RECORD_HEAD);
+        head[0] = COMMIT;
+        *((uint32_t *)(head + 4)) = htonl(time(NULL));
+        *((uint32_t *)(head + 12)) = htonl(crc);
+
+        if (mappedfile_pwrite(db->mf, head, RECORD_HEAD, db->txn_end) < 0) {
+            r = CYRUSDB_IOERROR;
+            goto fail;
+        }
+
+        r = mappedfile_commit(db->mf);
+        if (r) goto fail;
+
+        db->end = db->txn_end + RECORD_HEAD;
+
+        if (db->end - HEADER_SIZE >= LOG_FLUSH_SIZE) {
+            /* it's committed in the log either way */
+            if (flush_log(db))
+                syslog(LOG_ERR, "DBERROR: lsm: failed to flush %s",
+                       FNAME(db));
+        }
+    }
+
+    /* free the tid */
+    free(tid);
+    db->current_txn = NULL;
+
+    unlock(db);
+
+    /* merge runs now that nobody is waiting on us */
+    if (db->want_compact && !(db->open_flags & CYRUSDB_NOCOMPACT)) {
+        db->want_compact = 0;
+        if (compact(db, 0))
+            syslog(LOG_ERR, "DBERROR: lsm: failed to compact %s", FNAME(db));
+    }
+
+    return 0;
+
+fail:
+    syslog(LOG_ERR, "DBERROR: lsm: failed to commit %s", FNAME(db));
+    myabort(db, tid);
+    return r;
+}
+
+static int myabort(struct dbengine *db, struct txn *tid)
+{
+    int r = 0;
+
+    assert(db);
+    assert(tid == db->current_txn);
+
+    /* free the tid */
+    free(tid);
+    db->current_txn = NULL;
+
+    if (db->txn_end > db->end) {
+        r = mappedfile_truncate(db->mf, db->end);
+        if (!r) r = mappedfile_commit(db->mf);
+        if (r) r = CYRUSDB_IOERROR;
+
+        /* the memtable has our writes in it, read it again */
+        db->generation = 0;
+        db->changes++;
+    }
+
+    unlock(db);
+
+    return r;
+}
+
+static int mystore(struct dbengine *db,
+            const char *key, size_t keylen,
+            const char *data, size_t datalen,
+            struct txn **tidptr, int force)
+{
+    struct txn *localtid = NULL;
+    int r = 0;
+    int r2 = 0;
+
+    assert(db);
+    assert(key && keylen);
+
+    /* not keeping the transaction, just create one local to
+     * this function */
+    if (!tidptr) tidptr = &localtid;
+
+    /* make sure we're write locked and up to date */
+    if (!*tidptr) {
+        r = newtxn(db, tidptr);
+        if (r) return r;
+    }
+
+    r = lsmwrite(db, key, keylen, data, datalen, force);
+
+    if (r) {
+        r2 = myabort(db, *tidptr);
+        *tidptr = NULL;
+    }
+    else if (localtid) {
+        /* commit the store, which releases the write lock */
+        r = mycommit(db, localtid);
+    }
+
+    return r2 ? r2 : r;
+}
+
+/* flush the log and merge every run into one, dropping tombstones
+ * and expired records */
+static int myrepack(struct dbengine *db)
+{
+    int r;
+
+    /* the log can't be flushed with uncommitted records in it */
+    if (db->current_txn)
+        return 0;
+
+    r = write_lock(db);
+    if (r) return r;
+
+    if (db->end > HEADER_SIZE)
+        r = flush_log(db);
+
+    unlock(db);
+    if (r) return r;
+
+    db->want_compact = 0;
+
+    return compact(db, 1);
+}
+
+static void dump_record(const struct lsmrecord *record, struct buf *scratch)
+{
+    switch (record->type) {
+    case COMMIT:
+        printf("COMMIT crc=%08lX\n", (LU)record->vallen);
+        break;
+
+    case STORE:
+    case DELETE:
+        buf_setmap(scratch, record->key, record->keylen);
+        buf_replace_char(scratch, '\0', '-');
+        printf("%s kl=%llu dl=%llu ts=%lu (%s)\n",
+               (record->type == STORE ? "STORE" : "DELETE"),
+               (LLU)record->keylen, (LLU)record->vallen,
+               (LU)record->stamp, buf_cstring(scratch));
+        break;
+    }
+}
+
+/* dump the database.
+   if detail == 1, dump all records.
+*/
+static int dump(struct dbengine *db, int detail)
+{
+    struct lsmrecord record;
+    struct buf scratch = BUF_INITIALIZER;
+    size_t offset = HEADER_SIZE;
+    size_t n;
+    int i;
+    int r;
+
+    r = read_lock(db);
+    if (r) return r;
+
+    printf("HEADER: v=%lu fl=%lu gen=%llu next=%llu runs=%lu log=%llu\n",
+          (LU)db->header.version,
+          (LU)db->header.flags,
+          (LLU)db->header.generation,
+          (LLU)db->header.nextrun,
+          (LU)db->header.num_runs,
+          (LLU)(db->end - HEADER_SIZE));
+
+    while (offset < db->end) {
+        r = parse_record(BASE(db), SIZE(db), offset, &record);
+        if (r) {
+            printf("ERROR\n");
+            break;
+        }
+        printf("%08llX ", (LLU)offset);
+        dump_record(&record, &scratch);
+        offset += record.len;
+    }
+
+    for (i = 0; !r && i < db->num_runs; i++) {
+        struct lsmsource src;
+
+        printf("RUN %llu: records=%llu size=%llu\n",
+               (LLU)db->runs[i].id, (LLU)db->runs[i].num_records,
+               (LLU)db->runs[i].size);
+        if (!detail) continue;
+
+        source_init(db, i + 1, &src);
+        for (n = 0; n < src.count; n++) {
+            r = source_record(&src, n, &record);
+            if (r) {
+                printf("ERROR\n");
+                break;
+            }
+            printf("%08llX ", (LLU)record.offset);
+            dump_record(&record, &scratch);
+        }
+    }
+
+    buf_free(&scratch);
+    unlock(db);
+
+    return r;
+}
+
+/* perform some basic consistency checks */
+static int consistent(struct dbengine *db)
+{
+    struct lsmrecord prev, record;
+    struct lsmsource src;
+    size_t n;
+    int i;
+    int r;
+
+    r = read_lock(db);
+    if (r) return r;
+
+    for (i = 0; !r && i <= db->num_runs; i++) {
+        source_init(db, i, &src);
+        for (n = 0; n < src.count; n++) {
+            r = source_record(&src, n, &record);
+            if (r) {
+                syslog(LOG_ERR, "DBERROR: lsm: bad record in %s source %d",
+                       FNAME(db), i);
+                break;
+            }
+            if (record.type == COMMIT
+                || (n && db->compar(prev.key, prev.keylen,
+                                    record.key, record.keylen) >= 0)) {
+                syslog(LOG_ERR, "DBERROR: lsm: out of order in %s source %d",
+                       FNAME(db), i);
+                r = CYRUSDB_INTERNAL;
+                break;
+            }
+            prev = record;
+        }
+    }
+
+    unlock(db);
+
+    return r;
+}
+
+/* read the run list straight from the file, for when there's
+ * no open database to ask */
+static int read_runs(const char *fname, int fd, struct db_header *header)
+{
+    char buf[HEADER_SIZE];
+
+    if (pread(fd, buf, HEADER_SIZE, 0) != HEADER_SIZE) {
+        syslog(LOG_ERR, "IOERROR: lsm: reading header %s: %m", fname);
+        return CYRUSDB_IOERROR;
+    }
+
+    return parse_header(buf, HEADER_SIZE, fname, header);
+}
+
+/* archive the main file and every run it lists, holding a lock on the
+ * main file so a compaction can't remove runs from under us */
+static int myarchive(const strarray_t *fnames, const char *dirname)
+{
+    struct db_header header;
+    char dstname[1024], *dp;
+    int length, rest;
+    int i;
+    uint32_t j;
+    int r = 0;
+
+    strlcpy(dstname, dirname, sizeof(dstname));
+    length = strlen(dstname);
+    dp = dstname + length;
+    rest = sizeof(dstname) - length;
+
+    for (i = 0; !r && i < fnames->count; i++) {
+        const char *fname = strarray_nth(fnames, i);
+        int fd = open(fname, O_RDONLY, 0);
+
+        if (fd < 0) {
+            syslog(LOG_DEBUG, "not archiving database file: %s: %m", fname);
+            continue;
+        }
+
+        if (lock_setlock(fd, /*exclusive*/0, /*nonblock*/0, fname) < 0) {
+            syslog(LOG_ERR, "IOERROR: lsm: locking %s: %m", fname);
+            close(fd);
+            return CYRUSDB_IOERROR;
+        }
+
+        r = read_runs(fname, fd, &header);
+        for (j = 0; !r && j < header.num_runs; j++) {
+            char *runname = run_fname(fname, header.runs[j]);
+            strlcpy(dp, strrchr(runname, '/'), rest);
+            if (cyrusdb_copyfile(runname, dstname)) r = CYRUSDB_IOERROR;
+            free(runname);
+        }
+
+        if (!r) {
+            syslog(LOG_DEBUG, "archiving database file: %s", fname);
+            strlcpy(dp, strrchr(fname, '/'), rest);
+            if (cyrusdb_copyfile(fname, dstname)) r = CYRUSDB_IOERROR;
+        }
+
+        lock_unlock(fd, fname);
+        close(fd);
+
+        if (r) {
+            syslog(LOG_ERR,
+                   "DBERROR: error archiving database file: %s", fname);
+        }
+    }
+
+    return r;
+}
+
+static int myunlink(const char *fname, int flags __attribute__((unused)))
+{
+    struct db_header header;
+    uint32_t j;
+    int fd;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd >= 0) {
+        if (!read_runs(fname, fd, &header)) {
+            for (j = 0; j < header.num_runs; j++) {
+                char *runname = run_fname(fname, header.runs[j]);
+                unlink(runname);
+                free(runname);
+            }
+        }
+        close(fd);
+    }
+
+    return unlink(fname);
+}
+
+static int fetch(struct dbengine *mydb,
+                 const char *key, size_t keylen,
+                 const char **data, size_t *datalen,
+                 struct txn **tidptr)
+{
+    assert(key);
+    assert(keylen);
+    return myfetch(mydb, key, keylen, NULL, NULL,
+                   data, datalen, tidptr, 0);
+}
+
+static int fetchnext(struct dbengine *mydb,
+                 const char *key, size_t keylen,
+                 const char **foundkey, size_t *fklen,
+                 const char **data, size_t *datalen,
+                 struct txn **tidptr)
+{
+    return myfetch(mydb, key, keylen, foundkey, fklen,
+                   data, datalen, tidptr, 1);
+}
+
+static int create(struct dbengine *db,
+                  const char *key, size_t keylen,
+                  const char *data, size_t datalen,
+                  struct txn **tid)
+{
+    if (datalen) assert(data);
+    return mystore(db, key, keylen, data ? data : "", datalen, tid, 0);
+}
+
+static int store(struct dbengine *db,
+                 const char *key, size_t keylen,
+                 const char *data, size_t datalen,
+                 struct txn **tid)
+{
+    if (datalen) assert(data);
+    return mystore(db, key, keylen, data ? data : "", datalen, tid, 1);
+}
+
+static int delete(struct dbengine *db,
+                 const char *key, size_t keylen,
+                 struct txn **tid, int force)
+{
+    return mystore(db, key, keylen, NULL, 0, tid, force);
+}
+
+/* the lifetime may have been reconfigured since the handle was opened */
+static void myrefresh(struct dbengine *db)
+{
+    db->ttl = config_ttl(FNAME(db));
+}
+
+/* lsm compar function is set at open */
+static int mycompar(struct dbengine *db, const char *a, int alen,
+                    const char *b, int blen)
+{
+    return db->compar(a, alen, b, blen);
+}
+
+HIDDEN struct cyrusdb_backend cyrusdb_lsm =
+{
+    "lsm",                      /* name */
+
+    &cyrusdb_generic_init,
+    &cyrusdb_generic_done,
+    &cyrusdb_generic_sync,
+    &myarchive,
+    &myunlink,
+
+    &myopen,
+    &myclose,
+
+    &fetch,
+    &fetch,
+    &fetchnext,
+
+    &myforeach,
+    &create,
+    &store,
+    &delete,
+
+    &mycommit,
+    &myabort,
+
+    &dump,
+    &consistent,
+    &myrepack,
+    &mycompar,
+
+    NULL, /* cursor_open */
+    NULL, /* cursor_seek */
+    NULL, /* cursor_next */
+    NULL, /* cursor_prev */
+    NULL, /* cursor_close */
+
+    NULL, /* release */
+    &myrefresh
+};
@@ -50,6 +50,7 @@
 #include "bsearch.h"
 #include "cyrusdb.h"
 #include "exitcodes.h"
+#include "hash.h"
 #include "libcyr_cfg.h"
 #include "xmalloc.h"
 #include "util.h"
@@ -60,6 +61,12 @@ typedef int exec_cb(void *rock,
                     const char *key, size_t keylen,
                     const char *data, size_t datalen);
 
+/* a value bound to a '?' placeholder */
+struct sqlparam {
+    const char *s;
+    size_t len;
+};
+
 typedef struct sql_engine {
     const char *name;
     const char *binary_type;
@@ -73,23 +80,55 @@ typedef struct sql_engine {
     int (*sql_rollback_txn)(void *conn);
     int (*sql_exec)(void *conn, const char *cmd, exec_cb *cb, void *rock);
     void (*sql_close)(void *conn);
+    /* prepared statements with '?' placeholders - NULL if the engine
+     * only runs escaped SQL strings */
+    void *(*sql_prepare)(void *conn, const char *cmd);
+    int (*sql_exec_stmt)(void *conn, void *stmt,
+                         const struct sqlparam *params, int nparams,
+                         exec_cb *cb, void *rock);
+    void (*sql_finalize)(void *conn, void *stmt);
 } sql_engine_t;
 
+/* a prepared statement, cached on its connection */
+struct sql_stmt {
+    void *conn;
+    void *stmt;
+    int busy;       /* still being read by a callback */
+};
+
+/* a pooled connection, shared by all the tables in one SQL database
+ * that the process has open */
+struct sql_conn {
+    char *database;
+    void *conn;
+    struct txn *txn;        /* transaction this connection is reserved for */
+    hash_table stmts;       /* prepared statements, by SQL text */
+    struct sql_conn *next;
+};
+
 struct dbengine {
-    void *conn;     /* connection to database */
+    char *database; /* SQL database the table lives in */
     char *table;    /* table that we are operating on */
-    char *esc_key;  /* allocated buffer for escaped key */
-    char *esc_data; /* allocated buffer for escaped data */
+    struct txn *txn;    /* current transaction, if any */
     char *data;     /* allocated buffer for fetched data */
 };
 
+/* number of new rows to INSERT in one statement */
+#define BATCH_SIZE 64
+
 struct txn {
     char *lastkey;  /* allocated buffer for last SELECTed key */
     size_t keylen;
+    struct sql_conn *conn;  /* connection running this transaction */
+    /* rows to INSERT at once, none of which are in the table yet */
+    int nbatch;
+    struct buf batchkey[BATCH_SIZE];
+    struct buf batchdata[BATCH_SIZE];
 };
 
 static int dbinit = 0;
 static const sql_engine_t *dbengine = NULL;
+static struct sql_conn *sql_pool = NULL;
 
 
 #ifdef HAVE_MYSQL
@@ -302,6 +341,90 @@ static void _pgsql_close(void *conn)
 {
     PQfinish(conn);
 }
+
+static void *_pgsql_prepare(void *conn, const char *cmd)
+{
+    static unsigned stmtnum = 0;
+    struct buf sql = BUF_INITIALIZER;
+    struct buf name = BUF_INITIALIZER;
+    PGresult *result;
+    const char *p;
+    int nparams = 0;
+
+    /* libpq numbers its placeholders */
+    for (p = cmd; *p; p++) {
+        if (*p == '?') buf_printf(&sql, "$%d", ++nparams);
+        else buf_putc(&sql, *p);
+    }
+
+    buf_printf(&name, "cyrusdb_%u", ++stmtnum);
+
+    syslog(LOG_DEBUG, "preparing SQL cmd: %s", buf_cstring(&sql));
+
+    result = PQprepare(conn, buf_cstring(&name), buf_cstring(&sql), 0, NULL);
+    if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+        syslog(LOG_ERR, "DBERROR: SQL backend: %s", PQerrorMessage(conn));
+        buf_free(&name);
+    }
+
+    PQclear(result);
+    buf_free(&sql);
+
+    return buf_release(&name);
+}
+
+static int _pgsql_exec_stmt(void *conn, void *stmt,
+                            const struct sqlparam *params, int nparams,
+                            exec_cb *cb, void *rock)
+{
+    const char **values = xmalloc((nparams + 1) * sizeof(char *));
+    int *lengths = xmalloc((nparams + 1) * sizeof(int));
+    int *formats = xmalloc((nparams + 1) * sizeof(int));
+    PGresult *result;
+    ExecStatusType status;
+    int row_count, i, r = 0;
+
+    for (i = 0; i < nparams; i++) {
+        values[i] = params[i].s ? params[i].s : "";
+        lengths[i] = params[i].len;
+        formats[i] = 1;
+    }
+
+    /* binary parameters and results, so nothing needs escaping */
+    result = PQexecPrepared(conn, (const char *) stmt, nparams,
+                            values, lengths, formats, 1);
+
+    status = PQresultStatus(result);
+    if (status == PGRES_TUPLES_OK) {
+        row_count = PQntuples(result);
+        for (i = 0; cb && !r && i < row_count; i++) {
+            r = cb(rock, PQgetvalue(result, i, 0), PQgetlength(result, i, 0),
+                   PQgetvalue(result, i, 1), PQgetlength(result, i, 1));
+        }
+    }
+    else if (status != PGRES_COMMAND_OK) {
+        syslog(LOG_DEBUG, "SQL backend: %s ", PQerrorMessage(conn));
+        r = CYRUSDB_INTERNAL;
+    }
+
+    PQclear(result);
+    free(values);
+    free(lengths);
+    free(formats);
+
+    return r;
+}
+
+static void _pgsql_finalize(void *conn, void *stmt)
+{
+    struct buf cmd = BUF_INITIALIZER;
+
+    buf_printf(&cmd, "DEALLOCATE %s;", (char *) stmt);
+    PQclear(PQexec(conn, buf_cstring(&cmd)));
+    buf_free(&cmd);
+
+    free(stmt);
+}
 #endif /* HAVE_PGSQL */
 
 
@@ -399,6 +522,69 @@ static void _sqlite_close(void *conn)
 {
     sqlite3_close(conn);
 }
+
+static void *_sqlite_prepare(void *conn, const char *cmd)
+{
+    sqlite3_stmt *stmt = NULL;
+
+    syslog(LOG_DEBUG, "preparing SQL cmd: %s", cmd);
+
+    if (sqlite3_prepare_v2(conn, cmd, -1, &stmt, NULL) != SQLITE_OK) {
+        syslog(LOG_DEBUG, "SQL backend: %s ", sqlite3_errmsg(conn));
+        sqlite3_finalize(stmt);
+        return NULL;
+    }
+
+    return stmt;
+}
+
+static int _sqlite_exec_stmt(void *conn, void *stmt,
+                             const struct sqlparam *params, int nparams,
+                             exec_cb *cb, void *rock)
+{
+    int i, rc = SQLITE_OK, r = 0;
+
+    for (i = 0; i < nparams; i++) {
+        /* bound as text, to match the rows written as literals */
+        rc = sqlite3_bind_text(stmt, i + 1,
+                               params[i].s ? params[i].s : "",
+                               params[i].len, SQLITE_STATIC);
+        if (rc != SQLITE_OK) break;
+    }
+
+    /* process the results */
+    while (rc == SQLITE_OK || rc == SQLITE_ROW) {
+        const unsigned char *key, *data;
+        int keylen, datalen;
+
+        rc = sqlite3_step(stmt);
+        if (rc != SQLITE_ROW || !cb) continue;
+
+        key = sqlite3_column_text(stmt, 0);
+        keylen = sqlite3_column_bytes(stmt, 0);
+        data = sqlite3_column_text(stmt, 1);
+        datalen = sqlite3_column_bytes(stmt, 1);
+
+        r = cb(rock, (char *) key, keylen, (char *) data, datalen);
+        if (r) break;
+    }
+
+    if (!r && rc != SQLITE_DONE) {
+        syslog(LOG_DEBUG, "SQL backend: %s ", sqlite3_errmsg(conn));
+        r = CYRUSDB_INTERNAL;
+    }
+
+    /* ready for the next use */
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    return r;
+}
+
+static void _sqlite_finalize(void *conn __attribute__((unused)), void *stmt)
+{
+    sqlite3_finalize(stmt);
+}
 #endif /* HAVE_SQLITE */
 
 
@@ -406,19 +592,21 @@ static const sql_engine_t sql_engines[] = {
 #ifdef HAVE_MYSQL
     { "mysql", "BLOB", &_mysql_open, &_mysql_escape,
       &_mysql_begin_txn, &_mysql_commit_txn, &_mysql_rollback_txn,
-      &_mysql_exec, &_mysql_close },
+      &_mysql_exec, &_mysql_close, NULL, NULL, NULL },
 #endif /* HAVE_MYSQL */
 #ifdef HAVE_PGSQL
     { "pgsql", "BYTEA", &_pgsql_open, &_pgsql_escape,
       &_pgsql_begin_txn, &_pgsql_commit_txn, &_pgsql_rollback_txn,
-      &_pgsql_exec, &_pgsql_close },
+      &_pgsql_exec, &_pgsql_close,
+      &_pgsql_prepare, &_pgsql_exec_stmt, &_pgsql_finalize },
 #endif
 #ifdef HAVE_SQLITE
     { "sqlite", "BLOB", &_sqlite_open, &_sqlite_escape,
       &_sqlite_begin_txn, &_sqlite_commit_txn, &_sqlite_rollback_txn,
-      &_sqlite_exec, &_sqlite_close },
+      &_sqlite_exec, &_sqlite_close,
+      &_sqlite_prepare, &_sqlite_exec_stmt, &_sqlite_finalize },
 #endif
-    { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL }
+    { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL }
 };
 
 
@@ -456,36 +644,40 @@ static int init(const char *dbdir __attribute__((unused)),
     return r;
 }
 
-static int done(void)
+static void free_stmt(void *data)
 {
-    --dbinit;
-    return 0;
+    struct sql_stmt *stmt = (struct sql_stmt *) data;
+
+    dbengine->sql_finalize(stmt->conn, stmt->stmt);
+    free(stmt);
 }
 
-static struct txn *start_txn(struct dbengine *db)
+static int done(void)
 {
-    /* start a transaction */
-    if (dbengine->sql_begin_txn(db->conn)) {
-        syslog(LOG_ERR, "DBERROR: failed to start txn on %s",
-               db->table);
-        return NULL;
+    if (--dbinit) return 0;
+
+    /* close the pooled connections */
+    while (sql_pool) {
+        struct sql_conn *c = sql_pool;
+        sql_pool = c->next;
+
+        free_hash_table(&c->stmts, &free_stmt);
+        dbengine->sql_close(c->conn);
+        free(c->database);
+        free(c);
     }
-    return xzmalloc(sizeof(struct txn));
+
+    return 0;
 }
 
-static int myopen(const char *fname, int flags, struct dbengine **ret, struct txn **mytid)
+static void *sql_connect(const char *database)
 {
-    const char *database, *hostnames, *user, *passwd;
+    const char *hostnames, *user, *passwd;
     char *host_ptr, *host, *cur_host, *cur_port;
     int usessl;
     void *conn = NULL;
-    char *p, *table, cmd[1024];
-
-    assert(fname);
-    assert(ret);
 
     /* make a connection to the database */
-    database = libcyrus_config_getstring(CYRUSOPT_SQL_DATABASE);
     hostnames = libcyrus_config_getstring(CYRUSOPT_SQL_HOSTNAMES);
     user = libcyrus_config_getstring(CYRUSOPT_SQL_USER);
     passwd = libcyrus_config_getstring(CYRUSOPT_SQL_PASSWD);
@@ -497,9 +689,6 @@ static int myopen(const char *fname, int flags, struct dbengine **ret, struct tx
     /* create a working version of the hostnames */
     host_ptr = hostnames ? xstrdup(hostnames) : NULL;
 
-    /* make sqlite clever */
-    if (!database) database = fname;
-
     cur_host = host = host_ptr;
     while (cur_host != NULL) {
         host = strchr(host,',');
@@ -529,11 +718,241 @@ static int myopen(const char *fname, int flags, struct dbengine **ret, struct tx
 
     if (host_ptr) free(host_ptr);
 
+    return conn;
+}
+
+/* an idle connection to database, opening one if they're all busy
+ * with transactions */
+static struct sql_conn *pool_get(const char *database)
+{
+    struct sql_conn *c;
+    void *conn;
+
+    for (c = sql_pool; c; c = c->next) {
+        if (!c->txn && !strcmp(c->database, database)) return c;
+    }
+
+    conn = sql_connect(database);
     if (!conn) {
         syslog(LOG_ERR, "DBERROR: could not open SQL database '%s'", database);
-        return CYRUSDB_IOERROR;
+        return NULL;
+    }
+
+    c = xzmalloc(sizeof(struct sql_conn));
+    c->database = xstrdup(database);
+    c->conn = conn;
+    construct_hash_table(&c->stmts, 32, 0);
+
+    c->next = sql_pool;
+    sql_pool = c;
+
+    return c;
+}
+
+/* run a command with its '?' placeholders filled from params, as an
+ * escaped SQL string for engines without prepared statements */
+static int run_escaped(struct sql_conn *c, const char *cmd,
+                       const struct sqlparam *params, int nparams,
+                       exec_cb *cb, void *rock)
+{
+    struct buf sql = BUF_INITIALIZER;
+    const char *p;
+    int i = 0, r;
+
+    for (p = cmd; *p; p++) {
+        if (*p == '?' && i < nparams) {
+            char *esc = NULL;
+            char *esc_val = dbengine->sql_escape(c->conn, &esc,
+                                                 params[i].s ? params[i].s : "",
+                                                 params[i].len);
+            buf_printf(&sql, "'%s'", esc_val);
+            if (esc_val != esc) free(esc_val);
+            free(esc);
+            i++;
+        }
+        else buf_putc(&sql, *p);
+    }
+
+    r = dbengine->sql_exec(c->conn, buf_cstring(&sql), cb, rock);
+    buf_free(&sql);
+
+    return r;
+}
+
+/* run a command with its '?' placeholders bound to params, reusing
+ * the connection's prepared statement for it */
+static int sql_run(struct sql_conn *c, const char *cmd,
+                   const struct sqlparam *params, int nparams,
+                   exec_cb *cb, void *rock)
+{
+    struct sql_stmt *stmt;
+    int r;
+
+    if (!dbengine->sql_prepare)
+        return run_escaped(c, cmd, params, nparams, cb, rock);
+
+    stmt = hash_lookup(cmd, &c->stmts);
+    if (!stmt) {
+        void *prepared = dbengine->sql_prepare(c->conn, cmd);
+        if (!prepared) return CYRUSDB_INTERNAL;
+
+        stmt = xzmalloc(sizeof(struct sql_stmt));
+        stmt->conn = c->conn;
+        stmt->stmt = prepared;
+        hash_insert(cmd, stmt, &c->stmts);
+    }
+    else if (stmt->busy) {
+        /* a callback further up is still reading from it */
+        void *prepared = dbengine->sql_prepare(c->conn, cmd);
+        if (!prepared) return CYRUSDB_INTERNAL;
+
+        r = dbengine->sql_exec_stmt(c->conn, prepared, params, nparams,
+                                    cb, rock);
+        dbengine->sql_finalize(c->conn, prepared);
+        return r;
+    }
+
+    stmt->busy = 1;
+    r = dbengine->sql_exec_stmt(c->conn, stmt->stmt, params, nparams,
+                                cb, rock);
+    stmt->busy = 0;
+
+    return r;
+}
+
+/* INSERT the rows batched up by the transaction */
+static int flush_batch(struct dbengine *db, struct txn *tid)
+{
+    struct sqlparam params[2 * BATCH_SIZE];
+    struct buf cmd = BUF_INITIALIZER;
+    int i, r;
+
+    if (!tid->nbatch) return 0;
+
+    buf_printf(&cmd, "INSERT INTO %s VALUES (?, ?)", db->table);
+    for (i = 0; i < tid->nbatch; i++) {
+        if (i) buf_appendcstr(&cmd, ", (?, ?)");
+        params[2*i].s = tid->batchkey[i].s;
+        params[2*i].len = tid->batchkey[i].len;
+        params[2*i+1].s = tid->batchdata[i].s;
+        params[2*i+1].len = tid->batchdata[i].len;
+    }
+    buf_putc(&cmd, ';');
+
+    r = sql_run(tid->conn, buf_cstring(&cmd), params, 2 * tid->nbatch,
+                NULL, NULL);
+    if (r) syslog(LOG_ERR, "DBERROR: SQL failed: %s", buf_cstring(&cmd));
+
+    for (i = 0; i < tid->nbatch; i++) {
+        buf_reset(&tid->batchkey[i]);
+        buf_reset(&tid->batchdata[i]);
+    }
+    tid->nbatch = 0;
+
+    buf_free(&cmd);
+
+    return r ? CYRUSDB_INTERNAL : 0;
+}
+
+static int batch_find(struct txn *tid, const char *key, size_t keylen)
+{
+    int i;
+
+    for (i = 0; i < tid->nbatch; i++) {
+        if (tid->batchkey[i].len == keylen &&
+            !memcmp(tid->batchkey[i].s, key, keylen))
+            return i;
+    }
+
+    return -1;
+}
+
+static void batch_remove(struct txn *tid, int i)
+{
+    struct buf tmp;
+
+    /* swap it to the end, keeping the buffers for reuse */
+    tid->nbatch--;
+
+    tmp = tid->batchkey[i];
+    tid->batchkey[i] = tid->batchkey[tid->nbatch];
+    tid->batchkey[tid->nbatch] = tmp;
+    buf_reset(&tid->batchkey[tid->nbatch]);
+
+    tmp = tid->batchdata[i];
+    tid->batchdata[i] = tid->batchdata[tid->nbatch];
+    tid->batchdata[tid->nbatch] = tmp;
+    buf_reset(&tid->batchdata[tid->nbatch]);
+}
+
+static int batch_add(struct dbengine *db, struct txn *tid,
+                     const char *key, size_t keylen,
+                     const char *data, size_t datalen)
+{
+    buf_setmap(&tid->batchkey[tid->nbatch], key, keylen);
+    buf_setmap(&tid->batchdata[tid->nbatch], data, datalen);
+    tid->nbatch++;
+
+    if (tid->nbatch == BATCH_SIZE) return flush_batch(db, tid);
+
+    return 0;
+}
+
+/* the connection to read with, inside the transaction if there is
+ * one, with its batched rows written out so they're visible */
+static int read_conn(struct dbengine *db, struct txn *tid,
+                     struct sql_conn **connp)
+{
+    if (!tid) tid = db->txn;
+
+    if (tid) {
+        *connp = tid->conn;
+        return flush_batch(db, tid);
+    }
+
+    *connp = pool_get(db->database);
+
+    return *connp ? 0 : CYRUSDB_INTERNAL;
+}
+
+static struct txn *start_txn(struct dbengine *db)
+{
+    struct sql_conn *c = pool_get(db->database);
+    struct txn *tid;
+
+    /* start a transaction */
+    if (!c || dbengine->sql_begin_txn(c->conn)) {
+        syslog(LOG_ERR, "DBERROR: failed to start txn on %s",
+               db->table);
+        return NULL;
     }
 
+    /* keep the connection to ourselves until it's done */
+    tid = xzmalloc(sizeof(struct txn));
+    tid->conn = c;
+    c->txn = tid;
+    db->txn = tid;
+
+    return tid;
+}
+
+static int myopen(const char *fname, int flags, struct dbengine **ret, struct txn **mytid)
+{
+    const char *database;
+    struct sql_conn *c;
+    char *p, *table, cmd[1024];
+
+    assert(fname);
+    assert(ret);
+
+    database = libcyrus_config_getstring(CYRUSOPT_SQL_DATABASE);
+
+    /* make sqlite clever */
+    if (!database) database = fname;
+
+    c = pool_get(database);
+    if (!c) return CYRUSDB_IOERROR;
+
     /* get the name of the table and CREATE it if necessary */
 
     /* strip any path from the fname */
@@ -546,25 +965,26 @@ static int myopen(const char *fname, int flags, struct dbengine **ret, struct tx
     /* check if the table exists */
     /* XXX is this the best way to do this? */
     snprintf(cmd, sizeof(cmd), "SELECT * FROM %s LIMIT 0;", table);
-    if (dbengine->sql_exec(conn, cmd, NULL, NULL)) {
+    if (dbengine->sql_exec(c->conn, cmd, NULL, NULL)) {
         if (flags & CYRUSDB_CREATE) {
             /* create the table */
             snprintf(cmd, sizeof(cmd),
                      "CREATE TABLE %s (dbkey %s NOT NULL, data %s);",
                      table, dbengine->binary_type, dbengine->binary_type);
-            if (dbengine->sql_exec(conn, cmd, NULL, NULL)) {
+            if (dbengine->sql_exec(c->conn, cmd, NULL, NULL)) {
                 syslog(LOG_ERR, "DBERROR: SQL failed: %s", cmd);
-                dbengine->sql_close(conn);
+                free(table);
                 return CYRUSDB_INTERNAL;
             }
         }
         else {
+            free(table);
             return CYRUSDB_NOTFOUND;
         }
     }
 
     *ret = (struct dbengine *) xzmalloc(sizeof(struct dbengine));
-    (*ret)->conn = conn;
+    (*ret)->database = xstrdup(database);
     (*ret)->table = table;
 
     if (mytid) {
@@ -578,10 +998,9 @@ static int myclose(struct dbengine *db)
 {
     assert(db);
 
-    dbengine->sql_close(db->conn);
+    /* the connection stays in the pool */
+    free(db->database);
     free(db->table);
-    if (db->esc_key) free(db->esc_key);
-    if (db->esc_data) free(db->esc_data);
     if (db->data) free(db->data);
     free(db);
 
@@ -594,6 +1013,7 @@ struct select_rock {
     foreach_cb *goodp;
     foreach_cb *cb;
     void *rock;
+    int cbr;    /* what the callback stopped the SELECT with */
 };
 
 static int select_cb(void *rock,
@@ -618,6 +1038,7 @@ static int select_cb(void *rock,
 
         /* make callback */
         if (srock->cb) r = srock->cb(srock->rock, key, keylen, data, datalen);
+        srock->cbr = r;
     }
 
     return r;
@@ -636,7 +1057,8 @@ static int fetch_cb(void *rock,
     struct fetch_rock *frock = (struct fetch_rock *) rock;
 
     if (frock->data) {
-        *(frock->data) = xrealloc(*(frock->data), datalen);
+        /* at least 1 byte, so empty data isn't returned as NULL */
+        *(frock->data) = xrealloc(*(frock->data), datalen + 1);
         memcpy(*(frock->data), data, datalen);
     }
     if (frock->datalen) *(frock->datalen) = datalen;
@@ -649,10 +1071,12 @@ static int fetch(struct dbengine *db,
                  const char **data, size_t *datalen,
                  struct txn **tid)
 {
-    char cmd[1024], *esc_key;
+    struct buf cmd = BUF_INITIALIZER;
+    struct sqlparam param = { key, keylen };
+    struct sql_conn *c;
     size_t len = 0;
     struct fetch_rock frock = { &db->data, &len };
-    struct select_rock srock = { 0, NULL, NULL, &fetch_cb, &frock };
+    struct select_rock srock = { 0, NULL, NULL, &fetch_cb, &frock, 0 };
     int r;
 
     assert(db);
@@ -669,18 +1093,19 @@ static int fetch(struct dbengine *db,
     }
 
     /* fetch the data */
-    esc_key = dbengine->sql_escape(db->conn, &db->esc_key, key, keylen);
-    snprintf(cmd, sizeof(cmd),
-             "SELECT * FROM %s WHERE dbkey = '%s';", db->table, esc_key);
-    if (esc_key != db->esc_key) free(esc_key);
-    r = dbengine->sql_exec(db->conn, cmd, &select_cb, &srock);
+    buf_printf(&cmd, "SELECT dbkey, data FROM %s WHERE dbkey = ?;", db->table);
+    r = read_conn(db, tid ? *tid : NULL, &c);
+    if (!r) r = sql_run(c, buf_cstring(&cmd), &param, 1, &select_cb, &srock);
 
     if (r) {
-        syslog(LOG_ERR, "DBERROR: SQL failed %s", cmd);
-        if (tid) dbengine->sql_rollback_txn(db->conn);
+        syslog(LOG_ERR, "DBERROR: SQL failed %s", buf_cstring(&cmd));
+        if (tid) dbengine->sql_rollback_txn((*tid)->conn->conn);
+        buf_free(&cmd);
         return CYRUSDB_INTERNAL;
     }
 
+    buf_free(&cmd);
+
     if (!srock.found) return CYRUSDB_NOTFOUND;
 
     if (data) *data = db->data;
@@ -695,8 +1120,12 @@ static int foreach(struct dbengine *db,
                    foreach_cb *cb, void *rock,
                    struct txn **tid)
 {
-    char cmd[1024], *esc_key = NULL;
-    struct select_rock srock = { 0, NULL, goodp, cb, rock };
+    struct buf cmd = BUF_INITIALIZER;
+    struct buf upper = BUF_INITIALIZER;
+    struct sqlparam params[2];
+    struct select_rock srock = { 0, NULL, goodp, cb, rock, 0 };
+    struct sql_conn *c;
+    int nparams = 0;
     int r;
 
     assert(db);
@@ -709,22 +1138,41 @@ static int foreach(struct dbengine *db,
     }
 
     /* fetch the data */
-    if (prefixlen) /* XXX hack for SQLite */
-        esc_key = dbengine->sql_escape(db->conn, &db->esc_key,
-                                       prefix, prefixlen);
-    snprintf(cmd, sizeof(cmd),
-             "SELECT * FROM %s WHERE dbkey LIKE '%s%%' ORDER BY dbkey;",
-             db->table, esc_key ? esc_key : "");
-    if (esc_key && (esc_key != db->esc_key)) free(esc_key);
-    r = dbengine->sql_exec(db->conn, cmd, &select_cb, &srock);
+    buf_printf(&cmd, "SELECT dbkey, data FROM %s", db->table);
+    if (prefixlen) {
+        params[nparams].s = prefix;
+        params[nparams++].len = prefixlen;
+        buf_appendcstr(&cmd, " WHERE dbkey >= ?");
+
+        /* keys with the prefix sort below the prefix with its last
+         * byte incremented */
+        buf_setmap(&upper, prefix, prefixlen);
+        while (upper.len && (unsigned char) upper.s[upper.len-1] == 0xff)
+            buf_truncate(&upper, upper.len - 1);
+        if (upper.len) {
+            upper.s[upper.len-1]++;
+            params[nparams].s = upper.s;
+            params[nparams++].len = upper.len;
+            buf_appendcstr(&cmd, " AND dbkey < ?");
+        }
+    }
+    buf_appendcstr(&cmd, " ORDER BY dbkey;");
 
-    if (r) {
-        syslog(LOG_ERR, "DBERROR: SQL failed %s", cmd);
-        if (tid) dbengine->sql_rollback_txn(db->conn);
-        return CYRUSDB_INTERNAL;
+    r = read_conn(db, tid ? *tid : NULL, &c);
+    if (!r) r = sql_run(c, buf_cstring(&cmd), params, nparams,
+                        &select_cb, &srock);
+
+    /* a callback stopping it isn't an SQL failure */
+    if (r && r != srock.cbr) {
+        syslog(LOG_ERR, "DBERROR: SQL failed %s", buf_cstring(&cmd));
+        if (tid) dbengine->sql_rollback_txn((*tid)->conn->conn);
+        r = CYRUSDB_INTERNAL;
     }
 
-    return 0;
+    buf_free(&upper);
+    buf_free(&cmd);
+
+    return r;
 }
 
 static int mystore(struct dbengine *db,
@@ -733,10 +1181,12 @@ static int mystore(struct dbengine *db,
                    struct txn **tid, int overwrite,
                    int isdelete)
 {
-    char cmd[1024], *esc_key;
-    int free_esc_key = 0;
+    struct buf cmd = BUF_INITIALIZER;
+    struct sqlparam params[2];
+    struct sql_conn *c;
+    struct txn *txn;
     const char dummy = 0;
-    int r = 0;
+    int i, r = 0;
 
     assert(db);
     assert(key);
@@ -747,79 +1197,102 @@ static int mystore(struct dbengine *db,
 
     if (tid && !*tid && !(*tid = start_txn(db))) return CYRUSDB_INTERNAL;
 
-    esc_key = dbengine->sql_escape(db->conn, &db->esc_key, key, keylen);
-    free_esc_key = (esc_key != db->esc_key);
+    txn = tid ? *tid : db->txn;
+    c = txn ? txn->conn : pool_get(db->database);
+    if (!c) return CYRUSDB_INTERNAL;
+
+    /* rows batched in this transaction aren't in the table yet */
+    i = txn ? batch_find(txn, key, keylen) : -1;
+    if (i >= 0) {
+        if (isdelete) {
+            batch_remove(txn, i);
+        }
+        else if (overwrite) {
+            buf_setmap(&txn->batchdata[i], data, datalen);
+        }
+        else {
+            if (tid) dbengine->sql_rollback_txn(c->conn);
+            return CYRUSDB_EXISTS;
+        }
+        return 0;
+    }
+
+    params[0].s = key;
+    params[0].len = keylen;
 
     if (isdelete) {
         /* DELETE the entry */
-        snprintf(cmd, sizeof(cmd), "DELETE FROM %s WHERE dbkey = '%s';",
-                 db->table, esc_key);
-        r = dbengine->sql_exec(db->conn, cmd, NULL, NULL);
+        buf_printf(&cmd, "DELETE FROM %s WHERE dbkey = ?;", db->table);
+        r = sql_run(c, buf_cstring(&cmd), params, 1, NULL, NULL);
 
         /* see if we just removed the previously SELECTed key */
-        if (!r && tid && *tid &&
-            (*tid)->keylen == strlen(esc_key) &&
-            !memcmp((*tid)->lastkey, esc_key, (*tid)->keylen)) {
-            (*tid)->keylen = 0;
+        if (!r && txn &&
+            txn->keylen == (size_t) keylen &&
+            !memcmp(txn->lastkey, key, keylen)) {
+            txn->keylen = 0;
         }
     }
     else {
         /* INSERT/UPDATE the entry */
-        struct select_rock srock = { 0, NULL, NULL, NULL, NULL };
-
-        char *esc_data = dbengine->sql_escape(db->conn, &db->esc_data,
-                                              data, datalen);
-        int free_esc_data = (esc_data != db->esc_data);
+        struct select_rock srock = { 0, NULL, NULL, NULL, NULL, 0 };
 
         /* see if we just SELECTed this key in this transaction */
-        if (tid && *tid) {
-            if ((*tid)->keylen == strlen(esc_key) &&
-                !memcmp((*tid)->lastkey, esc_key, (*tid)->keylen)) {
+        if (txn) {
+            if (txn->keylen == (size_t) keylen &&
+                !memcmp(txn->lastkey, key, keylen)) {
                 srock.found = 1;
             }
-            srock.tid = *tid;
+            srock.tid = txn;
         }
 
         /* check if the entry exists */
         if (!srock.found) {
-            snprintf(cmd, sizeof(cmd),
-                     "SELECT * FROM %s WHERE dbkey = '%s';",
-                     db->table, esc_key);
-            r = dbengine->sql_exec(db->conn, cmd, &select_cb, &srock);
+            buf_printf(&cmd, "SELECT dbkey, data FROM %s WHERE dbkey = ?;",
+                       db->table);
+            r = sql_run(c, buf_cstring(&cmd), params, 1, &select_cb, &srock);
         }
 
         if (!r && srock.found) {
             if (overwrite) {
                 /* already have this entry, UPDATE it */
-                snprintf(cmd, sizeof(cmd),
-                         "UPDATE %s SET data = '%s' WHERE dbkey = '%s';",
-                         db->table, esc_data, esc_key);
-                r = dbengine->sql_exec(db->conn, cmd, NULL, NULL);
+                buf_reset(&cmd);
+                buf_printf(&cmd, "UPDATE %s SET data = ? WHERE dbkey = ?;",
+                           db->table);
+                params[0].s = data;
+                params[0].len = datalen;
+                params[1].s = key;
+                params[1].len = keylen;
+                r = sql_run(c, buf_cstring(&cmd), params, 2, NULL, NULL);
             }
             else {
-                if (tid) dbengine->sql_rollback_txn(db->conn);
+                if (tid) dbengine->sql_rollback_txn(c->conn);
+                buf_free(&cmd);
                 return CYRUSDB_EXISTS;
             }
         }
-        else if (!r && !srock.found) {
+        else if (!r && txn) {
+            /* INSERT it along with the transaction's other new entries */
+            r = batch_add(db, txn, key, keylen, data, datalen);
+        }
+        else if (!r) {
             /* INSERT the new entry */
-            snprintf(cmd, sizeof(cmd),
-                     "INSERT INTO %s VALUES ('%s', '%s');",
-                     db->table, esc_key, esc_data);
-            r = dbengine->sql_exec(db->conn, cmd, NULL, NULL);
+            buf_reset(&cmd);
+            buf_printf(&cmd, "INSERT INTO %s VALUES (?, ?);", db->table);
+            params[1].s = data;
+            params[1].len = datalen;
+            r = sql_run(c, buf_cstring(&cmd), params, 2, NULL, NULL);
         }
-
-        if (free_esc_data) free(esc_data);
     }
 
-    if (free_esc_key) free(esc_key);
-
     if (r) {
-        syslog(LOG_ERR, "DBERROR: SQL failed: %s", cmd);
-        if (tid) dbengine->sql_rollback_txn(db->conn);
+        syslog(LOG_ERR, "DBERROR: SQL failed: %s", buf_cstring(&cmd));
+        if (tid) dbengine->sql_rollback_txn(c->conn);
+        buf_free(&cmd);
         return CYRUSDB_INTERNAL;
     }
 
+    buf_free(&cmd);
+
     return 0;
 }
 
@@ -850,9 +1323,22 @@ static int delete(struct dbengine *db,
 static int finish_txn(struct dbengine *db, struct txn *tid, int commit)
 {
     if (tid) {
-        int rc = commit ? dbengine->sql_commit_txn(db->conn) :
-            dbengine->sql_rollback_txn(db->conn);
+        void *conn = tid->conn->conn;
+        int i, rc = 0;
+
+        if (commit) rc = flush_batch(db, tid);
 
+        if (!rc && commit) rc = dbengine->sql_commit_txn(conn);
+        else rc = dbengine->sql_rollback_txn(conn) || rc;
+
+        /* hand the connection back to the pool */
+        tid->conn->txn = NULL;
+        if (db->txn == tid) db->txn = NULL;
+
+        for (i = 0; i < BATCH_SIZE; i++) {
+            buf_free(&tid->batchkey[i]);
+            buf_free(&tid->batchdata[i]);
+        }
         if (tid->lastkey) free(tid->lastkey);
         free(tid);
 
@@ -43,10 +43,12 @@
 #include <config.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -254,6 +256,16 @@
  * more reliable than just using the inode, because inodes
  * can be reused.
  *
+ * With twoskip_online_repack enabled (and always for an explicit
+ * repack outside a transaction), the checkpoint doesn't hold the
+ * write lock throughout.  Instead the current records are copied
+ * into fname.REPACK a slice at a time under the read lock, then
+ * the commits made since the copy started are replayed from the
+ * old file into the new one - first under the read lock, and
+ * finally under the write lock for the last short tail before the
+ * rename.  Replaying a commit is idempotent, so it doesn't matter
+ * that some slices already saw some of the changes.
+ *
  * LOCATION OPTIMISATION:
  * If the generation is unchanged AND the size of the file
  * is unchanged, then all offsets stored in the skiploc are
@@ -262,6 +274,56 @@
  * regular fetches that happen to hit either the current key,
  * the gap immediately after, or the next key.  All other
  * locations cause a full relocate.
+ *
+ * SNAPSHOT READS:
+ * If twoskip_snapshot_reads is enabled, fetch and foreach outside
+ * of a transaction don't take the file lock at all.  Instead the
+ * reader refreshes the map, reads the header and treats the
+ * committed current_size as the end of the file.  Everything before
+ * that offset is either immutable (keys and values) or protected by
+ * the head crc32 (pointers), and the level zero logic above means
+ * there is always a pointer into the committed part of the file for
+ * any record a writer is busy changing.  Higher level pointers into
+ * the uncommitted part are just ignored, which costs a few extra
+ * steps at level zero but never finds the wrong record.
+ *
+ * A writer which commits (or checkpoints) while the reader is busy
+ * can invalidate those guarantees, so the reader checks the header
+ * again before handing anything back, and starts over from the last
+ * good key if it changed.  Torn reads of a record head being
+ * rewritten show up as crc failures, and are retried the same way.
+ * After SNAPSHOT_RETRIES failed attempts it falls back to the lock.
+ *
+ * GROUP COMMIT:
+ * If twoskip_group_commit is enabled, a commit doesn't sync while
+ * holding the write lock.  Instead the header is written with the
+ * new current_size and the SYNCPENDING flag (DIRTY stays set, so
+ * the header on disk never claims to be clean before the data is
+ * synced), the lock is dropped, and the committer waits for an
+ * fdatasync which started after its commit record was written.
+ * Committers queue on the "leader" byte lock of fname.sync; whoever
+ * gets it first syncs everything written so far and records the
+ * synced size in fname.sync, and anyone who was queued behind it
+ * and is covered by that size just returns.  Finally the committer
+ * takes the write lock again and clears the flags if nobody has
+ * committed since, otherwise that's left to the later committer.
+ *
+ * Between dropping the write lock and finishing, a committer holds
+ * a shared lock on the "inflight" byte of fname.sync.  A header
+ * with SYNCPENDING set is only treated as clean while somebody
+ * holds that lock - if the committer crashed, or the machine did,
+ * the next locker runs recovery.
+ *
+ * Readers never see a commit before it is on disk: a reader which
+ * finds SYNCPENDING in the header waits for (or does) the sync up
+ * to the header's current_size before reading anything.  Writers
+ * don't wait, so several commits can be published but not yet
+ * synced, and the header can reach the disk before the records it
+ * covers.  The in-place pointer updates of the later commits can
+ * then clobber both level 0 pointers of a synced record, so after
+ * a crash with SYNCPENDING set recovery doesn't trust the pointers
+ * at all, and goes straight to recovery2, which salvages every
+ * intact commit in file order.
  */
 
 
@@ -281,6 +343,18 @@
 /* release lock in foreach at least every N records */
 #define FOREACH_LOCK_RELEASE 256
 
+/* give up on snapshot reads and take the lock after N failed attempts */
+#define SNAPSHOT_RETRIES 3
+#define SNAPSHOT_READS libcyrus_config_getswitch(CYRUSOPT_TWOSKIP_SNAPSHOT_READS)
+
+/* online checkpoint: copy N records per read lock */
+#define REPACK_SLICE 1024
+/* replay passes under the read lock before taking the write lock anyway */
+#define REPACK_REPLAYS 8
+#define ONLINE_REPACK libcyrus_config_getswitch(CYRUSOPT_TWOSKIP_ONLINE_REPACK)
+
+#define GROUP_COMMIT libcyrus_config_getswitch(CYRUSOPT_TWOSKIP_GROUP_COMMIT)
+
 /* format specifics */
 #undef VERSION /* defined in config.h */
 #define VERSION 1
@@ -356,6 +430,9 @@ struct skiploc {
     /* need a generation so we know if the location is still valid */
     uint64_t generation;
     size_t end;
+
+    /* found without a lock, so the offsets may not be good for writing */
+    int is_snapshot;
 };
 
 enum {
@@ -365,6 +442,13 @@ enum {
 };
 
 #define DIRTY (1<<0)
+#define SYNCPENDING (1<<1)
+
+/* group commit sidecar: bytes locked, and the synced size record */
+#define SYNC_SUFFIX ".sync"
+#define SYNC_INFLIGHT 0
+#define SYNC_LEADER 1
+#define SYNC_RECORD_SIZE 16
 
 struct txn {
     /* logstart is where we start changes from on commit, where we truncate
@@ -395,6 +479,13 @@ struct dbengine {
     int txn_num;
     struct txn *current_txn;
 
+    /* reading without a lock, 'end' is the last committed size */
+    int snapshot;
+
+    /* waiting for a group commit sync, holding the inflight lock on syncfd */
+    int sync_inflight;
+    int syncfd;
+
     /* comparator function to use for sorting */
     int open_flags;
     int (*compar) (const char *s1, int l1, const char *s2, int l2);
@@ -434,8 +525,12 @@ static union skipwritebuf {
 static struct db_list *open_twoskip = NULL;
 
 static int mycommit(struct dbengine *db, struct txn *tid);
+static int _commit(struct dbengine *db, struct txn *tid, int group);
 static int myabort(struct dbengine *db, struct txn *tid);
 static int mycheckpoint(struct dbengine *db);
+static int online_checkpoint(struct dbengine *db);
+static int _replay_commit(struct dbengine *db, struct dbengine *newdb,
+                          struct skiprecord *commit, struct txn **tidptr);
 static int myconsistent(struct dbengine *db, struct txn *tid);
 static int recovery(struct dbengine *db);
 static int recovery1(struct dbengine *db, int *count);
@@ -514,6 +609,8 @@ static int read_header(struct dbengine *db)
     crc = ntohl(*((uint32_t *)(BASE(db) + OFFSET_CRC32)));
 
     if (crc32_map(BASE(db), OFFSET_CRC32) != crc) {
+        /* caught a writer halfway through updating the header */
+        if (db->snapshot) return CYRUSDB_AGAIN;
         syslog(LOG_ERR, "DBERROR: %s: twoskip header CRC failure",
                FNAME(db));
         return CYRUSDB_IOERROR;
@@ -576,6 +673,9 @@ static int check_tailcrc(struct dbengine *db, struct skiprecord *record)
 static int read_onerecord(struct dbengine *db, size_t offset,
                           struct skiprecord *record)
 {
+    /* snapshot readers must never look past the committed size,
+     * nor past what is mapped */
+    size_t size = db->snapshot ? MIN(db->end, SIZE(db)) : SIZE(db);
     const char *base;
     int i;
 
@@ -587,7 +687,7 @@ static int read_onerecord(struct dbengine *db, size_t offset,
     record->len = 24; /* absolute minimum */
 
     /* need space for at least the header plus some details */
-    if (record->offset + record->len > SIZE(db))
+    if (record->offset + record->len > size)
         goto badsize;
 
     base = BASE(db) + offset;
@@ -601,6 +701,7 @@ static int read_onerecord(struct dbengine *db, size_t offset,
 
     /* make sure we fit */
     if (record->level > MAXLEVEL) {
+        if (db->snapshot) return CYRUSDB_AGAIN;
         syslog(LOG_ERR, "DBERROR: twoskip invalid level %d for %s at %08llX",
                record->level, FNAME(db), (LLU)offset);
         return CYRUSDB_IOERROR;
@@ -626,7 +727,7 @@ static int read_onerecord(struct dbengine *db, size_t offset,
                 + 8                         /* crc32s */
                 + roundup(record->keylen + record->vallen, 8);  /* keyval */
 
-    if (record->offset + record->len > SIZE(db))
+    if (record->offset + record->len > size)
         goto badsize;
 
     for (i = 0; i <= record->level; i++) {
@@ -639,6 +740,8 @@ static int read_onerecord(struct dbengine *db, size_t offset,
     record->crc32_head = ntohl(*((uint32_t *)base));
     if (crc32_map(BASE(db) + record->offset, (offset - record->offset))
         != record->crc32_head) {
+        /* a writer is busy rewriting the pointers in this record */
+        if (db->snapshot) return CYRUSDB_AGAIN;
         syslog(LOG_ERR, "DBERROR: twoskip checksum head error for %s at %08llX",
                FNAME(db), (LLU)offset);
         return CYRUSDB_IOERROR;
@@ -652,6 +755,7 @@ static int read_onerecord(struct dbengine *db, size_t offset,
     return 0;
 
 badsize:
+    if (db->snapshot) return CYRUSDB_AGAIN;
     syslog(LOG_ERR, "twoskip: attempt to read past end of file %s: %08llX > %08llX",
            FNAME(db), (LLU)record->offset + record->len, (LLU)SIZE(db));
     return CYRUSDB_IOERROR;
@@ -811,8 +915,13 @@ static int append_record(struct dbengine *db, struct skiprecord *record,
 static size_t _getloc(struct dbengine *db, struct skiprecord *record,
                       uint8_t level)
 {
-    if (level)
+    if (level) {
+        /* uncommitted pointers don't exist for snapshot readers, fall
+         * down to a lower level instead */
+        if (db->snapshot && record->nextloc[level + 1] >= db->end)
+            return 0;
         return record->nextloc[level + 1];
+    }
 
     /* if one is past, must be the other */
     if (record->nextloc[0] >= db->end)
@@ -866,9 +975,11 @@ static int relocate(struct dbengine *db)
     /* pointer validity */
     loc->generation = db->header.generation;
     loc->end = db->end;
+    loc->is_snapshot = db->snapshot;
 
     /* start with the dummy */
     r = read_onerecord(db, DUMMY_OFFSET, &loc->record);
+    if (r) return r;
     loc->is_exactmatch = 0;
 
     /* initialise pointers */
@@ -898,6 +1009,8 @@ static int relocate(struct dbengine *db)
             if (r) return r;
 
             if (newrecord.offset) {
+                if (db->snapshot && newrecord.level < level)
+                    return CYRUSDB_AGAIN;
                 assert(newrecord.level >= level);
 
                 cmp = db->compar(KEY(db, &newrecord), newrecord.keylen,
@@ -1172,6 +1285,142 @@ static int delete_here(struct dbengine *db)
     return 0;
 }
 
+/************************** GROUP COMMIT SIDECAR **************************/
+
+static int sync_open(struct dbengine *db, int create)
+{
+    char fname[1024];
+
+    snprintf(fname, sizeof(fname), "%s%s", FNAME(db), SYNC_SUFFIX);
+
+    return open(fname, create ? O_RDWR | O_CREAT : O_RDWR, 0644);
+}
+
+/* take (or with F_UNLCK, release) a lock on one byte of the sidecar */
+static int sync_setlock(int fd, off_t pos, short type)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(struct flock));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = pos;
+    fl.l_len = 1;
+
+    while (fcntl(fd, F_SETLKW, &fl) < 0) {
+        if (errno != EINTR)
+            return CYRUSDB_IOERROR;
+    }
+
+    return 0;
+}
+
+/* the size known to be on disk for this generation, or zero */
+static size_t sync_read(int fd, uint64_t generation)
+{
+    char buf[SYNC_RECORD_SIZE];
+
+    if (pread(fd, buf, SYNC_RECORD_SIZE, 0) != SYNC_RECORD_SIZE)
+        return 0;
+
+    if (ntohll(*((uint64_t *)buf)) != generation)
+        return 0;
+
+    return ntohll(*((uint64_t *)(buf + 8)));
+}
+
+static int sync_write(int fd, uint64_t generation, size_t size)
+{
+    char buf[SYNC_RECORD_SIZE];
+
+    *((uint64_t *)buf) = htonll(generation);
+    *((uint64_t *)(buf + 8)) = htonll(size);
+
+    if (pwrite(fd, buf, SYNC_RECORD_SIZE, 0) != SYNC_RECORD_SIZE)
+        return CYRUSDB_IOERROR;
+
+    return 0;
+}
+
+/* recovery has synced up to current_size, and may have truncated the
+ * file, so make sure the sidecar doesn't claim anything past that */
+static void sync_reset(struct dbengine *db)
+{
+    int fd = db->sync_inflight ? db->syncfd : sync_open(db, 0);
+
+    if (fd < 0) return;
+
+    sync_write(fd, db->header.generation, db->header.current_size);
+
+    /* closing any descriptor drops all our fcntl locks on the file */
+    if (!db->sync_inflight) close(fd);
+}
+
+/* make sure everything up to the current_size in the header is on disk
+ * before a reader looks at it.  Called with the read lock held, so the
+ * header can't move underneath us.  Waits behind any sync in progress,
+ * and syncs the file itself if that didn't cover it */
+static int sync_wait(struct dbengine *db)
+{
+    uint64_t generation = db->header.generation;
+    size_t want = db->header.current_size;
+    int fd = db->sync_inflight ? db->syncfd : sync_open(db, 0);
+    int leader = 0;
+    off_t size;
+    int r = 0;
+
+    if (fd >= 0) {
+        if (sync_read(fd, generation) >= want)
+            goto done;
+
+        r = sync_setlock(fd, SYNC_LEADER, F_WRLCK);
+        if (r) goto done;
+        leader = 1;
+
+        if (sync_read(fd, generation) >= want)
+            goto done;
+    }
+
+    if (mappedfile_sync(db->mf, &size)) {
+        r = CYRUSDB_IOERROR;
+        goto done;
+    }
+
+    if (fd >= 0)
+        r = sync_write(fd, generation, size);
+
+ done:
+    if (leader) sync_setlock(fd, SYNC_LEADER, F_UNLCK);
+    if (fd >= 0 && !db->sync_inflight) close(fd);
+    return r;
+}
+
+/* is any live process waiting on a group commit sync? */
+static int sync_inflight(struct dbengine *db)
+{
+    struct flock fl;
+    int inflight = 0;
+    int fd;
+
+    if (db->sync_inflight) return 1;
+
+    fd = sync_open(db, 0);
+    if (fd < 0) return 0;
+
+    memset(&fl, 0, sizeof(struct flock));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = SYNC_INFLIGHT;
+    fl.l_len = 1;
+
+    if (fcntl(fd, F_GETLK, &fl) == 0 && fl.l_type != F_UNLCK)
+        inflight = 1;
+
+    close(fd);
+
+    return inflight;
+}
+
 /************ DATABASE STRUCT AND TRANSACTION MANAGEMENT **************/
 
 static int db_is_clean(struct dbengine *db)
@@ -1179,6 +1428,10 @@ static int db_is_clean(struct dbengine *db)
     if (db->header.current_size != SIZE(db))
         return 0;
 
+    /* committed, just waiting for the sync */
+    if (db->header.flags & SYNCPENDING)
+        return sync_inflight(db);
+
     if (db->header.flags & DIRTY)
         return 0;
 
@@ -1195,6 +1448,11 @@ static int write_lock(struct dbengine *db)
     int r = mappedfile_writelock(db->mf);
     if (r) return r;
 
+    /* a location found by a snapshot reader may have skipped pointers
+     * that a writer needs to update, so force a full relocate */
+    if (db->loc.is_snapshot)
+        db->loc.generation = 0;
+
     /* reread header */
     if (db->is_open) {
         r = read_header(db);
@@ -1229,11 +1487,86 @@ static int read_lock(struct dbengine *db)
             unlock(db);
             return read_lock(db);
         }
+
+        /* a group commit which isn't on disk yet */
+        if (db->header.flags & SYNCPENDING) {
+            r = sync_wait(db);
+            if (r) {
+                unlock(db);
+                return r;
+            }
+        }
     }
 
     return 0;
 }
 
+/* start a lockless read of the last committed state of the file */
+static int snapshot_begin(struct dbengine *db)
+{
+    int r;
+
+    assert(!db->current_txn);
+
+    r = mappedfile_refresh(db->mf);
+    if (r) return CYRUSDB_IOERROR;
+
+    db->snapshot = 1;
+    db->loc.is_snapshot = 1;
+
+    r = read_header(db);
+    if (r) db->snapshot = 0;
+
+    /* a writer committed more since we mapped the file: try again */
+    if (!r && db->header.current_size > SIZE(db)) {
+        db->snapshot = 0;
+        db->loc.is_snapshot = 0;
+        return CYRUSDB_AGAIN;
+    }
+
+    /* the last commit may not be on disk yet, which only the lock
+     * can wait for */
+    if (!r && (db->header.flags & SYNCPENDING)) {
+        db->snapshot = 0;
+        db->loc.is_snapshot = 0;
+        return read_lock(db);
+    }
+
+    return r;
+}
+
+/* finish a lockless read.  Returns CYRUSDB_AGAIN if anything was committed
+ * since snapshot_begin, in which case nothing read can be trusted */
+static int snapshot_end(struct dbengine *db)
+{
+    uint64_t generation = db->header.generation;
+    size_t current_size = db->header.current_size;
+    int r;
+
+    assert(db->snapshot);
+
+    r = read_header(db);
+    if (!r && (db->header.generation != generation ||
+               db->header.current_size != current_size))
+        r = CYRUSDB_AGAIN;
+
+    db->snapshot = 0;
+
+    return r;
+}
+
+/* readers outside a transaction either take the read lock or
+ * read a snapshot */
+static int read_begin(struct dbengine *db, int snapshot)
+{
+    return snapshot ? snapshot_begin(db) : read_lock(db);
+}
+
+static int read_end(struct dbengine *db)
+{
+    return db->snapshot ? snapshot_end(db) : unlock(db);
+}
+
 static int newtxn(struct dbengine *db, struct txn **tidptr)
 {
     int r;
@@ -1347,6 +1680,9 @@ static int opendb(const char *fname, int flags, struct dbengine **ret, struct tx
                    fname);
             goto done;
         }
+
+        /* a group commit sidecar left over from an earlier file */
+        sync_reset(db);
     }
 
     db->is_open = 1;
@@ -1448,6 +1784,8 @@ static int myfetch(struct dbengine *db,
             const char **data, size_t *datalen,
             struct txn **tidptr, int fetchnext)
 {
+    int snapshot = 0;
+    int retries = 0;
     int r = 0;
 
     assert(db);
@@ -1470,19 +1808,28 @@ static int myfetch(struct dbengine *db,
             if (r) return r;
         }
     } else {
-        /* grab a r lock */
-        r = read_lock(db);
+        snapshot = SNAPSHOT_READS;
+ again:
+        /* grab a r lock, or read without one */
+        r = read_begin(db, snapshot);
+        if (r == CYRUSDB_AGAIN) goto retry;
         if (r) return r;
     }
 
     r = find_loc(db, key, keylen);
-    if (r) goto done;
 
-    if (fetchnext) {
+    if (!r && fetchnext)
         r = advance_loc(db);
-        if (r) goto done;
+
+    if (db->snapshot) {
+        /* everything we found is only good if nothing committed meanwhile */
+        int r1 = snapshot_end(db);
+        if (!r) r = r1;
+        if (r == CYRUSDB_AGAIN) goto retry;
     }
 
+    if (r) goto done;
+
     if (foundkey) *foundkey = db->loc.keybuf.s;
     if (foundkeylen) *foundkeylen = db->loc.keybuf.len;
 
@@ -1505,6 +1852,11 @@ done:
     }
 
     return r;
+
+retry:
+    /* don't keep losing the race against writers, just wait for them */
+    if (++retries >= SNAPSHOT_RETRIES) snapshot = 0;
+    goto again;
 }
 
 /* foreach allows for subsidary mailbox operations in 'cb'.
@@ -1519,6 +1871,8 @@ static int myforeach(struct dbengine *db,
     int r = 0, cb_r = 0;
     int num_misses = 0;
     int need_unlock = 0;
+    int snapshot = 0;
+    int retries = 0;
     const char *val;
     size_t vallen;
     struct buf keybuf = BUF_INITIALIZER;
@@ -1539,21 +1893,37 @@ static int myforeach(struct dbengine *db,
             r = newtxn(db, tidptr);
             if (r) return r;
         }
-    } else {
-        /* grab a r lock */
-        r = read_lock(db);
-        if (r) return r;
+    }
+    else {
+        snapshot = SNAPSHOT_READS;
+    }
+
+ restart:
+    if (!tidptr) {
+        /* grab a r lock, or read without one */
+        r = read_begin(db, snapshot);
+        if (r) goto done;
         need_unlock = 1;
     }
 
-    r = find_loc(db, prefix, prefixlen);
-    if (r) goto done;
+    if (keybuf.len) {
+        /* carry on after the last key we know was good */
+        r = find_loc(db, keybuf.s, keybuf.len);
+        if (r) goto done;
 
-    if (!db->loc.is_exactmatch) {
-        /* advance to the first match */
         r = advance_loc(db);
         if (r) goto done;
     }
+    else {
+        r = find_loc(db, prefix, prefixlen);
+        if (r) goto done;
+
+        if (!db->loc.is_exactmatch) {
+            /* advance to the first match */
+            r = advance_loc(db);
+            if (r) goto done;
+        }
+    }
 
     while (db->loc.is_exactmatch) {
         /* does it match prefix? */
@@ -1567,17 +1937,18 @@ static int myforeach(struct dbengine *db,
 
         if (!goodp || goodp(rock, db->loc.keybuf.s, db->loc.keybuf.len,
                                   val, vallen)) {
-            /* take a copy of they key - just in case cb does actions on this database
-             * and clobbers loc */
-            buf_copy(&keybuf, &db->loc.keybuf);
-
             if (!tidptr) {
                 /* release read lock */
-                r = unlock(db);
-                if (r) goto done;
+                r = read_end(db);
                 need_unlock = 0;
+                if (r) goto done;
+                retries = 0;
             }
 
+            /* take a copy of they key - just in case cb does actions on this database
+             * and clobbers loc */
+            buf_copy(&keybuf, &db->loc.keybuf);
+
             /* make callback */
             cb_r = cb(rock, db->loc.keybuf.s, db->loc.keybuf.len,
                             val, vallen);
@@ -1585,7 +1956,7 @@ static int myforeach(struct dbengine *db,
 
             if (!tidptr) {
                 /* grab a r lock */
-                r = read_lock(db);
+                r = read_begin(db, snapshot);
                 if (r) goto done;
                 need_unlock = 1;
 
@@ -1599,17 +1970,18 @@ static int myforeach(struct dbengine *db,
         else if (!tidptr) {
             num_misses++;
             if (num_misses > FOREACH_LOCK_RELEASE) {
+                /* release read lock */
+                r = read_end(db);
+                need_unlock = 0;
+                if (r) goto done;
+                retries = 0;
+
                 /* take a copy of they key - just in case cb does actions on this database
                  * and clobbers loc */
                 buf_copy(&keybuf, &db->loc.keybuf);
 
-                /* release read lock */
-                r = unlock(db);
-                if (r) goto done;
-                need_unlock = 0;
-
                 /* grab a r lock */
-                r = read_lock(db);
+                r = read_begin(db, snapshot);
                 if (r) goto done;
                 need_unlock = 1;
 
@@ -1626,13 +1998,28 @@ static int myforeach(struct dbengine *db,
         if (r) goto done;
     }
 
+    if (need_unlock && db->snapshot) {
+        /* make sure we didn't stop early because of a writer */
+        r = read_end(db);
+        need_unlock = 0;
+    }
+
  done:
 
+    if (r == CYRUSDB_AGAIN && snapshot) {
+        /* a writer committed under our snapshot, try again from
+         * the last good key */
+        if (need_unlock) read_end(db);
+        need_unlock = 0;
+        if (++retries >= SNAPSHOT_RETRIES) snapshot = 0;
+        goto restart;
+    }
+
     buf_free(&keybuf);
 
     if (need_unlock) {
         /* release read lock */
-        int r1 = unlock(db);
+        int r1 = read_end(db);
         if (r1) return r1;
     }
 
@@ -1670,18 +2057,123 @@ static int skipwrite(struct dbengine *db,
     return 0;
 }
 
+/* join the group commit: open the sidecar and take the shared inflight
+ * lock, which tells everyone else that the SYNCPENDING flag belongs to
+ * a live process.  Returns the descriptor, or -1 to commit alone */
+static int group_open(struct dbengine *db)
+{
+    int fd = sync_open(db, 1);
+
+    if (fd < 0) {
+        syslog(LOG_ERR, "IOERROR: twoskip %s: failed to open sync file: %m",
+               FNAME(db));
+        return -1;
+    }
+
+    if (sync_setlock(fd, SYNC_INFLIGHT, F_RDLCK)) {
+        syslog(LOG_ERR, "IOERROR: twoskip %s: failed to lock sync file: %m",
+               FNAME(db));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* publish the commit with the header still dirty on disk, drop the
+ * lock, and share an fdatasync with everyone else committing at the
+ * same time.  Returns with the write lock held again, unless there
+ * was an error after the commit was published */
+static int group_commit(struct dbengine *db, int syncfd, int *publishedp)
+{
+    uint64_t generation = db->header.generation;
+    size_t oldsize = db->header.current_size;
+    uint32_t oldflags = db->header.flags;
+    size_t end = db->end;
+    size_t synced;
+    off_t size;
+    int r;
+
+    db->syncfd = syncfd;
+    db->sync_inflight = 1;
+
+    db->header.current_size = end;
+    db->header.flags |= SYNCPENDING;
+    r = write_header(db);
+    if (r) {
+        /* so the abort knows what to throw away */
+        db->header.current_size = oldsize;
+        db->header.flags = oldflags;
+        return r;
+    }
+
+    *publishedp = 1;
+
+    /* the group sync takes care of everything we've written */
+    mappedfile_nosync(db->mf);
+    unlock(db);
+
+    synced = sync_read(syncfd, generation);
+    if (synced < end) {
+        /* queue up behind whoever is syncing right now */
+        r = sync_setlock(syncfd, SYNC_LEADER, F_WRLCK);
+        if (r) return r;
+
+        /* they may have covered us already, otherwise we lead, and
+         * cover everyone who queued up behind us too */
+        synced = sync_read(syncfd, generation);
+        if (synced < end) {
+            r = mappedfile_sync(db->mf, &size);
+            if (!r) r = sync_write(syncfd, generation, size);
+            else r = CYRUSDB_IOERROR;
+        }
+
+        sync_setlock(syncfd, SYNC_LEADER, F_UNLCK);
+        if (r) return r;
+    }
+
+    /* clean up the header, unless somebody else has committed since
+     * our sync started - then it's theirs to clean */
+    r = write_lock(db);
+    if (r) return r;
+
+    if (db->header.generation == generation &&
+        (db->header.flags & SYNCPENDING) &&
+        db->header.current_size <= sync_read(syncfd, generation)) {
+        db->header.flags &= ~(DIRTY|SYNCPENDING);
+        r = write_header(db);
+        /* it's fine for this to hit the disk whenever */
+        mappedfile_nosync(db->mf);
+    }
+
+    return r;
+}
+
 static int mycommit(struct dbengine *db, struct txn *tid)
+{
+    return _commit(db, tid, GROUP_COMMIT);
+}
+
+/* the new files written by checkpoint and recovery always commit
+ * alone, so they don't need a sidecar */
+static int _commit(struct dbengine *db, struct txn *tid, int group)
 {
     struct skiprecord newrecord;
+    int syncfd = -1;
+    int published = 0;
+    int online = 0;
     int r = 0;
 
     assert(db);
     assert(tid == db->current_txn);
 
-    /* no need to abort if we're not dirty */
-    if (!(db->header.flags & DIRTY))
+    /* no need to abort if we're not dirty.  A group commit may have
+     * left the header dirty, so check we actually wrote something */
+    if (!(db->header.flags & DIRTY) || db->end == db->header.current_size)
         goto done;
 
+    if (group) syncfd = group_open(db);
+
     /* build a commit record */
     memset(&newrecord, 0, sizeof(struct skiprecord));
     newrecord.type = COMMIT;
@@ -1691,6 +2183,11 @@ static int mycommit(struct dbengine *db, struct txn *tid)
     r = append_record(db, &newrecord, NULL, NULL);
     if (r) goto done;
 
+    if (syncfd >= 0) {
+        r = group_commit(db, syncfd, &published);
+        goto done;
+    }
+
     /* commit ALL outstanding changes first, before
      * rewriting the header */
     r = mappedfile_commit(db->mf);
@@ -1698,11 +2195,11 @@ static int mycommit(struct dbengine *db, struct txn *tid)
 
     /* finally, update the header and commit again */
     db->header.current_size = db->end;
-    db->header.flags &= ~DIRTY;
+    db->header.flags &= ~(DIRTY|SYNCPENDING);
     r = commit_header(db);
 
  done:
-    if (r) {
+    if (r && !published) {
         int r2;
 
         /* error during commit; we must abort */
@@ -1711,11 +2208,24 @@ static int mycommit(struct dbengine *db, struct txn *tid)
             syslog(LOG_ERR, "DBERROR: twoskip %s: commit AND abort failed",
                    FNAME(db));
         }
+    } else if (r) {
+        /* everyone can see the commit already, but it may not be on disk */
+        syslog(LOG_ERR, "DBERROR: twoskip %s: failed to sync group commit",
+               FNAME(db));
+        if (mappedfile_islocked(db->mf))
+            unlock(db);
+
+        free(tid);
+        db->current_txn = NULL;
     } else {
         /* consider checkpointing */
         int diff = db->header.current_size - db->header.repack_size;
-        if (!(db->open_flags & CYRUSDB_NOCOMPACT) && diff > MINREWRITE &&
-           ((float)diff / (float)db->header.current_size) > REWRITE_RATIO) {
+        int want_checkpoint = !(db->open_flags & CYRUSDB_NOCOMPACT) &&
+            diff > MINREWRITE &&
+            ((float)diff / (float)db->header.current_size) > REWRITE_RATIO;
+        online = want_checkpoint && ONLINE_REPACK;
+
+        if (want_checkpoint && !online) {
             int r2 = mycheckpoint(db);
             if (r2) {
                 syslog(LOG_NOTICE, "twoskip: failed to checkpoint %s: %m",
@@ -1729,6 +2239,21 @@ static int mycommit(struct dbengine *db, struct txn *tid)
         db->current_txn = NULL;
     }
 
+    /* leave the group - closing drops the inflight lock */
+    if (syncfd >= 0) {
+        db->sync_inflight = 0;
+        close(syncfd);
+    }
+
+    /* or let everyone else carry on while we checkpoint */
+    if (online) {
+        int r2 = online_checkpoint(db);
+        if (r2) {
+            syslog(LOG_NOTICE, "twoskip: failed to online checkpoint %s",
+                   FNAME(db));
+        }
+    }
+
     return r;
 }
 
@@ -1849,7 +2374,7 @@ static int mycheckpoint(struct dbengine *db)
     /* increase the generation count */
     cr.db->header.generation = db->header.generation + 1;
 
-    r = mycommit(cr.db, cr.tid);
+    r = _commit(cr.db, cr.tid, 0);
     if (r) goto err;
 
     /* move new file to original file name */
@@ -1885,6 +2410,221 @@ static int mycheckpoint(struct dbengine *db)
     return CYRUSDB_IOERROR;
 }
 
+/* copy the next slice of records after 'lastkey' into newdb */
+static int _repack_copy(struct dbengine *db, struct dbengine *newdb,
+                        struct txn **tidptr, struct buf *lastkey, int *done)
+{
+    int count;
+    int r;
+
+    /* find where we got up to, the loop steps past it */
+    r = find_loc(db, lastkey->s, lastkey->len);
+    if (r) return r;
+
+    for (count = 0; count < REPACK_SLICE; count++) {
+        r = advance_loc(db);
+        if (r) return r;
+
+        if (!db->loc.is_exactmatch) {
+            *done = 1;
+            break;
+        }
+
+        r = mystore(newdb, KEY(db, &db->loc.record), db->loc.record.keylen,
+                    VAL(db, &db->loc.record), db->loc.record.vallen,
+                    tidptr, 0);
+        if (r) return r;
+
+        buf_copy(lastkey, &db->loc.keybuf);
+    }
+
+    return 0;
+}
+
+/* replay all commits from *offsetp up to the committed end of db into newdb */
+static int _repack_replay(struct dbengine *db, struct dbengine *newdb,
+                          struct txn **tidptr, size_t *offsetp)
+{
+    struct skiprecord record;
+    size_t offset;
+    int r;
+
+    for (offset = *offsetp; offset < db->header.current_size; offset += record.len) {
+        r = read_onerecord(db, offset, &record);
+        if (r) return r;
+
+        if (record.type == COMMIT) {
+            r = _replay_commit(db, newdb, &record, tidptr);
+            if (r) return r;
+        }
+    }
+
+    *offsetp = offset;
+
+    return 0;
+}
+
+/* checkpoint without holding the write lock for the whole copy, see
+ * CHECKPOINT above.  Must be called outside a transaction */
+static int online_checkpoint(struct dbengine *db)
+{
+    char newfname[1024];
+    clock_t start = sclock();
+    struct dbengine *newdb = NULL;
+    struct txn *tid = NULL;
+    struct buf lastkey = BUF_INITIALIZER;
+    struct stat sbuf;
+    uint64_t generation;
+    size_t old_size;
+    size_t offset;
+    ino_t ino = 0;
+    int locked = 0;
+    int passes;
+    int done = 0;
+    int r;
+
+    assert(!db->current_txn);
+
+    /* everything committed from here on gets replayed later */
+    r = write_lock(db);
+    if (r) return r;
+
+    old_size = offset = db->header.current_size;
+    generation = db->header.generation;
+
+    /* open fname.REPACK */
+    snprintf(newfname, sizeof(newfname), "%s.REPACK", FNAME(db));
+    unlink(newfname);
+
+    r = opendb(newfname, db->open_flags | CYRUSDB_CREATE, &newdb, &tid);
+    if (!r) {
+        /* remember which file is ours, in case another repack starts */
+        if (stat(newfname, &sbuf) == 0) ino = sbuf.st_ino;
+        else r = CYRUSDB_IOERROR;
+    }
+    unlock(db);
+    if (r) goto err;
+
+    /* copy all the current records, a slice at a time */
+    while (!done) {
+        r = read_lock(db);
+        if (r) goto err;
+
+        if (db->header.generation != generation)
+            r = CYRUSDB_AGAIN;
+        else
+            r = _repack_copy(db, newdb, &tid, &lastkey, &done);
+
+        unlock(db);
+        if (r) goto err;
+    }
+
+    /* catch up with the changes made meanwhile, until the tail is short */
+    for (passes = 0; passes < REPACK_REPLAYS; passes++) {
+        size_t tail;
+
+        r = read_lock(db);
+        if (r) goto err;
+
+        tail = db->header.current_size - offset;
+        if (db->header.generation != generation)
+            r = CYRUSDB_AGAIN;
+        else if (tail > MINREWRITE)
+            r = _repack_replay(db, newdb, &tid, &offset);
+
+        unlock(db);
+        if (r) goto err;
+
+        if (tail <= MINREWRITE) break;
+    }
+
+    /* and the last few commits with the write lock held */
+    r = write_lock(db);
+    if (r) goto err;
+    locked = 1;
+
+    if (db->header.generation != generation) {
+        r = CYRUSDB_AGAIN;
+        goto err;
+    }
+
+    r = _repack_replay(db, newdb, &tid, &offset);
+    if (r) goto err;
+
+    /* make sure the file we're about to rename is still ours */
+    if (stat(newfname, &sbuf) < 0 || sbuf.st_ino != ino) {
+        ino = 0;
+        r = CYRUSDB_AGAIN;
+        goto err;
+    }
+
+    r = myconsistent(newdb, tid);
+    if (r) {
+        syslog(LOG_ERR, "db %s, inconsistent post-checkpoint, bailing out",
+               FNAME(db));
+        goto err;
+    }
+
+    /* remember the repack size */
+    newdb->header.repack_size = newdb->end;
+
+    /* increase the generation count */
+    newdb->header.generation = generation + 1;
+
+    r = _commit(newdb, tid, 0);
+    tid = NULL;
+    if (r) goto err;
+
+    /* move new file to original file name */
+    r = mappedfile_rename(newdb->mf, FNAME(db));
+    if (r) goto err;
+
+    /* OK, we're commmitted now - clean up */
+    unlock(db);
+
+    /* gotta clean it all up */
+    mappedfile_close(&db->mf);
+    buf_free(&db->loc.keybuf);
+
+    *db = *newdb;
+    free(newdb);
+
+    syslog(LOG_INFO,
+           "twoskip: online checkpointed %s (%llu record%s, %llu => %llu bytes, %d replay pass%s) in %2.3f seconds",
+           FNAME(db), (LLU)db->header.num_records,
+           db->header.num_records == 1 ? "" : "s", (LLU)old_size,
+           (LLU)(db->header.current_size), passes + 1,
+           passes ? "es" : "", (sclock() - start) / (double) CLOCKS_PER_SEC);
+
+    buf_free(&lastkey);
+
+    return 0;
+
+ err:
+    if (r == CYRUSDB_AGAIN)
+        syslog(LOG_NOTICE, "twoskip: %s changed generation during online checkpoint",
+               FNAME(db));
+    if (tid) myabort(newdb, tid);
+    if (newdb) {
+        if (ino && stat(newfname, &sbuf) == 0 && sbuf.st_ino == ino)
+            unlink(newfname);
+        dispose_db(newdb);
+    }
+    if (locked) unlock(db);
+    buf_free(&lastkey);
+    return r == CYRUSDB_AGAIN ? r : CYRUSDB_IOERROR;
+}
+
+/* an explicit repack from outside a transaction doesn't need to block
+ * everyone else */
+static int myrepack(struct dbengine *db)
+{
+    if (db->current_txn)
+        return mycheckpoint(db);
+
+    return online_checkpoint(db);
+}
+
 
 /* dump the database.
    if detail == 1, dump all records.
@@ -2041,10 +2781,11 @@ static int myconsistent(struct dbengine *db, struct txn *tid)
     return 0;
 }
 
-static int _copy_commit(struct dbengine *db, struct dbengine *newdb,
-                        struct skiprecord *commit)
+/* apply all the changes from a single commit to newdb within the
+ * transaction 'tidptr' */
+static int _replay_commit(struct dbengine *db, struct dbengine *newdb,
+                          struct skiprecord *commit, struct txn **tidptr)
 {
-    struct txn *tid = NULL;
     struct skiprecord record;
     const char *val;
     size_t offset;
@@ -2052,7 +2793,7 @@ static int _copy_commit(struct dbengine *db, struct dbengine *newdb,
 
     for (offset = commit->nextloc[0]; offset < commit->offset; offset += record.len) {
         r = read_onerecord(db, offset, &record);
-        if (r) goto err;
+        if (r) return r;
         switch (record.type) {
         case DELETE:
             val = NULL;
@@ -2061,16 +2802,27 @@ static int _copy_commit(struct dbengine *db, struct dbengine *newdb,
             val = VAL(db, &record);
             break;
         default:
-            r = CYRUSDB_IOERROR;
-            goto err;
+            return CYRUSDB_IOERROR;
         }
 
         /* store into the new DB */
-        r = mystore(newdb, KEY(db, &record), record.keylen, val, record.vallen, &tid, 1);
-        if (r) goto err;
+        r = mystore(newdb, KEY(db, &record), record.keylen, val, record.vallen, tidptr, 1);
+        if (r) return r;
     }
 
-    if (tid) r = mycommit(newdb, tid);
+    return 0;
+}
+
+static int _copy_commit(struct dbengine *db, struct dbengine *newdb,
+                        struct skiprecord *commit)
+{
+    struct txn *tid = NULL;
+    int r;
+
+    r = _replay_commit(db, newdb, commit, &tid);
+    if (r) goto err;
+
+    if (tid) r = _commit(newdb, tid, 0);
     if (r) return r;
 
     return 0;
@@ -2289,11 +3041,13 @@ static int recovery1(struct dbengine *db, int *count)
     if (r) return r;
 
     /* clear the dirty flag */
-    db->header.flags &= ~DIRTY;
+    db->header.flags &= ~(DIRTY|SYNCPENDING);
     db->header.num_records = num_records;
     r = commit_header(db);
     if (r) return r;
 
+    sync_reset(db);
+
     if (count) *count = changed;
 
     return 0;
@@ -2309,13 +3063,22 @@ static int recovery(struct dbengine *db)
     if (db_is_clean(db))
         return 0;
 
-    r = recovery1(db, &count);
-    if (r) {
-        syslog(LOG_ERR, "DBERROR: recovery1 failed %s, trying recovery2", FNAME(db));
-        count = 0;
+    if (db->header.flags & SYNCPENDING) {
+        /* a group commit died before its sync, see GROUP COMMIT */
+        syslog(LOG_ERR, "DBERROR: unsynced group commit %s, running recovery2",
+               FNAME(db));
         r = recovery2(db, &count);
         if (r) return r;
     }
+    else {
+        r = recovery1(db, &count);
+        if (r) {
+            syslog(LOG_ERR, "DBERROR: recovery1 failed %s, trying recovery2", FNAME(db));
+            count = 0;
+            r = recovery2(db, &count);
+            if (r) return r;
+        }
+    }
 
     {
         syslog(LOG_INFO,
@@ -2351,6 +3114,259 @@ static int fetchnext(struct dbengine *mydb,
                    data, datalen, tidptr, 1);
 }
 
+/* cursors keep their own copy of the current key, and re-find it
+ * in db->loc on each step.  That's free when nothing else has moved
+ * loc meanwhile, so stepping forward costs one record read.  Stepping
+ * back has to search from the top, since there are no back pointers */
+struct dbcursor {
+    struct dbengine *db;
+    struct txn **tidptr;
+    struct buf prefix;
+    struct buf keybuf;
+    int positioned;
+};
+
+enum {
+    CURSOR_SEEK,
+    CURSOR_NEXT,
+    CURSOR_PREV
+};
+
+/* is db->loc on a record inside the cursor's range? */
+static int cursor_inrange(struct dbcursor *cur)
+{
+    struct dbengine *db = cur->db;
+
+    if (!db->loc.is_exactmatch) return 0;
+    if (!cur->prefix.len) return 1;
+    if (db->loc.record.keylen < cur->prefix.len) return 0;
+    return !db->compar(KEY(db, &db->loc.record), cur->prefix.len,
+                       cur->prefix.s, cur->prefix.len);
+}
+
+/* find the last record which sorts no later than 'prefix' when cut
+ * to the length of the prefix - the last record of the prefix range
+ * if there is one */
+static int find_last(struct dbengine *db,
+                     const char *prefix, size_t prefixlen,
+                     struct skiprecord *record)
+{
+    struct skiprecord newrecord;
+    size_t offset;
+    uint8_t level;
+    int r;
+
+    r = read_onerecord(db, DUMMY_OFFSET, record);
+    if (r) return r;
+
+    level = record->level;
+    while (level) {
+        offset = _getloc(db, record, level-1);
+        if (offset) {
+            r = read_skipdelete(db, offset, &newrecord);
+            if (r) return r;
+
+            if (newrecord.offset) {
+                if (db->snapshot && newrecord.level < level)
+                    return CYRUSDB_AGAIN;
+                assert(newrecord.level >= level);
+
+                if (!prefixlen ||
+                    db->compar(KEY(db, &newrecord),
+                               MIN(newrecord.keylen, prefixlen),
+                               prefix, prefixlen) <= 0) {
+                    *record = newrecord;
+                    continue;
+                }
+            }
+        }
+
+        level--;
+    }
+
+    return 0;
+}
+
+static int cursor_move(struct dbcursor *cur, int op,
+                       const char *key, size_t keylen)
+{
+    struct dbengine *db = cur->db;
+    struct skiprecord record;
+    size_t offset;
+    int r;
+
+    switch (op) {
+    case CURSOR_SEEK:
+        r = find_loc(db, key, keylen);
+        if (!r && !db->loc.is_exactmatch)
+            r = advance_loc(db);
+        break;
+
+    case CURSOR_NEXT:
+        if (cur->positioned) {
+            /* works whether or not the record is still there */
+            r = find_loc(db, cur->keybuf.s, cur->keybuf.len);
+            if (!r) r = advance_loc(db);
+        }
+        else {
+            r = find_loc(db, cur->prefix.s, cur->prefix.len);
+            if (!r && !db->loc.is_exactmatch)
+                r = advance_loc(db);
+        }
+        break;
+
+    case CURSOR_PREV:
+        if (cur->positioned) {
+            r = find_loc(db, cur->keybuf.s, cur->keybuf.len);
+            if (r) return r;
+            offset = db->loc.is_exactmatch ? db->loc.backloc[0]
+                                           : db->loc.record.offset;
+            if (offset == DUMMY_OFFSET) return CYRUSDB_DONE;
+            r = read_onerecord(db, offset, &record);
+        }
+        else {
+            r = find_last(db, cur->prefix.s, cur->prefix.len, &record);
+            if (!r && record.offset == DUMMY_OFFSET) return CYRUSDB_DONE;
+        }
+        if (!r) r = find_loc(db, KEY(db, &record), record.keylen);
+        break;
+
+    default:
+        return CYRUSDB_INTERNAL;
+    }
+
+    if (r) return r;
+
+    return cursor_inrange(cur) ? 0 : CYRUSDB_DONE;
+}
+
+static int cursor_step(struct dbcursor *cur, int op,
+                       const char *key, size_t keylen,
+                       const char **foundkey, size_t *foundkeylen,
+                       const char **data, size_t *datalen)
+{
+    struct dbengine *db = cur->db;
+    struct txn **tidptr = cur->tidptr;
+    int snapshot = 0;
+    int retries = 0;
+    int r = 0;
+
+    /* same as myfetch: read inside the db's transaction if there is one */
+    if (!tidptr && db->current_txn)
+        tidptr = &db->current_txn;
+
+    if (tidptr) {
+        if (!*tidptr) {
+            r = newtxn(db, tidptr);
+            if (r) return r;
+        }
+    } else {
+        snapshot = SNAPSHOT_READS;
+ again:
+        r = read_begin(db, snapshot);
+        if (r == CYRUSDB_AGAIN) goto retry;
+        if (r) return r;
+    }
+
+    r = cursor_move(cur, op, key, keylen);
+
+    if (db->snapshot) {
+        /* everything we found is only good if nothing committed meanwhile */
+        int r1 = snapshot_end(db);
+        if (r1 && (!r || r == CYRUSDB_DONE)) r = r1;
+        if (r == CYRUSDB_AGAIN) goto retry;
+    }
+
+    if (!r) {
+        buf_copy(&cur->keybuf, &db->loc.keybuf);
+        cur->positioned = 1;
+
+        if (foundkey) *foundkey = cur->keybuf.s;
+        if (foundkeylen) *foundkeylen = cur->keybuf.len;
+        if (data) *data = VAL(db, &db->loc.record);
+        if (datalen) *datalen = db->loc.record.vallen;
+    }
+
+    if (!tidptr) {
+        /* release read lock */
+        int r1;
+        if ((r1 = unlock(db)) < 0) {
+            return r1;
+        }
+    }
+
+    return r;
+
+retry:
+    /* don't keep losing the race against writers, just wait for them */
+    if (++retries >= SNAPSHOT_RETRIES) snapshot = 0;
+    goto again;
+}
+
+static int cursor_open(struct dbengine *db,
+                       const char *prefix, size_t prefixlen,
+                       struct txn **tidptr,
+                       struct dbcursor **curp)
+{
+    struct dbcursor *cur;
+    int r;
+
+    if (prefixlen) assert(prefix);
+
+    if (tidptr && !*tidptr) {
+        r = newtxn(db, tidptr);
+        if (r) return r;
+    }
+
+    cur = xzmalloc(sizeof(struct dbcursor));
+    cur->db = db;
+    cur->tidptr = tidptr;
+    buf_setmap(&cur->prefix, prefix, prefixlen);
+
+    *curp = cur;
+    return 0;
+}
+
+static int cursor_seek(struct dbcursor *cur,
+                       const char *key, size_t keylen,
+                       const char **foundkey, size_t *foundkeylen,
+                       const char **data, size_t *datalen)
+{
+    struct dbengine *db = cur->db;
+
+    /* nothing in the range sorts before the prefix */
+    if (db->compar(key, keylen, cur->prefix.s, cur->prefix.len) < 0) {
+        key = cur->prefix.s;
+        keylen = cur->prefix.len;
+    }
+
+    return cursor_step(cur, CURSOR_SEEK, key, keylen,
+                       foundkey, foundkeylen, data, datalen);
+}
+
+static int cursor_next(struct dbcursor *cur,
+                       const char **key, size_t *keylen,
+                       const char **data, size_t *datalen)
+{
+    return cursor_step(cur, CURSOR_NEXT, NULL, 0,
+                       key, keylen, data, datalen);
+}
+
+static int cursor_prev(struct dbcursor *cur,
+                       const char **key, size_t *keylen,
+                       const char **data, size_t *datalen)
+{
+    return cursor_step(cur, CURSOR_PREV, NULL, 0,
+                       key, keylen, data, datalen);
+}
+
+static void cursor_close(struct dbcursor *cur)
+{
+    buf_free(&cur->prefix);
+    buf_free(&cur->keybuf);
+    free(cur);
+}
+
 static int create(struct dbengine *db,
                   const char *key, size_t keylen,
                   const char *data, size_t datalen,
@@ -2410,6 +3426,12 @@ HIDDEN struct cyrusdb_backend cyrusdb_twoskip =
 
     &dump,
     &consistent,
-    &mycheckpoint,
-    &mycompar
+    &myrepack,
+    &mycompar,
+
+    &cursor_open,
+    &cursor_seek,
+    &cursor_next,
+    &cursor_prev,
+    &cursor_close
 };
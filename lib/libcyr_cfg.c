@@ -145,6 +145,30 @@ static struct cyrusopt_s cyrus_options[] = {
       CFGVAL(long, 1),
       CYRUS_OPT_SWITCH },
 
+    { CYRUSOPT_TWOSKIP_SNAPSHOT_READS,
+      CFGVAL(long, 0),
+      CYRUS_OPT_SWITCH },
+
+    { CYRUSOPT_TWOSKIP_ONLINE_REPACK,
+      CFGVAL(long, 0),
+      CYRUS_OPT_SWITCH },
+
+    { CYRUSOPT_TWOSKIP_GROUP_COMMIT,
+      CFGVAL(long, 0),
+      CYRUS_OPT_SWITCH },
+
+    { CYRUSOPT_LMDB_ZERO_COPY,
+      CFGVAL(long, 0),
+      CYRUS_OPT_SWITCH },
+
+    { CYRUSOPT_DBCACHE_TIMEOUT,
+      CFGVAL(long, 0),
+      CYRUS_OPT_INT },
+
+    { CYRUSOPT_LSM_TTL,
+      CFGVAL(const char *, NULL),
+      CYRUS_OPT_STRING },
+
     { CYRUSOPT_LAST, { NULL }, CYRUS_OPT_NOTOPT }
 };
 
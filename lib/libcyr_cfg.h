@@ -105,6 +105,18 @@ enum cyrus_opt {
     CYRUSOPT_SQL_USESSL,
     /* Checkpoint after every recovery (OFF) */
     CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
+    /* Lock-free snapshot reads on twoskip databases (OFF) */
+    CYRUSOPT_TWOSKIP_SNAPSHOT_READS,
+    /* Checkpoint twoskip databases without blocking writers (OFF) */
+    CYRUSOPT_TWOSKIP_ONLINE_REPACK,
+    /* Share fdatasync between concurrent twoskip commits (OFF) */
+    CYRUSOPT_TWOSKIP_GROUP_COMMIT,
+    /* Hand out pointers into the map from lmdb reads (OFF) */
+    CYRUSOPT_LMDB_ZERO_COPY,
+    /* Seconds to keep closed databases open for reuse (0) */
+    CYRUSOPT_DBCACHE_TIMEOUT,
+    /* Record lifetimes for lsm databases, as basename=seconds (NULL) */
+    CYRUSOPT_LSM_TTL,
 
     CYRUSOPT_LAST
 
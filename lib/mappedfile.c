@@ -245,6 +245,47 @@ EXPORTED int mappedfile_readlock(struct mappedfile *mf)
     return 0;
 }
 
+/* bring the map up to date with the file on disk WITHOUT taking a lock.
+ * Other processes may be writing to the file at the same time, so the
+ * caller must be able to cope with seeing partial updates (see the
+ * snapshot readers in cyrusdb_twoskip) */
+EXPORTED int mappedfile_refresh(struct mappedfile *mf)
+{
+    struct stat sbuf, sbuffile;
+    int newfd = -1;
+
+    assert(mf->lock_status == MF_UNLOCKED);
+    assert(mf->fd != -1);
+    assert(!mf->dirty);
+
+    for (;;) {
+        if (fstat(mf->fd, &sbuf) == -1) {
+            syslog(LOG_ERR, "IOERROR: fstat %s: %m", mf->fname);
+            return -EIO;
+        }
+
+        if (stat(mf->fname, &sbuffile) == -1) {
+            syslog(LOG_ERR, "IOERROR: stat %s: %m", mf->fname);
+            return -EIO;
+        }
+        if (sbuf.st_ino == sbuffile.st_ino) break;
+        buf_free(&mf->map_buf);
+
+        newfd = open(mf->fname, mf->is_rw ? O_RDWR : O_RDONLY, 0644);
+        if (newfd == -1) {
+            syslog(LOG_ERR, "IOERROR: open %s: %m", mf->fname);
+            return -EIO;
+        }
+
+        dup2(newfd, mf->fd);
+        close(newfd);
+    }
+
+    _ensure_mapped(mf, sbuf.st_size, /*update*/0);
+
+    return 0;
+}
+
 EXPORTED int mappedfile_writelock(struct mappedfile *mf)
 {
     int r;
@@ -321,6 +362,39 @@ EXPORTED int mappedfile_commit(struct mappedfile *mf)
     return 0;
 }
 
+/* flush everything written to the file so far, by any process, without
+ * needing a lock.  Returns the size of the file before the flush in
+ * *sizep - everything up to there is now on disk.  Works on read-only
+ * files too, fdatasync doesn't need a writable descriptor */
+EXPORTED int mappedfile_sync(struct mappedfile *mf, off_t *sizep)
+{
+    struct stat sbuf;
+
+    assert(mf->fd != -1);
+
+    if (fstat(mf->fd, &sbuf) < 0) {
+        syslog(LOG_ERR, "IOERROR: %s fstat: %m", mf->fname);
+        return -EIO;
+    }
+
+    if (fdatasync(mf->fd) < 0) {
+        syslog(LOG_ERR, "IOERROR: %s fdatasync: %m", mf->fname);
+        return -EIO;
+    }
+
+    if (sizep) *sizep = sbuf.st_size;
+
+    return 0;
+}
+
+/* forget about unsynced changes - the caller has made other arrangements
+ * to get them onto disk (e.g. a later mappedfile_sync) */
+EXPORTED void mappedfile_nosync(struct mappedfile *mf)
+{
+    mf->dirty = 0;
+    mf->was_resized = 0;
+}
+
 EXPORTED ssize_t mappedfile_pwrite(struct mappedfile *mf,
                                    const char *base, size_t len,
                                    off_t offset)
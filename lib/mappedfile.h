@@ -58,10 +58,13 @@ extern int mappedfile_open(struct mappedfile **mfp,
 extern int mappedfile_close(struct mappedfile **mfp);
 
 extern int mappedfile_readlock(struct mappedfile *mf);
+extern int mappedfile_refresh(struct mappedfile *mf);
 extern int mappedfile_writelock(struct mappedfile *mf);
 extern int mappedfile_unlock(struct mappedfile *mf);
 
 extern int mappedfile_commit(struct mappedfile *mf);
+extern int mappedfile_sync(struct mappedfile *mf, off_t *sizep);
+extern void mappedfile_nosync(struct mappedfile *mf);
 extern ssize_t mappedfile_pwrite(struct mappedfile *mf,
                                  const char *base, size_t len,
                                  off_t offset);
@@ -56,6 +56,11 @@
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
+#include <sys/uio.h>
+#include <poll.h>
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+#include <sys/sendfile.h>
+#endif
 
 #include "assert.h"
 #include "exitcodes.h"
@@ -64,6 +69,7 @@
 #include "map.h"
 #include "nonblock.h"
 #include "prot.h"
+#include "retry.h"
 #include "signals.h"
 #include "util.h"
 #include "xmalloc.h"
@@ -94,8 +100,10 @@ EXPORTED struct protstream *prot_new(int fd, int write)
     newstream->write = write;
     newstream->logfd = PROT_NO_FD;
     newstream->big_buffer = PROT_NO_FD;
-    if(write)
+    if(write) {
         newstream->cnt = PROT_BUFSIZE;
+        newstream->write_timeout = PROT_WRITE_TIMEOUT;
+    }
 
     return newstream;
 }
@@ -181,6 +189,9 @@ EXPORTED int prot_free(struct protstream *s)
     if (s->error) free(s->error);
     free(s->buf);
 
+    while (s->iovcnt) free(s->iov[--s->iovcnt].iov_base);
+    free(s->iov);
+
     if(s->big_buffer != PROT_NO_FD) {
         map_free(&(s->bigbuf_base), &(s->bigbuf_siz));
         close(s->big_buffer);
@@ -215,6 +226,26 @@ EXPORTED int prot_setisclient(struct protstream *s, int val)
     return 0;
 }
 
+/*
+ * Turn gathered output on or off for stream 's'.  While it's on, a full
+ * buffer is put aside rather than written, and up to PROT_GATHER_IOV of
+ * them go out in a single writev().
+ */
+EXPORTED int prot_setgather(struct protstream *s, int on)
+{
+    assert(s->write);
+
+    if (on && !s->iov) {
+        s->iov = xmalloc(PROT_GATHER_IOV * sizeof(struct iovec));
+    }
+    else if (!on && s->iovcnt) {
+        if (prot_flush_internal(s, 1) == EOF) return EOF;
+    }
+
+    s->gather = on;
+    return 0;
+}
+
 #ifdef HAVE_SSL
 
 /*
@@ -223,6 +254,10 @@ EXPORTED int prot_setisclient(struct protstream *s, int val)
 
 EXPORTED int prot_settls(struct protstream *s, SSL *tlsconn)
 {
+    /* gathered output was meant to go out in the clear, before the
+     * handshake; it's too late for it now */
+    assert(!s->iovcnt);
+
     s->tls_conn = tlsconn;
 
     /* Make nonblocking stuff to work similar to write() */
@@ -282,7 +317,7 @@ EXPORTED int prot_setsasl(struct protstream *s, sasl_conn_t *conn)
     const void *ssfp;
     int result;
 
-    if (s->write && s->ptr != s->buf) {
+    if (s->write && (s->ptr != s->buf || s->iovcnt)) {
         /* flush any pending output */
         if (prot_flush_internal(s, 0) == EOF)
             return EOF;
@@ -367,7 +402,7 @@ EXPORTED int prot_setcompress(struct protstream *s)
     zstrm->opaque = Z_NULL;
 
     if (s->write) {
-        if (s->ptr != s->buf) {
+        if (s->ptr != s->buf || s->iovcnt) {
             /* flush any pending output */
             if (prot_flush_internal(s, 0) == EOF)
                 goto error;
@@ -490,6 +525,18 @@ EXPORTED int prot_resettimeout(struct protstream *s)
     return 0;
 }
 
+/*
+ * Set the write timeout for the stream 's' to 'timeout' seconds.
+ * 's' must have been created for writing.
+ */
+EXPORTED int prot_setwritetimeout(struct protstream *s, int timeout)
+{
+    assert(s->write);
+
+    s->write_timeout = timeout;
+    return 0;
+}
+
 /*
  * Set the stream 's' to flush the stream 'flushs' before
  * blocking for reading. 's' must have been created for reading,
@@ -984,6 +1031,106 @@ static int prot_flush_writebuffer(struct protstream *s,
     return n;
 }
 
+/* Can output for this stream be gathered right now? */
+static int prot_can_gather(struct protstream *s)
+{
+    if (!s->gather || s->writetobuf || s->fd == PROT_NO_FD) return 0;
+    if (s->dontblock || s->big_buffer != PROT_NO_FD) return 0;
+    if (s->logfd != PROT_NO_FD || s->saslssf) return 0;
+#ifdef HAVE_ZLIB
+    if (s->zstrm) return 0;
+#endif
+#ifdef HAVE_SSL
+    if (s->tls_conn) return 0;
+#endif
+    return 1;
+}
+
+/*
+ * Wait until the socket under output stream 's' can take more data, for
+ * at most its write timeout.  Returns -1 with errno set on failure.
+ */
+static int prot_wait_writable(struct protstream *s)
+{
+    struct pollfd pfd = { s->fd, POLLOUT, 0 };
+    time_t mark = time(NULL) + s->write_timeout;
+    time_t now;
+    int r;
+
+    while ((now = time(NULL)) < mark) {
+        r = poll(&pfd, 1, (mark - now) * 1000);
+        if (r > 0) return 0;
+        if (r == -1 && (errno != EINTR || signals_poll())) return -1;
+    }
+
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+/* Put the memory buffer aside to be written with the next flush */
+static void prot_gather_buffer(struct protstream *s)
+{
+    WRITEV_ADD_TO_IOVEC(s->iov, s->iovcnt, s->buf, s->ptr - s->buf);
+
+    s->buf = (unsigned char *) xmalloc(s->buf_size);
+    s->ptr = s->buf;
+    s->cnt = s->maxplain;
+}
+
+/*
+ * Write out the gathered buffers, followed by 'len' bytes of 'extra',
+ * with as few writev() calls as possible.  Returns -1 with errno set
+ * if it couldn't all be written.
+ */
+static int prot_flush_gathered(struct protstream *s,
+                               const char *extra, size_t len)
+{
+    struct iovec iov[PROT_GATHER_IOV + 1];
+    struct iovec *v = iov;
+    int i, cnt = 0, saved_errno = 0;
+    ssize_t n;
+
+    for (i = 0; i < s->iovcnt; i++)
+        iov[cnt++] = s->iov[i];
+    if (len)
+        WRITEV_ADD_TO_IOVEC(iov, cnt, extra, len);
+
+    while (cnt) {
+        cmdtime_netstart();
+        n = writev(s->fd, v, cnt);
+        cmdtime_netend();
+
+        if (n == -1) {
+            if (errno == EINTR && !signals_poll())
+                continue;
+            /* the socket is shared with a nonblocking input stream */
+            if (errno == EAGAIN && !prot_wait_writable(s))
+                continue;
+            saved_errno = errno;
+            break;
+        }
+
+        /* skip past whatever was written */
+        while (cnt && (size_t) n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            cnt--;
+        }
+        if (cnt) {
+            v->iov_base = (char *) v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+
+    while (s->iovcnt) free(s->iov[--s->iovcnt].iov_base);
+
+    if (cnt) {
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
 int prot_flush_internal(struct protstream *s, int force)
 {
     int n;
@@ -1014,6 +1161,22 @@ int prot_flush_internal(struct protstream *s, int force)
 
     /* end protstream setup */
 
+    /* a full buffer waits to be written along with the next ones */
+    if (!force && !s->cnt && prot_can_gather(s)) {
+        prot_gather_buffer(s);
+        if (s->iovcnt < PROT_GATHER_IOV) return 0;
+
+        if (prot_flush_gathered(s, NULL, 0) == -1)
+            s->error = xstrdup(strerror(errno));
+        goto done;
+    }
+
+    /* anything gathered goes out first */
+    if (s->iovcnt && prot_flush_gathered(s, NULL, 0) == -1) {
+        s->error = xstrdup(strerror(errno));
+        goto done;
+    }
+
     /* if writing to a buffer, just append the lot.  Always works */
     if (s->writetobuf) {
         buf_appendmap(s->writetobuf, ptr, left);
@@ -1200,6 +1363,107 @@ int prot_flush_internal(struct protstream *s, int force)
     return 0;
 }
 
+#if defined(HAVE_SSL) && defined(SSL_OP_ENABLE_KTLS)
+#define PROT_KTLS
+#endif
+
+/*
+ * Write to the output stream 's' the 'len' bytes of file 'fd' starting
+ * at 'offset', after anything already buffered, using sendfile() so
+ * that the data isn't copied through the buffer.  This is only possible
+ * when nothing needs to see the data on the way: no SASL security
+ * layer, compression or telemetry log, and TLS only if the kernel is
+ * doing the encryption.
+ *
+ * Returns the number of bytes sent (with s->error set if that's short),
+ * or -1 if nothing was sent and the caller should write the data itself.
+ */
+EXPORTED ssize_t prot_sendfile(struct protstream *s, int fd,
+                               off_t offset, size_t len)
+{
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+    size_t done = 0;
+    ssize_t n;
+
+    assert(s->write);
+    if (s->error || s->eof) return -1;
+    if (s->writetobuf || s->logfd != PROT_NO_FD || s->saslssf) return -1;
+#ifdef HAVE_ZLIB
+    if (s->zstrm) return -1;
+#endif
+#ifdef HAVE_SSL
+    if (s->tls_conn) {
+#ifdef PROT_KTLS
+        if (!BIO_get_ktls_send(SSL_get_wbio(s->tls_conn))) return -1;
+#else
+        return -1;
+#endif
+    }
+#endif /* HAVE_SSL */
+
+    /* everything before it goes first */
+    if (prot_flush_internal(s, 1) == EOF) return -1;
+
+    while (done < len) {
+        cmdtime_netstart();
+#ifdef PROT_KTLS
+        if (s->tls_conn) {
+            errno = 0;
+            n = SSL_sendfile(s->tls_conn, fd, offset + done, len - done, 0);
+            if (n <= 0) {
+                /* errno is only meaningful for SSL_ERROR_SYSCALL */
+                switch (SSL_get_error(s->tls_conn, n)) {
+                case SSL_ERROR_WANT_READ:
+                case SSL_ERROR_WANT_WRITE:
+                    errno = EAGAIN;
+                    break;
+                case SSL_ERROR_SYSCALL:
+                    if (!errno) errno = EPIPE;
+                    break;
+                default:
+                    errno = EIO;
+                    break;
+                }
+                n = -1;
+            }
+        }
+        else
+#endif
+        {
+            off_t pos = offset + done;
+            n = sendfile(s->fd, fd, &pos, len - done);
+        }
+        cmdtime_netend();
+
+        if (n > 0) {
+            done += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR && !signals_poll())
+            continue;
+        /* the socket is shared with a nonblocking input stream */
+        if (n == -1 && errno == EAGAIN && !prot_wait_writable(s))
+            continue;
+
+        /* not supported for this file or socket?  Let the caller do it */
+        if (!done && n == -1 && (errno == EINVAL || errno == ENOSYS))
+            return -1;
+
+        s->error = xstrdup(n == -1 ? strerror(errno) : "file too short");
+        break;
+    }
+
+    s->bytes_out += done;
+    return done;
+#else
+    (void) s;
+    (void) fd;
+    (void) offset;
+    (void) len;
+    return -1;
+#endif /* HAVE_SENDFILE && HAVE_SYS_SENDFILE_H */
+}
+
 /*
  * Write to the output stream 's' the 'len' bytes of data at 'buf'
  */
@@ -1240,6 +1504,19 @@ EXPORTED int prot_write(struct protstream *s, const char *buf, unsigned len)
         s->boundary = 0;
     }
 
+    /* big blocks are written straight from the caller's memory */
+    if (len >= PROT_BUFSIZE && prot_can_gather(s)) {
+        if (s->ptr != s->buf) prot_gather_buffer(s);
+
+        if (prot_flush_gathered(s, buf, len) == -1) {
+            s->error = xstrdup(strerror(errno));
+            return EOF;
+        }
+
+        s->bytes_out += len;
+        return 0;
+    }
+
     while (len >= s->cnt) {
         /* XXX can we manage to write data from 'buf' without copying it
            to s->ptr ? */
@@ -47,6 +47,8 @@
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #include <sasl/sasl.h>
 #include <config.h>
@@ -66,6 +68,12 @@
 
 #define PROT_NO_FD -1
 
+/* Full buffers kept by a gathering stream before writing them out */
+#define PROT_GATHER_IOV 16
+
+/* Default seconds to wait for a full socket to drain before giving up */
+#define PROT_WRITE_TIMEOUT 600
+
 struct protstream;
 struct prot_waitevent;
 
@@ -110,6 +118,11 @@ struct protstream {
     size_t bigbuf_len; /* Length of mapped file */
     size_t bigbuf_pos; /* Current Position */
 
+    /* Gathered Output (full buffers waiting to be written) */
+    int gather;
+    struct iovec *iov;
+    int iovcnt;
+
     /* Callback-fill information */
     prot_fillcallback_t *fillcallback_proc;
     void *fillcallback_rock;
@@ -126,6 +139,7 @@ struct protstream {
     int dontblock_isset; /* write only, we've fcntl(O_NONBLOCK)'d */
     int read_timeout;
     time_t timeout_mark;
+    int write_timeout;
     struct protstream *flushonread;
     /* hack to write to an in-memory-string */
     struct buf *writetobuf;
@@ -223,6 +237,11 @@ int prot_setisclient(struct protstream *s, int val);
 int prot_setcompress(struct protstream *s);
 #endif /* HAVE_ZLIB */
 
+/* Keep full output buffers and write them out together with writev(),
+ * sending large writes straight from the caller's memory.  Only has an
+ * effect while the stream is blocking and writing plain data. */
+extern int prot_setgather(struct protstream *s, int on);
+
 /* Tell the protstream that the type of data is about to change. */
 int prot_data_boundary(struct protstream *s);
 
@@ -232,6 +251,9 @@ extern int prot_settimeout(struct protstream *s, int timeout);
 /* Reset the timeout timer for the connection (in seconds) */
 extern int prot_resettimeout(struct protstream *s);
 
+/* Set how long a write may wait for the connection (in seconds) */
+extern int prot_setwritetimeout(struct protstream *s, int timeout);
+
 /* Connect two streams so that when you block on reading s, the layer
  * will automaticly flush flushs */
 extern int prot_setflushonread(struct protstream *s,
@@ -258,6 +280,10 @@ extern int prot_flush(struct protstream *s);
 
 /* These are protlayer versions of the specified functions */
 extern int prot_write(struct protstream *s, const char *buf, unsigned len);
+/* write part of a file without copying it through the buffer, if the
+ * stream allows; returns -1 if the caller should write it instead */
+extern ssize_t prot_sendfile(struct protstream *s, int fd,
+                             off_t offset, size_t len);
 extern int prot_putbuf(struct protstream *s, struct buf *buf);
 extern int prot_puts(struct protstream *s, const char *str);
 extern int prot_vprintf(struct protstream *, const char *, va_list);